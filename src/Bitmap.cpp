@@ -0,0 +1,206 @@
+#include "Bitmap.hpp"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Portable popcount of a 64 bit word (SWAR), compilers without a POPCNT
+// target would otherwise call a table based helper
+static inline size_t popcount64(uint64_t x) {
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (x * 0x0101010101010101ULL) >> 56;
+}
+
+static size_t count_scalar(const uint8_t *p, size_t n) {
+  size_t bits = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    bits += popcount64(word);
+  }
+  for (; i < n; ++i)
+    bits += popcount64(p[i]);
+  return bits;
+}
+
+static size_t find_byte_scalar(const uint8_t *p, size_t n, uint8_t skip) {
+  uint64_t pattern = 0x0101010101010101ULL * skip;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    if (word != pattern)
+      break;
+  }
+  for (; i < n; ++i)
+    if (p[i] != skip)
+      return i;
+  return n;
+}
+
+template <typename F>
+static void apply_words(uint8_t *dst, const uint8_t *src, size_t n, F &&f) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a = f(a, b);
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < n; ++i)
+    dst[i] = f(dst[i], src[i]);
+}
+
+static void apply_scalar(BitOp op, uint8_t *dst, const uint8_t *src,
+                         size_t n) {
+  switch (op) {
+  case BitOp::And:
+    apply_words(dst, src, n, [](auto a, auto b) { return a & b; });
+    break;
+  case BitOp::Or:
+    apply_words(dst, src, n, [](auto a, auto b) { return a | b; });
+    break;
+  case BitOp::Xor:
+    apply_words(dst, src, n, [](auto a, auto b) { return a ^ b; });
+    break;
+  case BitOp::Not:
+    apply_words(dst, src, n,
+                [](auto, auto b) { return static_cast<decltype(b)>(~b); });
+    break;
+  }
+}
+
+const BitmapKernels bitmap_scalar = {"scalar", count_scalar,
+                                     find_byte_scalar, apply_scalar};
+
+#if defined(__x86_64__)
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+// Nibble lookup popcount (Mula): every byte is counted with two shuffles,
+// the byte counts are summed in 8 bit lanes for up to 31 blocks and folded
+// into 64 bit lanes with a sum of absolute differences.
+AVX2_TARGET static size_t count_avx2(const uint8_t *p, size_t n) {
+  const __m256i lookup =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                       1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  while (i + 32 <= n) {
+    __m256i bytes = _mm256_setzero_si256();
+    // 31 blocks of at most 8 bits per byte fit in a byte lane
+    for (int block = 0; block < 31 && i + 32 <= n; ++block, i += 32) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+      __m256i lo = _mm256_and_si256(v, low_mask);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+      bytes = _mm256_add_epi8(bytes, _mm256_shuffle_epi8(lookup, lo));
+      bytes = _mm256_add_epi8(bytes, _mm256_shuffle_epi8(lookup, hi));
+    }
+    total = _mm256_add_epi64(total,
+                             _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+  }
+  size_t bits = _mm256_extract_epi64(total, 0) +
+                _mm256_extract_epi64(total, 1) +
+                _mm256_extract_epi64(total, 2) +
+                _mm256_extract_epi64(total, 3);
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    bits += _mm_popcnt_u64(word);
+  }
+  for (; i < n; ++i)
+    bits += _mm_popcnt_u32(p[i]);
+  return bits;
+}
+
+AVX2_TARGET static size_t find_byte_avx2(const uint8_t *p, size_t n,
+                                         uint8_t skip) {
+  const __m256i pattern = _mm256_set1_epi8(static_cast<char>(skip));
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    uint32_t same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern));
+    if (same != 0xffffffff)
+      return i + __builtin_ctz(~same);
+  }
+  size_t rest = find_byte_scalar(p + i, n - i, skip);
+  return i + rest;
+}
+
+template <typename F>
+AVX2_TARGET static inline void apply_blocks(uint8_t *dst, const uint8_t *src,
+                                            size_t n, F &&f) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), f(a, b));
+  }
+  for (; i < n; ++i)
+    dst[i] = f(dst[i], src[i]);
+}
+
+AVX2_TARGET static void apply_avx2(BitOp op, uint8_t *dst, const uint8_t *src,
+                                   size_t n) {
+  switch (op) {
+  case BitOp::And:
+    apply_blocks(dst, src, n, [](auto a, auto b) AVX2_TARGET {
+      if constexpr (sizeof(a) == 32)
+        return _mm256_and_si256(a, b);
+      else
+        return static_cast<uint8_t>(a & b);
+    });
+    break;
+  case BitOp::Or:
+    apply_blocks(dst, src, n, [](auto a, auto b) AVX2_TARGET {
+      if constexpr (sizeof(a) == 32)
+        return _mm256_or_si256(a, b);
+      else
+        return static_cast<uint8_t>(a | b);
+    });
+    break;
+  case BitOp::Xor:
+    apply_blocks(dst, src, n, [](auto a, auto b) AVX2_TARGET {
+      if constexpr (sizeof(a) == 32)
+        return _mm256_xor_si256(a, b);
+      else
+        return static_cast<uint8_t>(a ^ b);
+    });
+    break;
+  case BitOp::Not:
+    apply_blocks(dst, src, n, [](auto, auto b) AVX2_TARGET {
+      if constexpr (sizeof(b) == 32)
+        return _mm256_xor_si256(b, _mm256_set1_epi8(-1));
+      else
+        return static_cast<uint8_t>(~b);
+    });
+    break;
+  }
+}
+
+static const BitmapKernels bitmap_avx2 = {"avx2", count_avx2, find_byte_avx2,
+                                          apply_avx2};
+
+static const BitmapKernels &detect_kernels() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    return bitmap_avx2;
+  return bitmap_scalar;
+}
+
+const BitmapKernels &bitmap_kernels() {
+  static const BitmapKernels &kernels = detect_kernels();
+  return kernels;
+}
+
+#else
+
+const BitmapKernels &bitmap_kernels() { return bitmap_scalar; }
+
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+Kernels behind the bitmap commands (SETBIT, BITCOUNT, BITPOS, BITOP), which
+work on plain string values. Bits are numbered from the most significant bit
+of the first byte, like Redis.
+
+Each kernel has a portable scalar version and an AVX2 one (with POPCNT for
+the tails). The AVX2 versions are compiled with a target attribute rather
+than -mavx2, and picked once at startup when the CPU reports both features,
+so the same binary runs on any x86-64 and on other architectures.
+*/
+
+enum class BitOp { And, Or, Xor, Not };
+
+struct BitmapKernels {
+  const char *name;
+  // Bits set in the n bytes at p
+  size_t (*count)(const uint8_t *p, size_t n);
+  // Index of the first of the n bytes at p that is not skip, n if none
+  size_t (*find_byte)(const uint8_t *p, size_t n, uint8_t skip);
+  // dst = dst op src over n bytes, dst = ~src for Not
+  void (*apply)(BitOp op, uint8_t *dst, const uint8_t *src, size_t n);
+};
+
+extern const BitmapKernels bitmap_scalar;
+// The kernels for this CPU
+const BitmapKernels &bitmap_kernels();
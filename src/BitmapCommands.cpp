@@ -0,0 +1,321 @@
+#include "Bitmap.hpp"
+#include "HandleResponse.hpp"
+#include <algorithm>
+#include <string>
+
+// Same limit as Redis: offsets address a string of at most 512 MiB
+#define MAX_BIT_OFFSET ((int64_t(1) << 32) - 1)
+
+// Index of the first bit of byte equal to bit, from the most significant,
+// or -1
+static int first_bit(uint8_t byte, bool bit) {
+  uint8_t bits = bit ? byte : static_cast<uint8_t>(~byte);
+  return bits == 0 ? -1 : __builtin_clz(bits) - 24;
+}
+
+void HandleResponse::setbit(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *offset_arg = arg_at(command_array, i++);
+  const std::string *value = arg_at(command_array, i++);
+  if (key == nullptr || offset_arg == nullptr || value == nullptr) {
+    wrong_args("SETBIT");
+    return;
+  }
+  int64_t offset;
+  if (!string_to_int64(*offset_arg, offset) || offset < 0 ||
+      offset > MAX_BIT_OFFSET) {
+    error("bit offset is not an integer or out of range");
+    return;
+  }
+  if (*value != "0" && *value != "1") {
+    error("bit is not an integer or out of range");
+    return;
+  }
+  size_t byte = offset >> 3;
+  uint8_t mask = 0x80 >> (offset & 7);
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    std::string bytes(byte + 1, '\0');
+    if (*value == "1")
+      bytes[byte] = mask;
+    config.db.insert(DB_Entry::create(config.db.allocator(), *key, bytes));
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+
+  size_t old_len = entry->value_len();
+  entry = make_room(config.db, entry, std::max(old_len, byte + 1));
+  RawString *raw = entry->value.raw;
+  if (byte >= old_len) {
+    memset(raw->buf + old_len, 0, byte + 1 - old_len);
+    raw->len = byte + 1;
+  }
+  uint8_t &target = reinterpret_cast<uint8_t &>(raw->buf[byte]);
+  integer((target & mask) != 0);
+  if (*value == "1")
+    target |= mask;
+  else
+    target &= ~mask;
+}
+
+void HandleResponse::getbit(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *offset_arg = arg_at(command_array, i++);
+  if (key == nullptr || offset_arg == nullptr) {
+    wrong_args("GETBIT");
+    return;
+  }
+  int64_t offset;
+  if (!string_to_int64(*offset_arg, offset) || offset < 0 ||
+      offset > MAX_BIT_OFFSET) {
+    error("bit offset is not an integer or out of range");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+  DB_Entry::Scratch scratch;
+  std::string_view value = entry->str(scratch);
+  size_t byte = offset >> 3;
+  integer(byte < value.length() &&
+          (static_cast<uint8_t>(value[byte]) & (0x80 >> (offset & 7))) != 0);
+}
+
+// Like Redis: negative indexes count from the end, the range is clamped to
+// the value and start > end leaves it empty (first > last)
+bool HandleResponse::bit_range(size_t &i,
+                               const std::vector<RespData> &command_array,
+                               size_t len, int64_t &first, int64_t &last,
+                               bool &bit_mode, bool &end_given) {
+  const std::string *start_arg = arg_at(command_array, i);
+  const std::string *end_arg = arg_at(command_array, i + 1);
+  const std::string *unit = arg_at(command_array, i + 2);
+  bit_mode = false;
+  end_given = end_arg != nullptr;
+  if (unit != nullptr) {
+    std::string name = *unit;
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if ((name != "BYTE" && name != "BIT") ||
+        i + 3 < command_array.size()) {
+      error("syntax error");
+      return false;
+    }
+    bit_mode = name == "BIT";
+  }
+  int64_t total = bit_mode ? len * 8 : len;
+  first = 0;
+  last = total - 1;
+  if (start_arg == nullptr)
+    return true;
+  int64_t start, end = last;
+  if (!string_to_int64(*start_arg, start) ||
+      (end_arg != nullptr && !string_to_int64(*end_arg, end))) {
+    error("value is not an integer or out of range");
+    return false;
+  }
+  i += 1 + (end_arg != nullptr) + (unit != nullptr);
+  if (start < 0)
+    start = std::max<int64_t>(total + start, 0);
+  if (end < 0)
+    end = std::max<int64_t>(total + end, 0);
+  first = start;
+  last = std::min(end, total - 1);
+  return true;
+}
+
+void HandleResponse::bitcount(size_t &i,
+                              const std::vector<RespData> &command_array,
+                              DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("BITCOUNT");
+    return;
+  }
+  // A start needs an end
+  if (i + 1 == command_array.size()) {
+    error("syntax error");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::String))
+    return;
+  DB_Entry::Scratch scratch;
+  std::string_view value = entry ? entry->str(scratch) : std::string_view();
+  int64_t first, last;
+  bool bit_mode, end_given;
+  if (!bit_range(i, command_array, value.length(), first, last, bit_mode,
+                 end_given))
+    return;
+  if (first > last) {
+    integer(0);
+    return;
+  }
+  const auto *bytes = reinterpret_cast<const uint8_t *>(value.data());
+  if (!bit_mode) {
+    integer(bitmap_kernels().count(bytes + first, last - first + 1));
+    return;
+  }
+  // Whole bytes, less the bits of the first and last bytes out of range
+  size_t first_byte = first >> 3, last_byte = last >> 3;
+  size_t bits = bitmap_kernels().count(bytes + first_byte,
+                                       last_byte - first_byte + 1);
+  uint8_t before = 0xff << (8 - (first & 7));
+  uint8_t after = 0xff >> ((last & 7) + 1);
+  bits -= __builtin_popcount(bytes[first_byte] & before);
+  bits -= __builtin_popcount(bytes[last_byte] & after);
+  integer(bits);
+}
+
+void HandleResponse::bitpos(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *bit_arg = arg_at(command_array, i++);
+  if (key == nullptr || bit_arg == nullptr) {
+    wrong_args("BITPOS");
+    return;
+  }
+  if (*bit_arg != "0" && *bit_arg != "1") {
+    error("The bit argument must be 1 or 0.");
+    return;
+  }
+  bool bit = *bit_arg == "1";
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::String))
+    return;
+  DB_Entry::Scratch scratch;
+  std::string_view value = entry ? entry->str(scratch) : std::string_view();
+  int64_t first, last;
+  bool bit_mode, end_given;
+  if (!bit_range(i, command_array, value.length(), first, last, bit_mode,
+                 end_given))
+    return;
+  // A missing key is an empty string, whose clear bits go on forever
+  if (entry == nullptr) {
+    integer(bit ? -1 : 0);
+    return;
+  }
+  if (first > last) {
+    integer(-1);
+    return;
+  }
+
+  const auto *bytes = reinterpret_cast<const uint8_t *>(value.data());
+  size_t first_byte = bit_mode ? first >> 3 : first;
+  size_t last_byte = bit_mode ? last >> 3 : last;
+  uint8_t skip = bit ? 0x00 : 0xff;
+  // The bits of the edge bytes out of a BIT range never match
+  auto edge = [&](size_t index) {
+    uint8_t byte = bytes[index];
+    if (!bit_mode)
+      return byte;
+    uint8_t outside = 0;
+    if (index == first_byte)
+      outside |= 0xff << (8 - (first & 7));
+    if (index == last_byte)
+      outside |= 0xff >> ((last & 7) + 1);
+    return static_cast<uint8_t>((byte & ~outside) | (skip & outside));
+  };
+
+  int64_t pos = -1;
+  int found = first_bit(edge(first_byte), bit);
+  if (found >= 0) {
+    pos = first_byte * 8 + found;
+  } else if (last_byte > first_byte) {
+    size_t index = first_byte + 1 +
+                   bitmap_kernels().find_byte(bytes + first_byte + 1,
+                                              last_byte - first_byte - 1,
+                                              skip);
+    if (index < last_byte)
+      pos = index * 8 + first_bit(bytes[index], bit);
+    else if ((found = first_bit(edge(last_byte), bit)) >= 0)
+      pos = last_byte * 8 + found;
+  }
+  // Looking for a clear bit with no end given, the string goes on with zeros
+  if (pos < 0 && !bit && !end_given)
+    pos = (last_byte + 1) * 8;
+  integer(pos);
+}
+
+void HandleResponse::bitop(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  const std::string *op_arg = arg_at(command_array, 1);
+  const std::string *dest = arg_at(command_array, 2);
+  if (op_arg == nullptr || dest == nullptr || command_array.size() < 4) {
+    wrong_args("BITOP");
+    return;
+  }
+  std::string name = *op_arg;
+  std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+  BitOp op;
+  if (name == "AND")
+    op = BitOp::And;
+  else if (name == "OR")
+    op = BitOp::Or;
+  else if (name == "XOR")
+    op = BitOp::Xor;
+  else if (name == "NOT")
+    op = BitOp::Not;
+  else {
+    error("syntax error");
+    return;
+  }
+  if (op == BitOp::Not && command_array.size() != 4) {
+    error("BITOP NOT must be called with a single source key.");
+    return;
+  }
+
+  // Missing keys are empty strings, shorter ones are padded with zeros
+  size_t count = command_array.size() - 3;
+  std::vector<std::string_view> sources(count);
+  std::vector<DB_Entry::Scratch> scratch(count);
+  size_t len = 0;
+  for (size_t n = 0; n < count; ++n) {
+    const std::string *key = arg_at(command_array, 3 + n);
+    if (key == nullptr)
+      continue;
+    DB_Entry *entry = lookup_key(config.partition_for(*key), *key);
+    if (entry == nullptr)
+      continue;
+    if (!check_type(entry, ValueType::String))
+      return;
+    sources[n] = entry->str(scratch[n]);
+    len = std::max(len, sources[n].length());
+  }
+  i = command_array.size();
+
+  DB_Config &target = config.partition_for(*dest);
+  if (len == 0) {
+    delete_key(target, *dest, false);
+    integer(0);
+    return;
+  }
+  std::string result(len, '\0');
+  auto *out = reinterpret_cast<uint8_t *>(result.data());
+  const BitmapKernels &kernels = bitmap_kernels();
+  // A missing first key has no data to copy
+  if (!sources[0].empty())
+    memcpy(out, sources[0].data(), sources[0].length());
+  if (op == BitOp::Not)
+    kernels.apply(op, out, out, len);
+  for (size_t n = 1; n < count; ++n) {
+    const auto *src = reinterpret_cast<const uint8_t *>(sources[n].data());
+    kernels.apply(op, out, src, sources[n].length());
+    if (op == BitOp::And)
+      memset(out + sources[n].length(), 0, len - sources[n].length());
+  }
+  target.db.insert(DB_Entry::create(target.db.allocator(), *dest, result));
+  integer(len);
+}
@@ -0,0 +1,60 @@
+#include "Blocking.hpp"
+
+void Blocking::block(Client *client, const std::vector<std::string> &keys,
+                     bool head, uint64_t deadline_ms, uint64_t now_ms) {
+  client->blocked = true;
+  client->blocked_head = head;
+  for (const std::string &key : keys) {
+    std::list<Client *> &waiters = m_waiters[key];
+    waiters.push_back(client);
+    client->blocked_on.emplace_back(key, std::prev(waiters.end()));
+  }
+  if (deadline_ms != 0) {
+    client->block_timer.owner = client;
+    m_timers.schedule(&client->block_timer, deadline_ms, now_ms);
+  }
+  ++m_blocked;
+}
+
+void Blocking::unblock(Client *client) {
+  if (!client->blocked)
+    return;
+  for (auto &[key, position] : client->blocked_on) {
+    auto it = m_waiters.find(key);
+    it->second.erase(position);
+    if (it->second.empty())
+      m_waiters.erase(it);
+  }
+  client->blocked_on.clear();
+  client->blocked_ids.clear();
+  m_timers.cancel(&client->block_timer);
+  client->blocked = false;
+  --m_blocked;
+}
+
+void Blocking::signal_ready(std::string_view key) {
+  if (m_waiters.empty())
+    return;
+  std::string name(key);
+  if (m_waiters.count(name) && m_ready_set.insert(name).second)
+    m_ready.push_back(std::move(name));
+}
+
+std::vector<std::string> Blocking::take_ready() {
+  std::vector<std::string> ready;
+  ready.swap(m_ready);
+  m_ready_set.clear();
+  return ready;
+}
+
+const std::list<Client *> *Blocking::waiters(const std::string &key) const {
+  auto it = m_waiters.find(key);
+  return it == m_waiters.end() ? nullptr : &it->second;
+}
+
+void Blocking::expire(uint64_t now_ms, std::vector<Client *> &timed_out) {
+  std::vector<TimerWheel::Timer *> expired;
+  m_timers.advance(now_ms, expired);
+  for (TimerWheel::Timer *timer : expired)
+    timed_out.push_back(static_cast<Client *>(timer->owner));
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Client.hpp"
+#include "TimerWheel.hpp"
+
+/*
+Clients blocked in BLPOP/BRPOP and XREAD.
+
+A blocked client is parked, in arrival order, on every key it waits for, and
+its deadline (if any) goes to a timer wheel. Nothing looks at parked clients
+until something happens to them: pushes (or XADDs) to a key with waiters mark
+it ready, and the server serves the ready keys once the event loop tick is
+done, while the wheel hands back the clients whose deadline passed. An idle
+blocked client costs memory only.
+*/
+class Blocking {
+public:
+  // Parks client on keys until deadline_ms, 0 waits forever
+  void block(Client *client, const std::vector<std::string> &keys,
+             bool head, uint64_t deadline_ms, uint64_t now_ms);
+  void unblock(Client *client);
+
+  // Marks key ready if clients wait on it
+  void signal_ready(std::string_view key);
+  // Takes the keys marked ready so far
+  std::vector<std::string> take_ready();
+  // Clients waiting on key, first to serve first
+  const std::list<Client *> *waiters(const std::string &key) const;
+
+  // Appends the clients whose deadline passed, they are still blocked
+  void expire(uint64_t now_ms, std::vector<Client *> &timed_out);
+  // Milliseconds until a deadline may pass, at most max_ms
+  uint64_t next_timeout(uint64_t now_ms, uint64_t max_ms) const {
+    return m_timers.next_timeout(now_ms, max_ms);
+  }
+  size_t blocked() const { return m_blocked; }
+
+private:
+  std::unordered_map<std::string, std::list<Client *>> m_waiters;
+  std::vector<std::string> m_ready;
+  std::unordered_set<std::string> m_ready_set;
+  TimerWheel m_timers;
+  size_t m_blocked = 0;
+};
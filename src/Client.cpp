@@ -0,0 +1,45 @@
+#include "Client.hpp"
+
+void Client::commit_reply() {
+  if (reply.empty())
+    return;
+  auto chunk = std::make_shared<const std::string>(std::move(reply));
+  reply.clear();
+  output_bytes += chunk->length();
+  output.push_back({chunk, *chunk});
+}
+
+void Client::queue(std::shared_ptr<const std::string> chunk) {
+  std::string_view data = *chunk;
+  queue(OutputChunk{std::move(chunk), data});
+}
+
+void Client::queue(OutputChunk chunk) {
+  commit_reply();
+  output_bytes += chunk.data.length();
+  output.push_back(std::move(chunk));
+}
+
+void Client::push(std::shared_ptr<const std::string> chunk,
+                  std::vector<Client *> &pending_writes) {
+  queue(std::move(chunk));
+  if (!pending_write) {
+    pending_write = true;
+    pending_writes.push_back(this);
+  }
+}
+
+bool Client::over_limit(const OutputLimit &limit, uint64_t now_ms) {
+  size_t pending = output_bytes - output_pos;
+  if (limit.hard != 0 && pending > limit.hard)
+    return true;
+  if (limit.soft == 0 || pending <= limit.soft) {
+    soft_limit_since = 0;
+    return false;
+  }
+  if (soft_limit_since == 0) {
+    soft_limit_since = now_ms;
+    return false;
+  }
+  return now_ms - soft_limit_since >= limit.soft_seconds * 1000;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "Parser.hpp"
+#include "Stream.hpp"
+#include "TimerWheel.hpp"
+
+// Output buffer limit: a client is disconnected when its pending output goes
+// over hard bytes, or stays over soft bytes for soft_seconds. 0 disables.
+struct OutputLimit {
+  size_t hard;
+  size_t soft;
+  uint64_t soft_seconds;
+};
+
+// Pending output and what keeps its bytes alive: a string shared by the
+// clients it was queued to, or a keyspace value pinned while it is sent in
+// place (see RawString)
+struct OutputChunk {
+  std::shared_ptr<const void> owner;
+  std::string_view data;
+};
+
+// Per connection state kept by the server between reads
+struct Client {
+  int fd;
+  uint64_t id = 0;
+  std::string name;
+  int protocol = 2; // RESP version, switched with HELLO
+  std::string query; // received bytes of the commands that did not run yet
+  // Commands parsed out of query that wait to run, from pending_head on, and
+  // where each ends in query. Those before prefetched were prefetched.
+  std::vector<RespData> pending;
+  std::vector<size_t> pending_ends;
+  size_t pending_head = 0;
+  size_t prefetched = 0;
+  std::string reply; // replies of the running batch, not queued yet
+  // Chunks waiting to be written. A chunk can be shared by many clients: a
+  // published message is serialized once and queued to every subscriber.
+  std::deque<OutputChunk> output;
+  size_t output_pos = 0;   // bytes of output.front() already written
+  size_t output_bytes = 0; // bytes in output, not counting reply
+  uint64_t soft_limit_since = 0;
+  bool pending_write = false; // in DB_Config::pending_writes
+  bool close_asap = false;    // closed by the server once the batch is done
+
+  std::unordered_set<std::string> channels;
+  std::unordered_set<std::string> patterns;
+
+  // MULTI state: commands are kept parsed until EXEC runs them
+  bool in_multi = false;
+  bool multi_failed = false; // a command was rejected while queueing
+  int multi_slot = -1;       // cluster slot of the queued commands' keys
+  std::vector<RespData> multi_queue;
+  // WATCHed keys with the version they had then
+  std::vector<std::pair<std::string, uint64_t>> watched;
+
+  // CLIENT TRACKING: keys read are remembered, or with bcast every key
+  // starting with one of the prefixes is reported
+  bool tracking = false;
+  bool tracking_bcast = false;
+  bool tracking_noloop = false; // not told about its own writes
+  std::vector<std::string> tracking_prefixes;
+
+  // BLPOP/BRPOP/XREAD: parked on keys, commands sent meanwhile wait in query
+  bool blocked = false;
+  bool blocked_head = true; // pops from the head
+  std::vector<std::pair<std::string, std::list<Client *>::iterator>> blocked_on;
+  // XREAD: the ID to read after for each key of blocked_on, and its COUNT
+  std::vector<StreamID> blocked_ids;
+  uint64_t blocked_count = 0;
+  TimerWheel::Timer block_timer;
+
+  // Tiered storage: spilled values the next command waits for, read back by
+  // the I/O threads. Commands sent meanwhile wait in query.
+  size_t loading = 0;
+
+  // Cluster: the next command may use a slot being imported
+  bool asking = false;
+
+  // --threads: replies of a run of commands sent to another partition, in
+  // command order, and whether it has not answered yet. Commands sent
+  // meanwhile wait in query.
+  std::vector<std::string> run_replies;
+  size_t run_waiting = 0;
+  // Partition the connection moves to at the end of the loop iteration, -1
+  int handoff = -1;
+  // Replies are being collected for a run: they must all stay in reply
+  bool capture_replies = false;
+
+  size_t subscriptions() const { return channels.size() + patterns.size(); }
+  // Moves reply to the output queue, keeping it ordered with shared chunks
+  void commit_reply();
+  // Queues a shared chunk after the replies written so far
+  void queue(std::shared_ptr<const std::string> chunk);
+  void queue(OutputChunk chunk);
+  // Queues a chunk written on behalf of another client, which the server
+  // flushes once the running batch is done
+  void push(std::shared_ptr<const std::string> chunk,
+            std::vector<Client *> &pending_writes);
+  // Checks the output queue against limit, true once it has to be closed
+  bool over_limit(const OutputLimit &limit, uint64_t now_ms);
+};
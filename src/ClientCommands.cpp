@@ -0,0 +1,185 @@
+#include "HandleResponse.hpp"
+#include <string>
+#include <vector>
+
+// HELLO [protover [SETNAME name]]: switches the connection's protocol and
+// replies with the server properties, encoded in the new protocol
+void HandleResponse::hello(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  int protocol = m_client.protocol;
+  if (const std::string *version = arg_at(command_array, i)) {
+    ++i;
+    int64_t requested;
+    if (!string_to_int64(*version, requested)) {
+      error("Protocol version is not an integer or out of range");
+      return;
+    }
+    if (requested != 2 && requested != 3) {
+      reply("-NOPROTO unsupported protocol version\r\n");
+      return;
+    }
+    protocol = requested;
+  }
+  std::string name = m_client.name;
+  for (; i < command_array.size(); ++i) {
+    const std::string *option = arg_at(command_array, i);
+    if (option != nullptr && upper(*option) == "SETNAME" &&
+        arg_at(command_array, i + 1) != nullptr) {
+      name = *arg_at(command_array, ++i);
+      continue;
+    }
+    // There are no users, so no AUTH
+    error("syntax error");
+    return;
+  }
+  if (protocol < 3 && m_client.tracking) {
+    error("client tracking needs RESP3, turn it off first");
+    return;
+  }
+  m_client.protocol = protocol;
+  m_client.name = name;
+
+  std::string response;
+  append_map_len(response, 7, protocol);
+  append_bulk(response, "server");
+  append_bulk(response, "redis");
+  append_bulk(response, "version");
+  append_bulk(response, "7.2.0");
+  append_bulk(response, "proto");
+  append_integer(response, protocol);
+  append_bulk(response, "id");
+  append_integer(response, m_client.id);
+  append_bulk(response, "mode");
+  append_bulk(response,
+              config.cluster.enabled() ? "cluster" : "standalone");
+  append_bulk(response, "role");
+  append_bulk(response, "master");
+  append_bulk(response, "modules");
+  append_array_len(response, 0);
+  reply(response);
+}
+
+// CLIENT ID | SETNAME name | GETNAME | TRACKING ...
+void HandleResponse::client(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *subcommand = arg_at(command_array, i++);
+  if (subcommand == nullptr) {
+    wrong_args("CLIENT");
+    return;
+  }
+  std::string name = upper(*subcommand);
+  if (name == "ID") {
+    integer(m_client.id);
+  } else if (name == "SETNAME") {
+    const std::string *client_name = arg_at(command_array, i++);
+    if (client_name == nullptr) {
+      wrong_args("CLIENT|SETNAME");
+      return;
+    }
+    for (char c : *client_name)
+      if (c < '!' || c > '~') {
+        error("Client names cannot contain spaces, newlines or special "
+              "characters.");
+        return;
+      }
+    m_client.name = *client_name;
+    ok();
+  } else if (name == "GETNAME") {
+    if (m_client.name.empty())
+      null();
+    else
+      bulk(m_client.name);
+  } else if (name == "TRACKING") {
+    client_tracking(i, command_array, config);
+  } else {
+    error("unknown subcommand '" + *subcommand + "'. Try CLIENT HELP.");
+  }
+}
+
+// CLIENT TRACKING ON|OFF [BCAST] [PREFIX prefix ...] [NOLOOP]
+void HandleResponse::client_tracking(size_t &i,
+                                     const std::vector<RespData> &command_array,
+                                     DB_Config &config) {
+  const std::string *state = arg_at(command_array, i++);
+  if (state == nullptr) {
+    wrong_args("CLIENT|TRACKING");
+    return;
+  }
+  std::string on_off = upper(*state);
+  if (on_off != "ON" && on_off != "OFF") {
+    error("syntax error");
+    return;
+  }
+  // Reads and writes of a key happen on its partition's thread, away from
+  // the tracking client
+  if (on_off == "ON" && !config.partitions.empty()) {
+    error("CLIENT TRACKING is not supported with --threads");
+    return;
+  }
+  bool bcast = false, noloop = false;
+  std::vector<std::string> prefixes;
+  for (; i < command_array.size(); ++i) {
+    const std::string *arg = arg_at(command_array, i);
+    std::string option = arg ? upper(*arg) : "";
+    if (option == "BCAST") {
+      bcast = true;
+    } else if (option == "NOLOOP") {
+      noloop = true;
+    } else if (option == "PREFIX" && arg_at(command_array, i + 1) != nullptr) {
+      prefixes.push_back(*arg_at(command_array, ++i));
+    } else {
+      error("syntax error");
+      return;
+    }
+  }
+
+  if (on_off == "OFF") {
+    if (m_client.tracking)
+      config.tracking.disable(&m_client);
+    m_client.tracking = false;
+    m_client.tracking_prefixes.clear();
+    ok();
+    return;
+  }
+  if (!prefixes.empty() && !bcast) {
+    error("PREFIX option requires BCAST mode to be enabled");
+    return;
+  }
+  // Invalidations are pushes, there is no REDIRECT to a RESP2 connection
+  if (m_client.protocol < 3) {
+    error("client tracking needs RESP3, switch with HELLO 3");
+    return;
+  }
+  // Switching modes would drop the keys remembered or collected so far
+  if (m_client.tracking && bcast != m_client.tracking_bcast) {
+    error("You can't switch BCAST mode on/off before disabling tracking for "
+          "this client, and then re-enabling it with a different mode.");
+    return;
+  }
+  if (bcast && prefixes.empty())
+    prefixes.push_back("");
+  // Turning tracking on again adds the new prefixes to the client's
+  if (m_client.tracking)
+    for (const std::string &prefix : m_client.tracking_prefixes)
+      if (std::find(prefixes.begin(), prefixes.end(), prefix) ==
+          prefixes.end())
+        prefixes.push_back(prefix);
+  // A key under two of a client's prefixes would be sent twice
+  for (size_t a = 0; a < prefixes.size(); ++a)
+    for (size_t b = 0; b < prefixes.size(); ++b)
+      if (a != b && prefixes[b].starts_with(prefixes[a])) {
+        error("Prefix '" + prefixes[b] + "' overlaps with another provided "
+              "prefix '" + prefixes[a] +
+              "'. Prefixes for a single client must not overlap.");
+        return;
+      }
+
+  m_client.tracking = true;
+  m_client.tracking_bcast = bcast;
+  m_client.tracking_noloop = noloop;
+  m_client.tracking_prefixes = std::move(prefixes);
+  config.tracking.enable(&m_client);
+  ok();
+}
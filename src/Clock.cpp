@@ -0,0 +1,34 @@
+#include "Clock.hpp"
+#include <chrono>
+
+Clock::Source Clock::m_source = &Clock::monotonic_us;
+uint64_t Clock::m_lru_resolution_ms = 1000;
+thread_local uint64_t Clock::m_now_us = Clock::monotonic_us();
+thread_local uint8_t Clock::m_lru = 0;
+
+uint64_t Clock::monotonic_us() {
+  using namespace std::chrono;
+  static const int64_t offset_us =
+      duration_cast<microseconds>(system_clock::now().time_since_epoch())
+          .count() -
+      duration_cast<microseconds>(steady_clock::now().time_since_epoch())
+          .count();
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch())
+             .count() +
+         offset_us;
+}
+
+void Clock::update() {
+  m_now_us = m_source();
+  m_lru = m_now_us / 1000 / m_lru_resolution_ms;
+}
+
+void Clock::set_lru_resolution(uint64_t ms) {
+  m_lru_resolution_ms = ms ? ms : 1;
+  update();
+}
+
+void Clock::set_source(Source source) {
+  m_source = source ? source : &Clock::monotonic_us;
+  update();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+Cached time service. Reading the clock on every command or key is wasteful, so
+the event loop refreshes a cached value once per iteration and everything that
+needs "now" (expiry, stats, cron) reads the cache.
+
+The time comes from a monotonic clock plus a wall-clock offset taken at start,
+so it is comparable with the unix-time expiries of RDB files and clients but
+never jumps backwards. The source can be replaced to make expiry deterministic.
+Each event loop thread has its own cached value.
+*/
+class Clock {
+public:
+  // Returns microseconds since the unix epoch
+  typedef uint64_t (*Source)();
+
+  // Refreshes the cached time from the source
+  static void update();
+  static uint64_t now_ms() { return m_now_us / 1000; }
+  static uint64_t now_us() { return m_now_us; }
+  // Coarse clock stamped on entries when they are accessed (DB_Entry::lru):
+  // ticks of the LRU resolution, wrapping at 256
+  static uint8_t lru() { return m_lru; }
+  // Sets the length of an LRU tick, before the event loops start
+  static void set_lru_resolution(uint64_t ms);
+
+  // Replaces the time source (nullptr restores the default) and refreshes
+  static void set_source(Source source);
+
+private:
+  static uint64_t monotonic_us();
+  static Source m_source;
+  static uint64_t m_lru_resolution_ms;
+  static thread_local uint64_t m_now_us;
+  static thread_local uint8_t m_lru;
+};
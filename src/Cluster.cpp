@@ -0,0 +1,383 @@
+#include "Cluster.hpp"
+#include "HandleResponse.hpp"
+#include <algorithm>
+#include <charconv>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <sys/epoll.h>
+
+Cluster::Cluster() = default;
+
+static std::string random_node_id() {
+  static const char hex[] = "0123456789abcdef";
+  std::random_device device;
+  std::mt19937_64 random(device());
+  std::string id(40, '0');
+  for (char &c : id)
+    c = hex[random() & 15];
+  return id;
+}
+
+template <typename T> static bool parse_number(std::string_view str, T &out) {
+  auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), out);
+  return ec == std::errc() && end == str.data() + str.size();
+}
+
+void Cluster::enable(const std::string &ip, int port) {
+  m_slots.assign(CLUSTER_SLOTS, nullptr);
+  m_migrating.assign(CLUSTER_SLOTS, nullptr);
+  m_importing.assign(CLUSTER_SLOTS, nullptr);
+  m_myself = learn(random_node_id(), ip, port);
+}
+
+ClusterNode *Cluster::node(const std::string &id) const {
+  for (const auto &node : m_nodes)
+    if (node->id == id)
+      return node.get();
+  return nullptr;
+}
+
+ClusterNode *Cluster::learn(const std::string &id, const std::string &ip,
+                            int port) {
+  if (ClusterNode *known = node(id)) {
+    known->ip = ip;
+    known->port = port;
+    return known;
+  }
+  auto node = std::make_unique<ClusterNode>();
+  node->id = id;
+  node->ip = ip;
+  node->port = port;
+  m_nodes.push_back(std::move(node));
+  return m_nodes.back().get();
+}
+
+void Cluster::bump_epoch() { m_myself->config_epoch = ++m_current_epoch; }
+
+std::vector<std::pair<int, int>>
+Cluster::slot_ranges(const ClusterNode *node) const {
+  std::vector<std::pair<int, int>> ranges;
+  for (int slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+    if (m_slots[slot] != node)
+      continue;
+    if (!ranges.empty() && ranges.back().second == slot - 1)
+      ranges.back().second = slot;
+    else
+      ranges.emplace_back(slot, slot);
+  }
+  return ranges;
+}
+
+void Cluster::meet(const std::string &ip, int port) {
+  m_meet.insert(ip + ":" + std::to_string(port));
+}
+
+bool Cluster::link_connected(const ClusterNode *node) const {
+  auto it = m_bus.find(node->address());
+  return it != m_bus.end() && it->second->connected;
+}
+
+/*
+CLUSTER GOSSIP id ip port config-epoch current-epoch slots [id ip port]...
+
+slots lists the sender's slots as comma separated "first-last" ranges (or
+single slots), "-" when it has none, and the trailing triples are the other
+nodes the sender knows.
+*/
+std::string Cluster::gossip_message() const {
+  std::string slots;
+  for (auto [first, last] : slot_ranges(m_myself)) {
+    if (!slots.empty())
+      slots += ',';
+    slots += std::to_string(first);
+    if (last != first)
+      slots += "-" + std::to_string(last);
+  }
+  std::string message;
+  append_array_len(message, 8 + 3 * (m_nodes.size() - 1));
+  append_bulk(message, "CLUSTER");
+  append_bulk(message, "GOSSIP");
+  append_bulk(message, m_myself->id);
+  append_bulk(message, m_myself->ip);
+  append_bulk(message, std::to_string(m_myself->port));
+  append_bulk(message, std::to_string(m_myself->config_epoch));
+  append_bulk(message, std::to_string(m_current_epoch));
+  append_bulk(message, slots.empty() ? "-" : slots);
+  for (const auto &node : m_nodes) {
+    if (node.get() == m_myself)
+      continue;
+    append_bulk(message, node->id);
+    append_bulk(message, node->ip);
+    append_bulk(message, std::to_string(node->port));
+  }
+  return message;
+}
+
+bool Cluster::receive_gossip(const std::vector<std::string> &args) {
+  int port;
+  uint64_t config_epoch, current_epoch;
+  if (args.size() < 6 || (args.size() - 6) % 3 != 0 ||
+      !parse_number(args[2], port) || !parse_number(args[3], config_epoch) ||
+      !parse_number(args[4], current_epoch))
+    return false;
+
+  std::vector<std::pair<int, int>> claims;
+  if (args[5] != "-") {
+    std::string_view slots = args[5];
+    while (!slots.empty()) {
+      std::string_view range = slots.substr(0, slots.find(','));
+      slots.remove_prefix(std::min(slots.size(), range.size() + 1));
+      size_t dash = range.find('-');
+      int first, last;
+      if (!parse_number(range.substr(0, dash), first))
+        return false;
+      last = first;
+      if (dash != std::string_view::npos &&
+          !parse_number(range.substr(dash + 1), last))
+        return false;
+      if (first < 0 || last >= CLUSTER_SLOTS || first > last)
+        return false;
+      claims.emplace_back(first, last);
+    }
+  }
+  if (args[0] == m_myself->id)
+    return true;
+
+  ClusterNode *sender = learn(args[0], args[1], port);
+  sender->config_epoch = config_epoch;
+  m_current_epoch = std::max({m_current_epoch, config_epoch, current_epoch});
+  m_meet.erase(sender->address());
+  for (auto [first, last] : claims)
+    for (int slot = first; slot <= last; ++slot) {
+      ClusterNode *owner = m_slots[slot];
+      if (owner == nullptr || owner->config_epoch < config_epoch)
+        m_slots[slot] = sender;
+    }
+
+  for (size_t n = 6; n < args.size(); n += 3)
+    if (args[n] != m_myself->id && node(args[n]) == nullptr &&
+        parse_number(args[n + 2], port))
+      learn(args[n], args[n + 1], port);
+  return true;
+}
+
+// Connects without waiting, the link is usable once epoll reports it writable
+ClusterLink *Cluster::open_link(const std::string &address) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos)
+    return nullptr;
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+  struct addrinfo hints = {};
+  struct addrinfo *info;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0)
+    return nullptr;
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int result = fd < 0 ? -1 : ::connect(fd, info->ai_addr, info->ai_addrlen);
+  freeaddrinfo(info);
+  if (result != 0 && (fd < 0 || errno != EINPROGRESS)) {
+    if (fd >= 0)
+      close(fd);
+    return nullptr;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  event.data.fd = fd;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    close(fd);
+    return nullptr;
+  }
+
+  auto link = std::make_unique<ClusterLink>();
+  link->fd = fd;
+  link->address = address;
+  link->connected = result == 0;
+  ClusterLink *opened = link.get();
+  m_links[fd] = std::move(link);
+  return opened;
+}
+
+void Cluster::close_link(int fd) {
+  auto it = m_links.find(fd);
+  std::unique_ptr<ClusterLink> link = std::move(it->second);
+  m_links.erase(it);
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  link->fd = -1;
+
+  if (link->migration) {
+    if (link->error.empty() && link->awaiting > 0)
+      link->error = link->connected
+                        ? "IOERR error or timeout reading to target instance"
+                        : "IOERR error or timeout connecting to the client";
+    m_finished.push_back(std::move(link));
+    return;
+  }
+  auto bus = m_bus.find(link->address);
+  if (bus != m_bus.end() && bus->second == link.get())
+    m_bus.erase(bus);
+}
+
+bool Cluster::flush(ClusterLink &link) {
+  if (!link.connected)
+    return true;
+  while (link.output_pos < link.output.length()) {
+    ssize_t written =
+        send(link.fd, link.output.data() + link.output_pos,
+             link.output.length() - link.output_pos, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    link.output_pos += written;
+  }
+  link.output.clear();
+  link.output_pos = 0;
+  return true;
+}
+
+bool Cluster::read(ClusterLink &link) {
+  char buffer[16 * 1024];
+  while (true) {
+    ssize_t bytes_read = recv(link.fd, buffer, sizeof(buffer), 0);
+    if (bytes_read == 0)
+      return false;
+    if (bytes_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    link.input.append(buffer, bytes_read);
+  }
+
+  RespParser parser;
+  size_t pos = 0;
+  try {
+    while (pos < link.input.length() && link.awaiting > 0) {
+      size_t start = pos;
+      RespData reply;
+      try {
+        reply = parser.parse(link.input, pos);
+      } catch (const RespIncomplete &) {
+        pos = start;
+        break;
+      }
+      --link.awaiting;
+      bool failed = reply.type == RespType::SimpleError;
+      if (link.migration)
+        link.restored.push_back(!failed);
+      if (failed && link.error.empty())
+        link.error = "ERR Target instance replied with error: " +
+                     std::get<std::string>(reply.value);
+    }
+  } catch (const std::exception &) {
+    return false;
+  }
+  link.input.erase(0, pos);
+  return true;
+}
+
+bool Cluster::handle_event(int fd, uint32_t events) {
+  auto it = m_links.find(fd);
+  if (it == m_links.end())
+    return false;
+  ClusterLink &link = *it->second;
+
+  bool alive = true;
+  if (!link.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    link.connected = error == 0;
+    alive = link.connected;
+  }
+  if (alive && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    alive = read(link);
+  if (alive && (events & EPOLLOUT))
+    alive = flush(link);
+  // A migration is done once every key got its reply
+  if (!alive || (link.migration && link.awaiting == 0))
+    close_link(fd);
+  return true;
+}
+
+void Cluster::cron(uint64_t now_ms) {
+  std::vector<int> expired;
+  for (const auto &[fd, link] : m_links)
+    if (link->migration && now_ms >= link->deadline_ms)
+      expired.push_back(fd);
+  for (int fd : expired)
+    close_link(fd);
+
+  // Links are (re)opened as needed, and get a new message once the previous
+  // one was answered
+  std::vector<std::string> targets(m_meet.begin(), m_meet.end());
+  for (const auto &node : m_nodes)
+    if (node.get() != m_myself)
+      targets.push_back(node->address());
+  std::string message = gossip_message();
+  for (const std::string &address : targets) {
+    ClusterLink *&link = m_bus[address];
+    if (link == nullptr && (link = open_link(address)) == nullptr) {
+      m_bus.erase(address);
+      continue;
+    }
+    if (link->awaiting > 0)
+      continue;
+    link->output += message;
+    link->awaiting = 1;
+    if (!flush(*link))
+      close_link(link->fd);
+  }
+}
+
+bool Cluster::migrate(const std::string &address, std::string commands,
+                      std::vector<std::string> keys,
+                      std::vector<uint64_t> versions, Client *client,
+                      bool copy, uint64_t deadline_ms) {
+  ClusterLink *link = open_link(address);
+  if (link == nullptr)
+    return false;
+  link->migration = true;
+  link->client = client;
+  link->copy = copy;
+  link->deadline_ms = deadline_ms;
+  link->awaiting = keys.size();
+  link->output = std::move(commands);
+  for (const std::string &key : keys)
+    m_in_flight.insert(key);
+  link->keys = std::move(keys);
+  link->versions = std::move(versions);
+  if (!flush(*link))
+    close_link(link->fd);
+  return true;
+}
+
+std::vector<std::unique_ptr<ClusterLink>> Cluster::take_finished() {
+  std::vector<std::unique_ptr<ClusterLink>> finished;
+  finished.swap(m_finished);
+  for (const auto &link : finished)
+    for (const std::string &key : link->keys)
+      m_in_flight.erase(key);
+  return finished;
+}
+
+void Cluster::forget_client(const Client *client) {
+  for (auto &[fd, link] : m_links)
+    if (link->client == client)
+      link->client = nullptr;
+  for (auto &link : m_finished)
+    if (link->client == client)
+      link->client = nullptr;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "Client.hpp"
+#include "HashSlot.hpp"
+
+/*
+Cluster mode (--cluster-enabled yes). Every hash slot (see HashSlot.hpp) is
+served by one node; a command whose keys are in a slot served elsewhere gets
+-MOVED slot ip:port, and one whose keys are in different slots -CROSSSLOT.
+The keyspace itself is indexed by slot, see Dict.hpp.
+
+Nodes find each other over a small bus that runs on the client port: every
+cron tick a node sends CLUSTER GOSSIP to each node it knows, with its address,
+its config epoch, the slots it serves and the nodes it knows about. CLUSTER
+MEET ip port starts it. A claim for a slot wins over the current owner's when
+its config epoch is higher, and a node that receives a slot by migration
+bumps its epoch past every epoch it has seen, so ownership converges to the
+latest migration. There is no failure detection, failover or persisted
+cluster state.
+
+A slot moves with the redis-cli --cluster reshard sequence:
+  target  CLUSTER SETSLOT slot IMPORTING source-id
+  source  CLUSTER SETSLOT slot MIGRATING target-id
+  source  CLUSTER GETKEYSINSLOT slot count, MIGRATE ... KEYS ...  (repeat)
+  both    CLUSTER SETSLOT slot NODE target-id
+Meanwhile the source serves the keys it still has and answers -ASK for the
+others, and the target serves the slot to clients that sent ASKING first.
+MIGRATE blocks neither node: the keys go to the target as RESTORE-ASKING
+commands over a nonblocking link while the calling client waits, and keys in
+flight answer -TRYAGAIN until the target has confirmed them.
+*/
+
+struct ClusterNode {
+  std::string id; // 40 hex characters
+  std::string ip;
+  int port;
+  // Epoch of the node's slot claims, the highest claim wins a slot
+  uint64_t config_epoch = 0;
+
+  std::string address() const { return ip + ":" + std::to_string(port); }
+};
+
+// Outgoing connection to another node: a gossip bus link, or a MIGRATE
+// sending RESTORE-ASKING commands. Replies are only counted and checked for
+// errors.
+struct ClusterLink {
+  int fd = -1;
+  std::string address; // ip:port
+  bool connected = false;
+  std::string output;
+  size_t output_pos = 0;
+  std::string input;
+  size_t awaiting = 0; // replies still expected
+
+  // MIGRATE: the waiting client (nullptr once it is gone), the keys sent, the
+  // WATCH version they had then and which of them the target restored, in
+  // order
+  bool migration = false;
+  Client *client = nullptr;
+  bool copy = false;
+  uint64_t deadline_ms = 0;
+  std::vector<std::string> keys;
+  std::vector<uint64_t> versions;
+  std::vector<bool> restored;
+  std::string error; // first error, without the leading '-'
+};
+
+class Cluster {
+public:
+  Cluster();
+
+  // Turns cluster mode on, ip and port are announced to the other nodes
+  void enable(const std::string &ip, int port);
+  bool enabled() const { return m_myself != nullptr; }
+  ClusterNode *myself() const { return m_myself; }
+  uint64_t current_epoch() const { return m_current_epoch; }
+  const std::vector<std::unique_ptr<ClusterNode>> &nodes() const {
+    return m_nodes;
+  }
+  ClusterNode *node(const std::string &id) const;
+
+  // Node serving slot, or nullptr
+  ClusterNode *owner(uint16_t slot) const { return m_slots[slot]; }
+  ClusterNode *migrating(uint16_t slot) const { return m_migrating[slot]; }
+  ClusterNode *importing(uint16_t slot) const { return m_importing[slot]; }
+  void set_owner(uint16_t slot, ClusterNode *node) { m_slots[slot] = node; }
+  void set_migrating(uint16_t slot, ClusterNode *node) {
+    m_migrating[slot] = node;
+  }
+  void set_importing(uint16_t slot, ClusterNode *node) {
+    m_importing[slot] = node;
+  }
+  // Gives myself a config epoch above every epoch seen, so that its claims
+  // win over the previous owners'
+  void bump_epoch();
+  // [first, last] slot ranges served by node
+  std::vector<std::pair<int, int>> slot_ranges(const ClusterNode *node) const;
+
+  // Gossips with the node at ip:port until it answers
+  void meet(const std::string &ip, int port);
+  // Applies a CLUSTER GOSSIP message, false if it is malformed
+  bool receive_gossip(const std::vector<std::string> &args);
+  bool link_connected(const ClusterNode *node) const;
+
+  // Links are registered with this epoll instance
+  void set_event_loop(int epoll_fd) { m_epoll_fd = epoll_fd; }
+  // Handles the events of fd if it is a link, false otherwise
+  bool handle_event(int fd, uint32_t events);
+  // Gossips and fails the migrations past their deadline
+  void cron(uint64_t now_ms);
+
+  // Sends commands, one RESTORE-ASKING per key, to address. False if the
+  // connection could not be started.
+  bool migrate(const std::string &address, std::string commands,
+               std::vector<std::string> keys, std::vector<uint64_t> versions,
+               Client *client, bool copy, uint64_t deadline_ms);
+  bool in_flight(const std::string &key) const {
+    return !m_in_flight.empty() && m_in_flight.count(key);
+  }
+  // Takes the migrations that completed or failed, their keys are no longer
+  // in flight
+  std::vector<std::unique_ptr<ClusterLink>> take_finished();
+  // Drops client from the migration it waits for
+  void forget_client(const Client *client);
+
+private:
+  ClusterNode *m_myself = nullptr;
+  std::vector<std::unique_ptr<ClusterNode>> m_nodes;
+  std::vector<ClusterNode *> m_slots;
+  std::vector<ClusterNode *> m_migrating;
+  std::vector<ClusterNode *> m_importing;
+  uint64_t m_current_epoch = 0;
+
+  int m_epoll_fd = -1;
+  std::unordered_map<int, std::unique_ptr<ClusterLink>> m_links;
+  // Gossip link of each address
+  std::unordered_map<std::string, ClusterLink *> m_bus;
+  // Addresses given to MEET that have not gossiped back yet
+  std::unordered_set<std::string> m_meet;
+  std::unordered_set<std::string> m_in_flight;
+  std::vector<std::unique_ptr<ClusterLink>> m_finished;
+
+  ClusterNode *learn(const std::string &id, const std::string &ip, int port);
+  std::string gossip_message() const;
+  ClusterLink *open_link(const std::string &address);
+  void close_link(int fd);
+  bool flush(ClusterLink &link);
+  bool read(ClusterLink &link);
+};
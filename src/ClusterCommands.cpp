@@ -0,0 +1,610 @@
+#include "Clock.hpp"
+#include "HandleResponse.hpp"
+#include "RDB_Decoder.hpp"
+#include "RDB_Encoder.hpp"
+#include <string>
+#include <vector>
+
+// How long MIGRATE waits for the target when given a timeout of 0
+#define MIGRATE_DEFAULT_TIMEOUT_MS 1000
+
+static bool parse_slot(const std::string *arg, int &slot) {
+  int64_t value;
+  if (arg == nullptr || !string_to_int64(*arg, value) || value < 0 ||
+      value >= CLUSTER_SLOTS)
+    return false;
+  slot = value;
+  return true;
+}
+
+/*
+Decides whether a command can run here. Its keys must be in one slot, served
+by this node, or being imported and the client sent ASKING. While a slot
+migrates away, keys already moved get -ASK and keys in flight -TRYAGAIN.
+Returns false having replied the redirection or error.
+*/
+bool HandleResponse::cluster_allows(const CommandSpec &command,
+                                    const std::vector<RespData> &command_array,
+                                    DB_Config &config, bool asking) {
+  int slot = -1;
+  bool cross_slot = false;
+  for_each_key(command, command_array, [&](const std::string &key) {
+    int key_slot = key_hash_slot(key);
+    if (slot == -1)
+      slot = key_slot;
+    else if (key_slot != slot)
+      cross_slot = true;
+  });
+  if (slot == -1)
+    return true;
+  // A transaction's keys all have to be in the same slot too
+  if (m_client.in_multi && !cross_slot) {
+    if (m_client.multi_slot == -1)
+      m_client.multi_slot = slot;
+    cross_slot = m_client.multi_slot != slot;
+  }
+  if (cross_slot) {
+    reply("-CROSSSLOT Keys in request don't hash to the same slot\r\n");
+    return false;
+  }
+
+  Cluster &cluster = config.cluster;
+  ClusterNode *owner = cluster.owner(slot);
+  if (owner != cluster.myself()) {
+    if ((asking || command.handler == &HandleResponse::restore_asking) &&
+        cluster.importing(slot) != nullptr)
+      return true;
+    if (owner == nullptr) {
+      reply("-CLUSTERDOWN Hash slot not served\r\n");
+      return false;
+    }
+    reply("-MOVED " + std::to_string(slot) + " " + owner->address() + "\r\n");
+    return false;
+  }
+
+  ClusterNode *target = cluster.migrating(slot);
+  if (target == nullptr)
+    return true;
+  size_t keys = 0, missing = 0;
+  bool in_flight = false;
+  for_each_key(command, command_array, [&](const std::string &key) {
+    ++keys;
+    if (config.db.find(key) == nullptr)
+      ++missing;
+    in_flight = in_flight || cluster.in_flight(key);
+  });
+  if (in_flight) {
+    reply("-TRYAGAIN Key is being migrated, retry later\r\n");
+    return false;
+  }
+  if (missing == 0)
+    return true;
+  if (missing < keys) {
+    reply("-TRYAGAIN Multiple keys request during rehashing of slot\r\n");
+    return false;
+  }
+  reply("-ASK " + std::to_string(slot) + " " + target->address() + "\r\n");
+  return false;
+}
+
+void HandleResponse::cluster_info(DB_Config &config) {
+  Cluster &cluster = config.cluster;
+  size_t assigned = 0;
+  std::unordered_set<const ClusterNode *> serving;
+  for (int slot = 0; slot < CLUSTER_SLOTS; ++slot)
+    if (const ClusterNode *owner = cluster.owner(slot)) {
+      ++assigned;
+      serving.insert(owner);
+    }
+  std::string slots = std::to_string(assigned);
+  std::string info;
+  info += "cluster_state:";
+  info += assigned == CLUSTER_SLOTS ? "ok\r\n" : "fail\r\n";
+  info += "cluster_slots_assigned:" + slots + "\r\n";
+  info += "cluster_slots_ok:" + slots + "\r\n";
+  info += "cluster_slots_pfail:0\r\n";
+  info += "cluster_slots_fail:0\r\n";
+  info += "cluster_known_nodes:" + std::to_string(cluster.nodes().size()) +
+          "\r\n";
+  info += "cluster_size:" + std::to_string(serving.size()) + "\r\n";
+  info += "cluster_current_epoch:" + std::to_string(cluster.current_epoch()) +
+          "\r\n";
+  info += "cluster_my_epoch:" +
+          std::to_string(cluster.myself()->config_epoch) + "\r\n";
+  bulk(info);
+}
+
+// One line per node: id address flags master ping pong epoch link slots...
+void HandleResponse::cluster_nodes(DB_Config &config) {
+  Cluster &cluster = config.cluster;
+  std::string nodes;
+  for (const auto &node : cluster.nodes()) {
+    bool myself = node.get() == cluster.myself();
+    nodes += node->id + " " + node->address() + "@" +
+             std::to_string(node->port) +
+             (myself ? " myself,master" : " master") + " - 0 0 " +
+             std::to_string(node->config_epoch) +
+             (myself || cluster.link_connected(node.get()) ? " connected"
+                                                           : " disconnected");
+    for (auto [first, last] : cluster.slot_ranges(node.get())) {
+      nodes += " " + std::to_string(first);
+      if (last != first)
+        nodes += "-" + std::to_string(last);
+    }
+    if (myself)
+      for (int slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+        if (const ClusterNode *target = cluster.migrating(slot))
+          nodes += " [" + std::to_string(slot) + "->-" + target->id + "]";
+        if (const ClusterNode *source = cluster.importing(slot))
+          nodes += " [" + std::to_string(slot) + "-<-" + source->id + "]";
+      }
+    nodes += "\n";
+  }
+  bulk(nodes);
+}
+
+// [[first, last, [ip, port, id]], ...]
+void HandleResponse::cluster_slots(DB_Config &config) {
+  Cluster &cluster = config.cluster;
+  std::string body;
+  size_t ranges = 0;
+  for (const auto &node : cluster.nodes())
+    for (auto [first, last] : cluster.slot_ranges(node.get())) {
+      append_array_len(body, 3);
+      append_integer(body, first);
+      append_integer(body, last);
+      append_array_len(body, 3);
+      append_bulk(body, node->ip);
+      append_integer(body, node->port);
+      append_bulk(body, node->id);
+      ++ranges;
+    }
+  std::string response;
+  append_array_len(response, ranges);
+  reply(response + body);
+}
+
+// One map per node: its slot ranges and its (only) member
+void HandleResponse::cluster_shards(DB_Config &config) {
+  Cluster &cluster = config.cluster;
+  int protocol = m_client.protocol;
+  std::string response;
+  append_array_len(response, cluster.nodes().size());
+  for (const auto &node : cluster.nodes()) {
+    std::vector<std::pair<int, int>> ranges = cluster.slot_ranges(node.get());
+    append_map_len(response, 2, protocol);
+    append_bulk(response, "slots");
+    append_array_len(response, ranges.size() * 2);
+    for (auto [first, last] : ranges) {
+      append_integer(response, first);
+      append_integer(response, last);
+    }
+    append_bulk(response, "nodes");
+    append_array_len(response, 1);
+    append_map_len(response, 7, protocol);
+    append_bulk(response, "id");
+    append_bulk(response, node->id);
+    append_bulk(response, "port");
+    append_integer(response, node->port);
+    append_bulk(response, "ip");
+    append_bulk(response, node->ip);
+    append_bulk(response, "endpoint");
+    append_bulk(response, node->ip);
+    append_bulk(response, "role");
+    append_bulk(response, "master");
+    append_bulk(response, "replication-offset");
+    append_integer(response, 0);
+    append_bulk(response, "health");
+    append_bulk(response, "online");
+  }
+  reply(response);
+}
+
+// CLUSTER SETSLOT slot IMPORTING id | MIGRATING id | NODE id | STABLE
+void HandleResponse::cluster_setslot(size_t &i,
+                                     const std::vector<RespData> &command_array,
+                                     DB_Config &config) {
+  Cluster &cluster = config.cluster;
+  int slot;
+  if (!parse_slot(arg_at(command_array, i++), slot)) {
+    error("Invalid or out of range slot");
+    return;
+  }
+  const std::string *action_arg = arg_at(command_array, i++);
+  std::string action = action_arg ? upper(*action_arg) : "";
+  if (action == "STABLE") {
+    cluster.set_migrating(slot, nullptr);
+    cluster.set_importing(slot, nullptr);
+    ok();
+    return;
+  }
+  const std::string *id = arg_at(command_array, i++);
+  if (id == nullptr ||
+      (action != "IMPORTING" && action != "MIGRATING" && action != "NODE")) {
+    error("Invalid CLUSTER SETSLOT action or number of arguments");
+    return;
+  }
+  ClusterNode *node = cluster.node(*id);
+  if (node == nullptr) {
+    error("I don't know about node " + *id);
+    return;
+  }
+  ClusterNode *myself = cluster.myself();
+  ClusterNode *owner = cluster.owner(slot);
+
+  if (action == "MIGRATING") {
+    if (owner != myself) {
+      error("I'm not the owner of hash slot " + std::to_string(slot));
+      return;
+    }
+    cluster.set_migrating(slot, node == myself ? nullptr : node);
+  } else if (action == "IMPORTING") {
+    if (owner == myself) {
+      error("I'm already the owner of hash slot " + std::to_string(slot));
+      return;
+    }
+    cluster.set_importing(slot, node == myself ? nullptr : node);
+  } else {
+    if (owner == myself && node != myself && config.db.slot_size(slot) > 0) {
+      error("Can't assign hashslot " + std::to_string(slot) +
+            " to a different node while I still hold keys for this hash "
+            "slot.");
+      return;
+    }
+    cluster.set_owner(slot, node);
+    cluster.set_migrating(slot, nullptr);
+    // Closing an import: the new claim has to win over the old owner's
+    if (node == myself && cluster.importing(slot) != nullptr) {
+      cluster.set_importing(slot, nullptr);
+      cluster.bump_epoch();
+    }
+  }
+  ok();
+}
+
+// CLUSTER INFO | MYID | NODES | SLOTS | SHARDS | KEYSLOT key |
+// COUNTKEYSINSLOT slot | GETKEYSINSLOT slot count | ADDSLOTS slot... |
+// ADDSLOTSRANGE first last... | DELSLOTS slot... | SETSLOT ... |
+// MEET ip port | GOSSIP ...
+void HandleResponse::cluster(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  Cluster &cluster = config.cluster;
+  if (!cluster.enabled()) {
+    error("This instance has cluster support disabled");
+    return;
+  }
+  const std::string *subcommand = arg_at(command_array, i++);
+  if (subcommand == nullptr) {
+    wrong_args("CLUSTER");
+    return;
+  }
+  std::string name = upper(*subcommand);
+
+  if (name == "INFO") {
+    cluster_info(config);
+  } else if (name == "MYID") {
+    bulk(cluster.myself()->id);
+  } else if (name == "NODES") {
+    cluster_nodes(config);
+  } else if (name == "SLOTS") {
+    cluster_slots(config);
+  } else if (name == "SHARDS") {
+    cluster_shards(config);
+  } else if (name == "KEYSLOT") {
+    const std::string *key = arg_at(command_array, i++);
+    if (key == nullptr) {
+      wrong_args("CLUSTER KEYSLOT");
+      return;
+    }
+    integer(key_hash_slot(*key));
+  } else if (name == "COUNTKEYSINSLOT") {
+    int slot;
+    if (!parse_slot(arg_at(command_array, i++), slot)) {
+      error("Invalid slot");
+      return;
+    }
+    integer(config.db.slot_size(slot));
+  } else if (name == "GETKEYSINSLOT") {
+    int slot;
+    int64_t count;
+    const std::string *count_arg;
+    if (!parse_slot(arg_at(command_array, i++), slot) ||
+        (count_arg = arg_at(command_array, i++)) == nullptr ||
+        !string_to_int64(*count_arg, count) || count < 0) {
+      error("Invalid slot or number of keys");
+      return;
+    }
+    std::string body;
+    int64_t found = 0;
+    config.db.for_each_in_slot(slot, [&](DB_Entry *entry) {
+      if (found == count)
+        return false;
+      append_bulk(body, entry->key());
+      ++found;
+      return true;
+    });
+    std::string response;
+    append_array_len(response, found);
+    reply(response + body);
+  } else if (name == "ADDSLOTS" || name == "ADDSLOTSRANGE" ||
+             name == "DELSLOTS") {
+    // Every slot is checked before any is changed
+    bool range = name == "ADDSLOTSRANGE";
+    bool add = name != "DELSLOTS";
+    std::vector<int> slots;
+    if (i >= command_array.size() ||
+        (range && (command_array.size() - i) % 2 != 0)) {
+      wrong_args("CLUSTER " + name);
+      return;
+    }
+    for (; i < command_array.size(); i += range ? 2 : 1) {
+      int first, last;
+      if (!parse_slot(arg_at(command_array, i), first) ||
+          !parse_slot(arg_at(command_array, range ? i + 1 : i), last) ||
+          last < first) {
+        error("Invalid or out of range slot");
+        return;
+      }
+      for (int slot = first; slot <= last; ++slot) {
+        if (add && cluster.owner(slot) != nullptr) {
+          error("Slot " + std::to_string(slot) + " is already busy");
+          return;
+        }
+        if (!add && cluster.owner(slot) == nullptr) {
+          error("Slot " + std::to_string(slot) + " is already unassigned");
+          return;
+        }
+        slots.push_back(slot);
+      }
+    }
+    for (int slot : slots)
+      cluster.set_owner(slot, add ? cluster.myself() : nullptr);
+    ok();
+  } else if (name == "SETSLOT") {
+    cluster_setslot(i, command_array, config);
+  } else if (name == "MEET") {
+    const std::string *ip = arg_at(command_array, i++);
+    const std::string *port_arg = arg_at(command_array, i++);
+    int64_t port;
+    if (ip == nullptr || port_arg == nullptr ||
+        !string_to_int64(*port_arg, port) || port <= 0 || port > 65535) {
+      error("Invalid node address specified");
+      return;
+    }
+    cluster.meet(*ip, port);
+    ok();
+  } else if (name == "GOSSIP") {
+    std::vector<std::string> args;
+    for (; const std::string *arg = arg_at(command_array, i); ++i)
+      args.push_back(*arg);
+    if (!cluster.receive_gossip(args)) {
+      error("Invalid gossip message");
+      return;
+    }
+    ok();
+  } else {
+    error("unknown subcommand '" + *subcommand + "'");
+  }
+}
+
+void HandleResponse::asking(size_t &, const std::vector<RespData> &,
+                            DB_Config &config) {
+  if (!config.cluster.enabled()) {
+    error("This instance has cluster support disabled");
+    return;
+  }
+  m_client.asking = true;
+  ok();
+}
+
+void HandleResponse::dump(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("DUMP");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    null();
+    return;
+  }
+  bulk(RDB_Encoder::dump(entry));
+}
+
+// RESTORE key ttl payload [REPLACE] [ABSTTL]
+void HandleResponse::restore(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *ttl_arg = arg_at(command_array, i++);
+  const std::string *payload = arg_at(command_array, i++);
+  if (key == nullptr || ttl_arg == nullptr || payload == nullptr) {
+    wrong_args("RESTORE");
+    return;
+  }
+  bool replace = false, absttl = false;
+  for (; const std::string *arg = arg_at(command_array, i); ++i) {
+    std::string option = upper(*arg);
+    if (option == "REPLACE") {
+      replace = true;
+    } else if (option == "ABSTTL") {
+      absttl = true;
+    } else {
+      error("syntax error");
+      return;
+    }
+  }
+  int64_t ttl;
+  if (!string_to_int64(*ttl_arg, ttl) || ttl < 0) {
+    error("Invalid TTL value, must be >= 0");
+    return;
+  }
+  DB_Entry *existing = lookup_key(config, *key);
+  if (existing != nullptr && !replace) {
+    reply("-BUSYKEY Target key name already exists.\r\n");
+    return;
+  }
+
+  uint64_t now = Clock::now_ms();
+  uint64_t expiry = ttl == 0 ? 0 : absttl ? ttl : now + ttl;
+  RDB_Decoder decoder(config);
+  DB_Entry *entry = decoder.restore(*payload, *key, expiry);
+  if (entry == nullptr) {
+    error("Bad data format");
+    return;
+  }
+  // Restoring an already expired key only deletes the old value
+  if (expiry != 0 && expiry <= now) {
+    DB_Entry::destroy(config.db.allocator(), entry);
+    if (existing != nullptr)
+      config.db.erase(*key);
+    ok();
+    return;
+  }
+  bool list = entry->type == ValueType::List;
+  config.db.insert(entry);
+  if (list)
+    config.blocking.signal_ready(*key);
+  ok();
+}
+
+// What MIGRATE sends: RESTORE that is accepted for a slot being imported
+void HandleResponse::restore_asking(size_t &i,
+                                    const std::vector<RespData> &command_array,
+                                    DB_Config &config) {
+  restore(i, command_array, config);
+}
+
+// MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE]
+//         [KEYS key...]
+void HandleResponse::migrate(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  const std::string *host = arg_at(command_array, i++);
+  const std::string *port_arg = arg_at(command_array, i++);
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *db = arg_at(command_array, i++);
+  const std::string *timeout_arg = arg_at(command_array, i++);
+  if (host == nullptr || port_arg == nullptr || key == nullptr ||
+      db == nullptr || timeout_arg == nullptr) {
+    wrong_args("MIGRATE");
+    return;
+  }
+  bool copy = false, replace = false;
+  std::vector<std::string> keys;
+  for (; const std::string *arg = arg_at(command_array, i); ++i) {
+    std::string option = upper(*arg);
+    if (option == "COPY") {
+      copy = true;
+    } else if (option == "REPLACE") {
+      replace = true;
+    } else if (option == "KEYS" && key->empty()) {
+      for (++i; const std::string *name = arg_at(command_array, i); ++i)
+        keys.push_back(*name);
+      break;
+    } else {
+      error("syntax error");
+      return;
+    }
+  }
+  if (!key->empty())
+    keys.push_back(*key);
+  int64_t port, timeout;
+  if (!string_to_int64(*port_arg, port) ||
+      !string_to_int64(*timeout_arg, timeout)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+  // There is a single database
+  if (*db != "0") {
+    error("DB index is out of range");
+    return;
+  }
+  if (m_exec) {
+    error("MIGRATE is not allowed in transactions");
+    return;
+  }
+
+  // Every existing key is sent as a RESTORE-ASKING with its remaining TTL
+  uint64_t now = Clock::now_ms();
+  std::vector<std::string> sent;
+  std::string commands;
+  for (const std::string &name : keys) {
+    if (config.cluster.in_flight(name)) {
+      reply("-TRYAGAIN Key is being migrated, retry later\r\n");
+      return;
+    }
+    DB_Entry *entry = lookup_key(config, name);
+    if (entry == nullptr)
+      continue;
+    uint64_t expiry = entry->expiry();
+    append_array_len(commands, replace ? 5 : 4);
+    append_bulk(commands, "RESTORE-ASKING");
+    append_bulk(commands, name);
+    append_bulk(commands, std::to_string(expiry == 0 ? 0 : expiry - now));
+    append_bulk(commands, RDB_Encoder::dump(entry));
+    if (replace)
+      append_bulk(commands, "REPLACE");
+    sent.push_back(name);
+  }
+  if (sent.empty()) {
+    reply("+NOKEY\r\n");
+    return;
+  }
+
+  // The keys are watched until the target answers: any write meanwhile, on a
+  // stable slot or by a blocked pop, keeps them from being deleted here
+  std::vector<uint64_t> versions;
+  if (!copy)
+    for (const std::string &name : sent)
+      versions.push_back(config.key_versions.watch(name));
+  uint64_t deadline =
+      now + (timeout > 0 ? timeout : MIGRATE_DEFAULT_TIMEOUT_MS);
+  if (!config.cluster.migrate(*host + ":" + std::to_string(port),
+                              std::move(commands), sent, std::move(versions),
+                              &m_client, copy, deadline)) {
+    if (!copy)
+      for (const std::string &name : sent)
+        config.key_versions.unwatch(name);
+    reply("-IOERR error or timeout connecting to the client\r\n");
+    return;
+  }
+  // The client waits, with the commands it sends meanwhile, for the reply
+  config.blocking.block(&m_client, {}, false, 0, now);
+}
+
+// Replies to the clients whose MIGRATE is done, deleting the keys the target
+// restored unless they were copied. A key written since MIGRATE sent it is
+// kept, and the MIGRATE replies an error.
+void HandleResponse::finish_migrations(DB_Config &config,
+                                       std::vector<Client *> &unblocked) {
+  for (const auto &link : config.cluster.take_finished()) {
+    if (!link->copy)
+      for (size_t n = 0; n < link->keys.size(); ++n) {
+        const std::string &key = link->keys[n];
+        bool written = config.key_versions.version(key) != link->versions[n];
+        config.key_versions.unwatch(key);
+        if (n >= link->restored.size() || !link->restored[n])
+          continue;
+        if (written) {
+          if (link->error.empty())
+            link->error = "ERR Key " + key +
+                          " was modified during MIGRATE, it was kept here";
+          continue;
+        }
+        config.db.erase(key);
+        signal_modified_key(config, key, link->client);
+      }
+    Client *client = link->client;
+    if (client == nullptr)
+      continue;
+    std::string response =
+        link->error.empty() ? "+OK\r\n" : "-" + link->error + "\r\n";
+    config.blocking.unblock(client);
+    client->push(std::make_shared<const std::string>(std::move(response)),
+                 config.pending_writes);
+    unblocked.push_back(client);
+  }
+}
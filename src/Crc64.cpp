@@ -0,0 +1,20 @@
+#include "Crc64.hpp"
+#include <array>
+
+// Reflected form of 0xad93d23594c935a9
+static constexpr std::array<uint64_t, 256> CRC64_TABLE = [] {
+  std::array<uint64_t, 256> table{};
+  for (int n = 0; n < 256; ++n) {
+    uint64_t crc = n;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x95ac9329ac4bc9b5ULL : crc >> 1;
+    table[n] = crc;
+  }
+  return table;
+}();
+
+uint64_t crc64(uint64_t crc, const char *buf, size_t len) {
+  for (size_t n = 0; n < len; ++n)
+    crc = CRC64_TABLE[(crc ^ uint8_t(buf[n])) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC64 with the Jones polynomial, the checksum of Redis' RDB files and DUMP
+// payloads
+uint64_t crc64(uint64_t crc, const char *buf, size_t len);
@@ -1,28 +1,109 @@
 #pragma once
 
-#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "Blocking.hpp"
+#include "Cluster.hpp"
+#include "Dict.hpp"
+#include "KeyVersions.hpp"
+#include "PubSub.hpp"
+#include "Tracking.hpp"
+
 // Redis request parser
 struct Request {
   std::string command;
   std::vector<std::string> args;
 };
 
-struct DB_Entry {
-  std::string value;
-  uint64_t date;
-  uint64_t expiry;
-};
+typedef Dict database;
 
-typedef std::map<std::string, DB_Entry> database;
+class LazyFree;
+class TieredStorage;
 
-struct DB_Config {
+// Settings, the same for every partition
+struct DB_Options {
   std::string dir;
   std::string db_filename;
   std::string file;
   int port;
+  // Unix domain socket path, empty to listen on TCP only
+  std::string unixsocket;
+  // Pending connections the kernel queues before accept
+  int tcp_backlog = 511;
+  bool active_defrag = false;
+  bool defrag_running = false;
+  // String values of at least this many bytes are stored LZF compressed when
+  // that saves enough (see DB_Entry.hpp), 0 disables
+  size_t string_compress_min_size = 0;
+  // Quicklist nodes left uncompressed at each end of a list, 0 disables
+  int list_compress_depth = 0;
+  // Hashes stay listpack encoded up to this many fields of at most this size
+  size_t hash_max_listpack_entries = 128;
+  size_t hash_max_listpack_value = 64;
+  // Same for sorted sets, by member count and member size
+  size_t zset_max_listpack_entries = 128;
+  size_t zset_max_listpack_value = 64;
+  // Stream blocks take entries up to this many bytes and entries, 0 for no
+  // limit
+  size_t stream_node_max_bytes = 4096;
+  size_t stream_node_max_entries = 100;
+  // Clients are closed when their output goes over the limit of their
+  // class: pubsub once subscribed, normal otherwise
+  OutputLimit normal_output_limit = {0, 0, 0};
+  OutputLimit pubsub_output_limit = {32 * 1024 * 1024, 8 * 1024 * 1024, 60};
+  // Event loop threads, each owning a partition of the keyspace
+  size_t threads = 1;
+  // Leave big values to the lazy free thread when they expire, on DEL, and
+  // on FLUSHALL/FLUSHDB without ASYNC or SYNC
+  bool lazyfree_lazy_expire = false;
+  bool lazyfree_lazy_user_del = false;
+  bool lazyfree_lazy_user_flush = false;
+  // Tiered storage, see TieredStorage.hpp: String values of at least
+  // tiered_min_value bytes idle for tiered_cold_seconds move to a log on disk
+  bool tiered_enabled = false;
+  uint64_t tiered_cold_seconds = 60;
+  size_t tiered_min_value = 64;
+  size_t tiered_io_threads = 2;
+  uint64_t tiered_segment_size = 64 * 1024 * 1024;
+
+  const OutputLimit &output_limit(const Client &client) const {
+    return client.subscriptions() > 0 ? pubsub_output_limit
+                                      : normal_output_limit;
+  }
+};
+
+struct DB_Config : DB_Options {
   database db;
-  database in_memory_db;
+  // Versions of the WATCHed keys, bumped by every write to them
+  KeyVersions key_versions;
+  PubSub pubsub;
+  Tracking tracking;
+  Blocking blocking;
+  Cluster cluster;
+  // Clients given output by other clients' commands (published messages,
+  // invalidations), flushed by the server once the running batch is done
+  std::vector<Client *> pending_writes;
+  // Shared by every partition, each queueing with its own index
+  LazyFree *lazy_free = nullptr;
+  // The partition's log with --tiered-enabled, nullptr otherwise
+  TieredStorage *tiered = nullptr;
+
+  // --threads: the config of every partition, this one at index partition.
+  // Empty with a single thread. See Partitions.hpp for who may touch which.
+  std::vector<DB_Config *> partitions;
+  size_t partition = 0;
+
+  size_t partition_of(std::string_view key) const {
+    return partitions.empty() ? partition
+                              : key_hash_slot(key) % partitions.size();
+  }
+  DB_Config &partition_for(std::string_view key) {
+    return partitions.empty() ? *this : *partitions[partition_of(key)];
+  }
+  // Every partition, this config alone with a single thread
+  std::vector<DB_Config *> all_partitions() {
+    return partitions.empty() ? std::vector<DB_Config *>{this} : partitions;
+  }
 };
@@ -0,0 +1,352 @@
+#include "DB_Entry.hpp"
+#include "Clock.hpp"
+#include "Hash.hpp"
+#include "Lzf.hpp"
+#include "ObjectAlloc.hpp"
+#include "Quicklist.hpp"
+#include "Stream.hpp"
+#include "TieredStorage.hpp"
+#include "ZSet.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+#include <new>
+
+bool string_to_int64(std::string_view str, int64_t &out) {
+  if (str.empty() || str.length() > 20)
+    return false;
+  const char *begin = str.data();
+  const char *end = begin + str.length();
+  if (*begin == '-' && str.length() > 1)
+    ++begin;
+  // Reject leading zeros ("007", "-0") but accept "0" itself
+  if (*begin == '0' && (end - begin > 1 || begin != str.data()))
+    return false;
+  auto [ptr, ec] = std::from_chars(str.data(), end, out);
+  return ec == std::errc() && ptr == end;
+}
+
+// Updated from every partition, hence atomic
+static struct {
+  std::atomic<uint64_t> keys{0};
+  std::atomic<uint64_t> value_bytes{0};
+  std::atomic<uint64_t> stored_bytes{0};
+  std::atomic<uint64_t> compressions{0};
+  std::atomic<uint64_t> rejected{0};
+  std::atomic<uint64_t> decompressions{0};
+  std::atomic<uint64_t> compress_ns{0};
+  std::atomic<uint64_t> decompress_ns{0};
+} compression;
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+CompressionStats compression_stats() {
+  CompressionStats stats;
+  stats.keys = compression.keys.load(std::memory_order_relaxed);
+  stats.value_bytes = compression.value_bytes.load(std::memory_order_relaxed);
+  stats.stored_bytes =
+      compression.stored_bytes.load(std::memory_order_relaxed);
+  stats.compressions =
+      compression.compressions.load(std::memory_order_relaxed);
+  stats.rejected = compression.rejected.load(std::memory_order_relaxed);
+  stats.decompressions =
+      compression.decompressions.load(std::memory_order_relaxed);
+  stats.compress_us =
+      compression.compress_ns.load(std::memory_order_relaxed) / 1000;
+  stats.decompress_us =
+      compression.decompress_ns.load(std::memory_order_relaxed) / 1000;
+  return stats;
+}
+
+static size_t grown_capacity(size_t len) {
+  return len < RawString::MAX_PREALLOC ? len * 2
+                                       : len + RawString::MAX_PREALLOC;
+}
+
+RawString *RawString::create(SlabAllocator &alloc, std::string_view value,
+                             size_t cap) {
+  cap = std::max(cap, value.length());
+  RawString *raw;
+  if (is_shared(cap)) {
+    char *block = static_cast<char *>(
+        object_alloc(REFS_SIZE + sizeof(RawString) + cap));
+    new (block) std::atomic<uint32_t>(1);
+    raw = reinterpret_cast<RawString *>(block + REFS_SIZE);
+  } else {
+    raw = static_cast<RawString *>(alloc.allocate(sizeof(RawString) + cap));
+  }
+  raw->len = value.length();
+  raw->cap = cap;
+  memcpy(raw->buf, value.data(), value.length());
+  return raw;
+}
+
+void RawString::destroy(SlabAllocator &alloc, RawString *raw) {
+  if (raw->shared())
+    unpin(raw);
+  else
+    alloc.deallocate(raw, raw->alloc_size());
+}
+
+RawString *RawString::reserve(SlabAllocator &alloc, RawString *raw,
+                              size_t len) {
+  // Replies still sending the value keep the old bytes
+  bool pinned = raw->shared() && refs(raw).load(std::memory_order_acquire) > 1;
+  if (raw->cap >= len && !pinned)
+    return raw;
+  size_t cap = raw->cap >= len ? raw->cap : grown_capacity(len);
+  if (!pinned && raw->shared() && is_shared(cap)) {
+    char *block = static_cast<char *>(object_realloc(
+        reinterpret_cast<char *>(raw) - REFS_SIZE,
+        REFS_SIZE + raw->alloc_size(), REFS_SIZE + sizeof(RawString) + cap));
+    raw = reinterpret_cast<RawString *>(block + REFS_SIZE);
+  } else if (!pinned && !raw->shared() && !is_shared(cap)) {
+    raw = static_cast<RawString *>(alloc.reallocate(
+        raw, raw->alloc_size(), sizeof(RawString) + cap));
+  } else {
+    RawString *grown = create(alloc, {raw->buf, raw->len}, cap);
+    destroy(alloc, raw);
+    return grown;
+  }
+  raw->cap = cap;
+  return raw;
+}
+
+void RawString::pin(RawString *raw) {
+  refs(raw).fetch_add(1, std::memory_order_relaxed);
+}
+
+void RawString::unpin(RawString *raw) {
+  size_t size = REFS_SIZE + raw->alloc_size();
+  if (refs(raw).fetch_sub(1, std::memory_order_acq_rel) == 1)
+    object_free(reinterpret_cast<char *>(raw) - REFS_SIZE, size);
+}
+
+DB_Entry *DB_Entry::allocate(SlabAllocator &alloc, std::string_view key,
+                             size_t embed_len, uint64_t expiry) {
+  size_t expiry_len = expiry ? sizeof(uint64_t) : 0;
+  size_t size = sizeof(DB_Entry) + expiry_len + key.length() + embed_len;
+  auto *entry = static_cast<DB_Entry *>(alloc.allocate(size));
+  entry->next = nullptr;
+  entry->hash = 0;
+  entry->key_len = key.length();
+  entry->type = ValueType::String;
+  entry->flags = expiry ? HAS_EXPIRE : 0;
+  entry->lru = Clock::lru();
+  if (expiry)
+    memcpy(entry->data, &expiry, sizeof(expiry));
+  memcpy(entry->data + expiry_len, key.data(), key.length());
+  return entry;
+}
+
+DB_Entry *DB_Entry::create(SlabAllocator &alloc, std::string_view key,
+                           std::string_view value, uint64_t expiry,
+                           size_t compress_min) {
+  int64_t integer;
+  if (string_to_int64(value, integer))
+    return create_int(alloc, key, integer, expiry);
+
+  if (compress_min > 0 && value.length() >= compress_min &&
+      value.length() > EMBED_MAX && value.length() <= UINT32_MAX) {
+    // lzf_compress gives up once the output does not fit
+    auto start = std::chrono::steady_clock::now();
+    std::string lzf(max_compressed(value.length()), '\0');
+    size_t lzf_len =
+        lzf_compress(value.data(), value.length(), lzf.data(), lzf.length());
+    compression.compress_ns.fetch_add(elapsed_ns(start),
+                                      std::memory_order_relaxed);
+    if (lzf_len > 0) {
+      compression.compressions.fetch_add(1, std::memory_order_relaxed);
+      return create_lzf(alloc, key, {lzf.data(), lzf_len}, value.length(),
+                        expiry);
+    }
+    compression.rejected.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (value.length() <= EMBED_MAX) {
+    DB_Entry *entry = allocate(alloc, key, value.length(), expiry);
+    entry->encoding = Encoding::Embedded;
+    entry->value.embedded_len = value.length();
+    memcpy(entry->embedded(), value.data(), value.length());
+    return entry;
+  }
+
+  DB_Entry *entry = allocate(alloc, key, 0, expiry);
+  entry->encoding = Encoding::Raw;
+  try {
+    entry->value.raw = RawString::create(alloc, value);
+  } catch (...) {
+    alloc.deallocate(entry, entry->alloc_size());
+    throw;
+  }
+  return entry;
+}
+
+DB_Entry *DB_Entry::create_lzf(SlabAllocator &alloc, std::string_view key,
+                               std::string_view lzf, size_t len,
+                               uint64_t expiry) {
+  DB_Entry *entry = allocate(alloc, key, sizeof(uint32_t), expiry);
+  entry->encoding = Encoding::Compressed;
+  uint32_t value_len = len;
+  memcpy(entry->embedded(), &value_len, sizeof(value_len));
+  try {
+    entry->value.raw = RawString::create(alloc, lzf);
+  } catch (...) {
+    alloc.deallocate(entry, entry->alloc_size());
+    throw;
+  }
+  compression.keys.fetch_add(1, std::memory_order_relaxed);
+  compression.value_bytes.fetch_add(len, std::memory_order_relaxed);
+  compression.stored_bytes.fetch_add(lzf.length(), std::memory_order_relaxed);
+  return entry;
+}
+
+DB_Entry *DB_Entry::create_int(SlabAllocator &alloc, std::string_view key,
+                               int64_t value, uint64_t expiry) {
+  DB_Entry *entry = allocate(alloc, key, 0, expiry);
+  entry->encoding = Encoding::Int;
+  entry->value.integer = value;
+  return entry;
+}
+
+DB_Entry *DB_Entry::create_object(SlabAllocator &alloc, std::string_view key,
+                                  ValueType type, Encoding encoding,
+                                  void *object, uint64_t expiry) {
+  DB_Entry *entry = allocate(alloc, key, 0, expiry);
+  entry->type = type;
+  entry->encoding = encoding;
+  entry->value.object = object;
+  return entry;
+}
+
+DB_Entry *DB_Entry::to_raw(SlabAllocator &alloc, const DB_Entry *entry,
+                           size_t len) {
+  Scratch scratch;
+  std::string_view value = entry->str(scratch);
+  DB_Entry *raw = allocate(alloc, entry->key(), 0, entry->expiry());
+  raw->encoding = Encoding::Raw;
+  try {
+    size_t cap = grown_capacity(std::max(len, value.length()));
+    raw->value.raw = RawString::create(alloc, value, cap);
+  } catch (...) {
+    alloc.deallocate(raw, raw->alloc_size());
+    throw;
+  }
+  return raw;
+}
+
+DB_Entry *DB_Entry::create_spilled(SlabAllocator &alloc,
+                                   const DB_Entry *entry, LogSegment *segment,
+                                   SpillRef ref) {
+  DB_Entry *spilled =
+      allocate(alloc, entry->key(), sizeof(SpillRef), entry->expiry());
+  spilled->encoding = Encoding::Spilled;
+  spilled->lru = entry->lru;
+  spilled->move_spilled(segment, ref);
+  return spilled;
+}
+
+void DB_Entry::destroy(SlabAllocator &alloc, DB_Entry *entry) {
+  if (entry == nullptr)
+    return;
+  if (entry->encoding == Encoding::Compressed) {
+    compression.keys.fetch_sub(1, std::memory_order_relaxed);
+    compression.value_bytes.fetch_sub(entry->value_len(),
+                                      std::memory_order_relaxed);
+    compression.stored_bytes.fetch_sub(entry->value.raw->len,
+                                       std::memory_order_relaxed);
+  }
+  if (entry->has_raw())
+    RawString::destroy(alloc, entry->value.raw);
+  else if (entry->encoding == Encoding::Spilled)
+    entry->segment()->release(entry);
+  else
+    free_object(entry->encoding, entry->value.object);
+  alloc.deallocate(entry, entry->alloc_size());
+}
+
+void DB_Entry::free_object(Encoding encoding, void *object) {
+  switch (encoding) {
+  case Encoding::Quicklist:
+    delete static_cast<Quicklist *>(object);
+    break;
+  case Encoding::Listpack:
+    Listpack::free(static_cast<uint8_t *>(object));
+    break;
+  case Encoding::HashTable:
+    delete static_cast<HashTable *>(object);
+    break;
+  case Encoding::Skiplist:
+    delete static_cast<SortedSet *>(object);
+    break;
+  case Encoding::Stream:
+    delete static_cast<Stream *>(object);
+    break;
+  default:
+    break;
+  }
+}
+
+size_t DB_Entry::free_effort() const {
+  switch (encoding) {
+  case Encoding::Quicklist:
+    return static_cast<const Quicklist *>(value.object)->nodes();
+  case Encoding::HashTable:
+    return static_cast<const HashTable *>(value.object)->map.size();
+  case Encoding::Skiplist:
+    return static_cast<const SortedSet *>(value.object)->length();
+  case Encoding::Stream:
+    return static_cast<const Stream *>(value.object)->blocks();
+  default:
+    return 1;
+  }
+}
+
+std::string_view DB_Entry::str(Scratch &scratch) const {
+  switch (encoding) {
+  case Encoding::Int: {
+    char *digits = scratch.digits;
+    auto [ptr, ec] = std::to_chars(digits, digits + sizeof(scratch.digits),
+                                   value.integer);
+    return {digits, static_cast<size_t>(ptr - digits)};
+  }
+  case Encoding::Embedded:
+    return {embedded(), value.embedded_len};
+  case Encoding::Raw:
+    return {value.raw->buf, value.raw->len};
+  case Encoding::Compressed: {
+    auto start = std::chrono::steady_clock::now();
+    scratch.text.resize(value_len());
+    // Only valid LZF is ever stored, see RDB_Decoder::read_object
+    lzf_decompress(value.raw->buf, value.raw->len, scratch.text.data(),
+                   scratch.text.length());
+    compression.decompress_ns.fetch_add(elapsed_ns(start),
+                                        std::memory_order_relaxed);
+    compression.decompressions.fetch_add(1, std::memory_order_relaxed);
+    return scratch.text;
+  }
+  default:
+    return {};
+  }
+}
+
+std::string DB_Entry::to_string() const {
+  Scratch scratch;
+  return std::string(str(scratch));
+}
+
+size_t DB_Entry::value_len() const {
+  if (encoding == Encoding::Compressed) {
+    uint32_t len;
+    memcpy(&len, embedded(), sizeof(len));
+    return len;
+  }
+  Scratch scratch;
+  return str(scratch).length();
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "Slab.hpp"
+
+/*
+A keyspace entry is a single allocation holding the hash-chain link, the
+metadata, the key bytes and - for short values - the value bytes:
+
+  +------+------+---------+------+----------+-------+----------+------------+
+  | next | hash | key_len | type | encoding | flags | value    | data[]     |
+  +------+------+---------+------+----------+-------+----------+------------+
+                                                     int64 /    [expiry]
+                                                     raw ptr /  key bytes
+                                                     embed len  [embedded]
+
+String values are stored with one of three encodings:
+  Int       the value is a canonical int64, kept natively (no text)
+  Embedded  the value is at most EMBED_MAX bytes and lives after the key
+  Raw       the value lives in a separate RawString buffer
+
+Aggregate values (lists, hashes, ...) live in their own object, owned by the
+entry:
+  Quicklist a List stored as a Quicklist
+  Listpack  a small Hash or ZSet in a single listpack
+  HashTable a Hash in a HashTable, see Hash.hpp
+  Skiplist  a ZSet in a SortedSet, see ZSet.hpp
+  Stream    a Stream, see Stream.hpp
+
+A String value of at least --string-compress-min-size bytes that LZF shrinks by
+an eighth or more is Compressed: the RawString holds the LZF bytes and the
+length of the value follows the key. It is decompressed into a Scratch every
+time it is read, and made Raw again by the first write to it.
+
+A String value moved to disk by tiered storage is Spilled: the entry points at
+its LogSegment and keeps where the value is (SpillRef) after the key, see
+TieredStorage.hpp.
+
+The expiry is only present (8 bytes in front of the key) when the key has one.
+What was padding after flags holds the LRU clock of the last access.
+*/
+
+enum class ValueType : uint8_t { String, List, Hash, ZSet, Stream };
+
+enum class Encoding : uint8_t {
+  Int,
+  Embedded,
+  Raw,
+  Quicklist,
+  Listpack,
+  HashTable,
+  Skiplist,
+  Stream,
+  Spilled,
+  Compressed
+};
+
+struct LogSegment;
+
+// Heap buffer for string values that do not fit inside the entry.
+//
+// Buffers too big for a slab class are shared instead: they come from
+// ObjectAlloc with a reference count in front, so that a reply can pin the
+// value and send it from the keyspace without copying it. The entry holds one
+// reference, every pending reply another; a pinned value is copied before it
+// is modified, and freed by whoever drops the last reference.
+struct RawString {
+  uint32_t len;
+  uint32_t cap;
+  char buf[];
+
+  static constexpr size_t MAX_PREALLOC = 1024 * 1024;
+
+  // cap reserves room for the value to grow in place
+  static RawString *create(SlabAllocator &alloc, std::string_view value,
+                           size_t cap = 0);
+  static void destroy(SlabAllocator &alloc, RawString *raw);
+  // Makes room for at least len bytes, doubling the capacity (by at most
+  // MAX_PREALLOC) so that repeated appends are amortized O(1). The value
+  // may move, and always does when it is pinned.
+  static RawString *reserve(SlabAllocator &alloc, RawString *raw, size_t len);
+  size_t alloc_size() const { return sizeof(RawString) + cap; }
+
+  bool shared() const { return is_shared(cap); }
+  // Shared buffers only, from any thread
+  static void pin(RawString *raw);
+  static void unpin(RawString *raw);
+
+private:
+  static constexpr size_t REFS_SIZE = 16; // keeps buf 16 byte aligned
+
+  static bool is_shared(size_t cap) {
+    return sizeof(RawString) + cap > SlabAllocator::MAX_CLASS_SIZE;
+  }
+  static std::atomic<uint32_t> &refs(RawString *raw) {
+    return *reinterpret_cast<std::atomic<uint32_t> *>(
+        reinterpret_cast<char *>(raw) - REFS_SIZE);
+  }
+};
+
+struct DB_Entry {
+  static constexpr size_t EMBED_MAX = 32;
+  static constexpr uint8_t HAS_EXPIRE = 1 << 0;
+
+  DB_Entry *next;
+  uint32_t hash;
+  uint32_t key_len;
+  ValueType type;
+  Encoding encoding;
+  uint8_t flags;
+  // Clock::lru() when the key was last read or written
+  uint8_t lru;
+  // Index in its slot's key list, cluster mode only (see Dict.hpp)
+  uint32_t slot_pos;
+  union {
+    int64_t integer;
+    RawString *raw;
+    uint32_t embedded_len;
+    void *object;
+  } value;
+  alignas(uint64_t) char data[];
+
+  // Builds a string entry, picking the most compact encoding for the value.
+  // Values of at least compress_min bytes are tried Compressed, 0 never.
+  static DB_Entry *create(SlabAllocator &alloc, std::string_view key,
+                          std::string_view value, uint64_t expiry = 0,
+                          size_t compress_min = 0);
+  // Most LZF bytes a value of len bytes is kept Compressed in: it has to
+  // save an eighth of the value
+  static size_t max_compressed(size_t len) { return len - len / 8; }
+  // Builds a Compressed entry from the LZF bytes of a value of len bytes
+  static DB_Entry *create_lzf(SlabAllocator &alloc, std::string_view key,
+                              std::string_view lzf, size_t len,
+                              uint64_t expiry = 0);
+  static DB_Entry *create_int(SlabAllocator &alloc, std::string_view key,
+                              int64_t value, uint64_t expiry = 0);
+  // Builds an entry taking ownership of an aggregate value
+  static DB_Entry *create_object(SlabAllocator &alloc, std::string_view key,
+                                 ValueType type, Encoding encoding,
+                                 void *object, uint64_t expiry = 0);
+  // Where a Spilled value is in its segment
+  struct SpillRef {
+    uint32_t offset;
+    uint32_t length; // of the value
+  };
+  // Builds a Spilled copy of the String entry, its value being at ref in
+  // segment
+  static DB_Entry *create_spilled(SlabAllocator &alloc, const DB_Entry *entry,
+                                  LogSegment *segment, SpillRef ref);
+  static void destroy(SlabAllocator &alloc, DB_Entry *entry);
+  // Frees an aggregate value taken out of its entry
+  static void free_object(Encoding encoding, void *object);
+  // Allocations freeing the value takes, which is what makes it slow
+  size_t free_effort() const;
+  // Builds a copy of entry whose value is Raw with room for len bytes
+  static DB_Entry *to_raw(SlabAllocator &alloc, const DB_Entry *entry,
+                          size_t len);
+
+  // Bytes of the entry allocation itself, excluding a Raw value buffer
+  size_t alloc_size() const {
+    return sizeof(DB_Entry) + expiry_size() + key_len +
+           (encoding == Encoding::Embedded     ? value.embedded_len
+            : encoding == Encoding::Spilled    ? sizeof(SpillRef)
+            : encoding == Encoding::Compressed ? sizeof(uint32_t)
+                                               : 0);
+  }
+  // Whether value.raw is a RawString the entry owns
+  bool has_raw() const {
+    return encoding == Encoding::Raw || encoding == Encoding::Compressed;
+  }
+
+  uint64_t expiry() const {
+    if (!(flags & HAS_EXPIRE))
+      return 0;
+    uint64_t ms;
+    memcpy(&ms, data, sizeof(ms));
+    return ms;
+  }
+
+  std::string_view key() const {
+    return {data + expiry_size(), key_len};
+  }
+
+  // Where str() puts values that are not kept as text
+  struct Scratch {
+    char digits[21];  // Int
+    std::string text; // Compressed
+  };
+  // Returns the value of a String entry as text. Int values are formatted
+  // and Compressed ones decompressed into scratch, which must outlive the
+  // returned view.
+  std::string_view str(Scratch &scratch) const;
+  std::string to_string() const;
+
+  size_t value_len() const;
+
+  // Spilled entries only
+  LogSegment *segment() const {
+    return static_cast<LogSegment *>(value.object);
+  }
+  SpillRef spill_ref() const {
+    SpillRef ref;
+    memcpy(&ref, embedded(), sizeof(ref));
+    return ref;
+  }
+  // Points the entry at a copy of its value elsewhere in the log
+  void move_spilled(LogSegment *segment, SpillRef ref) {
+    value.object = segment;
+    memcpy(embedded(), &ref, sizeof(ref));
+  }
+
+private:
+  size_t expiry_size() const {
+    return (flags & HAS_EXPIRE) ? sizeof(uint64_t) : 0;
+  }
+  char *embedded() { return data + expiry_size() + key_len; }
+  const char *embedded() const { return data + expiry_size() + key_len; }
+
+  static DB_Entry *allocate(SlabAllocator &alloc, std::string_view key,
+                            size_t embed_len, uint64_t expiry);
+};
+
+// Parses a canonical base-10 int64 ("12", "-7" but not "007", "+1" or " 1"),
+// so that encoding it back yields the same bytes.
+bool string_to_int64(std::string_view str, int64_t &out);
+
+// Compressed values of every partition and the time spent on them
+struct CompressionStats {
+  uint64_t keys = 0;
+  uint64_t value_bytes = 0;  // uncompressed
+  uint64_t stored_bytes = 0; // compressed
+  uint64_t compressions = 0;
+  uint64_t rejected = 0; // values left as they were, saving too little
+  uint64_t decompressions = 0;
+  uint64_t compress_us = 0;
+  uint64_t decompress_us = 0;
+};
+CompressionStats compression_stats();
@@ -0,0 +1,78 @@
+#include "HandleResponse.hpp"
+#include "Synthetic.hpp"
+#include <algorithm>
+#include <string>
+
+// DEBUG POPULATE count [prefix [size [seed]]]
+void HandleResponse::debug(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  const std::string *subcommand = arg_at(command_array, i++);
+  if (subcommand == nullptr) {
+    wrong_args("DEBUG");
+    return;
+  }
+  std::string name = *subcommand;
+  std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+  if (name == "POPULATE") {
+    debug_populate(i, command_array, config);
+    return;
+  }
+  error("unknown subcommand '" + *subcommand + "'. Try DEBUG HELP.");
+}
+
+// Adds the String keys prefix:0 to prefix:count-1 ("key" without a prefix)
+// straight to the keyspace, leaving those that exist alone. Like Redis the
+// value of prefix:n is value:n, padded with zero bytes or cut to size bytes
+// when there is a size. With a seed it is size bytes of synthetic text
+// instead (see Synthetic.hpp), the same for every run with that seed.
+void HandleResponse::debug_populate(size_t &i,
+                                    const std::vector<RespData> &command_array,
+                                    DB_Config &config) {
+  const std::string *count_arg = arg_at(command_array, i++);
+  const std::string *prefix_arg = arg_at(command_array, i++);
+  const std::string *size_arg = arg_at(command_array, i++);
+  const std::string *seed_arg = arg_at(command_array, i++);
+  if (count_arg == nullptr || i < command_array.size()) {
+    wrong_args("DEBUG|POPULATE");
+    return;
+  }
+  int64_t count, size = 0, seed = 0;
+  if (!string_to_int64(*count_arg, count) || count < 0) {
+    error("count is not an integer or out of range");
+    return;
+  }
+  if (size_arg != nullptr &&
+      (!string_to_int64(*size_arg, size) || size < 0 ||
+       size > MAX_STRING_SIZE)) {
+    error("size is not an integer or out of range");
+    return;
+  }
+  if (seed_arg != nullptr && !string_to_int64(*seed_arg, seed)) {
+    error("seed is not an integer or out of range");
+    return;
+  }
+  std::string prefix = prefix_arg != nullptr ? *prefix_arg : "key";
+  prefix += ':';
+
+  std::string key, value;
+  for (int64_t n = 0; n < count; ++n) {
+    key.assign(prefix).append(std::to_string(n));
+    DB_Config &partition = config.partition_for(key);
+    if (partition.db.find(key) != nullptr)
+      continue;
+    value.clear();
+    if (seed_arg != nullptr) {
+      SyntheticRng rng(seed, n);
+      synthetic_text(rng, size, value);
+    } else {
+      value.assign("value:").append(std::to_string(n));
+      if (size_arg != nullptr)
+        value.resize(size, '\0');
+    }
+    partition.db.insert(
+        DB_Entry::create(partition.db.allocator(), key, value, 0,
+                         partition.string_compress_min_size));
+  }
+  ok();
+}
@@ -0,0 +1,275 @@
+#include "Dict.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <utility>
+
+Dict::~Dict() { clear(); }
+
+uint32_t Dict::hash(std::string_view key) {
+  uint64_t h = std::hash<std::string_view>{}(key);
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+void Dict::enable_slots() { m_slot_keys.resize(CLUSTER_SLOTS); }
+
+void Dict::slot_link(DB_Entry *entry) {
+  std::vector<DB_Entry *> &keys = m_slot_keys[key_hash_slot(entry->key())];
+  entry->slot_pos = keys.size();
+  keys.push_back(entry);
+}
+
+// The last key of the slot takes the place of the removed one
+void Dict::slot_unlink(DB_Entry *entry) {
+  std::vector<DB_Entry *> &keys = m_slot_keys[key_hash_slot(entry->key())];
+  DB_Entry *last = keys.back();
+  last->slot_pos = entry->slot_pos;
+  keys[entry->slot_pos] = last;
+  keys.pop_back();
+  // A slot that migrated away gives its memory back
+  if (keys.empty())
+    std::vector<DB_Entry *>().swap(keys);
+}
+
+void Dict::slot_replace(DB_Entry *old_entry, DB_Entry *new_entry) {
+  new_entry->slot_pos = old_entry->slot_pos;
+  m_slot_keys[key_hash_slot(new_entry->key())][new_entry->slot_pos] =
+      new_entry;
+}
+
+void Dict::clear() {
+  for (auto &table : m_table) {
+    for (size_t i = 0; i < table.size; ++i) {
+      DB_Entry *e = table.buckets[i];
+      while (e != nullptr) {
+        DB_Entry *next = e->next;
+        DB_Entry::destroy(m_alloc, e);
+        e = next;
+      }
+    }
+    free(table.buckets);
+    table = Table();
+  }
+  m_used = 0;
+  m_rehash_idx = -1;
+  for (auto &keys : m_slot_keys)
+    std::vector<DB_Entry *>().swap(keys);
+}
+
+std::unique_ptr<Dict> Dict::detach() {
+  auto detached = std::make_unique<Dict>();
+  detached->m_alloc.swap(m_alloc);
+  std::swap(detached->m_table, m_table);
+  std::swap(detached->m_used, m_used);
+  std::swap(detached->m_rehash_idx, m_rehash_idx);
+  std::swap(detached->m_slot_keys, m_slot_keys);
+  m_defrag_cursor = 0;
+  if (detached->slots())
+    enable_slots();
+  return detached;
+}
+
+void Dict::rehash_step(int buckets) {
+  // Bound the number of empty buckets visited so a sparse table cannot stall
+  int empty_visits = buckets * 10;
+  while (buckets-- && rehashing()) {
+    Table &from = m_table[0];
+    while (static_cast<size_t>(m_rehash_idx) < from.size &&
+           from.buckets[m_rehash_idx] == nullptr) {
+      ++m_rehash_idx;
+      if (--empty_visits == 0)
+        return;
+    }
+    if (static_cast<size_t>(m_rehash_idx) < from.size) {
+      DB_Entry *e = from.buckets[m_rehash_idx];
+      while (e != nullptr) {
+        DB_Entry *next = e->next;
+        size_t idx = e->hash & m_table[1].mask;
+        e->next = m_table[1].buckets[idx];
+        m_table[1].buckets[idx] = e;
+        e = next;
+      }
+      from.buckets[m_rehash_idx++] = nullptr;
+    }
+    if (static_cast<size_t>(m_rehash_idx) >= from.size) {
+      free(from.buckets);
+      m_table[0] = m_table[1];
+      m_table[1] = Table();
+      m_rehash_idx = -1;
+    }
+  }
+}
+
+void Dict::expand_if_needed() {
+  if (rehashing())
+    return;
+  if (m_table[0].size != 0 && m_used < m_table[0].size)
+    return;
+
+  size_t size = m_table[0].size ? m_table[0].size * 2 : INITIAL_SIZE;
+  auto **buckets =
+      static_cast<DB_Entry **>(calloc(size, sizeof(DB_Entry *)));
+  if (buckets == nullptr)
+    throw std::bad_alloc();
+
+  if (m_table[0].size == 0) {
+    m_table[0] = Table{buckets, size, size - 1};
+    return;
+  }
+  m_table[1] = Table{buckets, size, size - 1};
+  m_rehash_idx = 0;
+}
+
+DB_Entry **Dict::find_slot(std::string_view key, uint32_t h) {
+  for (int t = 0; t <= 1; ++t) {
+    Table &table = m_table[t];
+    if (table.size == 0)
+      break;
+    DB_Entry **slot = &table.buckets[h & table.mask];
+    for (; *slot != nullptr; slot = &(*slot)->next)
+      if ((*slot)->hash == h && (*slot)->key() == key)
+        return slot;
+    if (!rehashing())
+      break;
+  }
+  return nullptr;
+}
+
+DB_Entry *Dict::find(std::string_view key) {
+  if (m_used == 0)
+    return nullptr;
+  if (rehashing())
+    rehash_step(REHASH_STEP);
+  DB_Entry **slot = find_slot(key, hash(key));
+  return slot ? *slot : nullptr;
+}
+
+/*
+Group prefetching: a lookup is a chain of dependent loads (bucket -> entry ->
+value buffer) and each link is likely a cache miss on a large keyspace. Done
+one key after the other, a batch pays every miss in sequence. Instead, hash all
+keys and prefetch their buckets, then prefetch the entries the buckets point
+to, then the Raw buffers of those entries, so that the misses of one stage
+overlap across the whole batch. The actual lookups then hit the cache.
+*/
+void Dict::prefetch(const std::vector<std::string_view> &keys) {
+  if (m_used == 0 || keys.size() < 2)
+    return;
+
+  m_prefetch_buckets.clear();
+  for (std::string_view key : keys) {
+    uint32_t h = hash(key);
+    for (int t = 0; t <= (rehashing() ? 1 : 0); ++t) {
+      DB_Entry **bucket = &m_table[t].buckets[h & m_table[t].mask];
+      __builtin_prefetch(bucket);
+      m_prefetch_buckets.push_back(bucket);
+    }
+  }
+  for (DB_Entry **bucket : m_prefetch_buckets)
+    if (*bucket != nullptr)
+      __builtin_prefetch(*bucket);
+  for (DB_Entry **bucket : m_prefetch_buckets) {
+    DB_Entry *e = *bucket;
+    if (e != nullptr && e->has_raw())
+      __builtin_prefetch(e->value.raw);
+  }
+}
+
+void Dict::insert(DB_Entry *entry) {
+  if (rehashing())
+    rehash_step(REHASH_STEP);
+  expand_if_needed();
+
+  entry->hash = hash(entry->key());
+  if (DB_Entry **slot = find_slot(entry->key(), entry->hash)) {
+    DB_Entry *old = *slot;
+    entry->next = old->next;
+    *slot = entry;
+    if (slots())
+      slot_replace(old, entry);
+    DB_Entry::destroy(m_alloc, old);
+    return;
+  }
+  // New keys go to the table being rehashed into, if any
+  Table &table = rehashing() ? m_table[1] : m_table[0];
+  DB_Entry **bucket = &table.buckets[entry->hash & table.mask];
+  entry->next = *bucket;
+  *bucket = entry;
+  ++m_used;
+  if (slots())
+    slot_link(entry);
+}
+
+void Dict::relink(DB_Entry *old_entry, DB_Entry *new_entry) {
+  DB_Entry **slot = find_slot(old_entry->key(), old_entry->hash);
+  new_entry->hash = old_entry->hash;
+  new_entry->next = old_entry->next;
+  *slot = new_entry;
+  if (slots())
+    slot_replace(old_entry, new_entry);
+}
+
+bool Dict::erase(std::string_view key) {
+  DB_Entry *e = unlink(key);
+  if (e == nullptr)
+    return false;
+  DB_Entry::destroy(m_alloc, e);
+  return true;
+}
+
+DB_Entry *Dict::unlink(std::string_view key) {
+  if (m_used == 0)
+    return nullptr;
+  if (rehashing())
+    rehash_step(REHASH_STEP);
+  DB_Entry **slot = find_slot(key, hash(key));
+  if (slot == nullptr)
+    return nullptr;
+  DB_Entry *e = *slot;
+  *slot = e->next;
+  if (slots())
+    slot_unlink(e);
+  --m_used;
+  return e;
+}
+
+bool Dict::defrag(uint64_t budget_us) {
+  // Bucket positions shift while rehashing, wait for it to complete
+  if (rehashing() || m_table[0].size == 0)
+    return false;
+
+  auto start = std::chrono::steady_clock::now();
+  Table &table = m_table[0];
+  while (m_defrag_cursor < table.size) {
+    for (DB_Entry **slot = &table.buckets[m_defrag_cursor]; *slot != nullptr;
+         slot = &(*slot)->next) {
+      DB_Entry *e = *slot;
+      size_t size = e->alloc_size();
+      if (m_alloc.should_move(e, size)) {
+        auto *moved = static_cast<DB_Entry *>(m_alloc.allocate(size));
+        memcpy(moved, e, size);
+        if (slots())
+          slot_replace(e, moved);
+        m_alloc.deallocate(e, size);
+        *slot = e = moved;
+      }
+      if (e->has_raw() &&
+          m_alloc.should_move(e->value.raw, e->value.raw->alloc_size())) {
+        size_t raw_size = e->value.raw->alloc_size();
+        auto *moved = static_cast<RawString *>(m_alloc.allocate(raw_size));
+        memcpy(moved, e->value.raw, raw_size);
+        m_alloc.deallocate(e->value.raw, raw_size);
+        e->value.raw = moved;
+      }
+    }
+    ++m_defrag_cursor;
+    if ((m_defrag_cursor & 15) == 0 &&
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+                .count() >= static_cast<int64_t>(budget_us))
+      return false;
+  }
+  m_defrag_cursor = 0;
+  return true;
+}
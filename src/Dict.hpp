@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "DB_Entry.hpp"
+#include "HashSlot.hpp"
+#include "Slab.hpp"
+
+/*
+Chained hash table for the keyspace. Entries are intrusive (DB_Entry::next),
+so a key costs one allocation plus one bucket pointer.
+
+Like Redis' dict, the table grows by incremental rehashing: while a resize is
+in progress both tables are live and every operation moves a few buckets from
+the old table to the new one, so no single command pays for the whole move.
+
+Entries and their string buffers come from the table's own slab allocator.
+
+In cluster mode every slot also keeps an array of its keys, and each entry
+stores its index in that array (in what was padding), so a key joins or leaves
+its slot in O(1) and counting or walking a slot never looks at other slots.
+*/
+class Dict {
+public:
+  Dict() = default;
+  ~Dict();
+  Dict(const Dict &) = delete;
+  Dict &operator=(const Dict &) = delete;
+
+  static uint32_t hash(std::string_view key);
+  // Starts indexing the keys by slot, the table must be empty
+  void enable_slots();
+
+  DB_Entry *find(std::string_view key);
+  // Warms the cache for a batch of upcoming lookups, see Dict.cpp
+  void prefetch(const std::vector<std::string_view> &keys);
+  // Inserts the entry, replacing (and destroying) an existing one with the
+  // same key.
+  void insert(DB_Entry *entry);
+  // Replaces old_entry, which must be linked in the table, by new_entry for
+  // the same key without destroying it.
+  void relink(DB_Entry *old_entry, DB_Entry *new_entry);
+  bool erase(std::string_view key);
+  // Takes the entry of key out of the table without destroying it, nullptr
+  // if there is none
+  DB_Entry *unlink(std::string_view key);
+  void clear();
+  // Moves every key, with the allocator backing it, to a new table and
+  // leaves this one empty. Used to free a whole keyspace elsewhere.
+  std::unique_ptr<Dict> detach();
+
+  // Moves entries and values out of sparse slabs, for at most budget_us
+  // microseconds. Returns true once a full pass over the table completed.
+  bool defrag(uint64_t budget_us);
+  // Calls fn(entry) for the keys of up to count buckets from cursor, and
+  // returns the cursor to go on from: 0 once both tables were walked to their
+  // end. Keys moved by rehashing meanwhile may be missed or seen twice.
+  template <typename F> size_t scan(size_t cursor, size_t count, F &&fn) {
+    for (; count > 0; ++cursor, --count) {
+      const Table *table = &m_table[0];
+      size_t index = cursor;
+      if (index >= table->size) {
+        index -= table->size;
+        table = &m_table[1];
+      }
+      if (index >= table->size)
+        return 0;
+      for (DB_Entry *e = table->buckets[index]; e != nullptr; e = e->next)
+        fn(e);
+    }
+    return cursor;
+  }
+
+  SlabAllocator &allocator() { return m_alloc; }
+  size_t size() const { return m_used; }
+  // Bucket array memory, for memory accounting
+  size_t overhead() const {
+    return (m_table[0].size + m_table[1].size) * sizeof(DB_Entry *);
+  }
+
+  // Keys in slot, cluster mode only
+  size_t slot_size(uint16_t slot) const { return m_slot_keys[slot].size(); }
+  // Calls fn(entry) for the keys in slot until it returns false. The table
+  // must not be modified meanwhile.
+  template <typename F> void for_each_in_slot(uint16_t slot, F &&fn) {
+    for (DB_Entry *e : m_slot_keys[slot])
+      if (!fn(e))
+        return;
+  }
+
+  template <typename F> void for_each(F &&fn) {
+    for (auto &table : m_table)
+      for (size_t i = 0; i < table.size; ++i)
+        for (DB_Entry *e = table.buckets[i]; e != nullptr;) {
+          DB_Entry *next = e->next;
+          fn(e);
+          e = next;
+        }
+  }
+
+private:
+  struct Table {
+    DB_Entry **buckets = nullptr;
+    size_t size = 0;
+    size_t mask = 0;
+  };
+
+  static constexpr size_t INITIAL_SIZE = 4;
+  static constexpr int REHASH_STEP = 1;
+
+  // Declared first so that it outlives the entries it backs
+  SlabAllocator m_alloc;
+  Table m_table[2];
+  size_t m_used = 0;
+  // Next bucket of m_table[0] to move, -1 when not rehashing
+  long m_rehash_idx = -1;
+  size_t m_defrag_cursor = 0;
+  std::vector<DB_Entry **> m_prefetch_buckets;
+  // Keys of each slot, empty unless enable_slots was called
+  std::vector<std::vector<DB_Entry *>> m_slot_keys;
+
+  bool rehashing() const { return m_rehash_idx != -1; }
+  bool slots() const { return !m_slot_keys.empty(); }
+  void slot_link(DB_Entry *entry);
+  void slot_unlink(DB_Entry *entry);
+  void slot_replace(DB_Entry *old_entry, DB_Entry *new_entry);
+  void rehash_step(int buckets);
+  void expand_if_needed();
+  DB_Entry **find_slot(std::string_view key, uint32_t h);
+};
@@ -1,102 +1,446 @@
 #include "HandleResponse.hpp"
+#include "Clock.hpp"
+#include "LazyFree.hpp"
+#include "ObjectAlloc.hpp"
 #include "Parser.hpp"
 #include "Server.hpp"
+#include "TieredStorage.hpp"
+#include "ZSet.hpp"
 #include <algorithm>
-#include <bits/chrono.h>
 #include <cstdint>
 #include <cstdlib>
 #include <iterator>
+#include <map>
 #include <string>
 
-int HandleResponse::check_expire_ms(std::string key, DB_Config &config) {
+int HandleResponse::check_expire_ms(DB_Entry *entry, DB_Config &config) {
 
-  if (config.db[key].expiry == 0)
+  uint64_t expiry = entry->expiry();
+  if (expiry == 0)
     return 0;
-  std::cout << "Checking expiry: " << key << std::endl;
-  uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                     std::chrono::system_clock::now().time_since_epoch())
-                     .count();
-
-  if (config.db[key].expiry > now)
+  if (expiry > Clock::now_ms())
     return 0;
 
-  config.db.erase(key);
-  try {
-    config.in_memory_db.at(key);
-    config.in_memory_db.erase(key);
-  } catch (std::exception &e) {
-  }
-  null();
+  signal_modified_key(config, entry->key(), nullptr);
+  delete_key(config, entry->key(), config.lazyfree_lazy_expire);
   return 1;
 }
 
-HandleResponse::HandleResponse(RespData result, int client_fd,
+DB_Entry *HandleResponse::find_key(DB_Config &config, const std::string &key) {
+  DB_Entry *entry = config.db.find(key);
+  if (entry == nullptr || check_expire_ms(entry, config) == 1)
+    return nullptr;
+  return entry;
+}
+
+// Looks a key up, expiring it first if its time has passed. A spilled value
+// the command did not wait for is read back right away, and if it cannot be
+// the key stays spilled and SpillReadError fails the command.
+DB_Entry *HandleResponse::lookup_key(DB_Config &config,
+                                     const std::string &key) {
+  DB_Entry *entry = find_key(config, key);
+  if (entry == nullptr)
+    return nullptr;
+  entry->lru = Clock::lru();
+  if (entry->encoding == Encoding::Spilled &&
+      (entry = config.tiered->load(config.db, entry)) == nullptr)
+    throw SpillReadError("Could not read the spilled value of " + key);
+  return entry;
+}
+
+size_t HandleResponse::load_spilled(const RespData &result, int fd,
+                                    uint64_t client_id, DB_Config &config) {
+  const CommandSpec *command = lookup_command(result);
+  if (command == nullptr)
+    return 0;
+  size_t loads = 0;
+  const auto &command_array = std::get<std::vector<RespData>>(result.value);
+  for_each_key(*command, command_array, [&](const std::string &key) {
+    if (config.partition_of(key) != config.partition)
+      return;
+    DB_Entry *entry = config.db.find(key);
+    if (entry != nullptr && entry->encoding == Encoding::Spilled &&
+        config.tiered->load_async(entry, fd, client_id))
+      ++loads;
+  });
+  return loads;
+}
+
+bool HandleResponse::check_type(const DB_Entry *entry, ValueType type) {
+  if (entry->type == type)
+    return true;
+  reply("-WRONGTYPE Operation against a key holding the wrong kind of "
+        "value\r\n");
+  return false;
+}
+
+HandleResponse::HandleResponse(RespData &result, Client &client,
                                DB_Config &config)
-    : m_client_fd(client_fd) {
+    : m_client(client) {
   if (result.type == RespType::Array) {
     array(result, config);
   }
 }
 
+// CONFIG GET parameter [parameter ...], the parameters are glob patterns
 void HandleResponse::config_req(size_t &i,
                                 const std::vector<RespData> &command_array,
-                                const DB_Config &config) {
+                                DB_Config &config) {
+  const std::string *subcommand = arg_at(command_array, i++);
+  if (subcommand == nullptr) {
+    wrong_args("CONFIG");
+    return;
+  }
+  std::string name = *subcommand;
+  std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+  if (name != "GET") {
+    error("unknown subcommand '" + *subcommand + "'. Try CONFIG HELP.");
+    return;
+  }
+  if (i >= command_array.size()) {
+    wrong_args("CONFIG|GET");
+    return;
+  }
+
+  const std::pair<const char *, const std::string *> parameters[] = {
+      {"dir", &config.dir}, {"dbfilename", &config.db_filename}};
+  bool found[std::size(parameters)] = {};
+  for (; i < command_array.size(); ++i)
+    if (const std::string *pattern = arg_at(command_array, i)) {
+      GlobMatcher matcher(*pattern);
+      for (size_t n = 0; n < std::size(parameters); ++n)
+        found[n] |= matcher.match(parameters[n].first);
+    }
+  std::string body;
+  int64_t pairs = 0;
+  for (size_t n = 0; n < std::size(parameters); ++n)
+    if (found[n]) {
+      append_bulk(body, parameters[n].first);
+      append_bulk(body, *parameters[n].second);
+      ++pairs;
+    }
+  std::string response;
+  append_map_len(response, pairs, m_client.protocol);
+  reply(response);
+  reply(body);
+}
+
+void HandleResponse::keys(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *pattern = arg_at(command_array, i++);
+  if (pattern == nullptr || i < command_array.size()) {
+    wrong_args("KEYS");
+    return;
+  }
+
+  GlobMatcher matcher(*pattern);
+  std::vector<DB_Config *> partitions = config.all_partitions();
+  size_t keys = 0;
+  std::string body;
+  for (DB_Config *partition : partitions)
+    partition->db.for_each([&](DB_Entry *entry) {
+      std::string_view key = entry->key();
+      if (!matcher.match(key))
+        return;
+      append_bulk(body, key);
+      ++keys;
+    });
+  std::string response;
+  append_array_len(response, keys);
+  reply(response);
+  reply(body);
+}
+
+const std::string *arg_at(const std::vector<RespData> &command_array,
+                          size_t i) {
   if (i >= command_array.size() ||
       command_array[i].type != RespType::BulkString)
+    return nullptr;
+  return &std::get<std::string>(command_array[i].value);
+}
+
+std::string upper(const std::string &str) {
+  std::string result = str;
+  std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+  return result;
+}
+
+std::string format_ratio(double ratio) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", ratio);
+  return buf;
+}
+
+void append_bulk(std::string &response, std::string_view str) {
+  response += "$";
+  response += std::to_string(str.length());
+  response += "\r\n";
+  response += str;
+  response += "\r\n";
+}
+
+void append_integer(std::string &response, int64_t value) {
+  response += ":";
+  response += std::to_string(value);
+  response += "\r\n";
+}
+
+void append_array_len(std::string &response, int64_t len) {
+  response += "*";
+  response += std::to_string(len);
+  response += "\r\n";
+}
+
+void append_null(std::string &response, int protocol) {
+  response += protocol >= 3 ? "_\r\n" : "$-1\r\n";
+}
+
+void append_null_array(std::string &response, int protocol) {
+  response += protocol >= 3 ? "_\r\n" : "*-1\r\n";
+}
+
+void append_map_len(std::string &response, int64_t pairs, int protocol) {
+  if (protocol < 3) {
+    append_array_len(response, pairs * 2);
     return;
+  }
+  response += "%";
+  response += std::to_string(pairs);
+  response += "\r\n";
+}
 
-  // The only request handling is CONFIG GET
-  std::string cmd = std::get<std::string>(command_array[i++].value);
-  std::string what = std::get<std::string>(command_array[i++].value);
-  if (cmd != "GET")
+void append_push_len(std::string &response, int64_t len, int protocol) {
+  if (protocol < 3) {
+    append_array_len(response, len);
     return;
+  }
+  response += ">";
+  response += std::to_string(len);
+  response += "\r\n";
+}
 
-  if (what == "dir") {
-    std::string response = "*2\r\n$3\r\ndir\r\n$";
-    response += std::to_string(config.dir.length());
-    response += "\r\n";
-    response += config.dir;
-    response += "\r\n";
-    send(m_client_fd, response.c_str(), response.length(), 0);
+void append_double(std::string &response, double value, int protocol) {
+  if (protocol < 3) {
+    append_bulk(response, format_score(value));
+    return;
   }
-  if (what == "dbfilename") {
-    std::string response = "*2\r\n$10\r\ndbfilename\r\n$";
-    response += std::to_string(config.db_filename.length());
-    response += "\r\n";
-    response += config.db_filename;
-    response += "\r\n";
-    send(m_client_fd, response.c_str(), response.length(), 0);
+  response += ",";
+  response += format_score(value);
+  response += "\r\n";
+}
+
+// Allocator stats, table overhead and key count summed over the partitions
+static SlabAllocator::Stats keyspace_stats(DB_Config &config, size_t &overhead,
+                                           size_t &keys) {
+  SlabAllocator::Stats total = {};
+  overhead = keys = 0;
+  for (DB_Config *partition : config.all_partitions()) {
+    SlabAllocator::Stats stats = partition->db.allocator().stats();
+    total.used += stats.used;
+    total.allocated += stats.allocated;
+    total.resident += stats.resident;
+    total.slabs += stats.slabs;
+    total.large += stats.large;
+    overhead += partition->db.overhead();
+    keys += partition->db.size();
   }
+  return total;
 }
 
-void HandleResponse::keys(size_t &i, const std::vector<RespData> &command_array,
-                          DB_Config &config) {
-  if (i > command_array.size() || command_array[i].type != RespType::BulkString)
+void HandleResponse::memory(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  if (i >= command_array.size() ||
+      command_array[i].type != RespType::BulkString) {
+    null();
     return;
-
+  }
   std::string cmd = std::get<std::string>(command_array[i++].value);
+  std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+  if (cmd != "STATS") {
+    null();
+    return;
+  }
+
+  size_t overhead, keys;
+  SlabAllocator::Stats stats = keyspace_stats(config, overhead, keys);
+  size_t used = stats.allocated + overhead + object_memory();
+  size_t rss = process_rss();
+  // Partitions only list the classes they have slabs in, match them by size
+  std::map<size_t, SlabAllocator::ClassStats> classes;
+  for (DB_Config *partition : config.all_partitions()) {
+    for (const auto &part : partition->db.allocator().class_stats()) {
+      SlabAllocator::ClassStats &cls = classes[part.size];
+      cls.size = part.size;
+      cls.slabs += part.slabs;
+      cls.objects += part.objects;
+      cls.capacity += part.capacity;
+    }
+  }
+
   std::string response;
-  if (cmd == "*") {
-    response += "*";
-    response += std::to_string(config.db.size());
-    response += "\r\n";
-    for (auto &entry : config.db) {
-      std::string key = entry.first;
-      response += "$";
-      response += std::to_string(key.length());
-      response += "\r\n";
-      response += key;
-      response += "\r\n";
+  append_map_len(response, 10, m_client.protocol);
+  append_bulk(response, "total.allocated");
+  append_integer(response, used);
+  append_bulk(response, "keys.count");
+  append_integer(response, keys);
+  append_bulk(response, "keys.bytes-per-key");
+  append_integer(response, keys ? used / keys : 0);
+  append_bulk(response, "dataset.bytes");
+  append_integer(response, stats.used);
+  append_bulk(response, "allocator.allocated");
+  append_integer(response, stats.allocated);
+  append_bulk(response, "allocator.resident");
+  append_integer(response, stats.resident);
+  append_bulk(response, "allocator-fragmentation.ratio");
+  append_bulk(response, format_ratio(stats.allocated ? (double)stats.resident /
+                                                           stats.allocated
+                                                     : 1.0));
+  append_bulk(response, "fragmentation");
+  append_bulk(response, format_ratio(used ? (double)rss / used : 1.0));
+  append_bulk(response, "fragmentation.bytes");
+  append_integer(response, (int64_t)rss - (int64_t)used);
+  append_bulk(response, "slab.classes");
+  // Per size class: slot size, slabs, live objects, free slots
+  response += "*" + std::to_string(classes.size()) + "\r\n";
+  for (const auto &[size, cls] : classes) {
+    response += "*4\r\n";
+    append_integer(response, size);
+    append_integer(response, cls.slabs);
+    append_integer(response, cls.objects);
+    append_integer(response, cls.capacity - cls.objects);
+  }
+  reply(response);
+}
+
+void HandleResponse::info(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  // Memory is the only section so far, accept INFO and INFO memory
+  if (i < command_array.size() &&
+      command_array[i].type == RespType::BulkString) {
+    std::string section = std::get<std::string>(command_array[i++].value);
+    std::transform(section.begin(), section.end(), section.begin(),
+                   ::tolower);
+    if (section != "memory" && section != "all" && section != "default") {
+      empty();
+      return;
+    }
+  }
+
+  size_t overhead, keys;
+  SlabAllocator::Stats stats = keyspace_stats(config, overhead, keys);
+  size_t used = stats.allocated + overhead + object_memory();
+  size_t rss = process_rss();
+
+  std::string info = "# Memory\r\n";
+  info += "used_memory:" + std::to_string(used) + "\r\n";
+  info += "used_memory_dataset:" + std::to_string(stats.used) + "\r\n";
+  info += "used_memory_objects:" + std::to_string(object_memory()) + "\r\n";
+  info += "used_memory_rss:" + std::to_string(rss) + "\r\n";
+  info += "allocator_allocated:" + std::to_string(stats.allocated) + "\r\n";
+  info += "allocator_resident:" + std::to_string(stats.resident) + "\r\n";
+  info += "allocator_frag_ratio:" +
+          format_ratio(stats.allocated
+                           ? (double)stats.resident / stats.allocated
+                           : 1.0) +
+          "\r\n";
+  info += "allocator_frag_bytes:" +
+          std::to_string(stats.resident - stats.allocated) + "\r\n";
+  info += "mem_fragmentation_ratio:" +
+          format_ratio(used ? (double)rss / used : 1.0) + "\r\n";
+  info += "slab_count:" + std::to_string(stats.slabs) + "\r\n";
+  info += "active_defrag_enabled:" +
+          std::to_string(config.active_defrag ? 1 : 0) + "\r\n";
+  info += "active_defrag_running:" +
+          std::to_string(config.defrag_running ? 1 : 0) + "\r\n";
+  if (config.lazy_free != nullptr) {
+    info += "lazyfree_pending_objects:" +
+            std::to_string(config.lazy_free->pending()) + "\r\n";
+    info += "lazyfreed_objects:" + std::to_string(config.lazy_free->freed()) +
+            "\r\n";
+  }
+  if (config.tiered != nullptr) {
+    TieredStorage::Stats tiered;
+    for (DB_Config *partition : config.all_partitions()) {
+      TieredStorage::Stats stats = partition->tiered->stats();
+      tiered.spilled_keys += stats.spilled_keys;
+      tiered.spilled_bytes += stats.spilled_bytes;
+      tiered.log_bytes += stats.log_bytes;
+      tiered.segments += stats.segments;
+      tiered.spills += stats.spills;
+      tiered.loads += stats.loads;
+      tiered.sync_loads += stats.sync_loads;
+      tiered.loads_in_flight += stats.loads_in_flight;
+      tiered.compactions += stats.compactions;
+      tiered.load_errors += stats.load_errors;
     }
+    info += "tiered_spilled_keys:" + std::to_string(tiered.spilled_keys) +
+            "\r\n";
+    info += "tiered_spilled_bytes:" + std::to_string(tiered.spilled_bytes) +
+            "\r\n";
+    info += "tiered_log_bytes:" + std::to_string(tiered.log_bytes) + "\r\n";
+    info += "tiered_segments:" + std::to_string(tiered.segments) + "\r\n";
+    info += "tiered_spills:" + std::to_string(tiered.spills) + "\r\n";
+    info += "tiered_loads:" + std::to_string(tiered.loads) + "\r\n";
+    info += "tiered_sync_loads:" + std::to_string(tiered.sync_loads) + "\r\n";
+    info += "tiered_loads_in_flight:" +
+            std::to_string(tiered.loads_in_flight) + "\r\n";
+    info += "tiered_compactions:" + std::to_string(tiered.compactions) +
+            "\r\n";
+    info += "tiered_load_errors:" + std::to_string(tiered.load_errors) +
+            "\r\n";
   }
-  send(m_client_fd, response.c_str(), response.length(), 0);
+
+  if (config.string_compress_min_size > 0) {
+    CompressionStats compressed = compression_stats();
+    info += "compressed_keys:" + std::to_string(compressed.keys) + "\r\n";
+    info += "compressed_value_bytes:" +
+            std::to_string(compressed.value_bytes) + "\r\n";
+    info += "compressed_stored_bytes:" +
+            std::to_string(compressed.stored_bytes) + "\r\n";
+    info += "compression_ratio:" +
+            format_ratio(compressed.stored_bytes
+                             ? (double)compressed.value_bytes /
+                                   compressed.stored_bytes
+                             : 1.0) +
+            "\r\n";
+    info += "compressions:" + std::to_string(compressed.compressions) +
+            "\r\n";
+    info += "compressions_rejected:" + std::to_string(compressed.rejected) +
+            "\r\n";
+    info += "decompressions:" + std::to_string(compressed.decompressions) +
+            "\r\n";
+    info += "compress_usec:" + std::to_string(compressed.compress_us) +
+            "\r\n";
+    info += "decompress_usec:" + std::to_string(compressed.decompress_us) +
+            "\r\n";
+  }
+
+  std::string response;
+  append_bulk(response, info);
+  reply(response);
+}
+
+// Replies are buffered and written by the server once the batch of pipelined
+// commands has run
+void HandleResponse::reply(std::string_view response) {
+  m_client.reply += response;
 }
 
-void HandleResponse::ping() {
-  send(m_client_fd, ping_response, strlen(ping_response), 0);
+void HandleResponse::ping(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &) {
+  // Subscribed RESP2 connections get it framed like a message
+  if (m_client.subscriptions() > 0 && m_client.protocol < 3) {
+    const std::string *message = arg_at(command_array, i++);
+    std::string response = "*2\r\n$4\r\npong\r\n";
+    append_bulk(response, message ? *message : "");
+    reply(response);
+    return;
+  }
+  reply(ping_response);
 }
-void HandleResponse::echo(size_t &i,
-                          const std::vector<RespData> &command_array) {
+void HandleResponse::echo(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &) {
 
   if (i < command_array.size() &&
       command_array[i].type == RespType::BulkString) {
@@ -107,7 +451,7 @@ void HandleResponse::echo(size_t &i,
     echo_response += "\r\n";
     echo_response += echo_data;
     echo_response += "\r\n";
-    send(m_client_fd, echo_response.c_str(), echo_response.length(), 0);
+    reply(echo_response);
   } else {
     empty();
   }
@@ -115,125 +459,502 @@ void HandleResponse::echo(size_t &i,
 
 void HandleResponse::empty() {
   const char *empty_response = "$0\r\n\r\n";
-  send(m_client_fd, empty_response, strlen(empty_response), 0);
+  reply(empty_response);
 }
 
 void HandleResponse::ok() {
   const char *ok_response = "+OK\r\n";
-  send(m_client_fd, ok_response, strlen(ok_response), 0);
+  reply(ok_response);
+}
+
+void HandleResponse::error(const std::string &message) {
+  std::string response = "-ERR ";
+  response += message;
+  response += "\r\n";
+  reply(response);
+}
+
+void HandleResponse::wrong_args(const std::string &command) {
+  std::string name = command;
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  error("wrong number of arguments for '" + name + "' command");
+}
+
+void HandleResponse::integer(int64_t value) {
+  std::string response;
+  append_integer(response, value);
+  reply(response);
+}
+
+void HandleResponse::bulk(std::string_view value) {
+  std::string response;
+  append_bulk(response, value);
+  reply(response);
+}
+
+void HandleResponse::bulk_value(const DB_Entry *entry,
+                                std::string_view value) {
+  if (entry->encoding != Encoding::Raw || !entry->value.raw->shared() ||
+      value.length() < ZERO_COPY_MIN || m_client.capture_replies) {
+    bulk(value);
+    return;
+  }
+  // Header and trailer go around a chunk pointing into the value
+  RawString *raw = entry->value.raw;
+  reply("$" + std::to_string(value.length()) + "\r\n");
+  RawString::pin(raw);
+  std::shared_ptr<const void> pinned(raw, RawString::unpin);
+  m_client.queue(OutputChunk{std::move(pinned), value});
+  reply("\r\n");
 }
 
 void HandleResponse::null() {
-  const char *null_bulk_string = "$-1\r\n";
-  send(m_client_fd, null_bulk_string, strlen(null_bulk_string), 0);
+  std::string response;
+  append_null(response, m_client.protocol);
+  reply(response);
 }
 
+void HandleResponse::null_array() {
+  std::string response;
+  append_null_array(response, m_client.protocol);
+  reply(response);
+}
+
+void HandleResponse::double_value(double value) {
+  std::string response;
+  append_double(response, value, m_client.protocol);
+  reply(response);
+}
+
+// SET key value [NX | XX] [GET] [EX s | PX ms | EXAT s | PXAT ms | KEEPTTL]
 void HandleResponse::set(size_t &i, const std::vector<RespData> &command_array,
                          DB_Config &config) {
-  size_t max_size = command_array.size();
-  if (i >= max_size || command_array[i].type != RespType::BulkString) {
-    null();
+  const std::string *key_arg = arg_at(command_array, i++);
+  const std::string *value_arg = arg_at(command_array, i++);
+  if (key_arg == nullptr || value_arg == nullptr) {
+    wrong_args("SET");
     return;
   }
+  const std::string &key = *key_arg;
+  const std::string &value = *value_arg;
 
-  std::string key = std::get<std::string>(command_array[i++].value);
-  if (i > max_size || command_array[i].type != RespType::BulkString) {
-    null();
-    return;
+  bool nx = false, xx = false, get = false, keep_ttl = false;
+  std::string expire_option;
+  int64_t ttl = 0;
+  for (; i < command_array.size(); ++i) {
+    const std::string *arg = arg_at(command_array, i);
+    if (arg == nullptr) {
+      error("syntax error");
+      return;
+    }
+    std::string option = *arg;
+    std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+    if (option == "NX" && !xx) {
+      nx = true;
+    } else if (option == "XX" && !nx) {
+      xx = true;
+    } else if (option == "GET") {
+      get = true;
+    } else if (option == "KEEPTTL" && expire_option.empty()) {
+      keep_ttl = true;
+    } else if ((option == "EX" || option == "PX" || option == "EXAT" ||
+                option == "PXAT") &&
+               expire_option.empty() && !keep_ttl) {
+      const std::string *ttl_arg = arg_at(command_array, ++i);
+      if (ttl_arg == nullptr) {
+        error("syntax error");
+        return;
+      }
+      if (!string_to_int64(*ttl_arg, ttl)) {
+        error("value is not an integer or out of range");
+        return;
+      }
+      expire_option = option;
+    } else {
+      error("syntax error");
+      return;
+    }
   }
-  std::string value = std::get<std::string>(command_array[i++].value);
-  uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                     std::chrono::system_clock::now().time_since_epoch())
-                     .count();
-  DB_Entry entry{value, now, 0};
-  config.db.insert_or_assign(key, entry);
-  config.in_memory_db.insert_or_assign(key, entry);
-  if (i >= max_size) {
-    ok();
-    return;
+
+  // Seconds are turned into milliseconds, relative times into absolute ones
+  uint64_t expiry = 0;
+  if (!expire_option.empty()) {
+    bool seconds = expire_option == "EX" || expire_option == "EXAT";
+    bool relative = expire_option == "EX" || expire_option == "PX";
+    int64_t now = relative ? Clock::now_ms() : 0;
+    if (ttl <= 0 || (seconds && ttl > INT64_MAX / 1000) ||
+        (seconds ? ttl * 1000 : ttl) > INT64_MAX - now) {
+      error("invalid expire time in 'set' command");
+      return;
+    }
+    expiry = now + (seconds ? ttl * 1000 : ttl);
   }
-  std::string next_cmd = std::get<std::string>(command_array[i].value);
-  if (next_cmd != "px") {
+
+  // Only GET needs the old value, a spilled one is overwritten unread
+  DB_Entry *existing = get ? lookup_key(config, key) : find_key(config, key);
+  if (get && existing != nullptr && !check_type(existing, ValueType::String))
     return;
+  // GET replies with the old value whether or not the new one is set
+  if (get) {
+    if (existing == nullptr) {
+      null();
+    } else {
+      DB_Entry::Scratch scratch;
+      bulk_value(existing, existing->str(scratch));
+    }
   }
-  entry.expiry =
-      now +
-      std::strtoull(std::get<std::string>(command_array[++i].value).c_str(),
-                    NULL, 10);
-  if (entry.expiry == 0)
+  if ((nx && existing != nullptr) || (xx && existing == nullptr)) {
+    m_signal_keys = false;
+    if (!get)
+      null();
     return;
-  // std::cout << "Assigned to db_expiry[" << key << "] : " << entry.expiry
-  //           << "/ms" << std::endl;
-  config.db.insert_or_assign(key, entry);
-  config.in_memory_db.insert_or_assign(key, entry);
-  ok();
+  }
+  if (keep_ttl && existing != nullptr)
+    expiry = existing->expiry();
+  config.db.insert(DB_Entry::create(config.db.allocator(), key, value, expiry,
+                                    config.string_compress_min_size));
+  if (!get)
+    ok();
 }
 
 int HandleResponse::send_entry(DB_Config &config, const std::string &key) {
-  try {
-    config.db.at(key);
-    if (check_expire_ms(key, config) == 1)
-      return -1;
-    std::string value = config.db[key].value;
-    // std::cout << "Delivering: " << key << std::endl;
-    std::string response = "$";
-    response += std::to_string(value.length());
-    response += "\r\n";
-    response += value;
-    response += "\r\n";
-    send(m_client_fd, response.c_str(), response.length(), 0);
-  } catch (std::exception &e) {
-    std::cerr << "Map error, key not found: " << e.what() << std::endl;
+  DB_Entry *entry = lookup_key(config, key);
+  if (entry == nullptr) {
     null();
     return -1;
   }
+
+  if (!check_type(entry, ValueType::String))
+    return -1;
+
+  DB_Entry::Scratch scratch;
+  bulk_value(entry, entry->str(scratch));
   return 0;
 }
 
 void HandleResponse::get(size_t &i, const std::vector<RespData> &command_array,
                          DB_Config &config) {
-  size_t max_size = command_array.size();
-  if (i > max_size || command_array[i].type != RespType::BulkString) {
-    null();
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("GET");
+    return;
+  }
+  send_entry(config, *key);
+}
+
+void HandleResponse::type(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("TYPE");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    reply("+none\r\n");
     return;
   }
-  std::string key = std::get<std::string>(command_array[i++].value);
-  send_entry(config, key);
-  return;
+  switch (entry->type) {
+  case ValueType::String:
+    reply("+string\r\n");
+    break;
+  case ValueType::List:
+    reply("+list\r\n");
+    break;
+  case ValueType::Hash:
+    reply("+hash\r\n");
+    break;
+  case ValueType::ZSet:
+    reply("+zset\r\n");
+    break;
+  case ValueType::Stream:
+    reply("+stream\r\n");
+    break;
+  }
 }
 
-void HandleResponse::array(RespData result, DB_Config &config) {
-  // Extract array
+const std::unordered_map<std::string, HandleResponse::CommandSpec>
+    HandleResponse::commands = {
+        {"PING", {&HandleResponse::ping, 0, 0, 0, 0}},
+        {"ECHO", {&HandleResponse::echo, 0, 0, 0, 0}},
+        {"SET", {&HandleResponse::set, 1, 1, 1, CMD_WRITE}},
+        {"GET", {&HandleResponse::get, 1, 1, 1, CMD_READONLY}},
+        {"CONFIG", {&HandleResponse::config_req, 0, 0, 0, 0}},
+        {"KEYS", {&HandleResponse::keys, 0, 0, 0, 0}},
+        {"MEMORY", {&HandleResponse::memory, 0, 0, 0, 0}},
+        {"INFO", {&HandleResponse::info, 0, 0, 0, 0}},
+        {"INCR", {&HandleResponse::incr, 1, 1, 1, CMD_WRITE}},
+        {"DECR", {&HandleResponse::decr, 1, 1, 1, CMD_WRITE}},
+        {"INCRBY", {&HandleResponse::incrby, 1, 1, 1, CMD_WRITE}},
+        {"DECRBY", {&HandleResponse::decrby, 1, 1, 1, CMD_WRITE}},
+        {"APPEND", {&HandleResponse::append, 1, 1, 1, CMD_WRITE}},
+        {"GETRANGE", {&HandleResponse::getrange, 1, 1, 1, CMD_READONLY}},
+        {"SETRANGE", {&HandleResponse::setrange, 1, 1, 1, CMD_WRITE}},
+        {"STRLEN", {&HandleResponse::strlen_cmd, 1, 1, 1, CMD_READONLY}},
+        {"MGET", {&HandleResponse::mget, 1, -1, 1, CMD_READONLY}},
+        {"MSET", {&HandleResponse::mset, 1, -1, 2, CMD_WRITE}},
+        {"TYPE", {&HandleResponse::type, 1, 1, 1, CMD_READONLY}},
+        {"SETBIT", {&HandleResponse::setbit, 1, 1, 1, CMD_WRITE}},
+        {"GETBIT", {&HandleResponse::getbit, 1, 1, 1, CMD_READONLY}},
+        {"BITCOUNT", {&HandleResponse::bitcount, 1, 1, 1, CMD_READONLY}},
+        {"BITPOS", {&HandleResponse::bitpos, 1, 1, 1, CMD_READONLY}},
+        {"BITOP", {&HandleResponse::bitop, 2, -1, 1, CMD_WRITE_FIRST}},
+        {"PFADD", {&HandleResponse::pfadd, 1, 1, 1, CMD_WRITE}},
+        {"PFCOUNT", {&HandleResponse::pfcount, 1, -1, 1, CMD_READONLY}},
+        {"PFMERGE", {&HandleResponse::pfmerge, 1, -1, 1, CMD_WRITE_FIRST}},
+        {"DEL", {&HandleResponse::del, 1, -1, 1, CMD_WRITE}},
+        {"UNLINK", {&HandleResponse::unlink, 1, -1, 1, CMD_WRITE}},
+        {"FLUSHALL", {&HandleResponse::flushall, 0, 0, 0, 0}},
+        {"FLUSHDB", {&HandleResponse::flushdb, 0, 0, 0, 0}},
+        {"LPUSH", {&HandleResponse::lpush, 1, 1, 1, CMD_WRITE}},
+        {"RPUSH", {&HandleResponse::rpush, 1, 1, 1, CMD_WRITE}},
+        {"LPOP", {&HandleResponse::lpop, 1, 1, 1, CMD_WRITE}},
+        {"RPOP", {&HandleResponse::rpop, 1, 1, 1, CMD_WRITE}},
+        {"LRANGE", {&HandleResponse::lrange, 1, 1, 1, CMD_READONLY}},
+        {"LLEN", {&HandleResponse::llen, 1, 1, 1, CMD_READONLY}},
+        {"LINDEX", {&HandleResponse::lindex, 1, 1, 1, CMD_READONLY}},
+        {"XADD", {&HandleResponse::xadd, 1, 1, 1, CMD_WRITE}},
+        {"XLEN", {&HandleResponse::xlen, 1, 1, 1, CMD_READONLY}},
+        {"XRANGE", {&HandleResponse::xrange, 1, 1, 1, CMD_READONLY}},
+        {"XREVRANGE", {&HandleResponse::xrevrange, 1, 1, 1, CMD_READONLY}},
+        {"XREAD", {&HandleResponse::xread, 0, 0, 0, 0}},
+        {"HSET", {&HandleResponse::hset, 1, 1, 1, CMD_WRITE}},
+        {"HGET", {&HandleResponse::hget, 1, 1, 1, CMD_READONLY}},
+        {"HMGET", {&HandleResponse::hmget, 1, 1, 1, CMD_READONLY}},
+        {"HDEL", {&HandleResponse::hdel, 1, 1, 1, CMD_WRITE}},
+        {"HGETALL", {&HandleResponse::hgetall, 1, 1, 1, CMD_READONLY}},
+        {"HINCRBY", {&HandleResponse::hincrby, 1, 1, 1, CMD_WRITE}},
+        {"HLEN", {&HandleResponse::hlen, 1, 1, 1, CMD_READONLY}},
+        {"ZADD", {&HandleResponse::zadd, 1, 1, 1, CMD_WRITE}},
+        {"ZINCRBY", {&HandleResponse::zincrby, 1, 1, 1, CMD_WRITE}},
+        {"ZREM", {&HandleResponse::zrem, 1, 1, 1, CMD_WRITE}},
+        {"ZSCORE", {&HandleResponse::zscore, 1, 1, 1, CMD_READONLY}},
+        {"ZCARD", {&HandleResponse::zcard, 1, 1, 1, CMD_READONLY}},
+        {"ZRANK", {&HandleResponse::zrank, 1, 1, 1, CMD_READONLY}},
+        {"ZREVRANK", {&HandleResponse::zrevrank, 1, 1, 1, CMD_READONLY}},
+        {"ZRANGE", {&HandleResponse::zrange, 1, 1, 1, CMD_READONLY}},
+        {"ZRANGEBYSCORE",
+         {&HandleResponse::zrangebyscore, 1, 1, 1, CMD_READONLY}},
+        {"SUBSCRIBE", {&HandleResponse::subscribe, 0, 0, 0, 0}},
+        {"UNSUBSCRIBE", {&HandleResponse::unsubscribe, 0, 0, 0, 0}},
+        {"PSUBSCRIBE", {&HandleResponse::psubscribe, 0, 0, 0, 0}},
+        {"PUNSUBSCRIBE", {&HandleResponse::punsubscribe, 0, 0, 0, 0}},
+        {"PUBLISH", {&HandleResponse::publish, 0, 0, 0, 0}},
+        {"HELLO", {&HandleResponse::hello, 0, 0, 0, 0}},
+        {"CLIENT", {&HandleResponse::client, 0, 0, 0, 0}},
+        {"BLPOP", {&HandleResponse::blpop, 1, -2, 1, 0}},
+        {"BRPOP", {&HandleResponse::brpop, 1, -2, 1, 0}},
+        {"MULTI", {&HandleResponse::multi, 0, 0, 0, 0}},
+        {"EXEC", {&HandleResponse::exec, 0, 0, 0, 0}},
+        {"DISCARD", {&HandleResponse::discard, 0, 0, 0, 0}},
+        {"WATCH", {&HandleResponse::watch, 1, -1, 1, 0}},
+        {"UNWATCH", {&HandleResponse::unwatch, 0, 0, 0, 0}},
+        {"CLUSTER", {&HandleResponse::cluster, 0, 0, 0, 0}},
+        {"ASKING", {&HandleResponse::asking, 0, 0, 0, 0}},
+        {"DUMP", {&HandleResponse::dump, 1, 1, 1, CMD_READONLY}},
+        {"RESTORE", {&HandleResponse::restore, 1, 1, 1, CMD_WRITE}},
+        {"RESTORE-ASKING",
+         {&HandleResponse::restore_asking, 1, 1, 1, CMD_WRITE}},
+        {"MIGRATE", {&HandleResponse::migrate, 0, 0, 0, 0}},
+        {"DEBUG", {&HandleResponse::debug, 0, 0, 0, 0}},
+};
+
+const HandleResponse::CommandSpec *
+HandleResponse::lookup_command(const RespData &result) {
+  if (result.type != RespType::Array)
+    return nullptr;
   const auto &command_array = std::get<std::vector<RespData>>(result.value);
-  for (size_t i = 0; i <= command_array.size(); ++i) {
-    const auto &command = command_array[i];
-    // Extract each command based on type std::get()
-    if (command.type == RespType::BulkString) {
-      std::string command_str = std::get<std::string>(command.value);
-      std::transform(command_str.begin(), command_str.end(),
-                     command_str.begin(), ::toupper);
-
-      if (command_str == "PING") {
-        ping();
-        ++i;
-      }
-      if (command_str == "ECHO") {
-        echo(++i, command_array);
-      }
-      if (command_str == "SET") {
-        set(++i, command_array, config);
-      }
-      if (command_str == "GET") {
-        get(++i, command_array, config);
-      }
-      if (command_str == "CONFIG") {
-        config_req(++i, command_array, config);
-      }
-      if (command_str == "KEYS") {
-        keys(++i, command_array, config);
+  if (command_array.empty() || command_array[0].type != RespType::BulkString)
+    return nullptr;
+
+  std::string command_str = std::get<std::string>(command_array[0].value);
+  std::transform(command_str.begin(), command_str.end(), command_str.begin(),
+                 ::toupper);
+  auto command = commands.find(command_str);
+  return command == commands.end() ? nullptr : &command->second;
+}
+
+void HandleResponse::prefetch(std::span<const RespData> batch,
+                              DB_Config &config) {
+  std::vector<std::string_view> keys;
+  for (const auto &result : batch) {
+    const CommandSpec *spec = lookup_command(result);
+    if (spec == nullptr)
+      continue;
+    for_each_key(*spec, std::get<std::vector<RespData>>(result.value),
+                 [&keys](const std::string &key) { keys.push_back(key); });
+  }
+  config.db.prefetch(keys);
+}
+
+void HandleResponse::array(RespData &result, DB_Config &config) {
+  // Extract array: the command name followed by its arguments
+  const auto &command_array = std::get<std::vector<RespData>>(result.value);
+  if (command_array.empty() || command_array[0].type != RespType::BulkString)
+    return;
+
+  const CommandSpec *command = lookup_command(result);
+  if (command == nullptr) {
+    std::string name = std::get<std::string>(command_array[0].value);
+    error("unknown command '" + name + "'");
+    // A transaction with a rejected command is refused by EXEC
+    if (m_client.in_multi)
+      m_client.multi_failed = true;
+    return;
+  }
+  // A subscribed RESP2 connection only receives messages, RESP3 tells pushes
+  // from replies
+  if (m_client.subscriptions() > 0 && m_client.protocol < 3 &&
+      command->handler != &HandleResponse::ping &&
+      command->handler != &HandleResponse::subscribe &&
+      command->handler != &HandleResponse::unsubscribe &&
+      command->handler != &HandleResponse::psubscribe &&
+      command->handler != &HandleResponse::punsubscribe) {
+    std::string name = std::get<std::string>(command_array[0].value);
+    error("Can't execute '" + name +
+          "': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this "
+          "context");
+    return;
+  }
+  // ASKING only holds for the command right after it
+  bool asking = m_client.asking;
+  m_client.asking = false;
+  if (config.cluster.enabled() &&
+      !cluster_allows(*command, command_array, config, asking)) {
+    if (m_client.in_multi)
+      m_client.multi_failed = true;
+    return;
+  }
+  // Inside MULTI commands are queued as parsed, to be run by EXEC
+  if (m_client.in_multi && command->handler != &HandleResponse::exec &&
+      command->handler != &HandleResponse::discard &&
+      command->handler != &HandleResponse::multi &&
+      command->handler != &HandleResponse::watch) {
+    m_client.multi_queue.push_back(std::move(result));
+    reply("+QUEUED\r\n");
+    return;
+  }
+  call(*command, command_array, config);
+}
+
+HandleResponse::Route HandleResponse::route(const RespData &result,
+                                            const Client &client,
+                                            DB_Config &config,
+                                            size_t &partition) {
+  partition = config.partition;
+  const CommandSpec *command = lookup_command(result);
+  if (config.partitions.empty() || command == nullptr)
+    return Route::Home;
+  Command handler = command->handler;
+  // Queued by MULTI, or refused to a subscribed connection
+  if ((client.in_multi && handler != &HandleResponse::exec &&
+       handler != &HandleResponse::discard &&
+       handler != &HandleResponse::multi &&
+       handler != &HandleResponse::watch) ||
+      (client.subscriptions() > 0 && client.protocol < 3))
+    return Route::Home;
+  // Commands over every partition, alone or in a transaction
+  auto everywhere = [](Command handler) {
+    return handler == &HandleResponse::keys ||
+           handler == &HandleResponse::info ||
+           handler == &HandleResponse::memory ||
+           handler == &HandleResponse::publish ||
+           handler == &HandleResponse::flushall ||
+           handler == &HandleResponse::flushdb ||
+           handler == &HandleResponse::debug;
+  };
+  if (everywhere(handler))
+    return Route::World;
+
+  size_t first = SIZE_MAX;
+  bool several = false;
+  auto add = [&](const std::string &key) {
+    size_t p = config.partition_of(key);
+    if (first == SIZE_MAX)
+      first = p;
+    several |= p != first;
+  };
+  const auto &command_array = std::get<std::vector<RespData>>(result.value);
+  for_each_key(*command, command_array, add);
+  // Transactions keep their state in the client, they run at home and stop
+  // the world when their keys are elsewhere
+  if (handler == &HandleResponse::watch || handler == &HandleResponse::exec ||
+      handler == &HandleResponse::discard ||
+      handler == &HandleResponse::unwatch) {
+    for (const auto &watched : client.watched)
+      add(watched.first);
+    if (handler == &HandleResponse::exec)
+      for (const RespData &queued : client.multi_queue) {
+        const CommandSpec *spec = lookup_command(queued);
+        if (everywhere(spec->handler))
+          return Route::World;
+        for_each_key(*spec, std::get<std::vector<RespData>>(queued.value),
+                     add);
       }
-    } else {
-      ++i;
-    }
+    return first == SIZE_MAX || (!several && first == config.partition)
+               ? Route::Home
+               : Route::World;
   }
+  if (first == SIZE_MAX)
+    return Route::Home;
+  if (command->flags & (CMD_WRITE | CMD_WRITE_FIRST | CMD_READONLY)) {
+    if (several)
+      return Route::World;
+    partition = first;
+    return Route::Partition;
+  }
+  // A blocking pop waits on the thread owning its keys, the handler refuses
+  // keys spread over several partitions
+  if (several || first == config.partition || client.subscriptions() > 0)
+    return Route::Home;
+  partition = first;
+  return Route::Handoff;
+}
+
+void HandleResponse::call(const CommandSpec &command,
+                          const std::vector<RespData> &command_array,
+                          DB_Config &home) {
+  // With --threads data commands run on the partition of their (first) key,
+  // route() made sure it is safe to touch
+  DB_Config *config = &home;
+  bool first = true;
+  if (!home.partitions.empty() &&
+      (command.flags & (CMD_WRITE | CMD_WRITE_FIRST | CMD_READONLY)))
+    for_each_key(command, command_array, [&](const std::string &key) {
+      if (first)
+        config = &home.partition_for(key);
+      first = false;
+    });
+  size_t i = 1;
+  size_t replied = m_client.reply.length();
+  m_signal_keys = true;
+  try {
+    (this->*command.handler)(i, command_array, *config);
+  } catch (const SpillReadError &e) {
+    reply("-IOERR " + std::string(e.what()) + "\r\n");
+  }
+  // A failed write changed nothing, a WATCH on its keys still holds
+  if (m_client.reply.length() > replied && m_client.reply[replied] == '-')
+    m_signal_keys = false;
+  if ((command.flags & (CMD_WRITE | CMD_WRITE_FIRST)) && m_signal_keys) {
+    bool all = command.flags & CMD_WRITE;
+    first = true;
+    for_each_key(command, command_array, [&](const std::string &key) {
+      if (all || first)
+        signal_modified_key(home.partition_for(key), key, &m_client);
+      first = false;
+    });
+  } else if ((command.flags & CMD_READONLY) && m_client.tracking &&
+             !m_client.tracking_bcast) {
+    for_each_key(command, command_array, [&](const std::string &key) {
+      config->tracking.remember(&m_client, key);
+    });
+  }
+}
+
+void HandleResponse::signal_modified_key(DB_Config &config,
+                                         std::string_view key,
+                                         const Client *writer) {
+  config.key_versions.touch(key);
+  config.tracking.invalidate(key, writer, config.pending_writes);
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Client.hpp"
 #include "Parser.hpp"
 #include "Server.hpp"
 #include <algorithm>
@@ -10,36 +11,408 @@
 #include <ctime>
 #include <fcntl.h>
 #include <iostream>
+#include <span>
+#include <string_view>
+#include <strings.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <unordered_map>
 
+// String values at least this long are sent in place rather than copied into
+// the reply (see RawString)
+#define ZERO_COPY_MIN (16 * 1024)
+
+// Largest String value, same limit as Redis' proto-max-bulk-len
+#define MAX_STRING_SIZE (512 * 1024 * 1024)
+
 class HandleResponse {
 
 public:
-  HandleResponse(RespData result, int client_fd, DB_Config &config);
+  // Runs the command in result, which is moved to the client's queue when it
+  // is in a transaction
+  HandleResponse(RespData &result, Client &client, DB_Config &config);
+
+  // Prefetches the keys of a batch of pipelined commands before they run
+  static void prefetch(std::span<const RespData> batch, DB_Config &config);
+  // Drops every key the client WATCHes
+  static void unwatch_all(Client &client, DB_Config &config);
+  // Tells WATCH and client tracking that key changed, writer is nullptr when
+  // it expired
+  static void signal_modified_key(DB_Config &config, std::string_view key,
+                                  const Client *writer);
+  // Serves the blocked clients whose keys are ready or whose timeout passed,
+  // appending them to unblocked
+  static void handle_blocked_clients(DB_Config &config, uint64_t now_ms,
+                                     std::vector<Client *> &unblocked);
+  // Answers the clients whose MIGRATE completed, appending them to unblocked
+  static void finish_migrations(DB_Config &config,
+                                std::vector<Client *> &unblocked);
+
+  // Tiered storage: starts reading back the spilled values of the command's
+  // keys in this partition, for the client fd/id. Returns how many it has to
+  // wait for.
+  static size_t load_spilled(const RespData &result, int fd,
+                             uint64_t client_id, DB_Config &config);
+
+  // --threads: where a command of client has to run (see Partitions.hpp).
+  // Home: on the client's partition. Partition: on the one owning its keys,
+  // set in partition. World: on the client's partition with the others
+  // stopped. Handoff: the client has to move to partition first.
+  enum class Route { Home, Partition, World, Handoff };
+  static Route route(const RespData &result, const Client &client,
+                     DB_Config &config, size_t &partition);
 
 private:
+  // Every command handler gets the index of its first argument
+  typedef void (HandleResponse::*Command)(
+      size_t &i, const std::vector<RespData> &command_array,
+      DB_Config &config);
+  // Positions of the keys in the command array: first, last (-1 for the last
+  // argument) and step, 0 when the command takes no keys
+  struct CommandSpec {
+    Command handler;
+    int first_key;
+    int last_key;
+    int key_step;
+    uint8_t flags;
+  };
+  enum : uint8_t {
+    // Modifies its keys: bumps their WATCH versions and invalidates them for
+    // the clients tracking them
+    CMD_WRITE = 1,
+    // Reads its keys: they are tracked for clients with CLIENT TRACKING on
+    CMD_READONLY = 2,
+    // Writes its first key and reads the others (BITOP, PFMERGE)
+    CMD_WRITE_FIRST = 4,
+  };
+  static const std::unordered_map<std::string, CommandSpec> commands;
+  static const CommandSpec *lookup_command(const RespData &result);
+  template <typename F>
+  static void for_each_key(const CommandSpec &spec,
+                           const std::vector<RespData> &command_array, F &&fn);
+
   const char *ping_response = "+PONG\r\n";
   std::string echo_response;
-  int m_client_fd;
+  Client &m_client;
+  bool m_exec = false; // running the commands queued by MULTI
+  // call() signals the keys of a write command once it ran, unless it
+  // replied with an error or the handler cleared this: it left its keys as
+  // they were, or signalled the ones it changed itself
+  bool m_signal_keys = true;
 
+  void reply(std::string_view response);
   void ok();
   void null();
+  void null_array();
   void empty();
-  void array(RespData result, DB_Config &config);
-  void ping();
+  void error(const std::string &message);
+  void wrong_args(const std::string &command);
+  void integer(int64_t value);
+  void bulk(std::string_view value);
+  // Bulk reply with value, a part of the String value of entry. Big values
+  // are pinned and sent from the keyspace instead of copied.
+  void bulk_value(const DB_Entry *entry, std::string_view value);
+  void double_value(double value);
+  void array(RespData &result, DB_Config &config);
+  void call(const CommandSpec &command,
+            const std::vector<RespData> &command_array, DB_Config &config);
   int send_entry(DB_Config &config, const std::string &key);
-  void echo(size_t &i, const std::vector<RespData> &command_array);
+
+  void ping(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void echo(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
   void set(size_t &i, const std::vector<RespData> &command_array,
            DB_Config &config);
   void get(size_t &i, const std::vector<RespData> &command_array,
            DB_Config &config);
   void config_req(size_t &i, const std::vector<RespData> &command_array,
-                  const DB_Config &config);
+                  DB_Config &config);
   void keys(size_t &i, const std::vector<RespData> &command_array,
             DB_Config &config);
+  void memory(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void info(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void type(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+
+  // Keyspace commands, KeyCommands.cpp
+  void del(size_t &i, const std::vector<RespData> &command_array,
+           DB_Config &config);
+  void unlink(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void del_generic(size_t &i, const std::vector<RespData> &command_array,
+                   DB_Config &config, bool lazy, const std::string &name);
+  void flushall(size_t &i, const std::vector<RespData> &command_array,
+                DB_Config &config);
+  void flushdb(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void flush_generic(size_t &i, const std::vector<RespData> &command_array,
+                     DB_Config &config, const std::string &name);
+
+  // Bitmap commands, BitmapCommands.cpp
+  void setbit(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void getbit(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void bitcount(size_t &i, const std::vector<RespData> &command_array,
+                DB_Config &config);
+  void bitpos(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void bitop(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  // Parses the optional start end [BYTE|BIT] of BITCOUNT and BITPOS into a
+  // range of the value's bits. Returns false after replying an error.
+  bool bit_range(size_t &i, const std::vector<RespData> &command_array,
+                 size_t len, int64_t &first, int64_t &last, bool &bit_mode,
+                 bool &end_given);
+
+  // HyperLogLog commands, HyperLogLogCommands.cpp
+  void pfadd(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void pfcount(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void pfmerge(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  // Replies WRONGTYPE like Redis and returns false unless value, a String,
+  // is a HyperLogLog
+  bool check_hll(std::string_view value);
+
+  // String commands, StringCommands.cpp
+  void incr(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void decr(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void incrby(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void decrby(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void append(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void getrange(size_t &i, const std::vector<RespData> &command_array,
+                DB_Config &config);
+  void setrange(size_t &i, const std::vector<RespData> &command_array,
+                DB_Config &config);
+  void strlen_cmd(size_t &i, const std::vector<RespData> &command_array,
+                  DB_Config &config);
+  void mget(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void mset(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void incr_by(DB_Config &config, const std::string &key, int64_t by);
+
+  // List commands, ListCommands.cpp
+  void lpush(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void rpush(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void lpop(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void rpop(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void lrange(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void llen(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void lindex(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void list_push(size_t &i, const std::vector<RespData> &command_array,
+                 DB_Config &config, bool head, const std::string &name);
+  void list_pop(size_t &i, const std::vector<RespData> &command_array,
+                DB_Config &config, bool head, const std::string &name);
+  void blpop(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void brpop(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void blocking_pop(size_t &i, const std::vector<RespData> &command_array,
+                    DB_Config &config, bool head, const std::string &name);
+  // Pops an element of the list in entry into a [key, element] reply
+  static void pop_to_reply(DB_Config &config, DB_Entry *entry,
+                           const std::string &key, bool head,
+                           const Client *writer, std::string &response);
+
+  // Stream commands, StreamCommands.cpp
+  void xadd(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void xlen(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void xrange(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void xrevrange(size_t &i, const std::vector<RespData> &command_array,
+                 DB_Config &config);
+  void xread(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void xrange_generic(size_t &i, const std::vector<RespData> &command_array,
+                      DB_Config &config, bool reverse,
+                      const std::string &name);
+  // Answers the XREAD clients waiting on key, a Stream, that have entries
+  // after their ID
+  static void serve_stream_waiters(DB_Config &config, DB_Entry *entry,
+                                   const std::string &key,
+                                   std::vector<Client *> &unblocked);
+
+  // Hash commands, HashCommands.cpp
+  void hset(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void hget(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void hmget(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void hdel(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void hgetall(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void hincrby(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void hlen(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+
+  // Sorted set commands, ZSetCommands.cpp
+  void zadd(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void zincrby(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void zrem(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void zscore(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void zcard(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void zrank(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void zrevrank(size_t &i, const std::vector<RespData> &command_array,
+                DB_Config &config);
+  void zrange(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void zrangebyscore(size_t &i, const std::vector<RespData> &command_array,
+                     DB_Config &config);
+  void zrank_generic(size_t &i, const std::vector<RespData> &command_array,
+                     DB_Config &config, bool reverse, const std::string &name);
+  void zrange_generic(size_t &i, const std::vector<RespData> &command_array,
+                      DB_Config &config, bool by_score,
+                      const std::string &name);
+
+  // Pub/Sub commands, PubSubCommands.cpp
+  void subscribe(size_t &i, const std::vector<RespData> &command_array,
+                 DB_Config &config);
+  void unsubscribe(size_t &i, const std::vector<RespData> &command_array,
+                   DB_Config &config);
+  void psubscribe(size_t &i, const std::vector<RespData> &command_array,
+                  DB_Config &config);
+  void punsubscribe(size_t &i, const std::vector<RespData> &command_array,
+                    DB_Config &config);
+  void publish(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void subscription_reply(std::string_view kind, const std::string *name);
 
-  int check_expire_ms(std::string key, DB_Config &config);
+  // Connection commands, ClientCommands.cpp
+  void hello(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void client(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void client_tracking(size_t &i, const std::vector<RespData> &command_array,
+                       DB_Config &config);
+
+  // Debugging commands, DebugCommands.cpp
+  void debug(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void debug_populate(size_t &i, const std::vector<RespData> &command_array,
+                      DB_Config &config);
+
+  // Transaction commands, TransactionCommands.cpp
+  void multi(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void exec(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void discard(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void watch(size_t &i, const std::vector<RespData> &command_array,
+             DB_Config &config);
+  void unwatch(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+
+  // Cluster commands, ClusterCommands.cpp
+  void cluster(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void cluster_info(DB_Config &config);
+  void cluster_nodes(DB_Config &config);
+  void cluster_slots(DB_Config &config);
+  void cluster_shards(DB_Config &config);
+  void cluster_setslot(size_t &i, const std::vector<RespData> &command_array,
+                       DB_Config &config);
+  void asking(size_t &i, const std::vector<RespData> &command_array,
+              DB_Config &config);
+  void dump(size_t &i, const std::vector<RespData> &command_array,
+            DB_Config &config);
+  void restore(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  void restore_asking(size_t &i, const std::vector<RespData> &command_array,
+                      DB_Config &config);
+  void migrate(size_t &i, const std::vector<RespData> &command_array,
+               DB_Config &config);
+  bool cluster_allows(const CommandSpec &command,
+                      const std::vector<RespData> &command_array,
+                      DB_Config &config, bool asking);
+
+  static int check_expire_ms(DB_Entry *entry, DB_Config &config);
+  static DB_Entry *lookup_key(DB_Config &config, const std::string &key);
+  // lookup_key without reading back a spilled value, for commands that only
+  // need to know whether the key exists
+  static DB_Entry *find_key(DB_Config &config, const std::string &key);
+  // Removes key, leaving a big value to the lazy free thread when lazy.
+  // Returns false if there was no such key.
+  static bool delete_key(DB_Config &config, std::string_view key, bool lazy);
+  // Replies WRONGTYPE and returns false if entry does not hold a value of type
+  bool check_type(const DB_Entry *entry, ValueType type);
 };
+
+std::string format_ratio(double ratio);
+void append_bulk(std::string &response, std::string_view str);
+void append_integer(std::string &response, int64_t value);
+void append_array_len(std::string &response, int64_t len);
+// RESP3 types, written in their RESP2 shape when protocol is 2: nulls as
+// $-1 or *-1, maps and pushes as flat arrays, doubles as bulk strings
+void append_null(std::string &response, int protocol);
+void append_null_array(std::string &response, int protocol);
+void append_map_len(std::string &response, int64_t pairs, int protocol);
+void append_push_len(std::string &response, int64_t len, int protocol);
+void append_double(std::string &response, double value, int protocol);
+// Returns the bulk string argument at i, or nullptr when missing
+const std::string *arg_at(const std::vector<RespData> &command_array,
+                          size_t i);
+// Returns str in upper case, for matching command options
+std::string upper(const std::string &str);
+// Makes sure the value of entry, a String in db, is Raw with room for len
+// bytes. Returns the entry, which may have been replaced.
+DB_Entry *make_room(Dict &db, DB_Entry *entry, size_t len);
+
+// Calls fn with every key argument of a command
+template <typename F>
+void HandleResponse::for_each_key(const CommandSpec &spec,
+                                  const std::vector<RespData> &command_array,
+                                  F &&fn) {
+  // XREAD keys are the first half of the arguments after STREAMS
+  if (spec.handler == &HandleResponse::xread) {
+    size_t streams = 1;
+    while (streams < command_array.size()) {
+      const std::string *arg = arg_at(command_array, streams++);
+      if (arg != nullptr && arg->length() == 7 &&
+          strncasecmp(arg->c_str(), "STREAMS", 7) == 0)
+        break;
+    }
+    size_t keys = (command_array.size() - streams) / 2;
+    for (size_t k = streams; k < streams + keys; ++k)
+      if (const std::string *key = arg_at(command_array, k))
+        fn(*key);
+    return;
+  }
+  if (spec.first_key == 0)
+    return;
+  int last = spec.last_key < 0 ? command_array.size() + spec.last_key
+                               : spec.last_key;
+  for (int k = spec.first_key; k <= last; k += spec.key_step)
+    if (const std::string *key = arg_at(command_array, k))
+      fn(*key);
+}
@@ -0,0 +1,145 @@
+#include "Hash.hpp"
+
+static uint8_t *listpack_of(const DB_Entry *entry) {
+  return static_cast<uint8_t *>(entry->value.object);
+}
+
+static HashTable *table_of(const DB_Entry *entry) {
+  return static_cast<HashTable *>(entry->value.object);
+}
+
+// Returns the field element of a listpack encoded hash, or nullptr
+static uint8_t *find_field(uint8_t *lp, std::string_view field) {
+  for (uint8_t *p = Listpack::first(lp); p != nullptr;) {
+    char scratch[21];
+    if (Listpack::get(p, scratch) == field)
+      return p;
+    p = Listpack::next(lp, Listpack::next(lp, p));
+  }
+  return nullptr;
+}
+
+DB_Entry *Hash::create(SlabAllocator &alloc, std::string_view key,
+                       uint64_t expiry) {
+  uint8_t *lp = Listpack::create();
+  try {
+    return DB_Entry::create_object(alloc, key, ValueType::Hash,
+                                   Encoding::Listpack, lp, expiry);
+  } catch (...) {
+    Listpack::free(lp);
+    throw;
+  }
+}
+
+DB_Entry *Hash::from_listpack(SlabAllocator &alloc, std::string_view key,
+                              uint8_t *lp, const DB_Config &config,
+                              uint64_t expiry) {
+  DB_Entry *entry;
+  try {
+    entry = DB_Entry::create_object(alloc, key, ValueType::Hash,
+                                    Encoding::Listpack, lp, expiry);
+  } catch (...) {
+    Listpack::free(lp);
+    throw;
+  }
+
+  bool too_big = length(entry) > config.hash_max_listpack_entries;
+  for_each(entry, [&](std::string_view field, std::string_view value) {
+    if (field.length() > config.hash_max_listpack_value ||
+        value.length() > config.hash_max_listpack_value)
+      too_big = true;
+  });
+  if (too_big)
+    convert(entry);
+  return entry;
+}
+
+size_t Hash::length(const DB_Entry *entry) {
+  if (entry->encoding == Encoding::HashTable)
+    return table_of(entry)->map.size();
+  return Listpack::length(listpack_of(entry)) / 2;
+}
+
+bool Hash::get(DB_Entry *entry, std::string_view field, std::string &out) {
+  if (entry->encoding == Encoding::HashTable) {
+    auto &map = table_of(entry)->map;
+    auto it = map.find(field);
+    if (it == map.end())
+      return false;
+    out = it->second;
+    return true;
+  }
+  uint8_t *lp = listpack_of(entry);
+  uint8_t *p = find_field(lp, field);
+  if (p == nullptr)
+    return false;
+  char scratch[21];
+  out = Listpack::get(Listpack::next(lp, p), scratch);
+  return true;
+}
+
+bool Hash::set(DB_Entry *entry, std::string_view field, std::string_view value,
+               const DB_Config &config) {
+  if (entry->encoding == Encoding::Listpack &&
+      (field.length() > config.hash_max_listpack_value ||
+       value.length() > config.hash_max_listpack_value))
+    convert(entry);
+
+  if (entry->encoding == Encoding::HashTable) {
+    auto &map = table_of(entry)->map;
+    auto it = map.find(field);
+    if (it != map.end()) {
+      it->second.assign(value);
+      return false;
+    }
+    map.emplace(ObjectString(field), ObjectString(value));
+    return true;
+  }
+
+  uint8_t *lp = listpack_of(entry);
+  if (uint8_t *p = find_field(lp, field)) {
+    entry->value.object = Listpack::insert(lp, value, Listpack::next(lp, p),
+                                           Listpack::Where::Replace);
+    return false;
+  }
+  lp = Listpack::append(lp, field);
+  lp = Listpack::append(lp, value);
+  entry->value.object = lp;
+  if (length(entry) > config.hash_max_listpack_entries)
+    convert(entry);
+  return true;
+}
+
+bool Hash::remove(DB_Entry *entry, std::string_view field) {
+  if (entry->encoding == Encoding::HashTable) {
+    auto &map = table_of(entry)->map;
+    auto it = map.find(field);
+    if (it == map.end())
+      return false;
+    map.erase(it);
+    return true;
+  }
+
+  uint8_t *lp = listpack_of(entry);
+  uint8_t *p = find_field(lp, field);
+  if (p == nullptr)
+    return false;
+  entry->value.object = Listpack::remove(lp, p, 2);
+  return true;
+}
+
+void Hash::convert(DB_Entry *entry) {
+  auto *table = new HashTable;
+  try {
+    table->map.reserve(length(entry));
+    for_each(entry, [table](std::string_view field, std::string_view value) {
+      table->map.emplace(ObjectString(field), ObjectString(value));
+    });
+  } catch (...) {
+    delete table;
+    throw;
+  }
+  Listpack::free(listpack_of(entry));
+  entry->encoding = Encoding::HashTable;
+  entry->value.object = table;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "DB.hpp"
+#include "Listpack.hpp"
+#include "ObjectAlloc.hpp"
+
+/*
+Hash values have two encodings:
+  Listpack   fields and values alternate in a single listpack blob and are
+             found by a linear scan, which for a few dozen fields is both
+             faster and several times smaller than a hash table
+  HashTable  an unordered_map, once the hash has more than
+             hash_max_listpack_entries fields or is given a field or value
+             longer than hash_max_listpack_value bytes
+
+Like in Redis the conversion only goes one way: a hash that shrank again keeps
+its table.
+*/
+
+typedef std::basic_string<char, std::char_traits<char>, ObjectAllocator<char>>
+    ObjectString;
+
+struct StringViewHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view str) const {
+    return std::hash<std::string_view>{}(str);
+  }
+};
+
+struct HashTable : public TrackedObject {
+  std::unordered_map<
+      ObjectString, ObjectString, StringViewHash, std::equal_to<>,
+      ObjectAllocator<std::pair<const ObjectString, ObjectString>>>
+      map;
+};
+
+struct Hash {
+  // A new, empty, listpack encoded hash entry
+  static DB_Entry *create(SlabAllocator &alloc, std::string_view key,
+                          uint64_t expiry = 0);
+  // Adopts a listpack read from disk, converting it if it is over the limits
+  static DB_Entry *from_listpack(SlabAllocator &alloc, std::string_view key,
+                                 uint8_t *lp, const DB_Config &config,
+                                 uint64_t expiry = 0);
+
+  static size_t length(const DB_Entry *entry);
+  static bool get(DB_Entry *entry, std::string_view field, std::string &out);
+  // Returns true if the field is new
+  static bool set(DB_Entry *entry, std::string_view field,
+                  std::string_view value, const DB_Config &config);
+  // Returns true if the field existed
+  static bool remove(DB_Entry *entry, std::string_view field);
+  // Calls fn(field, value) for every field
+  template <typename F> static void for_each(DB_Entry *entry, F &&fn);
+
+private:
+  static void convert(DB_Entry *entry);
+};
+
+template <typename F> void Hash::for_each(DB_Entry *entry, F &&fn) {
+  if (entry->encoding == Encoding::HashTable) {
+    for (const auto &[field, value] :
+         static_cast<HashTable *>(entry->value.object)->map)
+      fn(std::string_view(field), std::string_view(value));
+    return;
+  }
+  auto *lp = static_cast<uint8_t *>(entry->value.object);
+  for (uint8_t *p = Listpack::first(lp); p != nullptr;) {
+    uint8_t *v = Listpack::next(lp, p);
+    char field_scratch[21], value_scratch[21];
+    fn(Listpack::get(p, field_scratch), Listpack::get(v, value_scratch));
+    p = Listpack::next(lp, v);
+  }
+}
@@ -0,0 +1,197 @@
+#include "Hash.hpp"
+#include "HandleResponse.hpp"
+#include <string>
+
+void HandleResponse::hset(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  size_t args = command_array.size() - i;
+  if (key == nullptr || args == 0 || args % 2 != 0) {
+    wrong_args("HSET");
+    return;
+  }
+  for (size_t arg = i; arg < command_array.size(); ++arg)
+    if (arg_at(command_array, arg) == nullptr) {
+      wrong_args("HSET");
+      return;
+    }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    entry = Hash::create(config.db.allocator(), *key);
+    config.db.insert(entry);
+  } else if (!check_type(entry, ValueType::Hash)) {
+    return;
+  }
+
+  int64_t added = 0;
+  for (; i < command_array.size(); i += 2) {
+    const std::string &field = std::get<std::string>(command_array[i].value);
+    const std::string &value =
+        std::get<std::string>(command_array[i + 1].value);
+    added += Hash::set(entry, field, value, config);
+  }
+  integer(added);
+}
+
+void HandleResponse::hget(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *field = arg_at(command_array, i++);
+  if (key == nullptr || field == nullptr) {
+    wrong_args("HGET");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    null();
+    return;
+  }
+  if (!check_type(entry, ValueType::Hash))
+    return;
+  std::string value;
+  if (!Hash::get(entry, *field, value)) {
+    null();
+    return;
+  }
+  bulk(value);
+}
+
+void HandleResponse::hmget(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr || i >= command_array.size()) {
+    wrong_args("HMGET");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::Hash))
+    return;
+
+  std::string response;
+  append_array_len(response, command_array.size() - i);
+  std::string value;
+  for (; i < command_array.size(); ++i) {
+    const std::string *field = arg_at(command_array, i);
+    if (entry == nullptr || field == nullptr ||
+        !Hash::get(entry, *field, value)) {
+      append_null(response, m_client.protocol);
+      continue;
+    }
+    append_bulk(response, value);
+  }
+  reply(response);
+}
+
+void HandleResponse::hdel(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr || i >= command_array.size()) {
+    wrong_args("HDEL");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    m_signal_keys = false;
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::Hash))
+    return;
+
+  int64_t removed = 0;
+  for (; i < command_array.size(); ++i)
+    if (const std::string *field = arg_at(command_array, i))
+      removed += Hash::remove(entry, *field);
+  // Empty hashes do not exist
+  if (Hash::length(entry) == 0)
+    config.db.erase(*key);
+  m_signal_keys = removed > 0;
+  integer(removed);
+}
+
+void HandleResponse::hgetall(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("HGETALL");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  std::string response;
+  if (entry == nullptr) {
+    append_map_len(response, 0, m_client.protocol);
+    reply(response);
+    return;
+  }
+  if (!check_type(entry, ValueType::Hash))
+    return;
+
+  append_map_len(response, Hash::length(entry), m_client.protocol);
+  Hash::for_each(entry, [&response](std::string_view field,
+                                    std::string_view value) {
+    append_bulk(response, field);
+    append_bulk(response, value);
+  });
+  reply(response);
+}
+
+void HandleResponse::hincrby(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *field = arg_at(command_array, i++);
+  const std::string *by = arg_at(command_array, i++);
+  if (key == nullptr || field == nullptr || by == nullptr) {
+    wrong_args("HINCRBY");
+    return;
+  }
+  int64_t increment;
+  if (!string_to_int64(*by, increment)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::Hash))
+    return;
+
+  int64_t value = 0;
+  std::string current;
+  if (entry != nullptr && Hash::get(entry, *field, current) &&
+      !string_to_int64(current, value)) {
+    error("hash value is not an integer");
+    return;
+  }
+  int64_t result;
+  if (__builtin_add_overflow(value, increment, &result)) {
+    error("increment or decrement would overflow");
+    return;
+  }
+
+  if (entry == nullptr) {
+    entry = Hash::create(config.db.allocator(), *key);
+    config.db.insert(entry);
+  }
+  Hash::set(entry, *field, std::to_string(result), config);
+  integer(result);
+}
+
+void HandleResponse::hlen(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("HLEN");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::Hash))
+    return;
+  integer(Hash::length(entry));
+}
@@ -0,0 +1,30 @@
+#include "HashSlot.hpp"
+#include <array>
+
+static constexpr std::array<uint16_t, 256> CRC16_TABLE = [] {
+  std::array<uint16_t, 256> table{};
+  for (int n = 0; n < 256; ++n) {
+    uint16_t crc = n << 8;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    table[n] = crc;
+  }
+  return table;
+}();
+
+uint16_t crc16(const char *buf, size_t len) {
+  uint16_t crc = 0;
+  for (size_t n = 0; n < len; ++n)
+    crc = (crc << 8) ^ CRC16_TABLE[((crc >> 8) ^ uint8_t(buf[n])) & 0xFF];
+  return crc;
+}
+
+uint16_t key_hash_slot(std::string_view key) {
+  size_t open = key.find('{');
+  if (open != std::string_view::npos) {
+    size_t close = key.find('}', open + 1);
+    if (close != std::string_view::npos && close != open + 1)
+      key = key.substr(open + 1, close - open - 1);
+  }
+  return crc16(key.data(), key.length()) & (CLUSTER_SLOTS - 1);
+}
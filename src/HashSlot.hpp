@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+Cluster hash slots. A key belongs to slot CRC16(key) mod 16384, or - when it
+has a hash tag, a non empty part between its first '{' and the next '}' - to
+the slot of the tag alone, so that keys sharing a tag share a slot.
+*/
+
+constexpr int CLUSTER_SLOTS = 16384;
+
+// CRC16/XMODEM (polynomial 0x1021), the checksum Redis Cluster uses
+uint16_t crc16(const char *buf, size_t len);
+uint16_t key_hash_slot(std::string_view key);
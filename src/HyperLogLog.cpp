@@ -0,0 +1,423 @@
+#include "HyperLogLog.hpp"
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define HLL_Q (64 - HLL_P) // hash bits left to count zeros in
+#define HLL_DENSE 0
+#define HLL_SPARSE 1
+#define HLL_SPARSE_MAX_VALUE 32
+#define HLL_ALPHA_INF 0.721347520444481703680
+
+// MurmurHash64A with the seed of Redis, so that the same elements land in
+// the same registers
+static uint64_t murmur_hash64a(std::string_view key) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  size_t len = key.length();
+  uint64_t h = 0xadc83b19ULL ^ (len * m);
+  const auto *data = reinterpret_cast<const uint8_t *>(key.data());
+  const uint8_t *end = data + (len - (len & 7));
+  for (; data != end; data += 8) {
+    uint64_t k = 0;
+    for (int b = 7; b >= 0; --b)
+      k = k << 8 | data[b];
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  switch (len & 7) {
+  case 7:
+    h ^= uint64_t(data[6]) << 48;
+    [[fallthrough]];
+  case 6:
+    h ^= uint64_t(data[5]) << 40;
+    [[fallthrough]];
+  case 5:
+    h ^= uint64_t(data[4]) << 32;
+    [[fallthrough]];
+  case 4:
+    h ^= uint64_t(data[3]) << 24;
+    [[fallthrough]];
+  case 3:
+    h ^= uint64_t(data[2]) << 16;
+    [[fallthrough]];
+  case 2:
+    h ^= uint64_t(data[1]) << 8;
+    [[fallthrough]];
+  case 1:
+    h ^= uint64_t(data[0]);
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// Register of element and the count to put in it
+static void hll_position(std::string_view element, uint32_t &index,
+                         uint8_t &count) {
+  uint64_t hash = murmur_hash64a(element);
+  index = hash & (HLL_REGISTERS - 1);
+  hash >>= HLL_P;
+  hash |= uint64_t(1) << HLL_Q; // at most HLL_Q + 1
+  count = __builtin_ctzll(hash) + 1;
+}
+
+// Dense registers come in groups of 4 in 3 bytes
+static uint8_t dense_get(const uint8_t *p, uint32_t index) {
+  const uint8_t *b = p + index / 4 * 3;
+  switch (index & 3) {
+  case 0:
+    return b[0] & 63;
+  case 1:
+    return (b[0] >> 6 | b[1] << 2) & 63;
+  case 2:
+    return (b[1] >> 4 | b[2] << 4) & 63;
+  default:
+    return b[2] >> 2;
+  }
+}
+
+static void dense_set(uint8_t *p, uint32_t index, uint8_t value) {
+  uint8_t *b = p + index / 4 * 3;
+  switch (index & 3) {
+  case 0:
+    b[0] = (b[0] & ~63) | value;
+    break;
+  case 1:
+    b[0] = (b[0] & 63) | value << 6;
+    b[1] = (b[1] & ~15) | value >> 2;
+    break;
+  case 2:
+    b[1] = (b[1] & 15) | value << 4;
+    b[2] = (b[2] & ~3) | value >> 4;
+    break;
+  default:
+    b[2] = (b[2] & 3) | value << 2;
+  }
+}
+
+static void dense_unpack(const uint8_t *p, uint8_t *registers) {
+  for (uint32_t group = 0; group < HLL_REGISTERS / 4; ++group, p += 3) {
+    uint8_t *r = registers + group * 4;
+    r[0] = p[0] & 63;
+    r[1] = (p[0] >> 6 | p[1] << 2) & 63;
+    r[2] = (p[1] >> 4 | p[2] << 4) & 63;
+    r[3] = p[2] >> 2;
+  }
+}
+
+struct SparseRun {
+  uint8_t value;
+  uint32_t len;
+};
+
+// Decodes the opcodes of a sparse value, false unless they are well formed
+// and cover every register exactly
+static bool sparse_runs(std::string_view value, std::vector<SparseRun> &runs) {
+  const auto *p = reinterpret_cast<const uint8_t *>(value.data());
+  const uint8_t *end = p + value.length();
+  uint32_t total = 0;
+  for (p += HLL_HEADER_SIZE; p < end; ++p) {
+    SparseRun run;
+    if ((*p & 0xc0) == 0x00) {
+      run = {0, uint32_t(*p & 63) + 1};
+    } else if ((*p & 0xc0) == 0x40) {
+      if (p + 1 == end)
+        return false;
+      run = {0, (uint32_t(*p & 63) << 8 | p[1]) + 1};
+      ++p;
+    } else {
+      run = {uint8_t((*p >> 2 & 31) + 1), uint32_t(*p & 3) + 1};
+    }
+    total += run.len;
+    if (total > HLL_REGISTERS)
+      return false;
+    if (!runs.empty() && runs.back().value == run.value)
+      runs.back().len += run.len;
+    else
+      runs.push_back(run);
+  }
+  return total == HLL_REGISTERS;
+}
+
+static void sparse_encode(const std::vector<SparseRun> &runs,
+                          std::string &out) {
+  for (SparseRun run : runs) {
+    while (run.len > 0) {
+      uint32_t len;
+      if (run.value == 0 && run.len > 64) {
+        len = std::min<uint32_t>(run.len, 16384);
+        out += char(0x40 | (len - 1) >> 8);
+        out += char((len - 1) & 0xff);
+      } else if (run.value == 0) {
+        len = run.len;
+        out += char(len - 1);
+      } else {
+        len = std::min<uint32_t>(run.len, 4);
+        out += char(0x80 | (run.value - 1) << 2 | (len - 1));
+      }
+      run.len -= len;
+    }
+  }
+}
+
+void hll_invalidate(char *buf) { buf[15] |= char(0x80); }
+
+void hll_set_cached(char *buf, uint64_t cardinality) {
+  for (int b = 0; b < 8; ++b)
+    buf[8 + b] = char(cardinality >> (8 * b));
+}
+
+bool hll_cached(std::string_view value, uint64_t &cardinality) {
+  const auto *card = reinterpret_cast<const uint8_t *>(value.data()) + 8;
+  if (card[7] & 0x80)
+    return false;
+  cardinality = 0;
+  for (int b = 7; b >= 0; --b)
+    cardinality = cardinality << 8 | card[b];
+  return true;
+}
+
+std::string hll_create() {
+  std::string value("HYLL", 4);
+  value += char(HLL_SPARSE);
+  value.append(11, '\0');
+  sparse_encode({{0, HLL_REGISTERS}}, value);
+  return value;
+}
+
+bool hll_is_valid(std::string_view value) {
+  if (value.length() < HLL_HEADER_SIZE || value.substr(0, 4) != "HYLL")
+    return false;
+  if (value[4] == HLL_DENSE)
+    return value.length() == HLL_DENSE_SIZE;
+  return value[4] == HLL_SPARSE;
+}
+
+std::string hll_dense_value(const uint8_t *registers) {
+  std::string value(HLL_DENSE_SIZE, '\0');
+  memcpy(value.data(), "HYLL", 4);
+  value[4] = HLL_DENSE;
+  hll_invalidate(value.data());
+  auto *p = reinterpret_cast<uint8_t *>(value.data()) + HLL_HEADER_SIZE;
+  for (uint32_t group = 0; group < HLL_REGISTERS / 4; ++group, p += 3) {
+    const uint8_t *r = registers + group * 4;
+    p[0] = r[0] | r[1] << 6;
+    p[1] = r[1] >> 2 | r[2] << 4;
+    p[2] = r[2] >> 4 | r[3] << 2;
+  }
+  return value;
+}
+
+bool hll_registers(std::string_view value, uint8_t *registers) {
+  const auto *p = reinterpret_cast<const uint8_t *>(value.data());
+  if (value[4] == HLL_DENSE) {
+    dense_unpack(p + HLL_HEADER_SIZE, registers);
+    return true;
+  }
+  std::vector<SparseRun> runs;
+  if (!sparse_runs(value, runs))
+    return false;
+  for (const SparseRun &run : runs) {
+    memset(registers, run.value, run.len);
+    registers += run.len;
+  }
+  return true;
+}
+
+bool hll_dense_add(char *buf, std::string_view element) {
+  uint32_t index;
+  uint8_t count;
+  hll_position(element, index, count);
+  auto *registers = reinterpret_cast<uint8_t *>(buf) + HLL_HEADER_SIZE;
+  if (dense_get(registers, index) >= count)
+    return false;
+  dense_set(registers, index, count);
+  hll_invalidate(buf);
+  return true;
+}
+
+int hll_add(std::string &value, std::string_view element) {
+  if (value[4] == HLL_DENSE)
+    return hll_dense_add(value.data(), element);
+
+  uint32_t index;
+  uint8_t count;
+  hll_position(element, index, count);
+  std::vector<SparseRun> runs;
+  if (!sparse_runs(value, runs))
+    return -1;
+  size_t n = 0;
+  uint32_t start = 0;
+  while (start + runs[n].len <= index)
+    start += runs[n++].len;
+  if (runs[n].value >= count)
+    return 0;
+
+  if (count <= HLL_SPARSE_MAX_VALUE) {
+    // Split the run around the register and merge it with equal neighbours
+    SparseRun run = runs[n];
+    std::vector<SparseRun> split;
+    if (index > start)
+      split.push_back({run.value, index - start});
+    split.push_back({count, 1});
+    if (start + run.len > index + 1)
+      split.push_back({run.value, start + run.len - index - 1});
+    runs.erase(runs.begin() + n);
+    runs.insert(runs.begin() + n, split.begin(), split.end());
+    std::vector<SparseRun> merged;
+    for (const SparseRun &r : runs)
+      if (!merged.empty() && merged.back().value == r.value)
+        merged.back().len += r.len;
+      else
+        merged.push_back(r);
+    std::string sparse = value.substr(0, HLL_HEADER_SIZE);
+    sparse_encode(merged, sparse);
+    if (sparse.length() <= HLL_SPARSE_MAX_BYTES) {
+      value = std::move(sparse);
+      hll_invalidate(value.data());
+      return 1;
+    }
+  }
+  // Too big or too high a count for the sparse encoding
+  uint8_t registers[HLL_REGISTERS];
+  hll_registers(value, registers);
+  registers[index] = count;
+  value = hll_dense_value(registers);
+  return 1;
+}
+
+static void merge_scalar(uint8_t *registers, const uint8_t *other) {
+  for (size_t i = 0; i < HLL_REGISTERS; ++i)
+    registers[i] = std::max(registers[i], other[i]);
+}
+
+static uint64_t sum_scalar(const uint8_t *registers, uint32_t &zeros,
+                           uint32_t &saturated) {
+  uint64_t sum = 0;
+  zeros = saturated = 0;
+  for (size_t i = 0; i < HLL_REGISTERS; ++i) {
+    uint8_t r = registers[i];
+    if (r == 0)
+      ++zeros;
+    else if (r <= HLL_Q)
+      sum += uint64_t(1) << (HLL_Q - r);
+    else if (r == HLL_Q + 1)
+      ++saturated;
+  }
+  return sum;
+}
+
+const HllKernels hll_scalar = {"scalar", merge_scalar, sum_scalar};
+
+#if defined(__x86_64__)
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+AVX2_TARGET static void merge_avx2(uint8_t *registers, const uint8_t *other) {
+  for (size_t i = 0; i < HLL_REGISTERS; i += 32) {
+    auto *dst = reinterpret_cast<__m256i *>(registers + i);
+    __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(other + i));
+    _mm256_storeu_si256(dst, _mm256_max_epu8(_mm256_loadu_si256(dst), b));
+  }
+}
+
+// 2^(50 - r) for 4 registers at a time with a variable shift, which gives 0
+// for the registers above 50. The registers at 0 add 2^50 each, taken out at
+// the end: the sum wraps but the result fits in 64 bits.
+AVX2_TARGET static uint64_t sum_avx2(const uint8_t *registers, uint32_t &zeros,
+                                     uint32_t &saturated) {
+  const __m256i q = _mm256_set1_epi64x(HLL_Q);
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i top = _mm256_set1_epi8(HLL_Q + 1);
+  __m256i sum = _mm256_setzero_si256();
+  zeros = saturated = 0;
+  for (size_t i = 0; i < HLL_REGISTERS; i += 32) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(registers + i));
+    zeros += _mm_popcnt_u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+    saturated +=
+        _mm_popcnt_u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, top)));
+    for (size_t j = 0; j < 32; j += 4) {
+      int32_t four;
+      memcpy(&four, registers + i + j, sizeof(four));
+      __m256i r = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four));
+      sum = _mm256_add_epi64(
+          sum, _mm256_sllv_epi64(one, _mm256_sub_epi64(q, r)));
+    }
+  }
+  // The lanes can go past INT64_MAX, add them unsigned
+  uint64_t total = uint64_t(_mm256_extract_epi64(sum, 0)) +
+                   uint64_t(_mm256_extract_epi64(sum, 1)) +
+                   uint64_t(_mm256_extract_epi64(sum, 2)) +
+                   uint64_t(_mm256_extract_epi64(sum, 3));
+  return total - (uint64_t(zeros) << HLL_Q);
+}
+
+static const HllKernels hll_avx2 = {"avx2", merge_avx2, sum_avx2};
+
+static const HllKernels &detect_kernels() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    return hll_avx2;
+  return hll_scalar;
+}
+
+const HllKernels &hll_kernels() {
+  static const HllKernels &kernels = detect_kernels();
+  return kernels;
+}
+
+#else
+
+const HllKernels &hll_kernels() { return hll_scalar; }
+
+#endif
+
+// Ertl's sigma and tau ("New cardinality estimation algorithms for
+// HyperLogLog sketches"), as in Redis
+static double hll_sigma(double x) {
+  if (x == 1.0)
+    return INFINITY;
+  double z_prime, y = 1, z = x;
+  do {
+    x *= x;
+    z_prime = z;
+    z += x * y;
+    y += y;
+  } while (z_prime != z);
+  return z;
+}
+
+static double hll_tau(double x) {
+  if (x == 0.0 || x == 1.0)
+    return 0.0;
+  double z_prime, y = 1.0, z = 1 - x;
+  do {
+    x = std::sqrt(x);
+    z_prime = z;
+    y *= 0.5;
+    z -= std::pow(1 - x, 2) * y;
+  } while (z_prime != z);
+  return z / 3;
+}
+
+uint64_t hll_estimate(const uint8_t *registers) {
+  const double m = HLL_REGISTERS;
+  uint32_t zeros, saturated;
+  uint64_t sum = hll_kernels().sum(registers, zeros, saturated);
+  double z = std::ldexp(m * hll_tau((m - saturated) / m) + double(sum), -HLL_Q);
+  z += m * hll_sigma(zeros / m);
+  return std::llround(HLL_ALPHA_INF * m * m / z);
+}
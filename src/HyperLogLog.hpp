@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+HyperLogLog values (PFADD, PFCOUNT, PFMERGE) are plain strings in the format
+of Redis, so that they survive DUMP/RESTORE and RDB files both ways:
+
+  "HYLL" | encoding (0 dense, 1 sparse) | 3 unused | cached cardinality
+
+The cardinality is 8 bytes little endian, its top bit set when it is stale.
+16384 registers follow, each holding the longest run of zeros (plus one) seen
+in the hashes of the elements it got:
+  Dense   6 bits per register, least significant first: 12 KB
+  Sparse  run-length opcodes, for the few registers set of small counts
+            00xxxxxx           xxxxxx+1 zero registers
+            01xxxxxx yyyyyyyy  xxxxxxyyyyyyyy+1 zero registers
+            1vvvvvxx           xx+1 registers of value vvvvv+1
+A sparse value becomes dense for good once it would go over
+HLL_SPARSE_MAX_BYTES or a register over 32.
+
+Counting unpacks the registers to one byte each. The union of several values
+(PFMERGE, PFCOUNT of several keys) is their bytewise maximum, and the estimate
+(Ertl's improved estimator, like Redis) needs the sum of 2^-register. Both
+have a scalar and an AVX2 kernel, picked at startup like the bitmap ones.
+*/
+
+#define HLL_P 14
+#define HLL_REGISTERS (1 << HLL_P)
+#define HLL_HEADER_SIZE 16
+#define HLL_DENSE_SIZE (HLL_HEADER_SIZE + HLL_REGISTERS * 6 / 8)
+#define HLL_SPARSE_MAX_BYTES 3000
+
+struct HllKernels {
+  const char *name;
+  // registers = max(registers, other), bytewise over HLL_REGISTERS
+  void (*merge)(uint8_t *registers, const uint8_t *other);
+  // Sum of 2^(50 - r) over the registers r in [1, 50], exact, and the number
+  // of registers at 0 and above 50
+  uint64_t (*sum)(const uint8_t *registers, uint32_t &zeros,
+                  uint32_t &saturated);
+};
+
+extern const HllKernels hll_scalar;
+// The kernels for this CPU
+const HllKernels &hll_kernels();
+
+// An empty sparse value
+std::string hll_create();
+// Whether value has a HyperLogLog header and, when dense, its size
+bool hll_is_valid(std::string_view value);
+// Adds element to value, which may be rewritten as dense. Returns 1 if a
+// register changed, 0 if not, -1 if value is corrupt.
+int hll_add(std::string &value, std::string_view element);
+// Sets the register for element in the dense value at buf, in place
+bool hll_dense_add(char *buf, std::string_view element);
+// Unpacks the registers of value to one byte each, false if it is corrupt
+bool hll_registers(std::string_view value, uint8_t *registers);
+// A dense value holding registers, with no cached cardinality
+std::string hll_dense_value(const uint8_t *registers);
+// Cardinality estimate of unpacked registers
+uint64_t hll_estimate(const uint8_t *registers);
+// The cached cardinality of value, false when it is stale
+bool hll_cached(std::string_view value, uint64_t &cardinality);
+void hll_set_cached(char *buf, uint64_t cardinality);
+void hll_invalidate(char *buf);
@@ -0,0 +1,186 @@
+#include "HandleResponse.hpp"
+#include "HyperLogLog.hpp"
+#include <memory>
+
+bool HandleResponse::check_hll(std::string_view value) {
+  if (hll_is_valid(value))
+    return true;
+  reply("-WRONGTYPE Key is not a valid HyperLogLog string value.\r\n");
+  return false;
+}
+
+void HandleResponse::pfadd(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("PFADD");
+    return;
+  }
+  size_t first = i;
+  i = command_array.size();
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    std::string value = hll_create();
+    for (size_t arg = first; arg < command_array.size(); ++arg)
+      if (const std::string *element = arg_at(command_array, arg))
+        hll_add(value, *element);
+    config.db.insert(DB_Entry::create(config.db.allocator(), *key, value));
+    integer(1);
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+  DB_Entry::Scratch scratch;
+  std::string_view current = entry->str(scratch);
+  if (!check_hll(current))
+    return;
+
+  bool changed = false;
+  if (current[4] == 0) {
+    // Dense values keep their size, their registers are set in place
+    entry = make_room(config.db, entry, current.length());
+    for (size_t arg = first; arg < command_array.size(); ++arg)
+      if (const std::string *element = arg_at(command_array, arg))
+        changed |= hll_dense_add(entry->value.raw->buf, *element);
+    m_signal_keys = changed;
+    integer(changed);
+    return;
+  }
+  std::string value(current);
+  for (size_t arg = first; arg < command_array.size(); ++arg) {
+    const std::string *element = arg_at(command_array, arg);
+    if (element == nullptr)
+      continue;
+    int added = hll_add(value, *element);
+    if (added < 0) {
+      reply("-INVALIDOBJ Corrupted HLL object detected\r\n");
+      return;
+    }
+    changed |= added;
+  }
+  if (changed) {
+    entry = make_room(config.db, entry, value.length());
+    memcpy(entry->value.raw->buf, value.data(), value.length());
+    entry->value.raw->len = value.length();
+  }
+  m_signal_keys = changed;
+  integer(changed);
+}
+
+void HandleResponse::pfcount(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  size_t first = i;
+  i = command_array.size();
+  if (first >= command_array.size()) {
+    wrong_args("PFCOUNT");
+    return;
+  }
+  const std::string *key = arg_at(command_array, first);
+  if (key == nullptr) {
+    wrong_args("PFCOUNT");
+    return;
+  }
+  auto registers = std::make_unique<uint8_t[]>(HLL_REGISTERS);
+  DB_Entry::Scratch scratch;
+
+  // A single key answers from, or refreshes, its cached cardinality
+  if (first + 1 == command_array.size()) {
+    DB_Entry *entry = lookup_key(config, *key);
+    if (entry == nullptr) {
+      integer(0);
+      return;
+    }
+    if (!check_type(entry, ValueType::String))
+      return;
+    std::string_view value = entry->str(scratch);
+    if (!check_hll(value))
+      return;
+    uint64_t cardinality;
+    if (hll_cached(value, cardinality)) {
+      integer(cardinality);
+      return;
+    }
+    if (!hll_registers(value, registers.get())) {
+      reply("-INVALIDOBJ Corrupted HLL object detected\r\n");
+      return;
+    }
+    cardinality = hll_estimate(registers.get());
+    entry = make_room(config.db, entry, value.length());
+    hll_set_cached(entry->value.raw->buf, cardinality);
+    integer(cardinality);
+    return;
+  }
+
+  // Several keys count their union, without caching it
+  auto other = std::make_unique<uint8_t[]>(HLL_REGISTERS);
+  const HllKernels &kernels = hll_kernels();
+  for (size_t arg = first; arg < command_array.size(); ++arg) {
+    key = arg_at(command_array, arg);
+    if (key == nullptr)
+      continue;
+    DB_Entry *entry = lookup_key(config.partition_for(*key), *key);
+    if (entry == nullptr)
+      continue;
+    if (!check_type(entry, ValueType::String))
+      return;
+    std::string_view value = entry->str(scratch);
+    if (!check_hll(value))
+      return;
+    if (!hll_registers(value, other.get())) {
+      reply("-INVALIDOBJ Corrupted HLL object detected\r\n");
+      return;
+    }
+    kernels.merge(registers.get(), other.get());
+  }
+  integer(hll_estimate(registers.get()));
+}
+
+void HandleResponse::pfmerge(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  const std::string *dest = arg_at(command_array, i);
+  if (dest == nullptr) {
+    wrong_args("PFMERGE");
+    return;
+  }
+  size_t first = i;
+  i = command_array.size();
+
+  // The union of the destination and the sources, stored dense
+  auto registers = std::make_unique<uint8_t[]>(HLL_REGISTERS);
+  auto other = std::make_unique<uint8_t[]>(HLL_REGISTERS);
+  const HllKernels &kernels = hll_kernels();
+  DB_Entry::Scratch scratch;
+  for (size_t arg = first; arg < command_array.size(); ++arg) {
+    const std::string *key = arg_at(command_array, arg);
+    if (key == nullptr)
+      continue;
+    DB_Entry *entry = lookup_key(config.partition_for(*key), *key);
+    if (entry == nullptr)
+      continue;
+    if (!check_type(entry, ValueType::String))
+      return;
+    std::string_view value = entry->str(scratch);
+    if (!check_hll(value))
+      return;
+    if (!hll_registers(value, other.get())) {
+      reply("-INVALIDOBJ Corrupted HLL object detected\r\n");
+      return;
+    }
+    kernels.merge(registers.get(), other.get());
+  }
+
+  std::string merged = hll_dense_value(registers.get());
+  DB_Config &target = config.partition_for(*dest);
+  DB_Entry *entry = lookup_key(target, *dest);
+  if (entry == nullptr) {
+    target.db.insert(DB_Entry::create(target.db.allocator(), *dest, merged));
+  } else {
+    entry = make_room(target.db, entry, merged.length());
+    memcpy(entry->value.raw->buf, merged.data(), merged.length());
+    entry->value.raw->len = merged.length();
+  }
+  ok();
+}
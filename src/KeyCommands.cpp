@@ -0,0 +1,97 @@
+#include "HandleResponse.hpp"
+#include "LazyFree.hpp"
+#include <algorithm>
+#include <string>
+
+bool HandleResponse::delete_key(DB_Config &config, std::string_view key,
+                                bool lazy) {
+  DB_Entry *entry = config.db.unlink(key);
+  if (entry == nullptr)
+    return false;
+  if (lazy && config.lazy_free != nullptr)
+    config.lazy_free->release(config.partition, config.db.allocator(), entry);
+  else
+    DB_Entry::destroy(config.db.allocator(), entry);
+  return true;
+}
+
+void HandleResponse::del(size_t &i, const std::vector<RespData> &command_array,
+                         DB_Config &config) {
+  del_generic(i, command_array, config, config.lazyfree_lazy_user_del, "DEL");
+}
+
+// DEL that leaves big values to the lazy free thread
+void HandleResponse::unlink(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  del_generic(i, command_array, config, true, "UNLINK");
+}
+
+void HandleResponse::del_generic(size_t &i,
+                                 const std::vector<RespData> &command_array,
+                                 DB_Config &config, bool lazy,
+                                 const std::string &name) {
+  if (i >= command_array.size()) {
+    wrong_args(name);
+    return;
+  }
+  int64_t deleted = 0;
+  for (; i < command_array.size(); ++i) {
+    const std::string *key = arg_at(command_array, i);
+    if (key == nullptr)
+      continue;
+    DB_Config &partition = config.partition_for(*key);
+    if (find_key(partition, *key) != nullptr &&
+        delete_key(partition, *key, lazy)) {
+      signal_modified_key(partition, *key, &m_client);
+      ++deleted;
+    }
+  }
+  // Only the keys that existed were signalled
+  m_signal_keys = false;
+  integer(deleted);
+}
+
+void HandleResponse::flushall(size_t &i,
+                              const std::vector<RespData> &command_array,
+                              DB_Config &config) {
+  flush_generic(i, command_array, config, "FLUSHALL");
+}
+
+// There is a single database, FLUSHDB is FLUSHALL
+void HandleResponse::flushdb(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  flush_generic(i, command_array, config, "FLUSHDB");
+}
+
+void HandleResponse::flush_generic(size_t &i,
+                                   const std::vector<RespData> &command_array,
+                                   DB_Config &config,
+                                   const std::string &name) {
+  bool lazy = config.lazyfree_lazy_user_flush;
+  if (const std::string *arg = arg_at(command_array, i)) {
+    std::string mode = *arg;
+    std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+    if (mode != "ASYNC" && mode != "SYNC") {
+      error("syntax error");
+      return;
+    }
+    lazy = mode == "ASYNC";
+    ++i;
+  }
+  if (i < command_array.size()) {
+    wrong_args(name);
+    return;
+  }
+  for (DB_Config *partition : config.all_partitions()) {
+    partition->key_versions.touch_all();
+    partition->tracking.invalidate_all(partition->pending_writes);
+    if (lazy && partition->lazy_free != nullptr)
+      partition->lazy_free->release(partition->partition,
+                                    partition->db.detach());
+    else
+      partition->db.clear();
+  }
+  ok();
+}
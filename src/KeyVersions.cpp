@@ -0,0 +1,29 @@
+#include "KeyVersions.hpp"
+
+uint64_t KeyVersions::watch(const std::string &key) {
+  Counter &counter = m_keys[key];
+  ++counter.watchers;
+  return counter.version;
+}
+
+void KeyVersions::unwatch(const std::string &key) {
+  auto it = m_keys.find(key);
+  if (it != m_keys.end() && --it->second.watchers == 0)
+    m_keys.erase(it);
+}
+
+uint64_t KeyVersions::version(const std::string &key) const {
+  auto it = m_keys.find(key);
+  return it == m_keys.end() ? 0 : it->second.version;
+}
+
+void KeyVersions::touch_all() {
+  for (auto &[key, counter] : m_keys)
+    ++counter.version;
+}
+
+void KeyVersions::bump(std::string_view key) {
+  auto it = m_keys.find(std::string(key));
+  if (it != m_keys.end())
+    ++it->second.version;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+Version counters for the keys clients WATCH. Every write bumps the version of
+the keys it touches, and EXEC only compares the versions a client saw when it
+watched its keys with the current ones: O(watched keys), values are never
+compared. Only watched keys have a counter, so writes cost a single emptiness
+check while nobody watches anything.
+*/
+class KeyVersions {
+public:
+  // Starts tracking key for one more watcher, returns its current version
+  uint64_t watch(const std::string &key);
+  void unwatch(const std::string &key);
+  uint64_t version(const std::string &key) const;
+
+  void touch(std::string_view key) {
+    if (!m_keys.empty())
+      bump(key);
+  }
+  // Every key changed, as on FLUSHALL
+  void touch_all();
+
+private:
+  struct Counter {
+    uint64_t version;
+    size_t watchers;
+  };
+  std::unordered_map<std::string, Counter> m_keys;
+
+  void bump(std::string_view key);
+};
@@ -0,0 +1,64 @@
+#include "LazyFree.hpp"
+
+LazyFree::LazyFree(size_t producers) {
+  for (size_t p = 0; p < producers; ++p)
+    m_queues.push_back(std::make_unique<Queue>());
+  m_thread = std::thread(&LazyFree::run, this);
+}
+
+LazyFree::~LazyFree() {
+  m_stop.store(true);
+  m_pending.fetch_add(1);
+  m_pending.notify_one();
+  m_thread.join();
+}
+
+void LazyFree::release(size_t producer, SlabAllocator &alloc,
+                       DB_Entry *entry) {
+  if (!entry->has_raw() &&
+      entry->free_effort() > THRESHOLD &&
+      push(producer, {entry->encoding, entry->value.object, nullptr})) {
+    // The entry keeps nothing to free but itself
+    entry->encoding = Encoding::Int;
+  }
+  DB_Entry::destroy(alloc, entry);
+}
+
+void LazyFree::release(size_t producer, std::unique_ptr<Dict> dict) {
+  if (dict->size() <= THRESHOLD)
+    return;
+  if (push(producer, {Encoding::Int, nullptr, dict.get()}))
+    dict.release();
+}
+
+bool LazyFree::push(size_t producer, const Job &job) {
+  if (!m_queues[producer]->push(job))
+    return false;
+  // Counted once queued, so the thread finds whatever it is told about
+  if (m_pending.fetch_add(1) == 0)
+    m_pending.notify_one();
+  return true;
+}
+
+void LazyFree::free_job(const Job &job) {
+  if (job.dict != nullptr)
+    delete job.dict;
+  else
+    DB_Entry::free_object(job.encoding, job.object);
+}
+
+void LazyFree::run() {
+  while (true) {
+    m_pending.wait(0);
+    Job job;
+    for (auto &queue : m_queues)
+      while (queue->pop(job)) {
+        free_job(job);
+        m_freed.fetch_add(1, std::memory_order_relaxed);
+        m_pending.fetch_sub(1);
+      }
+    // What was queued before the stop is freed first
+    if (m_stop.load() && m_pending.load() == 1)
+      return;
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "DB_Entry.hpp"
+#include "Dict.hpp"
+#include "SPSCQueue.hpp"
+
+/*
+Background freeing of big values (lazy free). UNLINK, FLUSHALL/FLUSHDB ASYNC
+and, with --lazyfree-lazy-expire, expiry take the value out of the keyspace in
+O(1) and queue it to a thread that frees it, so the event loop never stalls
+walking a list of millions of nodes or a keyspace of millions of keys.
+
+Only values that take more than THRESHOLD allocations to free are queued. They
+are aggregates, whose memory comes from malloc (see ObjectAlloc.hpp) and may be
+freed by any thread; the entry itself and string buffers live in the
+partition's slab allocator and are released inline, which is O(1) anyway. A
+flushed keyspace goes as a whole Dict, slab allocator included, which nothing
+else touches once it is queued.
+
+Every partition has its own SPSC queue to the thread. A value that finds its
+queue full is freed inline.
+*/
+class LazyFree {
+public:
+  static constexpr size_t THRESHOLD = 64;
+
+  // producers: partitions that queue values, each with its own index
+  explicit LazyFree(size_t producers);
+  ~LazyFree();
+  LazyFree(const LazyFree &) = delete;
+  LazyFree &operator=(const LazyFree &) = delete;
+
+  // Destroys entry, already out of the keyspace, leaving its value to the
+  // thread if it is big
+  void release(size_t producer, SlabAllocator &alloc, DB_Entry *entry);
+  // Frees dict and every key in it on the thread
+  void release(size_t producer, std::unique_ptr<Dict> dict);
+
+  size_t pending() const { return m_pending.load(std::memory_order_relaxed); }
+  size_t freed() const { return m_freed.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t QUEUE_SIZE = 1024;
+
+  // An aggregate value, or a whole keyspace when dict is set
+  struct Job {
+    Encoding encoding;
+    void *object;
+    Dict *dict;
+  };
+  typedef SPSCQueue<Job, QUEUE_SIZE> Queue;
+
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  // Jobs queued and not freed yet, the thread sleeps on it
+  std::atomic<size_t> m_pending{0};
+  std::atomic<size_t> m_freed{0};
+  std::atomic<bool> m_stop{false};
+  std::thread m_thread;
+
+  bool push(size_t producer, const Job &job);
+  static void free_job(const Job &job);
+  void run();
+};
@@ -0,0 +1,354 @@
+#include "Clock.hpp"
+#include "HandleResponse.hpp"
+#include "Quicklist.hpp"
+#include "ZSet.hpp"
+#include <cmath>
+#include <string>
+
+static Quicklist *list_of(DB_Entry *entry) {
+  return static_cast<Quicklist *>(entry->value.object);
+}
+
+void HandleResponse::list_push(size_t &i,
+                               const std::vector<RespData> &command_array,
+                               DB_Config &config, bool head,
+                               const std::string &name) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr || i >= command_array.size()) {
+    wrong_args(name);
+    return;
+  }
+  for (size_t arg = i; arg < command_array.size(); ++arg)
+    if (arg_at(command_array, arg) == nullptr) {
+      wrong_args(name);
+      return;
+    }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    auto *list = new Quicklist(config.list_compress_depth);
+    entry = DB_Entry::create_object(config.db.allocator(), *key,
+                                    ValueType::List, Encoding::Quicklist, list);
+    config.db.insert(entry);
+  } else if (!check_type(entry, ValueType::List)) {
+    return;
+  }
+
+  Quicklist *list = list_of(entry);
+  for (; i < command_array.size(); ++i) {
+    const std::string &value = std::get<std::string>(command_array[i].value);
+    if (head)
+      list->push_head(value);
+    else
+      list->push_tail(value);
+  }
+  integer(list->length());
+  config.blocking.signal_ready(*key);
+}
+
+void HandleResponse::list_pop(size_t &i,
+                              const std::vector<RespData> &command_array,
+                              DB_Config &config, bool head,
+                              const std::string &name) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args(name);
+    return;
+  }
+  // Without a count the reply is a single bulk string, with it an array
+  int64_t count = 1;
+  bool has_count = false;
+  if (const std::string *count_arg = arg_at(command_array, i)) {
+    ++i;
+    has_count = true;
+    if (!string_to_int64(*count_arg, count) || count < 0) {
+      error("value is out of range, must be positive");
+      return;
+    }
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    m_signal_keys = false;
+    if (has_count)
+      null_array();
+    else
+      null();
+    return;
+  }
+  if (!check_type(entry, ValueType::List))
+    return;
+
+  Quicklist *list = list_of(entry);
+  count = std::min<int64_t>(count, list->length());
+  m_signal_keys = count > 0;
+  std::string response;
+  if (has_count)
+    append_array_len(response, count);
+  std::string value;
+  for (int64_t n = 0; n < count; ++n) {
+    if (head)
+      list->pop_head(value);
+    else
+      list->pop_tail(value);
+    append_bulk(response, value);
+  }
+  // Empty lists do not exist
+  if (list->length() == 0)
+    config.db.erase(*key);
+  reply(response);
+}
+
+void HandleResponse::lpush(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  list_push(i, command_array, config, true, "LPUSH");
+}
+
+void HandleResponse::rpush(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  list_push(i, command_array, config, false, "RPUSH");
+}
+
+void HandleResponse::lpop(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  list_pop(i, command_array, config, true, "LPOP");
+}
+
+void HandleResponse::rpop(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  list_pop(i, command_array, config, false, "RPOP");
+}
+
+void HandleResponse::lrange(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *start_arg = arg_at(command_array, i++);
+  const std::string *stop_arg = arg_at(command_array, i++);
+  if (key == nullptr || start_arg == nullptr || stop_arg == nullptr) {
+    wrong_args("LRANGE");
+    return;
+  }
+  int64_t start, stop;
+  if (!string_to_int64(*start_arg, start) ||
+      !string_to_int64(*stop_arg, stop)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    reply("*0\r\n");
+    return;
+  }
+  if (!check_type(entry, ValueType::List))
+    return;
+
+  Quicklist *list = list_of(entry);
+  int64_t len = list->length();
+  // Negative indexes count from the tail, out of range ones are clamped
+  if (start < 0)
+    start = std::max<int64_t>(len + start, 0);
+  if (stop < 0)
+    stop = len + stop;
+  if (stop >= len)
+    stop = len - 1;
+  if (start > stop || start >= len) {
+    reply("*0\r\n");
+    return;
+  }
+
+  std::string response;
+  append_array_len(response, stop - start + 1);
+  list->range(start, stop, [&response](std::string_view value) {
+    append_bulk(response, value);
+  });
+  reply(response);
+}
+
+void HandleResponse::llen(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("LLEN");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::List))
+    return;
+  integer(list_of(entry)->length());
+}
+
+void HandleResponse::lindex(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *index_arg = arg_at(command_array, i++);
+  if (key == nullptr || index_arg == nullptr) {
+    wrong_args("LINDEX");
+    return;
+  }
+  int64_t index;
+  if (!string_to_int64(*index_arg, index)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    null();
+    return;
+  }
+  if (!check_type(entry, ValueType::List))
+    return;
+  std::string value;
+  if (!list_of(entry)->index(index, value)) {
+    null();
+    return;
+  }
+  bulk(value);
+}
+
+void HandleResponse::pop_to_reply(DB_Config &config, DB_Entry *entry,
+                                  const std::string &key, bool head,
+                                  const Client *writer,
+                                  std::string &response) {
+  Quicklist *list = list_of(entry);
+  std::string value;
+  if (head)
+    list->pop_head(value);
+  else
+    list->pop_tail(value);
+  append_array_len(response, 2);
+  append_bulk(response, key);
+  append_bulk(response, value);
+  // Empty lists do not exist
+  if (list->length() == 0)
+    config.db.erase(key);
+  signal_modified_key(config, key, writer);
+}
+
+// BLPOP/BRPOP key [key ...] timeout: pops from the first non-empty list, or
+// parks the client until one of the keys gets elements
+void HandleResponse::blocking_pop(size_t &i,
+                                  const std::vector<RespData> &command_array,
+                                  DB_Config &config, bool head,
+                                  const std::string &name) {
+  if (command_array.size() < i + 2) {
+    wrong_args(name);
+    return;
+  }
+  std::vector<std::string> keys;
+  for (; i + 1 < command_array.size(); ++i) {
+    const std::string *key = arg_at(command_array, i);
+    if (key == nullptr) {
+      wrong_args(name);
+      return;
+    }
+    keys.push_back(*key);
+  }
+  const std::string *timeout_arg = arg_at(command_array, i++);
+  double timeout;
+  if (timeout_arg == nullptr || !parse_score(*timeout_arg, timeout) ||
+      std::isinf(timeout)) {
+    error("timeout is not a float or out of range");
+    return;
+  }
+  if (timeout < 0) {
+    error("timeout is negative");
+    return;
+  }
+
+  // With --threads a client only waits on the keys of its own partition, a
+  // transaction runs with every partition at hand
+  if (!m_exec)
+    for (const std::string &key : keys)
+      if (config.partition_of(key) != config.partition) {
+        if (m_client.subscriptions() > 0)
+          error("blocking on keys of another thread is not allowed while "
+                "subscribed");
+        else
+          reply("-CROSSSLOT Keys in request don't hash to the same "
+                "partition\r\n");
+        return;
+      }
+  for (const std::string &key : keys) {
+    DB_Config &partition = config.partition_for(key);
+    DB_Entry *entry = lookup_key(partition, key);
+    if (entry == nullptr)
+      continue;
+    if (!check_type(entry, ValueType::List))
+      return;
+    std::string response;
+    pop_to_reply(partition, entry, key, head, &m_client, response);
+    reply(response);
+    return;
+  }
+  // A transaction can not wait
+  if (m_exec) {
+    null_array();
+    return;
+  }
+  uint64_t deadline = 0;
+  if (timeout > 0)
+    deadline = Clock::now_ms() +
+               std::max<uint64_t>(1, static_cast<uint64_t>(timeout * 1000));
+  config.blocking.block(&m_client, keys, head, deadline, Clock::now_ms());
+}
+
+void HandleResponse::blpop(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  blocking_pop(i, command_array, config, true, "BLPOP");
+}
+
+void HandleResponse::brpop(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  blocking_pop(i, command_array, config, false, "BRPOP");
+}
+
+void HandleResponse::handle_blocked_clients(DB_Config &config,
+                                            uint64_t now_ms,
+                                            std::vector<Client *> &unblocked) {
+  finish_migrations(config, unblocked);
+  std::vector<Client *> timed_out;
+  config.blocking.expire(now_ms, timed_out);
+  for (Client *client : timed_out) {
+    std::string response;
+    append_null_array(response, client->protocol);
+    config.blocking.unblock(client);
+    client->push(std::make_shared<const std::string>(std::move(response)),
+                 config.pending_writes);
+    unblocked.push_back(client);
+  }
+
+  // Waiters are served in the order they blocked, as long as the list lasts.
+  // Lists and streams are never spilled.
+  for (const std::string &key : config.blocking.take_ready()) {
+    while (const std::list<Client *> *waiters = config.blocking.waiters(key)) {
+      DB_Entry *entry = find_key(config, key);
+      if (entry != nullptr && entry->type == ValueType::Stream)
+        serve_stream_waiters(config, entry, key, unblocked);
+      if (entry == nullptr || entry->type != ValueType::List)
+        break;
+      auto it = std::find_if(waiters->begin(), waiters->end(),
+                             [](Client *c) { return c->blocked_ids.empty(); });
+      if (it == waiters->end())
+        break;
+      Client *client = *it;
+      std::string response;
+      pop_to_reply(config, entry, key, client->blocked_head, client, response);
+      config.blocking.unblock(client);
+      client->push(std::make_shared<const std::string>(std::move(response)),
+                   config.pending_writes);
+      unblocked.push_back(client);
+    }
+  }
+}
@@ -0,0 +1,394 @@
+#include "Listpack.hpp"
+#include "DB_Entry.hpp"
+#include "ObjectAlloc.hpp"
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+
+#define LP_COUNT_UNKNOWN 65535
+
+static uint32_t read_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void write_u32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint16_t read_u16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+
+static void write_u16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+// Size of <encoding+data> of the element at p
+static uint32_t entry_size(const uint8_t *p) {
+  uint8_t b = p[0];
+  if ((b & 0x80) == 0) // 7 bit uint
+    return 1;
+  if ((b & 0xC0) == 0x80) // 6 bit string length
+    return 1 + (b & 0x3F);
+  if ((b & 0xE0) == 0xC0) // 13 bit int
+    return 2;
+  if ((b & 0xF0) == 0xE0) // 12 bit string length
+    return 2 + (((b & 0x0F) << 8) | p[1]);
+  switch (b) {
+  case 0xF0: // 32 bit string length
+    return 5 + read_u32(p + 1);
+  case 0xF1:
+    return 3;
+  case 0xF2:
+    return 4;
+  case 0xF3:
+    return 5;
+  case 0xF4:
+    return 9;
+  }
+  return 0;
+}
+
+static uint32_t backlen_size(uint32_t l) {
+  if (l <= 127)
+    return 1;
+  if (l < 16383)
+    return 2;
+  if (l < 2097151)
+    return 3;
+  if (l < 268435455)
+    return 4;
+  return 5;
+}
+
+// Most significant group first, every byte but the first flagged with 128,
+// so that it can be decoded starting from the last byte
+static uint32_t encode_backlen(uint8_t *buf, uint32_t l) {
+  uint32_t n = backlen_size(l);
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t shift = 7 * (n - 1 - i);
+    buf[i] = ((l >> shift) & 127) | (i ? 128 : 0);
+  }
+  return n;
+}
+
+// p points at the last byte of a backlen
+static uint32_t decode_backlen(const uint8_t *p) {
+  uint32_t val = 0;
+  uint32_t shift = 0;
+  while (true) {
+    val |= static_cast<uint32_t>(p[0] & 127) << shift;
+    if (!(p[0] & 128))
+      break;
+    shift += 7;
+    --p;
+    if (shift > 28)
+      return UINT32_MAX;
+  }
+  return val;
+}
+
+static uint32_t element_size(const uint8_t *p) {
+  uint32_t l = entry_size(p);
+  return l + backlen_size(l);
+}
+
+// Encodes value as <encoding+data> into buf (at least 9 bytes, or 5 bytes
+// plus the string length) and returns its size
+static uint32_t encode_entry(uint8_t *buf, std::string_view value) {
+  int64_t v;
+  if (string_to_int64(value, v)) {
+    if (v >= 0 && v <= 127) {
+      buf[0] = v;
+      return 1;
+    }
+    if (v >= -4096 && v <= 4095) {
+      uint64_t u = v < 0 ? (1 << 13) + v : v;
+      buf[0] = (u >> 8) | 0xC0;
+      buf[1] = u & 0xFF;
+      return 2;
+    }
+    int bytes;
+    if (v >= INT16_MIN && v <= INT16_MAX) {
+      buf[0] = 0xF1;
+      bytes = 2;
+    } else if (v >= -(1 << 23) && v <= (1 << 23) - 1) {
+      buf[0] = 0xF2;
+      bytes = 3;
+    } else if (v >= INT32_MIN && v <= INT32_MAX) {
+      buf[0] = 0xF3;
+      bytes = 4;
+    } else {
+      buf[0] = 0xF4;
+      bytes = 8;
+    }
+    uint64_t u = static_cast<uint64_t>(v);
+    for (int i = 0; i < bytes; ++i)
+      buf[1 + i] = u >> (8 * i);
+    return 1 + bytes;
+  }
+
+  uint32_t len = value.length();
+  uint32_t header;
+  if (len < 64) {
+    buf[0] = 0x80 | len;
+    header = 1;
+  } else if (len < 4096) {
+    buf[0] = 0xE0 | (len >> 8);
+    buf[1] = len & 0xFF;
+    header = 2;
+  } else {
+    buf[0] = 0xF0;
+    write_u32(buf + 1, len);
+    header = 5;
+  }
+  memcpy(buf + header, value.data(), len);
+  return header + len;
+}
+
+size_t Listpack::encoded_size(std::string_view value) {
+  int64_t v;
+  uint32_t l;
+  if (string_to_int64(value, v)) {
+    uint8_t buf[9];
+    l = encode_entry(buf, value);
+  } else {
+    size_t len = value.length();
+    l = len + (len < 64 ? 1 : len < 4096 ? 2 : 5);
+  }
+  return l + backlen_size(l);
+}
+
+uint8_t *Listpack::create() {
+  auto *lp = static_cast<uint8_t *>(object_alloc(HEADER_SIZE + 1));
+  write_u32(lp, HEADER_SIZE + 1);
+  write_u16(lp + 4, 0);
+  lp[HEADER_SIZE] = EOF_BYTE;
+  return lp;
+}
+
+void Listpack::free(uint8_t *lp) {
+  if (lp != nullptr)
+    object_free(lp, bytes(lp));
+}
+
+uint32_t Listpack::bytes(const uint8_t *lp) { return read_u32(lp); }
+
+uint32_t Listpack::length(const uint8_t *lp) {
+  uint32_t count = read_u16(lp + 4);
+  if (count != LP_COUNT_UNKNOWN)
+    return count;
+  count = 0;
+  for (const uint8_t *p = lp + HEADER_SIZE; *p != EOF_BYTE;
+       p += element_size(p))
+    ++count;
+  return count;
+}
+
+static void add_count(uint8_t *lp, long delta) {
+  uint32_t count = read_u16(lp + 4);
+  if (count == LP_COUNT_UNKNOWN)
+    count = Listpack::length(lp) - delta;
+  count += delta;
+  write_u16(lp + 4, count < LP_COUNT_UNKNOWN ? count : LP_COUNT_UNKNOWN);
+}
+
+uint8_t *Listpack::first(uint8_t *lp) {
+  uint8_t *p = lp + HEADER_SIZE;
+  return *p == EOF_BYTE ? nullptr : p;
+}
+
+uint8_t *Listpack::last(uint8_t *lp) {
+  uint8_t *eof = lp + bytes(lp) - 1;
+  return prev(lp, eof);
+}
+
+uint8_t *Listpack::next(uint8_t *, uint8_t *p) {
+  p += element_size(p);
+  return *p == EOF_BYTE ? nullptr : p;
+}
+
+uint8_t *Listpack::prev(uint8_t *lp, uint8_t *p) {
+  if (p == lp + HEADER_SIZE)
+    return nullptr;
+  uint32_t l = decode_backlen(p - 1);
+  return p - backlen_size(l) - l;
+}
+
+uint8_t *Listpack::seek(uint8_t *lp, long index) {
+  long count = length(lp);
+  if (index < 0)
+    index += count;
+  if (index < 0 || index >= count)
+    return nullptr;
+  // Walk from the closest end
+  if (index < count / 2) {
+    uint8_t *p = first(lp);
+    while (index--)
+      p = next(lp, p);
+    return p;
+  }
+  uint8_t *p = last(lp);
+  for (long i = count - 1; i > index; --i)
+    p = prev(lp, p);
+  return p;
+}
+
+bool Listpack::get_int(const uint8_t *p, int64_t &value) {
+  uint8_t b = p[0];
+  if ((b & 0x80) == 0) {
+    value = b;
+    return true;
+  }
+  if ((b & 0xE0) == 0xC0) {
+    uint64_t u = ((b & 0x1F) << 8) | p[1];
+    value = u >= (1 << 12) ? static_cast<int64_t>(u) - (1 << 13) : u;
+    return true;
+  }
+  int bytes;
+  switch (b) {
+  case 0xF1:
+    bytes = 2;
+    break;
+  case 0xF2:
+    bytes = 3;
+    break;
+  case 0xF3:
+    bytes = 4;
+    break;
+  case 0xF4:
+    bytes = 8;
+    break;
+  default:
+    return false;
+  }
+  uint64_t u = 0;
+  for (int i = 0; i < bytes; ++i)
+    u |= static_cast<uint64_t>(p[1 + i]) << (8 * i);
+  // Sign extend from the stored width
+  if (bytes < 8 && (u >> (8 * bytes - 1)) & 1)
+    u |= ~0ULL << (8 * bytes);
+  value = static_cast<int64_t>(u);
+  return true;
+}
+
+std::string_view Listpack::get(const uint8_t *p, char (&scratch)[21]) {
+  int64_t v;
+  if (get_int(p, v)) {
+    auto [ptr, ec] = std::to_chars(scratch, scratch + sizeof(scratch), v);
+    return {scratch, static_cast<size_t>(ptr - scratch)};
+  }
+  uint8_t b = p[0];
+  if ((b & 0xC0) == 0x80)
+    return {reinterpret_cast<const char *>(p + 1),
+            static_cast<size_t>(b & 0x3F)};
+  if ((b & 0xF0) == 0xE0)
+    return {reinterpret_cast<const char *>(p + 2),
+            static_cast<size_t>(((b & 0x0F) << 8) | p[1])};
+  return {reinterpret_cast<const char *>(p + 5), read_u32(p + 1)};
+}
+
+uint8_t *Listpack::insert(uint8_t *lp, std::string_view value, uint8_t *p,
+                          Where where, uint8_t **newp) {
+  uint8_t small[32];
+  uint8_t *buf = small;
+  // Up to 5 bytes of encoding header and 5 of backlen around the data
+  if (value.length() + 10 > sizeof(small))
+    buf = static_cast<uint8_t *>(malloc(value.length() + 10));
+  uint32_t l = encode_entry(buf, value);
+  l += encode_backlen(buf + l, l);
+
+  uint32_t old_bytes = bytes(lp);
+  if (p == nullptr)
+    p = where == Where::Before ? lp + HEADER_SIZE : lp + old_bytes - 1;
+  else if (where == Where::After)
+    p += element_size(p);
+
+  uint32_t replaced = where == Where::Replace ? element_size(p) : 0;
+  size_t offset = p - lp;
+  uint32_t new_bytes = old_bytes + l - replaced;
+
+  if (new_bytes > old_bytes)
+    lp = static_cast<uint8_t *>(object_realloc(lp, old_bytes, new_bytes));
+  p = lp + offset;
+  memmove(p + l, p + replaced, old_bytes - offset - replaced);
+  memcpy(p, buf, l);
+  if (new_bytes < old_bytes)
+    lp = static_cast<uint8_t *>(object_realloc(lp, old_bytes, new_bytes));
+
+  write_u32(lp, new_bytes);
+  if (where != Where::Replace)
+    add_count(lp, 1);
+  if (newp)
+    *newp = lp + offset;
+  if (buf != small)
+    ::free(buf);
+  return lp;
+}
+
+uint8_t *Listpack::append(uint8_t *lp, const std::string_view *values,
+                          size_t count) {
+  uint32_t old_bytes = bytes(lp);
+  size_t new_bytes = old_bytes;
+  for (size_t n = 0; n < count; ++n)
+    new_bytes += encoded_size(values[n]);
+  lp = static_cast<uint8_t *>(object_realloc(lp, old_bytes, new_bytes));
+  uint8_t *p = lp + old_bytes - 1;
+  for (size_t n = 0; n < count; ++n) {
+    uint32_t l = encode_entry(p, values[n]);
+    p += l;
+    p += encode_backlen(p, l);
+  }
+  *p = EOF_BYTE;
+  write_u32(lp, new_bytes);
+  add_count(lp, count);
+  return lp;
+}
+
+uint8_t *Listpack::remove(uint8_t *lp, uint8_t *p, uint32_t count,
+                          uint8_t **nextp) {
+  uint32_t old_bytes = bytes(lp);
+  size_t offset = p - lp;
+  uint8_t *end = p;
+  uint32_t removed = 0;
+  while (removed < count && *end != EOF_BYTE) {
+    end += element_size(end);
+    ++removed;
+  }
+  uint32_t gap = end - p;
+  memmove(p, end, old_bytes - (end - lp));
+  uint32_t new_bytes = old_bytes - gap;
+  lp = static_cast<uint8_t *>(object_realloc(lp, old_bytes, new_bytes));
+  write_u32(lp, new_bytes);
+  add_count(lp, -static_cast<long>(removed));
+  if (nextp)
+    *nextp = lp[offset] == EOF_BYTE ? nullptr : lp + offset;
+  return lp;
+}
+
+bool Listpack::validate(const uint8_t *lp, size_t size) {
+  if (size < HEADER_SIZE + 1 || read_u32(lp) != size ||
+      lp[size - 1] != EOF_BYTE)
+    return false;
+  uint32_t count = 0;
+  const uint8_t *p = lp + HEADER_SIZE;
+  const uint8_t *eof = lp + size - 1;
+  while (p < eof) {
+    // The encoding header itself must be inside the buffer
+    if (((p[0] & 0xF0) == 0xE0 && p + 1 >= eof) ||
+        (p[0] == 0xF0 && p + 5 > eof))
+      return false;
+    uint32_t l = entry_size(p);
+    if (l == 0 || p + l + backlen_size(l) > eof)
+      return false;
+    if (decode_backlen(p + l + backlen_size(l) - 1) != l)
+      return false;
+    p += l + backlen_size(l);
+    ++count;
+  }
+  uint32_t header_count = read_u16(lp + 4);
+  return p == eof &&
+         (header_count == LP_COUNT_UNKNOWN || header_count == count);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+Listpack, the packed sequence Redis uses for small lists, hashes and sorted
+sets, in the same byte format so RDB listpack blobs can be adopted as they are.
+
+  <total bytes:u32> <num elements:u16> <element> ... <element> <0xFF>
+
+Every element is <encoding+data> <backlen>. Integers are stored in 1 to 9
+bytes, strings with a 1, 2 or 5 byte length prefix, and backlen - the size of
+<encoding+data> in 1 to 5 bytes, read right to left - allows walking backwards.
+Elements do not depend on their neighbours, so an insert or delete is a single
+memmove.
+
+Functions returning a listpack may have reallocated it. Element pointers
+returned by first/next/... point into the listpack and are invalidated by any
+modification.
+*/
+struct Listpack {
+  static constexpr size_t HEADER_SIZE = 6;
+  static constexpr uint8_t EOF_BYTE = 0xFF;
+
+  enum class Where { Before, After, Replace };
+
+  static uint8_t *create();
+  static void free(uint8_t *lp);
+
+  static uint32_t bytes(const uint8_t *lp);
+  static uint32_t length(const uint8_t *lp);
+
+  // nullptr when there is no such element
+  static uint8_t *first(uint8_t *lp);
+  static uint8_t *last(uint8_t *lp);
+  static uint8_t *next(uint8_t *lp, uint8_t *p);
+  static uint8_t *prev(uint8_t *lp, uint8_t *p);
+  // Negative indexes count from the end
+  static uint8_t *seek(uint8_t *lp, long index);
+
+  // Integer elements are formatted into scratch
+  static std::string_view get(const uint8_t *p, char (&scratch)[21]);
+  // True if the element is integer encoded, storing it in value
+  static bool get_int(const uint8_t *p, int64_t &value);
+
+  // Inserts value relative to p (which may be nullptr to append with After or
+  // prepend with Before). If newp is given it receives the new element.
+  static uint8_t *insert(uint8_t *lp, std::string_view value, uint8_t *p,
+                         Where where, uint8_t **newp = nullptr);
+  static uint8_t *append(uint8_t *lp, std::string_view value) {
+    return insert(lp, value, nullptr, Where::After);
+  }
+  // Appends count values with a single reallocation
+  static uint8_t *append(uint8_t *lp, const std::string_view *values,
+                         size_t count);
+  static uint8_t *prepend(uint8_t *lp, std::string_view value) {
+    return insert(lp, value, nullptr, Where::Before);
+  }
+  // Removes count elements starting at p. If nextp is given it receives the
+  // element that followed them (or nullptr).
+  static uint8_t *remove(uint8_t *lp, uint8_t *p, uint32_t count = 1,
+                         uint8_t **nextp = nullptr);
+
+  // Size the element would take, to check limits before inserting
+  static size_t encoded_size(std::string_view value);
+
+  // Checks that a blob read from disk is a well formed listpack
+  static bool validate(const uint8_t *lp, size_t size);
+};
@@ -0,0 +1,145 @@
+#include "Lzf.hpp"
+#include <cstdint>
+#include <cstring>
+
+#define HLOG 14
+#define MAX_LIT 32
+#define MAX_OFF (1 << 13)
+#define MAX_REF ((1 << 8) + (1 << 3))
+
+static inline uint32_t hash3(const uint8_t *p) {
+  uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - HLOG);
+}
+
+size_t lzf_compress(const void *in_data, size_t in_len, void *out_data,
+                    size_t out_len) {
+  // Positions of the last occurrence of each 3 byte hash. Stale entries from
+  // earlier calls are harmless: every candidate is bounds and byte checked.
+  thread_local uint32_t htab[1 << HLOG];
+
+  const auto *in = static_cast<const uint8_t *>(in_data);
+  const uint8_t *ip = in;
+  const uint8_t *in_end = in + in_len;
+  auto *op = static_cast<uint8_t *>(out_data);
+  uint8_t *out_end = op + out_len;
+  int lit = 0;
+
+  if (in_len == 0 || out_len < 2)
+    return 0;
+  op++; // length of the current literal run, filled in when it ends
+
+  while (ip + 2 < in_end) {
+    uint32_t h = hash3(ip);
+    uint32_t ref_pos = htab[h];
+    uint32_t ip_pos = ip - in;
+    htab[h] = ip_pos;
+
+    const uint8_t *ref = in + ref_pos;
+    size_t off = ip_pos - ref_pos - 1;
+    if (ref_pos < ip_pos && off < MAX_OFF && ref[0] == ip[0] &&
+        ref[1] == ip[1] && ref[2] == ip[2]) {
+      size_t len = 2;
+      size_t maxlen = in_end - ip - len;
+      if (maxlen > MAX_REF)
+        maxlen = MAX_REF;
+
+      if (op - !lit + 3 + 1 >= out_end)
+        return 0;
+      op[-lit - 1] = lit - 1; // close the literal run
+      op -= !lit;             // or drop its header if it is empty
+
+      do
+        len++;
+      while (len < maxlen && ref[len] == ip[len]);
+
+      len -= 2;
+      ip++;
+      if (len < 7) {
+        *op++ = (off >> 8) + (len << 5);
+      } else {
+        *op++ = (off >> 8) + (7 << 5);
+        *op++ = len - 7;
+      }
+      *op++ = off;
+
+      lit = 0;
+      op++;
+      ip += len + 1;
+      continue;
+    }
+
+    if (op >= out_end)
+      return 0;
+    lit++;
+    *op++ = *ip++;
+    if (lit == MAX_LIT) {
+      op[-lit - 1] = lit - 1;
+      lit = 0;
+      // No room for the header of the next run
+      if (op >= out_end)
+        return 0;
+      op++;
+    }
+  }
+
+  while (ip < in_end) {
+    if (op >= out_end)
+      return 0;
+    lit++;
+    *op++ = *ip++;
+    if (lit == MAX_LIT) {
+      op[-lit - 1] = lit - 1;
+      lit = 0;
+      // No room for the header of the next run
+      if (op >= out_end)
+        return 0;
+      op++;
+    }
+  }
+
+  op[-lit - 1] = lit - 1;
+  op -= !lit;
+  return op - static_cast<uint8_t *>(out_data);
+}
+
+size_t lzf_decompress(const void *in_data, size_t in_len, void *out_data,
+                      size_t out_len) {
+  const auto *ip = static_cast<const uint8_t *>(in_data);
+  const uint8_t *in_end = ip + in_len;
+  auto *out = static_cast<uint8_t *>(out_data);
+  uint8_t *op = out;
+  uint8_t *out_end = out + out_len;
+
+  while (ip < in_end) {
+    unsigned int ctrl = *ip++;
+
+    if (ctrl < (1 << 5)) { // literal run
+      ctrl++;
+      if (op + ctrl > out_end || ip + ctrl > in_end)
+        return 0;
+      memcpy(op, ip, ctrl);
+      op += ctrl;
+      ip += ctrl;
+      continue;
+    }
+
+    // back reference
+    unsigned int len = ctrl >> 5;
+    if (len == 7) {
+      if (ip >= in_end)
+        return 0;
+      len += *ip++;
+    }
+    if (ip >= in_end)
+      return 0;
+    const uint8_t *ref = op - ((ctrl & 0x1f) << 8) - 1 - *ip++;
+    len += 2;
+    if (op + len > out_end || ref < out)
+      return 0;
+    // Byte by byte: the reference may overlap what is being written
+    while (len--)
+      *op++ = *ref++;
+  }
+  return op - out;
+}
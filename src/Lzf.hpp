@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+LZF, the compression format Redis uses for RDB strings (0xC3) and quicklist
+nodes. The stream is a sequence of literal runs (ctrl < 32: ctrl + 1 bytes
+follow) and back references (ctrl >> 5 is the length - 2, with an extra length
+byte when it is 7, followed by the low byte of a 13 bit offset).
+*/
+
+// Returns the compressed size, or 0 if the output does not fit in out_len
+size_t lzf_compress(const void *in_data, size_t in_len, void *out_data,
+                    size_t out_len);
+// Returns the decompressed size, or 0 on corrupt input or short output
+size_t lzf_decompress(const void *in_data, size_t in_len, void *out_data,
+                      size_t out_len);
@@ -0,0 +1,31 @@
+#include "ObjectAlloc.hpp"
+#include <cstdlib>
+
+static std::atomic<size_t> used_memory{0};
+
+void *object_alloc(size_t size) {
+  void *ptr = malloc(size);
+  if (ptr == nullptr)
+    throw std::bad_alloc();
+  used_memory.fetch_add(size, std::memory_order_relaxed);
+  return ptr;
+}
+
+void *object_realloc(void *ptr, size_t old_size, size_t new_size) {
+  void *resized = realloc(ptr, new_size);
+  if (resized == nullptr)
+    throw std::bad_alloc();
+  used_memory.fetch_add(new_size - old_size, std::memory_order_relaxed);
+  return resized;
+}
+
+void object_free(void *ptr, size_t size) {
+  if (ptr == nullptr)
+    return;
+  free(ptr);
+  used_memory.fetch_sub(size, std::memory_order_relaxed);
+}
+
+size_t object_memory() {
+  return used_memory.load(std::memory_order_relaxed);
+}
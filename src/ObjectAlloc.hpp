@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+/*
+Memory for aggregate values (lists, hashes, ...). Unlike the keyspace slabs it
+comes from malloc, which is thread safe, and is counted with an atomic, so big
+objects can be built or released outside the event loop.
+*/
+void *object_alloc(size_t size);
+void *object_realloc(void *ptr, size_t old_size, size_t new_size);
+void object_free(void *ptr, size_t size);
+size_t object_memory();
+
+// Gives a class tracked operator new/delete
+struct TrackedObject {
+  static void *operator new(size_t size) { return object_alloc(size); }
+  static void operator delete(void *ptr, size_t size) {
+    object_free(ptr, size);
+  }
+};
+
+// STL allocator over object_alloc, for containers inside values
+template <typename T> struct ObjectAllocator {
+  typedef T value_type;
+
+  ObjectAllocator() = default;
+  template <typename U> ObjectAllocator(const ObjectAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(object_alloc(n * sizeof(T)));
+  }
+  void deallocate(T *ptr, size_t n) { object_free(ptr, n * sizeof(T)); }
+
+  template <typename U> bool operator==(const ObjectAllocator<U> &) const {
+    return true;
+  }
+};
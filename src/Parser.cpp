@@ -5,9 +5,13 @@ RespData RespParser::parse(const std::string &input) {
   return parseValue(input, pos);
 }
 
+RespData RespParser::parse(const std::string &input, size_t &pos) {
+  return parseValue(input, pos);
+}
+
 RespData RespParser::parseValue(const std::string &input, size_t &pos) {
   if (pos >= input.length()) {
-    throw std::runtime_error("Unexpected end of input");
+    throw RespIncomplete("Unexpected end of input");
   }
 
   char type = input[pos++];
@@ -49,7 +53,7 @@ RespData RespParser::parseValue(const std::string &input, size_t &pos) {
 std::string RespParser::readLine(const std::string &input, size_t &pos) {
   size_t end = input.find("\r\n", pos);
   if (end == std::string::npos) {
-    throw std::runtime_error("Expected CRLF");
+    throw RespIncomplete("Expected CRLF");
   }
   std::string line = input.substr(pos, end - pos);
   pos = end + 2;
@@ -73,8 +77,8 @@ RespData RespParser::parseBulkString(const std::string &input, size_t &pos) {
   if (len == -1) {
     return RespData(RespType::Null, nullptr);
   }
-  if (pos + len > input.length()) {
-    throw std::runtime_error("Bulk string length exceeds input");
+  if (pos + len + 2 > input.length()) {
+    throw RespIncomplete("Bulk string length exceeds input");
   }
   std::string str = input.substr(pos, len);
   pos += len + 2; // +2 for CRLF
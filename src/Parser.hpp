@@ -42,6 +42,8 @@ public:
 
   RespData(const RespData &) = default;
   RespData &operator=(const RespData &) = default;
+  RespData(RespData &&) = default;
+  RespData &operator=(RespData &&) = default;
 
   bool operator<(const RespData &other) const {
     if (type != other.type)
@@ -50,9 +52,18 @@ public:
   }
 };
 
+// Thrown when the input ends in the middle of a value, so the caller can wait
+// for more bytes instead of treating it as a protocol error
+class RespIncomplete : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
 class RespParser {
 public:
   RespData parse(const std::string &input);
+  // Parses the value starting at pos and moves pos past it
+  RespData parse(const std::string &input, size_t &pos);
   void printRespData(const RespData &data, int indent = 0);
 
 private:
@@ -0,0 +1,114 @@
+#include "Partitions.hpp"
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+Partitions::Partitions(size_t count)
+    : m_count(count), m_inboxes(new Inbox[count]), m_outboxes(count) {
+  for (size_t n = 0; n < count * count; ++n)
+    m_queues.push_back(std::make_unique<Queue>());
+  for (size_t p = 0; p < count; ++p) {
+    m_inboxes[p].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_outboxes[p].overflow.resize(count);
+    m_outboxes[p].dirty.resize(count);
+  }
+}
+
+Partitions::~Partitions() {
+  for (size_t p = 0; p < m_count; ++p)
+    close(m_inboxes[p].wake_fd);
+}
+
+void Partitions::send(size_t from, size_t to, PartitionMessage *message) {
+  Outbox &outbox = m_outboxes[from];
+  // Messages that overflowed go first to keep the order
+  if (!outbox.overflow[to].empty() || !queue(from, to).push(message))
+    outbox.overflow[to].push_back(message);
+  outbox.dirty[to] = true;
+}
+
+void Partitions::flush(size_t from) {
+  Outbox &outbox = m_outboxes[from];
+  for (size_t to = 0; to < m_count; ++to) {
+    std::deque<PartitionMessage *> &overflow = outbox.overflow[to];
+    while (!overflow.empty() && queue(from, to).push(overflow.front()))
+      overflow.pop_front();
+    if (!outbox.dirty[to])
+      continue;
+    // A receiver is woken up again until all our messages are in its queue
+    outbox.dirty[to] = !overflow.empty();
+    // Pairs with the fence in sleep(): either the receiver sees the message
+    // before sleeping or we see it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_inboxes[to].sleeping.load(std::memory_order_relaxed) &&
+        m_inboxes[to].sleeping.exchange(false))
+      wake(to);
+  }
+}
+
+PartitionMessage *Partitions::receive(size_t to) {
+  PartitionMessage *message;
+  for (size_t from = 0; from < m_count; ++from)
+    if (queue(from, to).pop(message))
+      return message;
+  return nullptr;
+}
+
+void Partitions::wake(size_t partition) {
+  uint64_t one = 1;
+  ssize_t written = write(m_inboxes[partition].wake_fd, &one, sizeof(one));
+  (void)written; // a full counter is still readable
+}
+
+bool Partitions::sleep(size_t partition) {
+  Inbox &inbox = m_inboxes[partition];
+  inbox.sleeping.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bool idle = (m_round.load() & 1) == 0;
+  for (size_t p = 0; idle && p < m_count; ++p)
+    idle = queue(p, partition).empty() &&
+           m_outboxes[partition].overflow[p].empty();
+  if (!idle)
+    inbox.sleeping.store(false, std::memory_order_relaxed);
+  return idle;
+}
+
+void Partitions::clear_wake(size_t partition) {
+  uint64_t count;
+  ssize_t bytes = read(m_inboxes[partition].wake_fd, &count, sizeof(count));
+  (void)bytes; // EAGAIN if it was already cleared
+}
+
+// Only one partition stops the world at a time. One waiting for its turn
+// parks for the partition that has it, or both would wait for each other.
+void Partitions::stop_world(size_t partition) {
+  while (m_world.test_and_set(std::memory_order_acquire)) {
+    park();
+    std::this_thread::yield();
+  }
+  m_round.fetch_add(1);
+  for (size_t p = 0; p < m_count; ++p)
+    if (p != partition)
+      wake(p);
+  size_t parked;
+  while ((parked = m_parked.load()) != m_count - 1)
+    m_parked.wait(parked);
+}
+
+void Partitions::resume_world() {
+  m_parked.store(0);
+  m_round.fetch_add(1);
+  m_round.notify_all();
+  m_world.clear(std::memory_order_release);
+}
+
+// The round can not end before this partition is counted, so the round read
+// is still the current one when it is counted
+void Partitions::park() {
+  uint64_t round = m_round.load();
+  if ((round & 1) == 0)
+    return;
+  m_parked.fetch_add(1);
+  m_parked.notify_all();
+  m_round.wait(round);
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "Parser.hpp"
+#include "SPSCQueue.hpp"
+
+/*
+Shared-nothing threads (--threads N). The keyspace is split into N partitions
+by hash slot (see HashSlot.hpp, so keys sharing a {hash tag} share a
+partition), and each partition is owned by one thread running its own event
+loop with its own DB_Config: dictionary, slab allocator, blocked clients,
+WATCH versions and Pub/Sub subscribers. No lock is taken on the data path, a
+partition's data is only touched by its thread.
+
+Connections are spread over the threads by the kernel (every thread listens on
+the port with SO_REUSEPORT). A command whose keys live in another partition is
+sent to it through a lock-free SPSC queue, one per pair of threads, and its
+reply comes back the same way; a run of pipelined commands for the same
+partition goes out as one message. The commands after a run wait until its
+replies are back, so a connection's commands still run in order. A thread only
+gets a syscall to wake it when it is asleep in epoll_wait.
+
+Commands that need several partitions at once (MGET, MSET, EXEC, KEYS,
+PUBLISH, ...) stop the world: the calling thread waits for every other thread
+to park at the top of its event loop, runs the command against all the
+partitions and lets them go. A blocking pop moves the connection to the
+thread that owns its keys instead, so that it can wait there.
+*/
+
+struct PartitionMessage {
+  enum Kind {
+    Request, // commands to run, replies to fill in
+    Reply,   // the same message on its way back
+    Handoff, // a connection moving to the receiving partition
+  };
+  Kind kind = Request;
+  size_t from = 0; // partition that sent the request
+  size_t to = 0;   // partition running the request
+  // The connection the commands come from, and its RESP version
+  int fd = -1;
+  uint64_t client_id = 0;
+  int protocol = 2;
+  std::vector<RespData> commands;
+  // Index of each command in the connection's run, and its reply
+  std::vector<size_t> positions;
+  std::vector<std::string> replies;
+  // Spilled values the commands wait for on the receiving partition
+  size_t loading = 0;
+  Client client; // Handoff
+};
+
+class Partitions {
+public:
+  explicit Partitions(size_t count);
+  ~Partitions();
+  Partitions(const Partitions &) = delete;
+  Partitions &operator=(const Partitions &) = delete;
+
+  size_t count() const { return m_count; }
+  uint64_t next_client_id() { return ++m_client_ids; }
+
+  // Queues message for partition to. It is pushed, and to woken up, by the
+  // next flush(from).
+  void send(size_t from, size_t to, PartitionMessage *message);
+  // Pushes the messages queued by partition from that fit and wakes up their
+  // receivers
+  void flush(size_t from);
+  // Next message for partition to, nullptr if there is none
+  PartitionMessage *receive(size_t to);
+
+  // Readable when partition has to wake up, for its epoll instance
+  int wake_fd(size_t partition) const { return m_inboxes[partition].wake_fd; }
+  // Called before sleeping in epoll_wait, false if there is already a
+  // message or a stop to attend, or messages of ours still to push
+  bool sleep(size_t partition);
+  void awake(size_t partition) {
+    m_inboxes[partition].sleeping.store(false, std::memory_order_relaxed);
+  }
+  // Resets wake_fd once it was readable
+  void clear_wake(size_t partition);
+
+  // Returns once every other partition is parked, until resume_world()
+  void stop_world(size_t partition);
+  void resume_world();
+  // Parks the calling partition while the world is stopped
+  void park();
+
+private:
+  static constexpr size_t QUEUE_SIZE = 1024;
+  typedef SPSCQueue<PartitionMessage *, QUEUE_SIZE> Queue;
+
+  struct alignas(64) Inbox {
+    std::atomic<bool> sleeping{false};
+    int wake_fd = -1;
+  };
+  // Sender side state, only touched by the sending partition
+  struct Outbox {
+    // Messages that did not fit in the queue, in order
+    std::vector<std::deque<PartitionMessage *>> overflow;
+    std::vector<bool> dirty; // receivers to wake up
+  };
+
+  size_t m_count;
+  // Queue from partition a to partition b at a * count + b
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::unique_ptr<Inbox[]> m_inboxes;
+  std::vector<Outbox> m_outboxes;
+  std::atomic<uint64_t> m_client_ids{0};
+
+  // World stops: m_world is held by the stopping partition, m_round is odd
+  // while the world is stopped and m_parked counts the partitions parked
+  std::atomic_flag m_world = ATOMIC_FLAG_INIT;
+  std::atomic<uint64_t> m_round{0};
+  std::atomic<size_t> m_parked{0};
+
+  Queue &queue(size_t from, size_t to) {
+    return *m_queues[from * m_count + to];
+  }
+  void wake(size_t partition);
+};
+
+// Keeps the other partitions parked while in scope
+class WorldStop {
+public:
+  WorldStop(Partitions &partitions, size_t partition)
+      : m_partitions(partitions) {
+    m_partitions.stop_world(partition);
+  }
+  ~WorldStop() { m_partitions.resume_world(); }
+  WorldStop(const WorldStop &) = delete;
+  WorldStop &operator=(const WorldStop &) = delete;
+
+private:
+  Partitions &m_partitions;
+};
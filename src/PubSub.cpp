@@ -0,0 +1,223 @@
+#include "PubSub.hpp"
+#include "HandleResponse.hpp"
+#include <algorithm>
+
+GlobMatcher::GlobMatcher(std::string_view pattern) {
+  size_t size = pattern.size();
+  size_t i = 0;
+  for (; i < size; ++i) {
+    char c = pattern[i];
+    if (c == '*' || c == '?' || c == '[')
+      break;
+    if (c == '\\' && i + 1 < size)
+      c = pattern[++i];
+    m_prefix += c;
+  }
+
+  for (; i < size; ++i) {
+    char c = pattern[i];
+    if (c == '*') {
+      // Consecutive stars match the same as one
+      if (m_tokens.empty() || !m_tokens.back().star)
+        m_tokens.push_back({true, {}});
+      continue;
+    }
+    Token token{false, {}};
+    if (c == '?') {
+      token.set.set();
+    } else if (c == '[') {
+      size_t j = i + 1;
+      bool negate = j < size && pattern[j] == '^';
+      if (negate)
+        ++j;
+      // An unterminated class runs to the end of the pattern
+      for (; j < size && pattern[j] != ']'; ++j) {
+        if (pattern[j] == '\\' && j + 1 < size) {
+          token.set.set(static_cast<uint8_t>(pattern[++j]));
+        } else if (j + 2 < size && pattern[j + 1] == '-' &&
+                   pattern[j + 2] != ']') {
+          int from = static_cast<uint8_t>(pattern[j]);
+          int to = static_cast<uint8_t>(pattern[j + 2]);
+          if (from > to)
+            std::swap(from, to);
+          for (int ch = from; ch <= to; ++ch)
+            token.set.set(ch);
+          j += 2;
+        } else {
+          token.set.set(static_cast<uint8_t>(pattern[j]));
+        }
+      }
+      if (negate)
+        token.set.flip();
+      i = j;
+    } else {
+      if (c == '\\' && i + 1 < size)
+        c = pattern[++i];
+      token.set.set(static_cast<uint8_t>(c));
+    }
+    m_tokens.push_back(token);
+  }
+}
+
+// Every token but the star matches a single character, so on a mismatch only
+// the last star has to take one more character: no recursion, O(n * m) at
+// worst and linear for the usual patterns
+bool GlobMatcher::match(std::string_view str) const {
+  if (!str.starts_with(m_prefix))
+    return false;
+  str.remove_prefix(m_prefix.length());
+
+  size_t t = 0, s = 0;
+  size_t star = std::string::npos, star_s = 0;
+  while (s < str.size()) {
+    if (t < m_tokens.size() && m_tokens[t].star) {
+      star = t++;
+      star_s = s;
+    } else if (t < m_tokens.size() &&
+               m_tokens[t].set.test(static_cast<uint8_t>(str[s]))) {
+      ++t;
+      ++s;
+    } else if (star != std::string::npos) {
+      t = star + 1;
+      s = ++star_s;
+    } else {
+      return false;
+    }
+  }
+  while (t < m_tokens.size() && m_tokens[t].star)
+    ++t;
+  return t == m_tokens.size();
+}
+
+bool PubSub::subscribe(Client *client, const std::string &channel) {
+  if (!client->channels.insert(channel).second)
+    return false;
+  m_channels[channel].insert(client);
+  return true;
+}
+
+bool PubSub::unsubscribe(Client *client, const std::string &channel) {
+  if (client->channels.erase(channel) == 0)
+    return false;
+  auto it = m_channels.find(channel);
+  it->second.erase(client);
+  if (it->second.empty())
+    m_channels.erase(it);
+  return true;
+}
+
+bool PubSub::psubscribe(Client *client, const std::string &pattern) {
+  if (!client->patterns.insert(pattern).second)
+    return false;
+  std::unique_ptr<Pattern> &entry = m_patterns[pattern];
+  if (!entry) {
+    entry.reset(new Pattern{pattern, GlobMatcher(pattern), {}});
+    trie_insert(entry.get());
+  }
+  entry->clients.insert(client);
+  return true;
+}
+
+bool PubSub::punsubscribe(Client *client, const std::string &pattern) {
+  if (client->patterns.erase(pattern) == 0)
+    return false;
+  auto it = m_patterns.find(pattern);
+  it->second->clients.erase(client);
+  if (it->second->clients.empty()) {
+    trie_erase(it->second.get());
+    m_patterns.erase(it);
+  }
+  return true;
+}
+
+void PubSub::unsubscribe_all(Client *client) {
+  while (!client->channels.empty()) {
+    std::string channel = *client->channels.begin();
+    unsubscribe(client, channel);
+  }
+  while (!client->patterns.empty()) {
+    std::string pattern = *client->patterns.begin();
+    punsubscribe(client, pattern);
+  }
+}
+
+size_t PubSub::publish(std::string_view channel, std::string_view message,
+                       const OutputLimit &limit, uint64_t now_ms,
+                       std::vector<Client *> &pending_writes) {
+  size_t receivers = 0;
+  auto fan_out = [&](const std::unordered_set<Client *> &clients,
+                     std::initializer_list<std::string_view> parts) {
+    // Serialized at most once per protocol, RESP3 clients get a push
+    std::shared_ptr<const std::string> frames[2];
+    for (Client *client : clients) {
+      ++receivers;
+      if (client->close_asap)
+        continue;
+      std::shared_ptr<const std::string> &frame =
+          frames[client->protocol >= 3];
+      if (!frame) {
+        std::string serialized;
+        append_push_len(serialized, parts.size(), client->protocol);
+        for (std::string_view part : parts)
+          append_bulk(serialized, part);
+        frame = std::make_shared<const std::string>(std::move(serialized));
+      }
+      client->push(frame, pending_writes);
+      if (client->over_limit(limit, now_ms))
+        client->close_asap = true;
+    }
+  };
+
+  auto subscribers = m_channels.find(std::string(channel));
+  if (subscribers != m_channels.end())
+    fan_out(subscribers->second, {"message", channel, message});
+  trie_match(channel, [&](Pattern *pattern) {
+    fan_out(pattern->clients, {"pmessage", pattern->text, channel, message});
+  });
+  return receivers;
+}
+
+void PubSub::trie_insert(Pattern *pattern) {
+  TrieNode *node = m_root.get();
+  for (char c : pattern->matcher.prefix()) {
+    std::unique_ptr<TrieNode> &child = node->children[c];
+    if (!child)
+      child = std::make_unique<TrieNode>();
+    node = child.get();
+  }
+  node->patterns.push_back(pattern);
+}
+
+void PubSub::trie_erase(Pattern *pattern) {
+  const std::string &prefix = pattern->matcher.prefix();
+  std::vector<TrieNode *> path = {m_root.get()};
+  for (char c : prefix)
+    path.push_back(path.back()->children.at(c).get());
+  std::erase(path.back()->patterns, pattern);
+
+  // Prune the nodes left without patterns or children
+  for (size_t depth = prefix.length(); depth > 0; --depth) {
+    TrieNode *node = path[depth];
+    if (!node->patterns.empty() || !node->children.empty())
+      break;
+    path[depth - 1]->children.erase(prefix[depth - 1]);
+  }
+}
+
+// Calls fn for every pattern matching channel, walking the trie along the
+// channel so only patterns with a matching prefix are tried
+template <typename F>
+void PubSub::trie_match(std::string_view channel, F &&fn) {
+  const TrieNode *node = m_root.get();
+  for (size_t depth = 0;; ++depth) {
+    for (Pattern *pattern : node->patterns)
+      if (pattern->matcher.match(channel))
+        fn(pattern);
+    if (depth == channel.size())
+      break;
+    auto child = node->children.find(channel[depth]);
+    if (child == node->children.end())
+      break;
+    node = child->second.get();
+  }
+}
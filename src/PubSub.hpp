@@ -0,0 +1,88 @@
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Client.hpp"
+
+/*
+Publish/subscribe registry.
+
+A published message is serialized once per channel (and once per matching
+pattern, as the frame names the pattern) into a reference counted buffer that
+is queued to every subscriber, so fan-out costs a pointer per subscriber and
+no copies. Subscribers whose queue grows over the pub/sub output limit are
+marked to be closed.
+
+Patterns are compiled once, on PSUBSCRIBE, to a list of character sets and
+stars, and indexed in a trie by their literal prefix (the part before the
+first wildcard). Publishing walks the trie along the channel name, so only the
+patterns whose prefix matches the channel are tried.
+*/
+
+// Glob pattern with Redis' syntax: *, ?, [abc], [^a-z] and \ escapes
+class GlobMatcher {
+public:
+  explicit GlobMatcher(std::string_view pattern);
+  bool match(std::string_view str) const;
+  // Literal characters at the start of the pattern
+  const std::string &prefix() const { return m_prefix; }
+
+private:
+  // Matches one character, or any run of characters when star is set
+  struct Token {
+    bool star;
+    std::bitset<256> set;
+  };
+  std::string m_prefix;
+  // Tokens of the pattern after the prefix
+  std::vector<Token> m_tokens;
+};
+
+class PubSub {
+public:
+  PubSub() : m_root(std::make_unique<TrieNode>()) {}
+
+  // Return false if client was already (or not) subscribed
+  bool subscribe(Client *client, const std::string &channel);
+  bool unsubscribe(Client *client, const std::string &channel);
+  bool psubscribe(Client *client, const std::string &pattern);
+  bool punsubscribe(Client *client, const std::string &pattern);
+  void unsubscribe_all(Client *client);
+
+  // Queues the message to the subscribers of channel and of the patterns
+  // matching it, returns how many got it. Clients with new output are added to
+  // pending_writes.
+  size_t publish(std::string_view channel, std::string_view message,
+                 const OutputLimit &limit, uint64_t now_ms,
+                 std::vector<Client *> &pending_writes);
+
+  size_t channels() const { return m_channels.size(); }
+  size_t patterns() const { return m_patterns.size(); }
+
+private:
+  struct Pattern {
+    std::string text;
+    GlobMatcher matcher;
+    std::unordered_set<Client *> clients;
+  };
+  struct TrieNode {
+    std::unordered_map<char, std::unique_ptr<TrieNode>> children;
+    // Patterns whose literal prefix ends at this node
+    std::vector<Pattern *> patterns;
+  };
+
+  std::unordered_map<std::string, std::unordered_set<Client *>> m_channels;
+  std::unordered_map<std::string, std::unique_ptr<Pattern>> m_patterns;
+  std::unique_ptr<TrieNode> m_root;
+
+  void trie_insert(Pattern *pattern);
+  void trie_erase(Pattern *pattern);
+  template <typename F> void trie_match(std::string_view channel, F &&fn);
+};
@@ -0,0 +1,106 @@
+#include "Clock.hpp"
+#include "HandleResponse.hpp"
+#include <string>
+#include <vector>
+
+// [kind, name, subscriptions left] frame confirming a (un)subscription, name
+// is nullptr when unsubscribing from nothing
+void HandleResponse::subscription_reply(std::string_view kind,
+                                        const std::string *name) {
+  std::string response;
+  append_push_len(response, 3, m_client.protocol);
+  append_bulk(response, kind);
+  if (name != nullptr)
+    append_bulk(response, *name);
+  else
+    append_null(response, m_client.protocol);
+  append_integer(response, m_client.subscriptions());
+  reply(response);
+}
+
+void HandleResponse::subscribe(size_t &i,
+                               const std::vector<RespData> &command_array,
+                               DB_Config &config) {
+  if (i >= command_array.size()) {
+    wrong_args("SUBSCRIBE");
+    return;
+  }
+  for (; i < command_array.size(); ++i)
+    if (const std::string *channel = arg_at(command_array, i)) {
+      config.pubsub.subscribe(&m_client, *channel);
+      subscription_reply("subscribe", channel);
+    }
+}
+
+void HandleResponse::psubscribe(size_t &i,
+                                const std::vector<RespData> &command_array,
+                                DB_Config &config) {
+  if (i >= command_array.size()) {
+    wrong_args("PSUBSCRIBE");
+    return;
+  }
+  for (; i < command_array.size(); ++i)
+    if (const std::string *pattern = arg_at(command_array, i)) {
+      config.pubsub.psubscribe(&m_client, *pattern);
+      subscription_reply("psubscribe", pattern);
+    }
+}
+
+// Without arguments, unsubscribes from everything
+void HandleResponse::unsubscribe(size_t &i,
+                                 const std::vector<RespData> &command_array,
+                                 DB_Config &config) {
+  std::vector<std::string> channels;
+  for (; i < command_array.size(); ++i)
+    if (const std::string *channel = arg_at(command_array, i))
+      channels.push_back(*channel);
+  if (i == 1) {
+    if (m_client.channels.empty()) {
+      subscription_reply("unsubscribe", nullptr);
+      return;
+    }
+    channels.assign(m_client.channels.begin(), m_client.channels.end());
+  }
+  for (const std::string &channel : channels) {
+    config.pubsub.unsubscribe(&m_client, channel);
+    subscription_reply("unsubscribe", &channel);
+  }
+}
+
+void HandleResponse::punsubscribe(size_t &i,
+                                  const std::vector<RespData> &command_array,
+                                  DB_Config &config) {
+  std::vector<std::string> patterns;
+  for (; i < command_array.size(); ++i)
+    if (const std::string *pattern = arg_at(command_array, i))
+      patterns.push_back(*pattern);
+  if (i == 1) {
+    if (m_client.patterns.empty()) {
+      subscription_reply("punsubscribe", nullptr);
+      return;
+    }
+    patterns.assign(m_client.patterns.begin(), m_client.patterns.end());
+  }
+  for (const std::string &pattern : patterns) {
+    config.pubsub.punsubscribe(&m_client, pattern);
+    subscription_reply("punsubscribe", &pattern);
+  }
+}
+
+void HandleResponse::publish(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  const std::string *channel = arg_at(command_array, i++);
+  const std::string *message = arg_at(command_array, i++);
+  if (channel == nullptr || message == nullptr) {
+    wrong_args("PUBLISH");
+    return;
+  }
+  // Subscribers are on every partition's thread, all stopped meanwhile
+  size_t receivers = 0;
+  for (DB_Config *partition : config.all_partitions())
+    receivers += partition->pubsub.publish(
+        *channel, *message, partition->pubsub_output_limit, Clock::now_ms(),
+        partition->pending_writes);
+  integer(receivers);
+}
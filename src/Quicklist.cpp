@@ -0,0 +1,192 @@
+#include "Quicklist.hpp"
+#include "Lzf.hpp"
+
+// Nodes smaller than this are not worth compressing, and a compressed node
+// must save at least MIN_COMPRESS_GAIN bytes to be kept compressed
+#define MIN_COMPRESS_BYTES 48
+#define MIN_COMPRESS_GAIN 8
+
+Quicklist::Quicklist(int compress_depth) : m_compress_depth(compress_depth) {}
+
+Quicklist::~Quicklist() {
+  while (m_head != nullptr)
+    delete_node(m_head);
+}
+
+Quicklist::Node *Quicklist::new_node() {
+  Node *node = new Node;
+  try {
+    node->data = Listpack::create();
+  } catch (...) {
+    delete node;
+    throw;
+  }
+  node->size = node->raw_size = Listpack::bytes(node->data);
+  ++m_nodes;
+  return node;
+}
+
+void Quicklist::delete_node(Node *node) {
+  if (node->prev != nullptr)
+    node->prev->next = node->next;
+  else
+    m_head = node->next;
+  if (node->next != nullptr)
+    node->next->prev = node->prev;
+  else
+    m_tail = node->prev;
+
+  if (node->compressed)
+    object_free(node->data, node->size);
+  else
+    Listpack::free(node->data);
+  delete node;
+  --m_nodes;
+}
+
+bool Quicklist::fits(const Node *node, std::string_view value) const {
+  return node->raw_size + Listpack::encoded_size(value) <= NODE_MAX_BYTES &&
+         node->count < NODE_MAX_COUNT;
+}
+
+void Quicklist::push_head(std::string_view value) {
+  if (m_head == nullptr || !fits(m_head, value)) {
+    Node *node = new_node();
+    node->next = m_head;
+    if (m_head != nullptr)
+      m_head->prev = node;
+    else
+      m_tail = node;
+    m_head = node;
+  }
+  m_head->data = Listpack::prepend(m_head->data, value);
+  m_head->size = m_head->raw_size = Listpack::bytes(m_head->data);
+  ++m_head->count;
+  ++m_count;
+  compress_ends();
+}
+
+void Quicklist::push_tail(std::string_view value) {
+  if (m_tail == nullptr || !fits(m_tail, value)) {
+    Node *node = new_node();
+    node->prev = m_tail;
+    if (m_tail != nullptr)
+      m_tail->next = node;
+    else
+      m_head = node;
+    m_tail = node;
+  }
+  m_tail->data = Listpack::append(m_tail->data, value);
+  m_tail->size = m_tail->raw_size = Listpack::bytes(m_tail->data);
+  ++m_tail->count;
+  ++m_count;
+  compress_ends();
+}
+
+bool Quicklist::pop(Node *node, bool head, std::string &out) {
+  if (node == nullptr)
+    return false;
+  // End nodes are never compressed
+  uint8_t *p = head ? Listpack::first(node->data) : Listpack::last(node->data);
+  char scratch[21];
+  out = Listpack::get(p, scratch);
+  node->data = Listpack::remove(node->data, p);
+  node->size = node->raw_size = Listpack::bytes(node->data);
+  --node->count;
+  --m_count;
+  if (node->count == 0) {
+    delete_node(node);
+    compress_ends();
+  }
+  return true;
+}
+
+bool Quicklist::pop_head(std::string &out) { return pop(m_head, true, out); }
+
+bool Quicklist::pop_tail(std::string &out) { return pop(m_tail, false, out); }
+
+bool Quicklist::index(long i, std::string &out) {
+  if (i < 0)
+    i += m_count;
+  if (i < 0 || static_cast<size_t>(i) >= m_count)
+    return false;
+
+  // Walk from the closer end
+  Node *node;
+  long offset;
+  if (static_cast<size_t>(i) < m_count / 2) {
+    node = m_head;
+    offset = i;
+    while (offset >= node->count) {
+      offset -= node->count;
+      node = node->next;
+    }
+  } else {
+    node = m_tail;
+    offset = i - m_count;
+    while (-offset > node->count) {
+      offset += node->count;
+      node = node->prev;
+    }
+  }
+  uint8_t *lp = view(node);
+  char scratch[21];
+  out = Listpack::get(Listpack::seek(lp, offset), scratch);
+  return true;
+}
+
+void Quicklist::compress(Node *node) {
+  if (node->compressed || node->raw_size < MIN_COMPRESS_BYTES)
+    return;
+  auto *buf = static_cast<uint8_t *>(object_alloc(node->raw_size));
+  size_t len = lzf_compress(node->data, node->raw_size, buf,
+                            node->raw_size - MIN_COMPRESS_GAIN);
+  if (len == 0) {
+    object_free(buf, node->raw_size);
+    return;
+  }
+  buf = static_cast<uint8_t *>(object_realloc(buf, node->raw_size, len));
+  Listpack::free(node->data);
+  node->data = buf;
+  node->size = len;
+  node->compressed = true;
+}
+
+void Quicklist::decompress(Node *node) {
+  if (!node->compressed)
+    return;
+  auto *lp = static_cast<uint8_t *>(object_alloc(node->raw_size));
+  lzf_decompress(node->data, node->size, lp, node->raw_size);
+  object_free(node->data, node->size);
+  node->data = lp;
+  node->size = node->raw_size;
+  node->compressed = false;
+}
+
+uint8_t *Quicklist::view(Node *node) {
+  if (!node->compressed)
+    return node->data;
+  m_scratch.resize(node->raw_size);
+  lzf_decompress(node->data, node->size, m_scratch.data(), node->raw_size);
+  return reinterpret_cast<uint8_t *>(m_scratch.data());
+}
+
+// Keeps the compress depth nodes at each end plain. Nodes only move one step
+// inwards per push, so compressing the next node in from each end is enough
+// to keep everything in the middle compressed.
+void Quicklist::compress_ends() {
+  if (m_compress_depth <= 0)
+    return;
+  Node *head = m_head;
+  Node *tail = m_tail;
+  for (int d = 0; d < m_compress_depth && head != nullptr; ++d) {
+    decompress(head);
+    decompress(tail);
+    head = head->next;
+    tail = tail->prev;
+  }
+  if (m_nodes > 2 * static_cast<size_t>(m_compress_depth)) {
+    compress(head);
+    compress(tail);
+  }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "Listpack.hpp"
+#include "ObjectAlloc.hpp"
+
+/*
+Quicklist: a doubly linked list of listpack nodes, the Redis list encoding.
+Pushes and pops touch only the end nodes (O(1)), while elements are packed a
+few kilobytes per node, so walking and per element overhead stay cheap.
+
+With a compress depth d > 0, every node but the d nodes at each end is kept
+LZF compressed; those are only decompressed into a scratch buffer to be read.
+*/
+class Quicklist : public TrackedObject {
+public:
+  static constexpr size_t NODE_MAX_BYTES = 8192;
+  static constexpr uint32_t NODE_MAX_COUNT = 65535;
+
+  explicit Quicklist(int compress_depth = 0);
+  ~Quicklist();
+  Quicklist(const Quicklist &) = delete;
+  Quicklist &operator=(const Quicklist &) = delete;
+
+  void push_head(std::string_view value);
+  void push_tail(std::string_view value);
+  bool pop_head(std::string &out);
+  bool pop_tail(std::string &out);
+
+  size_t length() const { return m_count; }
+  size_t nodes() const { return m_nodes; }
+
+  // Negative indexes count from the tail
+  bool index(long i, std::string &out);
+  // Calls fn(std::string_view) for the elements in [start, stop], which must
+  // be normalized (0 <= start <= stop < length())
+  template <typename F> void range(long start, long stop, F &&fn);
+
+private:
+  struct Node : public TrackedObject {
+    Node *prev = nullptr;
+    Node *next = nullptr;
+    // A listpack, or its LZF compressed form
+    uint8_t *data = nullptr;
+    uint32_t size = 0;     // bytes of data as stored
+    uint32_t raw_size = 0; // bytes of the listpack
+    uint32_t count = 0;
+    bool compressed = false;
+  };
+
+  Node *m_head = nullptr;
+  Node *m_tail = nullptr;
+  size_t m_count = 0;
+  size_t m_nodes = 0;
+  int m_compress_depth;
+  std::string m_scratch;
+
+  Node *new_node();
+  void delete_node(Node *node);
+  bool fits(const Node *node, std::string_view value) const;
+  void compress(Node *node);
+  void decompress(Node *node);
+  // Listpack of node, decompressed into the scratch buffer if needed
+  uint8_t *view(Node *node);
+  void compress_ends();
+  bool pop(Node *node, bool head, std::string &out);
+};
+
+template <typename F> void Quicklist::range(long start, long stop, F &&fn) {
+  // Skip the nodes before start
+  Node *node = m_head;
+  long node_start = 0;
+  while (node != nullptr && node_start + node->count <= start) {
+    node_start += node->count;
+    node = node->next;
+  }
+  long i = start;
+  for (; node != nullptr && i <= stop; node = node->next) {
+    uint8_t *lp = view(node);
+    uint8_t *p = Listpack::seek(lp, i - node_start);
+    for (; p != nullptr && i <= stop; p = Listpack::next(lp, p), ++i) {
+      char scratch[21];
+      fn(Listpack::get(p, scratch));
+    }
+    node_start += node->count;
+  }
+}
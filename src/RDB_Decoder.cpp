@@ -1,5 +1,17 @@
 #include "RDB_Decoder.hpp"
+#include "Clock.hpp"
+#include "Hash.hpp"
+#include "Lzf.hpp"
+#include "Quicklist.hpp"
+#include "RDB_Encoder.hpp"
+#include "Stream.hpp"
+#include "ZSet.hpp"
+#include <climits>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <spanstream>
+#include <unordered_set>
 
 #define DEBUG_RDB 0
 
@@ -15,7 +27,7 @@ Bits  How to parse - read the two most important bits first
 00    The next 6 bits represent the length
 01    Read one additional byte. The combined 14 bits represent the length
 10    Discard the remaining 6 bits. The next 4 bytes from the stream represent
-      the length
+      the length, or the next 8 bytes when the byte is 0x81
 11    The next object is encoded in a special format. The remaining 6
       bits indicate the format. May be used to store numbers or Strings, see
       String Encoding
@@ -23,17 +35,17 @@ Bits  How to parse - read the two most important bits first
 As a result of this encoding:
 Numbers up to and including 63 can be stored in 1 byte
 Numbers up to and including 16383 can be stored in 2 bytes
-Numbers up to 2^32 -1 can be stored in 4 bytes
+Numbers up to 2^32 -1 can be stored in 4 bytes, larger ones (stream IDs) in 8
 */
 
-template <typename T = unsigned char> T read(std::ifstream &rdb) {
-  T val;
+template <typename T = unsigned char> T read(std::istream &rdb) {
+  T val{};
   rdb.read(reinterpret_cast<char *>(&val), sizeof(val));
   return val;
 }
 
 std::pair<std::optional<uint64_t>, std::optional<int8_t>>
-RDB_Decoder::get_str_bytes_len(std::ifstream &rdb) {
+RDB_Decoder::get_str_bytes_len(std::istream &rdb) {
   // Read the first byte from the RDB file
   auto byte = read<uint8_t>(rdb);
 
@@ -56,9 +68,9 @@ RDB_Decoder::get_str_bytes_len(std::ifstream &rdb) {
   }
   case 2: {
     // If the two most significant bits are 10
-    // The length is the next 4 bytes
+    // The length is the next 4 bytes, or 8 after 0x81
     uint64_t sz = 0;
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < (byte == 0x81 ? 8 : 4); i++) {
       auto byte = read<uint8_t>(rdb);
       sz = (sz << 8) | byte;
     }
@@ -88,19 +100,66 @@ RDB_Decoder::get_str_bytes_len(std::ifstream &rdb) {
   return {std::nullopt, 0};
 }
 
-std::string RDB_Decoder::read_byte_to_string(std::ifstream &rdb) {
+// Whether rdb has len more bytes. Lengths come from the input, which RESTORE
+// takes from clients: a corrupt one must not allocate more than it holds.
+// Short ones cost little even when wrong and are not checked, seeking is not
+// free on files.
+static bool bytes_left(std::istream &rdb, uint64_t len) {
+  if (len <= 4096)
+    return true;
+  std::streampos pos = rdb.tellg();
+  if (pos < 0 || !rdb.seekg(0, std::ios::end))
+    return false;
+  std::streamoff left = rdb.tellg() - pos;
+  rdb.seekg(pos);
+  return left >= 0 && len <= static_cast<uint64_t>(left);
+}
+
+bool RDB_Decoder::read_lzf(std::istream &rdb, std::string &lzf,
+                           std::string &value) {
+  auto lzf_len = get_str_bytes_len(rdb);
+  auto len = get_str_bytes_len(rdb);
+  if (!rdb || !lzf_len.first.has_value() || !len.first.has_value() ||
+      lzf_len.first.value() == 0 || len.first.value() > UINT32_MAX ||
+      lzf_len.first.value() > len.first.value() ||
+      !bytes_left(rdb, lzf_len.first.value()))
+    return false;
+  // A 3 byte back reference copies at most 264 bytes, LZF does not expand
+  // anything more than 88 times
+  if (len.first.value() > lzf_len.first.value() * 88)
+    return false;
+  lzf.resize(lzf_len.first.value());
+  if (!rdb.read(lzf.data(), lzf.length()))
+    return false;
+  value.resize(len.first.value());
+  return lzf_decompress(lzf.data(), lzf.length(), value.data(),
+                        value.length()) == value.length();
+}
+
+std::string RDB_Decoder::read_byte_to_string(std::istream &rdb) {
+  if (rdb.peek() == RDB_ENC_LZF) {
+    rdb.get();
+    std::string lzf, value;
+    if (!read_lzf(rdb, lzf, value))
+      rdb.setstate(std::ios::failbit);
+    return value;
+  }
+
   std::pair<std::optional<uint64_t>, std::optional<int8_t>> decoded_size =
       get_str_bytes_len(rdb);
 
   if (decoded_size.first.has_value()) { // the length of the string is prefixed
-    int size = decoded_size.first.value();
-    std::vector<char> buffer(size);
-    rdb.read(buffer.data(), size);
-    return std::string(buffer.data(), size);
+    uint64_t size = decoded_size.first.value();
+    if (size > INT_MAX || !bytes_left(rdb, size)) {
+      rdb.setstate(std::ios::failbit);
+      return "";
+    }
+    std::string value(size, '\0');
+    rdb.read(value.data(), size);
+    return value;
   }
-  assert(
-      decoded_size.second.has_value()); // the string is encoded as an integer
-  int type = decoded_size.second.value();
+  // the string is encoded as an integer
+  int type = decoded_size.second.value_or(0);
   switch (type) {
   case 8: {
     auto val = read<int8_t>(rdb);
@@ -115,10 +174,416 @@ std::string RDB_Decoder::read_byte_to_string(std::ifstream &rdb) {
     return std::to_string(val);
   }
   default:
+    rdb.setstate(std::ios::failbit);
     return "";
   }
 }
 
+// The pairs of a hash or sorted set listpack read from disk have to be what
+// Hash and ZSet would have built: unique fields or members and, for sorted
+// sets, numeric scores in (score, member) order
+static bool valid_pairs(uint8_t *lp, bool zset) {
+  std::unordered_set<std::string> seen;
+  std::string last_member;
+  double last_score = -INFINITY;
+  for (uint8_t *p = Listpack::first(lp); p != nullptr;) {
+    char scratch[21];
+    std::string member(Listpack::get(p, scratch));
+    uint8_t *second = Listpack::next(lp, p);
+    p = Listpack::next(lp, second);
+    if (!zset) {
+      if (!seen.insert(std::move(member)).second)
+        return false;
+      continue;
+    }
+    int64_t integer;
+    double score = 0;
+    if (Listpack::get_int(second, integer))
+      score = integer;
+    else if (!parse_score(Listpack::get(second, scratch), score))
+      return false;
+    if (!seen.empty() &&
+        (score < last_score || (score == last_score && member < last_member)))
+      return false;
+    if (!seen.insert(member).second)
+      return false;
+    last_score = score;
+    last_member = std::move(member);
+  }
+  return true;
+}
+
+// Calls push with every element of a ziplist, the list node encoding of
+// RDB_TYPE_LIST_QUICKLIST: a header (total bytes u32, tail offset u32, count
+// u16), entries made of the previous entry length (1 byte, or 0xFE and 4),
+// an encoding and the data, and a 0xFF end byte. Returns false if it is
+// malformed.
+template <typename F> static bool read_ziplist(std::string_view zl, F &&push) {
+  auto u8 = [&](size_t at) { return static_cast<uint8_t>(zl[at]); };
+  auto little = [&](size_t at, int bytes) {
+    uint64_t value = 0;
+    for (int n = bytes - 1; n >= 0; --n)
+      value = (value << 8) | u8(at + n);
+    return value;
+  };
+  size_t pos = 10;
+  if (zl.length() < pos + 1 || little(0, 4) != zl.length())
+    return false;
+  while (pos < zl.length() && u8(pos) != 0xFF) {
+    pos += u8(pos) == 0xFE ? 5 : 1;
+    if (pos >= zl.length())
+      return false;
+    uint8_t enc = u8(pos);
+    uint64_t len;
+    size_t header;
+    if ((enc >> 6) == 0) {
+      len = enc & 0x3F;
+      header = 1;
+    } else if ((enc >> 6) == 1) {
+      if (pos + 2 > zl.length())
+        return false;
+      len = ((enc & 0x3F) << 8) | u8(pos + 1);
+      header = 2;
+    } else if (enc == 0x80) {
+      if (pos + 5 > zl.length())
+        return false;
+      // The only big endian length
+      len = (uint64_t(u8(pos + 1)) << 24) | (u8(pos + 2) << 16) |
+            (u8(pos + 3) << 8) | u8(pos + 4);
+      header = 5;
+    } else {
+      // Integers: int16, int32, int64, int24, int8, or 0 to 12 in the
+      // encoding byte itself
+      int bytes;
+      switch (enc) {
+      case 0xC0:
+        bytes = 2;
+        break;
+      case 0xD0:
+        bytes = 4;
+        break;
+      case 0xE0:
+        bytes = 8;
+        break;
+      case 0xF0:
+        bytes = 3;
+        break;
+      case 0xFE:
+        bytes = 1;
+        break;
+      default:
+        if (enc < 0xF1 || enc > 0xFD)
+          return false;
+        bytes = 0;
+      }
+      if (pos + 1 + bytes > zl.length())
+        return false;
+      int64_t value;
+      if (bytes == 0) {
+        value = (enc & 0x0F) - 1;
+      } else {
+        // Sign extended from its width
+        int shift = 64 - 8 * bytes;
+        value = static_cast<int64_t>(little(pos + 1, bytes) << shift) >> shift;
+      }
+      push(std::to_string(value));
+      pos += 1 + bytes;
+      continue;
+    }
+    if (len > zl.length() - pos - header)
+      return false;
+    push(zl.substr(pos + header, len));
+    pos += header + len;
+  }
+  return pos == zl.length() - 1;
+}
+
+// Reads the value of key, stored with the given value type. Returns nullptr
+// for types that are not supported or malformed values, and does not throw:
+// RESTORE reads values clients send.
+DB_Entry *RDB_Decoder::read_object(std::istream &rdb, uint8_t type,
+                                   const std::string &key, uint64_t expiry) {
+  // With --threads the entry is allocated by the partition that owns it
+  SlabAllocator &alloc = config.partition_for(key).db.allocator();
+  switch (type) {
+  case RDB_TYPE_STRING: {
+    size_t compress_min = config.string_compress_min_size;
+    if (rdb.peek() != RDB_ENC_LZF)
+      return DB_Entry::create(alloc, key, read_byte_to_string(rdb), expiry,
+                              compress_min);
+    // Stays compressed as it is if it would have been compressed anyway
+    rdb.get();
+    std::string lzf, value;
+    if (!read_lzf(rdb, lzf, value))
+      return nullptr;
+    if (compress_min > 0 && value.length() >= compress_min &&
+        lzf.length() <= DB_Entry::max_compressed(value.length()))
+      return DB_Entry::create_lzf(alloc, key, lzf, value.length(), expiry);
+    return DB_Entry::create(alloc, key, value, expiry);
+  }
+
+  case RDB_TYPE_LIST:
+  case RDB_TYPE_LIST_QUICKLIST:
+  case RDB_TYPE_LIST_QUICKLIST_2: {
+    // Number of elements, then the elements from head to tail. The
+    // quicklists of Redis 3.2 and later store a number of nodes instead, each
+    // a ziplist, or since Redis 7 a container followed by a single element or
+    // a listpack, in a string.
+    auto len = get_str_bytes_len(rdb);
+    if (!len.first.has_value())
+      return nullptr;
+    auto *list = new Quicklist(config.list_compress_depth);
+    try {
+      for (uint64_t n = 0; n < len.first.value() && rdb; ++n) {
+        if (type == RDB_TYPE_LIST) {
+          list->push_tail(read_byte_to_string(rdb));
+          continue;
+        }
+        uint64_t container = RDB_QUICKLIST_NODE_PACKED;
+        if (type == RDB_TYPE_LIST_QUICKLIST_2)
+          container = get_str_bytes_len(rdb).first.value_or(0);
+        std::string node = read_byte_to_string(rdb);
+        if (!rdb)
+          break;
+        bool valid = true;
+        if (type == RDB_TYPE_LIST_QUICKLIST) {
+          valid = read_ziplist(node, [&](std::string_view element) {
+            list->push_tail(element);
+          });
+        } else if (container == RDB_QUICKLIST_NODE_PLAIN) {
+          list->push_tail(node);
+        } else if (container == RDB_QUICKLIST_NODE_PACKED &&
+                   Listpack::validate(
+                       reinterpret_cast<const uint8_t *>(node.data()),
+                       node.length())) {
+          auto *lp = reinterpret_cast<uint8_t *>(node.data());
+          for (uint8_t *p = Listpack::first(lp); p != nullptr;
+               p = Listpack::next(lp, p)) {
+            char scratch[21];
+            list->push_tail(Listpack::get(p, scratch));
+          }
+        } else {
+          valid = false;
+        }
+        if (!valid) {
+          delete list;
+          std::cerr << "Invalid list node for key: " << key << std::endl;
+          return nullptr;
+        }
+      }
+      return DB_Entry::create_object(alloc, key, ValueType::List,
+                                     Encoding::Quicklist, list, expiry);
+    } catch (const std::exception &e) {
+      delete list;
+      std::cerr << "Could not read list " << key << ": " << e.what()
+                << std::endl;
+      return nullptr;
+    }
+  }
+
+  case RDB_TYPE_HASH: {
+    // Number of fields, then field and value strings
+    auto len = get_str_bytes_len(rdb);
+    if (!len.first.has_value())
+      return nullptr;
+    DB_Entry *entry = Hash::create(alloc, key, expiry);
+    try {
+      for (uint64_t n = 0; n < len.first.value(); ++n) {
+        std::string field = read_byte_to_string(rdb);
+        std::string value = read_byte_to_string(rdb);
+        if (!rdb)
+          break;
+        if (!Hash::set(entry, field, value, config)) {
+          std::cerr << "Duplicate hash field for key: " << key << std::endl;
+          DB_Entry::destroy(alloc, entry);
+          return nullptr;
+        }
+      }
+    } catch (const std::exception &e) {
+      DB_Entry::destroy(alloc, entry);
+      std::cerr << "Could not read hash " << key << ": " << e.what()
+                << std::endl;
+      return nullptr;
+    }
+    return entry;
+  }
+
+  case RDB_TYPE_ZSET:
+  case RDB_TYPE_ZSET_2: {
+    // Number of members, then members and scores: as text in the old
+    // format, as little endian doubles in ZSET_2
+    auto len = get_str_bytes_len(rdb);
+    if (!len.first.has_value())
+      return nullptr;
+    DB_Entry *entry = ZSet::create(alloc, key, expiry);
+    try {
+      for (uint64_t n = 0; n < len.first.value(); ++n) {
+        std::string member = read_byte_to_string(rdb);
+        double score = 0;
+        bool valid;
+        if (type == RDB_TYPE_ZSET_2) {
+          score = read<double>(rdb);
+          valid = !std::isnan(score);
+        } else {
+          // A length byte, then the score as text
+          uint8_t score_len = read<uint8_t>(rdb);
+          std::string text(score_len, '\0');
+          rdb.read(text.data(), score_len);
+          valid = parse_score(text, score);
+        }
+        if (!rdb)
+          break;
+        if (!valid || !ZSet::add(entry, member, score, config)) {
+          std::cerr << "Invalid sorted set member for key: " << key
+                    << std::endl;
+          DB_Entry::destroy(alloc, entry);
+          return nullptr;
+        }
+      }
+    } catch (const std::exception &e) {
+      DB_Entry::destroy(alloc, entry);
+      std::cerr << "Could not read sorted set " << key << ": " << e.what()
+                << std::endl;
+      return nullptr;
+    }
+    return entry;
+  }
+
+  case RDB_TYPE_HASH_LISTPACK:
+  case RDB_TYPE_ZSET_LISTPACK: {
+    // A string holding the listpack exactly as Redis keeps it in memory
+    std::string blob = read_byte_to_string(rdb);
+    auto *data = reinterpret_cast<const uint8_t *>(blob.data());
+    if (!Listpack::validate(data, blob.length()) ||
+        Listpack::length(data) % 2 != 0) {
+      std::cerr << "Invalid listpack for key: " << key << std::endl;
+      return nullptr;
+    }
+    auto *lp = static_cast<uint8_t *>(object_alloc(blob.length()));
+    memcpy(lp, blob.data(), blob.length());
+    if (!valid_pairs(lp, type == RDB_TYPE_ZSET_LISTPACK)) {
+      Listpack::free(lp);
+      std::cerr << "Invalid listpack for key: " << key << std::endl;
+      return nullptr;
+    }
+    // Both free the listpack when they throw
+    try {
+      if (type == RDB_TYPE_ZSET_LISTPACK)
+        return ZSet::from_listpack(alloc, key, lp, config, expiry);
+      return Hash::from_listpack(alloc, key, lp, config, expiry);
+    } catch (const std::exception &e) {
+      std::cerr << "Could not read listpack " << key << ": " << e.what()
+                << std::endl;
+      return nullptr;
+    }
+  }
+
+  case RDB_TYPE_STREAM_LISTPACKS:
+  case RDB_TYPE_STREAM_LISTPACKS_2:
+  case RDB_TYPE_STREAM_LISTPACKS_3:
+    try {
+      return read_stream(rdb, type, key, expiry);
+    } catch (const std::exception &e) {
+      std::cerr << "Could not read stream " << key << ": " << e.what()
+                << std::endl;
+      return nullptr;
+    }
+
+  default:
+    std::cerr << "Unsupported RDB value type: " << static_cast<int>(type)
+              << std::endl;
+    return nullptr;
+  }
+}
+
+// The blocks, each a 16 byte master ID and a listpack string, then the
+// length and last ID. Later types add the first ID, the last deleted ID and
+// the number of entries ever added, which are not kept. Consumer groups come
+// last and are not supported.
+DB_Entry *RDB_Decoder::read_stream(std::istream &rdb, uint8_t type,
+                                   const std::string &key, uint64_t expiry) {
+  auto read_length = [&](uint64_t &out) {
+    auto len = get_str_bytes_len(rdb);
+    out = len.first.value_or(0);
+    return len.first.has_value() && rdb;
+  };
+  auto stream = std::make_unique<Stream>();
+  uint64_t blocks;
+  if (!read_length(blocks))
+    return nullptr;
+  for (uint64_t n = 0; n < blocks; ++n) {
+    std::string master = read_byte_to_string(rdb);
+    std::string blob = read_byte_to_string(rdb);
+    auto *data = reinterpret_cast<const uint8_t *>(blob.data());
+    if (!rdb || master.length() != RadixTree::KEY_SIZE ||
+        !Listpack::validate(data, blob.length())) {
+      std::cerr << "Invalid stream block for key: " << key << std::endl;
+      return nullptr;
+    }
+    RadixTree::Key block_key;
+    memcpy(block_key.data(), master.data(), RadixTree::KEY_SIZE);
+    auto *lp = static_cast<uint8_t *>(object_alloc(blob.length()));
+    memcpy(lp, blob.data(), blob.length());
+    if (!stream->adopt_block(block_key, lp)) {
+      Listpack::free(lp);
+      std::cerr << "Invalid stream block for key: " << key << std::endl;
+      return nullptr;
+    }
+  }
+  uint64_t length, groups, unused;
+  StreamID last_id;
+  if (!read_length(length) || !read_length(last_id.ms) ||
+      !read_length(last_id.seq))
+    return nullptr;
+  if (type != RDB_TYPE_STREAM_LISTPACKS)
+    for (int n = 0; n < 5; ++n)
+      if (!read_length(unused))
+        return nullptr;
+  if (!read_length(groups))
+    return nullptr;
+  if (groups != 0) {
+    std::cerr << "Unsupported stream consumer groups for key: " << key
+              << std::endl;
+    return nullptr;
+  }
+  if (!stream->finish_load(length, last_id)) {
+    std::cerr << "Invalid stream length or last ID for key: " << key
+              << std::endl;
+    return nullptr;
+  }
+  SlabAllocator &alloc = config.partition_for(key).db.allocator();
+  DB_Entry *entry = DB_Entry::create_object(alloc, key, ValueType::Stream,
+                                            Encoding::Stream, stream.get(),
+                                            expiry);
+  stream.release();
+  return entry;
+}
+
+DB_Entry *RDB_Decoder::restore(std::string_view payload,
+                                const std::string &key, uint64_t expiry) {
+  // Type byte, object, then the 2 byte version and 8 byte checksum footer
+  if (payload.length() < 11)
+    return nullptr;
+  size_t footer = payload.length() - 10;
+  auto *bytes = reinterpret_cast<const uint8_t *>(payload.data());
+  uint16_t version = bytes[footer] | (bytes[footer + 1] << 8);
+  uint64_t checksum;
+  memcpy(&checksum, bytes + footer + 2, sizeof(checksum));
+  if (version > RDB_VERSION || crc64(0, payload.data(), footer + 2) != checksum)
+    return nullptr;
+
+  std::ispanstream object(
+      std::span<const char>(payload.data() + 1, footer - 1));
+  DB_Entry *entry = read_object(object, bytes[0], key, expiry);
+  // The object has to end right at the footer
+  if (entry != nullptr &&
+      (!object || object.tellg() != static_cast<std::streamoff>(footer - 1))) {
+    DB_Entry::destroy(config.partition_for(key).db.allocator(), entry);
+    return nullptr;
+  }
+  return entry;
+}
+
 // encoding -> https://rdb.fnordig.de/file_format.html#length-encoding
 // https://github.com/sripathikrishnan/redis-rdb-tools/wiki/Redis-RDB-Dump-File-Format
 // https://app.codecrafters.io/courses/redis/stages/jz6
@@ -171,6 +636,9 @@ int RDB_Decoder::read_rdb() {
     return 0;
   }
 
+  Clock::update();
+  uint64_t now = Clock::now_ms();
+
   char header[9];
   rdb.read(header, 9);
   if (DEBUG_RDB != 0)
@@ -236,15 +704,11 @@ int RDB_Decoder::read_rdb() {
       break;
     }
 
-    uint64_t expire_time_s = 0;
     uint64_t expire_time_ms = 0;
     if (opcode ==
         0xFD) { // expiry time in seconds followed by 4 byte - uint32_t
-      uint32_t seconds;
-      rdb.read(reinterpret_cast<char *>(&seconds), sizeof(seconds));
-      expire_time_s = read<uint32_t>(rdb);
+      expire_time_ms = static_cast<uint64_t>(read<uint32_t>(rdb)) * 1000;
       opcode = read<uint8_t>(rdb);
-      // rdb.read(reinterpret_cast<char *>(&opcode), 1);
       if (DEBUG_RDB != 0)
         std::cout << "EXPIRETIME: " << expire_time_ms << std::endl;
     }
@@ -256,17 +720,21 @@ int RDB_Decoder::read_rdb() {
         std::cout << "EXPIRETIMEMS: " << expire_time_ms << std::endl;
     }
 
-    // After 0xFD and 0x FC, comes the key-pair-value
+    // After 0xFD and 0x FC, comes the value type and the key-pair-value
     std::string key = read_byte_to_string(rdb);
-    std::string value = read_byte_to_string(rdb);
+    DB_Entry *entry = read_object(rdb, opcode, key, expire_time_ms);
+    if (entry == nullptr)
+      return -1;
 
-    uint64_t now = std::chrono::duration_cast<std::chrono::seconds>(
-                       std::chrono::system_clock::now().time_since_epoch())
-                       .count();
-    if (expire_time_s == 0 || expire_time_ms > now) {
+    // Both expiry forms are normalized to ms and compared with the same clock
+    // used for lazy expiry, keys already expired are not loaded
+    DB_Config &partition = config.partition_for(key);
+    if (expire_time_ms == 0 || expire_time_ms > now) {
       if (DEBUG_RDB != 0)
-        std::cout << "adding " << key << " - " << value << std::endl;
-      config.db.insert_or_assign(key, DB_Entry({value, 0, expire_time_ms}));
+        std::cout << "adding " << key << std::endl;
+      partition.db.insert(entry);
+    } else {
+      DB_Entry::destroy(partition.db.allocator(), entry);
     }
   }
 
@@ -6,18 +6,56 @@
 #include <iostream>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unistd.h>
 
 #include "DB.hpp"
 
+// Value types, the byte in front of every key
+#define RDB_TYPE_STRING 0
+#define RDB_TYPE_LIST 1
+#define RDB_TYPE_ZSET 3
+#define RDB_TYPE_HASH 4
+#define RDB_TYPE_ZSET_2 5
+#define RDB_TYPE_LIST_QUICKLIST 14
+#define RDB_TYPE_STREAM_LISTPACKS 15
+#define RDB_TYPE_HASH_LISTPACK 16
+#define RDB_TYPE_ZSET_LISTPACK 17
+#define RDB_TYPE_LIST_QUICKLIST_2 18
+#define RDB_TYPE_STREAM_LISTPACKS_2 19
+#define RDB_TYPE_STREAM_LISTPACKS_3 21
+
+// Containers of the nodes of a RDB_TYPE_LIST_QUICKLIST_2: a single element
+// or a listpack
+#define RDB_QUICKLIST_NODE_PLAIN 1
+#define RDB_QUICKLIST_NODE_PACKED 2
+
+// String encoding of LZF compressed strings: the compressed length, the
+// string length, then the LZF bytes
+#define RDB_ENC_LZF 0xC3
+
+// Newest RDB format version whose objects can be read
+#define RDB_VERSION 11
+
 class RDB_Decoder {
 private:
   DB_Config &config;
   std::pair<std::optional<uint64_t>, std::optional<int8_t>>
-  get_str_bytes_len(std::ifstream &rdb);
-  std::string read_byte_to_string(std::ifstream &rdb);
+  get_str_bytes_len(std::istream &rdb);
+  std::string read_byte_to_string(std::istream &rdb);
+  // Reads an LZF string whose RDB_ENC_LZF byte was read: its LZF bytes into
+  // lzf and the string into value. Returns false if it is corrupt.
+  bool read_lzf(std::istream &rdb, std::string &lzf, std::string &value);
+  DB_Entry *read_object(std::istream &rdb, uint8_t type,
+                        const std::string &key, uint64_t expiry);
+  DB_Entry *read_stream(std::istream &rdb, uint8_t type,
+                        const std::string &key, uint64_t expiry);
 
 public:
   RDB_Decoder(DB_Config &t_config) : config(t_config){};
   int read_rdb();
+  // Builds the entry of a DUMP payload (see RDB_Encoder.hpp), nullptr if the
+  // payload is corrupt or holds an unsupported type
+  DB_Entry *restore(std::string_view payload, const std::string &key,
+                    uint64_t expiry);
 };
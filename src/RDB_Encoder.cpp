@@ -0,0 +1,146 @@
+#include "RDB_Encoder.hpp"
+#include "Hash.hpp"
+#include "Quicklist.hpp"
+#include "RDB_Decoder.hpp"
+#include "Stream.hpp"
+#include "ZSet.hpp"
+#include <cstring>
+
+// See the length encoding table in RDB_Decoder.cpp
+void RDB_Encoder::write_length(std::string &out, uint64_t len) {
+  if (len < (1 << 6)) {
+    out += static_cast<char>(len);
+  } else if (len < (1 << 14)) {
+    out += static_cast<char>(0x40 | (len >> 8));
+    out += static_cast<char>(len & 0xFF);
+  } else if (len <= UINT32_MAX) {
+    out += static_cast<char>(0x80);
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out += static_cast<char>((len >> shift) & 0xFF);
+  } else {
+    out += static_cast<char>(0x81);
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out += static_cast<char>((len >> shift) & 0xFF);
+  }
+}
+
+void RDB_Encoder::write_string(std::string &out, std::string_view str) {
+  write_length(out, str.length());
+  out += str;
+}
+
+// Integers that fit 1, 2 or 4 bytes are written as 0xC0, 0xC1 or 0xC2 and the
+// value, little endian
+static bool write_int_string(std::string &out, int64_t value) {
+  int bytes;
+  if (value >= INT8_MIN && value <= INT8_MAX)
+    bytes = 1;
+  else if (value >= INT16_MIN && value <= INT16_MAX)
+    bytes = 2;
+  else if (value >= INT32_MIN && value <= INT32_MAX)
+    bytes = 4;
+  else
+    return false;
+  out += static_cast<char>(0xC0 | (bytes >> 1));
+  for (int n = 0; n < bytes; ++n)
+    out += static_cast<char>((value >> (8 * n)) & 0xFF);
+  return true;
+}
+
+void RDB_Encoder::write_object(std::string &out, DB_Entry *entry) {
+  switch (entry->type) {
+  case ValueType::String: {
+    out += static_cast<char>(RDB_TYPE_STRING);
+    if (entry->encoding == Encoding::Int &&
+        write_int_string(out, entry->value.integer))
+      return;
+    if (entry->encoding == Encoding::Compressed) {
+      // The LZF bytes as they are: 0xC3, their length, the value length
+      out += static_cast<char>(RDB_ENC_LZF);
+      write_length(out, entry->value.raw->len);
+      write_length(out, entry->value_len());
+      out.append(entry->value.raw->buf, entry->value.raw->len);
+      return;
+    }
+    DB_Entry::Scratch scratch;
+    write_string(out, entry->str(scratch));
+    return;
+  }
+
+  case ValueType::List: {
+    out += static_cast<char>(RDB_TYPE_LIST);
+    auto *list = static_cast<Quicklist *>(entry->value.object);
+    write_length(out, list->length());
+    if (list->length() > 0)
+      list->range(0, list->length() - 1,
+                  [&out](std::string_view value) { write_string(out, value); });
+    return;
+  }
+
+  case ValueType::Hash:
+  case ValueType::ZSet: {
+    bool hash = entry->type == ValueType::Hash;
+    if (entry->encoding == Encoding::Listpack) {
+      auto *lp = static_cast<const uint8_t *>(entry->value.object);
+      out += static_cast<char>(hash ? RDB_TYPE_HASH_LISTPACK
+                                    : RDB_TYPE_ZSET_LISTPACK);
+      write_string(out, std::string_view(reinterpret_cast<const char *>(lp),
+                                         Listpack::bytes(lp)));
+      return;
+    }
+    if (hash) {
+      out += static_cast<char>(RDB_TYPE_HASH);
+      write_length(out, Hash::length(entry));
+      Hash::for_each(entry, [&out](std::string_view field,
+                                   std::string_view value) {
+        write_string(out, field);
+        write_string(out, value);
+      });
+      return;
+    }
+    out += static_cast<char>(RDB_TYPE_ZSET_2);
+    size_t length = ZSet::length(entry);
+    write_length(out, length);
+    ZSet::range_by_rank(entry, 0, length - 1, false,
+                        [&out](std::string_view member, double score) {
+                          write_string(out, member);
+                          char bytes[sizeof(double)];
+                          memcpy(bytes, &score, sizeof(score));
+                          out.append(bytes, sizeof(bytes));
+                        });
+    return;
+  }
+
+  case ValueType::Stream: {
+    // Blocks as they are, no consumer groups (see RDB_Decoder::read_stream)
+    out += static_cast<char>(RDB_TYPE_STREAM_LISTPACKS);
+    auto *stream = static_cast<const Stream *>(entry->value.object);
+    write_length(out, stream->blocks());
+    stream->for_each_block([&out](const RadixTree::Key &key,
+                                  const uint8_t *lp) {
+      write_string(out, std::string_view(
+                            reinterpret_cast<const char *>(key.data()),
+                            key.size()));
+      write_string(out, std::string_view(reinterpret_cast<const char *>(lp),
+                                         Listpack::bytes(lp)));
+    });
+    write_length(out, stream->length());
+    write_length(out, stream->last_id().ms);
+    write_length(out, stream->last_id().seq);
+    write_length(out, 0);
+    return;
+  }
+  }
+}
+
+std::string RDB_Encoder::dump(DB_Entry *entry) {
+  std::string payload;
+  write_object(payload, entry);
+  payload += static_cast<char>(RDB_VERSION & 0xFF);
+  payload += static_cast<char>(RDB_VERSION >> 8);
+  uint64_t checksum = crc64(0, payload.data(), payload.length());
+  char bytes[sizeof(checksum)];
+  memcpy(bytes, &checksum, sizeof(checksum));
+  payload.append(bytes, sizeof(bytes));
+  return payload;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "Crc64.hpp"
+#include "DB_Entry.hpp"
+
+/*
+Writes values in the RDB object format RDB_Decoder reads, for DUMP and
+MIGRATE. Strings are length prefixed (small integers use the integer string
+encodings, Compressed values the LZF one with their bytes as they are), lists
+are plain element lists, and hashes and sorted sets are written as the
+listpack they already are or as field/value and member/score sequences.
+
+A DUMP payload is the value type byte and the object, followed by the RDB
+version (2 bytes) and a CRC64 of everything before it (8 bytes), both little
+endian, like Redis' own.
+*/
+struct RDB_Encoder {
+  static void write_length(std::string &out, uint64_t len);
+  static void write_string(std::string &out, std::string_view str);
+  // Appends the value type byte and the value of entry
+  static void write_object(std::string &out, DB_Entry *entry);
+  static std::string dump(DB_Entry *entry);
+};
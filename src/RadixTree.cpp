@@ -0,0 +1,177 @@
+#include "RadixTree.hpp"
+#include <algorithm>
+#include <cstring>
+
+RadixTree::~RadixTree() { destroy(m_root); }
+
+void RadixTree::destroy(Node *node) {
+  if (node == nullptr)
+    return;
+  for (Node *child : node->children)
+    destroy(child);
+  delete node;
+}
+
+// A leaf holding the rest of key from depth
+RadixTree::Node *RadixTree::leaf(const Key &key, size_t depth, void *value) {
+  Node *node = new Node;
+  node->prefix_len = KEY_SIZE - depth;
+  memcpy(node->prefix, key.data() + depth, node->prefix_len);
+  node->value = value;
+  return node;
+}
+
+bool RadixTree::insert(const Key &key, void *value) {
+  if (!insert(m_root, key, 0, value))
+    return false;
+  ++m_size;
+  return true;
+}
+
+bool RadixTree::insert(Node *&slot, const Key &key, size_t depth,
+                       void *value) {
+  if (slot == nullptr) {
+    slot = leaf(key, depth, value);
+    return true;
+  }
+  Node *node = slot;
+  size_t common = 0;
+  while (common < node->prefix_len &&
+         node->prefix[common] == key[depth + common])
+    ++common;
+  if (common < node->prefix_len) {
+    // Split the prefix where key leaves it
+    Node *parent = new Node;
+    parent->prefix_len = common;
+    memcpy(parent->prefix, node->prefix, common);
+    uint8_t old_byte = node->prefix[common];
+    uint8_t new_byte = key[depth + common];
+    node->prefix_len -= common + 1;
+    memmove(node->prefix, node->prefix + common + 1, node->prefix_len);
+    Node *added = leaf(key, depth + common + 1, value);
+    if (old_byte < new_byte) {
+      parent->bytes = {old_byte, new_byte};
+      parent->children = {node, added};
+    } else {
+      parent->bytes = {new_byte, old_byte};
+      parent->children = {added, node};
+    }
+    slot = parent;
+    return true;
+  }
+  depth += node->prefix_len;
+  if (depth == KEY_SIZE)
+    return false;
+  auto it = std::lower_bound(node->bytes.begin(), node->bytes.end(),
+                             key[depth]);
+  size_t c = it - node->bytes.begin();
+  if (it != node->bytes.end() && *it == key[depth])
+    return insert(node->children[c], key, depth + 1, value);
+  node->bytes.insert(it, key[depth]);
+  node->children.insert(node->children.begin() + c,
+                        leaf(key, depth + 1, value));
+  return true;
+}
+
+void **RadixTree::find(const Key &key) {
+  Node *node = m_root;
+  size_t depth = 0;
+  while (node != nullptr) {
+    if (memcmp(node->prefix, key.data() + depth, node->prefix_len) != 0)
+      return nullptr;
+    depth += node->prefix_len;
+    if (depth == KEY_SIZE)
+      return &node->value;
+    auto it = std::lower_bound(node->bytes.begin(), node->bytes.end(),
+                               key[depth]);
+    if (it == node->bytes.end() || *it != key[depth])
+      return nullptr;
+    node = node->children[it - node->bytes.begin()];
+    ++depth;
+  }
+  return nullptr;
+}
+
+bool RadixTree::erase(const Key &key) {
+  if (!erase(m_root, key, 0))
+    return false;
+  --m_size;
+  return true;
+}
+
+bool RadixTree::erase(Node *&slot, const Key &key, size_t depth) {
+  Node *node = slot;
+  if (node == nullptr ||
+      memcmp(node->prefix, key.data() + depth, node->prefix_len) != 0)
+    return false;
+  depth += node->prefix_len;
+  if (depth == KEY_SIZE) {
+    delete node;
+    slot = nullptr;
+    return true;
+  }
+  auto it = std::lower_bound(node->bytes.begin(), node->bytes.end(),
+                             key[depth]);
+  size_t c = it - node->bytes.begin();
+  if (it == node->bytes.end() || *it != key[depth] ||
+      !erase(node->children[c], key, depth + 1))
+    return false;
+  if (node->children[c] != nullptr)
+    return true;
+  node->bytes.erase(it);
+  node->children.erase(node->children.begin() + c);
+  if (node->children.size() == 1) {
+    // Merge the node into its only child
+    Node *child = node->children[0];
+    uint8_t merged[KEY_SIZE];
+    size_t len = node->prefix_len;
+    memcpy(merged, node->prefix, len);
+    merged[len++] = node->bytes[0];
+    memcpy(merged + len, child->prefix, child->prefix_len);
+    child->prefix_len += len;
+    memcpy(child->prefix, merged, child->prefix_len);
+    delete node;
+    slot = child;
+  }
+  return true;
+}
+
+bool RadixTree::seek_ge(const Key &key, Key &found, void *&value) const {
+  return m_root != nullptr && seek(m_root, key, 0, true, true, found, value);
+}
+
+bool RadixTree::seek_le(const Key &key, Key &found, void *&value) const {
+  return m_root != nullptr && seek(m_root, key, 0, true, false, found, value);
+}
+
+// While tied the path so far equals key; once it went past key (in the
+// direction sought) any key of the subtree will do, the first or last one.
+bool RadixTree::seek(const Node *node, const Key &key, size_t depth,
+                     bool tied, bool ge, Key &found, void *&value) {
+  memcpy(found.data() + depth, node->prefix, node->prefix_len);
+  if (tied) {
+    int cmp = memcmp(node->prefix, key.data() + depth, node->prefix_len);
+    if (cmp != 0) {
+      if ((cmp > 0) != ge)
+        return false;
+      tied = false;
+    }
+  }
+  depth += node->prefix_len;
+  if (depth == KEY_SIZE) {
+    value = node->value;
+    return true;
+  }
+  size_t count = node->children.size();
+  for (size_t n = 0; n < count; ++n) {
+    size_t c = ge ? n : count - 1 - n;
+    uint8_t byte = node->bytes[c];
+    if (tied && (ge ? byte < key[depth] : byte > key[depth]))
+      continue;
+    found[depth] = byte;
+    if (seek(node->children[c], key, depth + 1, tied && byte == key[depth],
+             ge, found, value))
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ObjectAlloc.hpp"
+
+/*
+Ordered map from fixed size binary keys to pointers, the index of stream
+blocks (see Stream.hpp), whose keys are big endian IDs so that byte order is
+ID order.
+
+A path compressed radix tree: every node holds the key bytes it consumes and,
+unless it is a leaf, its children sorted by the byte that follows. Consecutive
+IDs share all but their last bytes, so a stream of a million blocks is a few
+levels of wide nodes rather than 16 levels of single child ones. Nodes with a
+single child are merged into it, so every inner node branches.
+*/
+class RadixTree {
+public:
+  static constexpr size_t KEY_SIZE = 16;
+  typedef std::array<uint8_t, KEY_SIZE> Key;
+
+  RadixTree() = default;
+  ~RadixTree();
+  RadixTree(const RadixTree &) = delete;
+  RadixTree &operator=(const RadixTree &) = delete;
+
+  size_t size() const { return m_size; }
+  // False if key is already there
+  bool insert(const Key &key, void *value);
+  // Where the value of key is kept, to read or replace it, or nullptr
+  void **find(const Key &key);
+  bool erase(const Key &key);
+  // The first key >= key / the last key <= key, false if there is none
+  bool seek_ge(const Key &key, Key &found, void *&value) const;
+  bool seek_le(const Key &key, Key &found, void *&value) const;
+  // Calls fn(key, value) for every key in order
+  template <typename F> void for_each(F &&fn) const;
+
+private:
+  struct Node : TrackedObject {
+    uint8_t prefix_len = 0;
+    uint8_t prefix[KEY_SIZE];
+    void *value = nullptr; // leaves
+    std::vector<uint8_t, ObjectAllocator<uint8_t>> bytes;
+    std::vector<Node *, ObjectAllocator<Node *>> children;
+  };
+
+  Node *m_root = nullptr;
+  size_t m_size = 0;
+
+  static Node *leaf(const Key &key, size_t depth, void *value);
+  static void destroy(Node *node);
+  bool insert(Node *&slot, const Key &key, size_t depth, void *value);
+  bool erase(Node *&slot, const Key &key, size_t depth);
+  static bool seek(const Node *node, const Key &key, size_t depth, bool tied,
+                   bool ge, Key &found, void *&value);
+  template <typename F>
+  static void for_each(const Node *node, size_t depth, Key &key, F &fn);
+};
+
+template <typename F> void RadixTree::for_each(F &&fn) const {
+  Key key;
+  if (m_root != nullptr)
+    for_each(m_root, 0, key, fn);
+}
+
+template <typename F>
+void RadixTree::for_each(const Node *node, size_t depth, Key &key, F &fn) {
+  for (size_t n = 0; n < node->prefix_len; ++n)
+    key[depth + n] = node->prefix[n];
+  depth += node->prefix_len;
+  if (depth == KEY_SIZE) {
+    fn(static_cast<const Key &>(key), node->value);
+    return;
+  }
+  for (size_t c = 0; c < node->children.size(); ++c) {
+    key[depth] = node->bytes[c];
+    for_each(node->children[c], depth + 1, key, fn);
+  }
+}
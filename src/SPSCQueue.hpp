@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+/*
+Bounded single producer, single consumer queue. Each side only writes its own
+index, so push and pop are a few loads and one release store, no locks and no
+read-modify-write. Each side also caches the other's index and only reloads it
+when the queue looks full (producer) or empty (consumer), so the two cache
+lines are not bounced on every operation.
+*/
+template <typename T, size_t Capacity> class SPSCQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "capacity must be a power of two");
+
+public:
+  // Producer only, false when the queue is full
+  bool push(const T &value) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head_cache == Capacity) {
+      m_head_cache = m_head.load(std::memory_order_acquire);
+      if (tail - m_head_cache == Capacity)
+        return false;
+    }
+    m_items[tail & (Capacity - 1)] = value;
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only, false when the queue is empty
+  bool pop(T &value) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail_cache) {
+      m_tail_cache = m_tail.load(std::memory_order_acquire);
+      if (head == m_tail_cache)
+        return false;
+    }
+    value = m_items[head & (Capacity - 1)];
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return m_head.load(std::memory_order_acquire) ==
+           m_tail.load(std::memory_order_acquire);
+  }
+
+private:
+  // Consumer side
+  alignas(64) std::atomic<size_t> m_head{0};
+  size_t m_tail_cache = 0;
+  // Producer side
+  alignas(64) std::atomic<size_t> m_tail{0};
+  size_t m_head_cache = 0;
+  alignas(64) std::array<T, Capacity> m_items;
+};
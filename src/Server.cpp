@@ -1,4 +1,5 @@
 #include "Server.hpp"
+#include "Clock.hpp"
 #include "HandleResponse.hpp"
 #include "Parser.hpp"
 #include <algorithm>
@@ -11,12 +12,30 @@
 #include <iostream>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <span>
+#include <sys/un.h>
 #include <unistd.h>
 
 #define MAX_EVENTS 100
+// Connections accepted per listener wakeup, the rest wait for the next one
+#define MAX_ACCEPTS_PER_CALL 1000
+// Output chunks gathered by a single sendmsg
+#define MAX_IOV 64
 #define DEBUG_SERVER 0
+#define CRON_INTERVAL_MS 100
+// Active defrag starts once this much memory is wasted (and 10% of it)...
+#define DEFRAG_IGNORE_BYTES (100 * 1024 * 1024)
+#define DEFRAG_THRESHOLD 1.1
+// ...and gets this much time per cron tick
+#define DEFRAG_CYCLE_US 1000
+// Tiered storage gets this much time per cron tick to spill cold values
+#define TIERED_CYCLE_US 1000
+#define MAX_THREADS 64
+// Messages from other partitions handled per loop iteration
+#define MAX_MESSAGES_PER_CALL 1024
 
-Server::Server(int argc, char **argv) : m_connection_backlog(5) {
+Server::Server(int argc, char **argv) {
   if (set_db(argc, argv) == -1)
     exit(1);
   if (init_server() < 0)
@@ -24,12 +43,49 @@ Server::Server(int argc, char **argv) : m_connection_backlog(5) {
   std::cout << "\nServer listening to port " << config.port << std::endl;
 }
 
+// Worker owning partition index, with the primary's options
+Server::Server(Server &primary, size_t index)
+    : m_partitions(primary.m_partitions), m_index(index) {
+  static_cast<DB_Options &>(config) = primary.config;
+  // The unix socket is served by the first thread only
+  config.unixsocket.clear();
+  config.partition = index;
+  if (init_server() < 0)
+    exit(1);
+}
+
 void Server::how_to_use() {
   std::cout << "\nAccepted arguments:\n\t"
             << "--help\n\t"
             << "--dir /dir/path\n\t"
             << "--dbfilename file_name.rdb\n\t"
-            << "--port replica_port_number" << std::endl;
+            << "--port replica_port_number\n\t"
+            << "--unixsocket /socket/path\n\t"
+            << "--tcp-backlog connections\n\t"
+            << "--threads count\n\t"
+            << "--cluster-enabled yes|no\n\t"
+            << "--cluster-announce-ip ip\n\t"
+            << "--activedefrag yes|no\n\t"
+            << "--lazyfree-lazy-expire yes|no\n\t"
+            << "--lazyfree-lazy-user-del yes|no\n\t"
+            << "--lazyfree-lazy-user-flush yes|no\n\t"
+            << "--tiered-enabled yes|no\n\t"
+            << "--tiered-cold-seconds seconds\n\t"
+            << "--tiered-min-value bytes\n\t"
+            << "--tiered-io-threads count\n\t"
+            << "--tiered-segment-size bytes\n\t"
+            << "--string-compress-min-size bytes\n\t"
+            << "--list-compress-depth depth\n\t"
+            << "--hash-max-listpack-entries count\n\t"
+            << "--hash-max-listpack-value bytes\n\t"
+            << "--zset-max-listpack-entries count\n\t"
+            << "--zset-max-listpack-value bytes\n\t"
+            << "--stream-node-max-bytes bytes\n\t"
+            << "--stream-node-max-entries count\n\t"
+            << "--pubsub-output-limit hard_bytes soft_bytes soft_seconds\n\t"
+            << "--client-output-buffer-limit normal|pubsub hard_bytes "
+               "soft_bytes soft_seconds"
+            << std::endl;
 }
 
 int Server::set_db(int argc, char **argv) {
@@ -37,6 +93,8 @@ int Server::set_db(int argc, char **argv) {
   config.dir = ".";
   config.db_filename = "dump.rdb";
   config.port = 6379;
+  bool cluster_enabled = false;
+  std::string announce_ip = "127.0.0.1";
 
   for (int i = 0; i < argc; ++i) {
     if (strncmp(argv[i], "--dir", strlen(argv[i])) == 0 && (i + 1) < argc)
@@ -52,6 +110,87 @@ int Server::set_db(int argc, char **argv) {
     }
     if (strncmp(argv[i], "--port", strlen(argv[i])) == 0 && (i + 1) < argc)
       config.port = std::stoi(argv[i + 1]);
+    if (strncmp(argv[i], "--unixsocket", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.unixsocket = std::string(argv[i + 1]);
+    if (strncmp(argv[i], "--tcp-backlog", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.tcp_backlog = std::max(1, std::stoi(argv[i + 1]));
+    if (strncmp(argv[i], "--threads", strlen(argv[i])) == 0 && (i + 1) < argc)
+      config.threads = std::clamp(std::stoi(argv[i + 1]), 1, MAX_THREADS);
+    if (strncmp(argv[i], "--cluster-enabled", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      cluster_enabled = strcmp(argv[i + 1], "yes") == 0;
+    if (strncmp(argv[i], "--cluster-announce-ip", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      announce_ip = std::string(argv[i + 1]);
+    if (strncmp(argv[i], "--activedefrag", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.active_defrag = strcmp(argv[i + 1], "yes") == 0;
+    if (strncmp(argv[i], "--lazyfree-lazy-expire", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.lazyfree_lazy_expire = strcmp(argv[i + 1], "yes") == 0;
+    if (strncmp(argv[i], "--lazyfree-lazy-user-del", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.lazyfree_lazy_user_del = strcmp(argv[i + 1], "yes") == 0;
+    if (strncmp(argv[i], "--lazyfree-lazy-user-flush", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.lazyfree_lazy_user_flush = strcmp(argv[i + 1], "yes") == 0;
+    if (strncmp(argv[i], "--tiered-enabled", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.tiered_enabled = strcmp(argv[i + 1], "yes") == 0;
+    if (strncmp(argv[i], "--tiered-cold-seconds", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.tiered_cold_seconds = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--tiered-min-value", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.tiered_min_value = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--tiered-io-threads", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.tiered_io_threads = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--tiered-segment-size", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.tiered_segment_size = std::stoull(argv[i + 1]);
+    if (strncmp(argv[i], "--string-compress-min-size", strlen(argv[i])) ==
+            0 &&
+        (i + 1) < argc)
+      config.string_compress_min_size = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--list-compress-depth", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.list_compress_depth = std::max(0, std::stoi(argv[i + 1]));
+    if (strncmp(argv[i], "--hash-max-listpack-entries", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.hash_max_listpack_entries = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--hash-max-listpack-value", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.hash_max_listpack_value = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--zset-max-listpack-entries", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.zset_max_listpack_entries = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--zset-max-listpack-value", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.zset_max_listpack_value = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--stream-node-max-bytes", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.stream_node_max_bytes = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--stream-node-max-entries", strlen(argv[i])) == 0 &&
+        (i + 1) < argc)
+      config.stream_node_max_entries = std::stoul(argv[i + 1]);
+    if (strncmp(argv[i], "--pubsub-output-limit", strlen(argv[i])) == 0 &&
+        (i + 3) < argc)
+      config.pubsub_output_limit = {std::stoul(argv[i + 1]),
+                                    std::stoul(argv[i + 2]),
+                                    std::stoul(argv[i + 3])};
+    if (strncmp(argv[i], "--client-output-buffer-limit", strlen(argv[i])) ==
+            0 &&
+        (i + 4) < argc) {
+      OutputLimit limit = {std::stoul(argv[i + 2]), std::stoul(argv[i + 3]),
+                           std::stoul(argv[i + 4])};
+      if (strcmp(argv[i + 1], "normal") == 0)
+        config.normal_output_limit = limit;
+      else if (strcmp(argv[i + 1], "pubsub") == 0)
+        config.pubsub_output_limit = limit;
+    }
     if (strncmp(argv[i], "--help", strlen(argv[i])) == 0) {
       how_to_use();
       return -1;
@@ -63,12 +202,44 @@ int Server::set_db(int argc, char **argv) {
               << "dir: " << config.dir << "\n\t"
               << "filename: " << config.db_filename << "\n\t"
               << "port: " << config.port << "\n\t" << std::endl;
+  if (cluster_enabled && config.threads > 1) {
+    std::cerr << "--threads can not be used with --cluster-enabled"
+              << std::endl;
+    return -1;
+  }
+  // Values idle for COLD_TICKS ticks are cold
+  Clock::set_lru_resolution(config.tiered_cold_seconds * 1000 /
+                            TieredStorage::COLD_TICKS);
+  // Keys go to their partition from the first one loaded
+  if (config.threads > 1)
+    start_partitions();
+  m_lazy_free = std::make_unique<LazyFree>(config.threads);
+  for (DB_Config *partition : config.all_partitions())
+    partition->lazy_free = m_lazy_free.get();
+  // Keys are indexed by slot from the first one loaded
+  if (cluster_enabled) {
+    config.cluster.enable(announce_ip, config.port);
+    config.db.enable_slots();
+  }
   RDB_Decoder decoder(config);
   if (decoder.read_rdb() == -1)
     return -1;
   return 0;
 }
 
+// Creates the servers of the other partitions, whose threads start with the
+// event loop
+void Server::start_partitions() {
+  m_partitions = std::make_shared<Partitions>(config.threads);
+  std::vector<DB_Config *> configs = {&config};
+  for (size_t index = 1; index < config.threads; ++index) {
+    m_workers.push_back(std::unique_ptr<Server>(new Server(*this, index)));
+    configs.push_back(&m_workers.back()->config);
+  }
+  for (DB_Config *partition : configs)
+    partition->partitions = configs;
+}
+
 std::string Server::parse_value(const std::string &needle,
                                 const std::string &haystack,
                                 const std::string &separator) {
@@ -101,6 +272,15 @@ int Server::init_server() {
     close(m_server_fd);
     return -1;
   }
+  // Every partition's thread listens on the port, the kernel spreads the
+  // connections
+  if (config.threads > 1 &&
+      setsockopt(m_server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                 sizeof(reuse)) < 0) {
+    std::cerr << "setsockopt failed\n";
+    close(m_server_fd);
+    return -1;
+  }
 
   if (bind(m_server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) !=
       0) {
@@ -108,18 +288,93 @@ int Server::init_server() {
     return -1;
   }
 
-  if (listen(m_server_fd, m_connection_backlog) != 0) {
+  if (listen(m_server_fd, config.tcp_backlog) != 0) {
     std::cerr << "Could not listen for the client" << std::endl;
     return -1;
   }
 
   set_nonblocking(m_server_fd);
+  if (config.tiered_enabled) {
+    m_tiered = std::make_unique<TieredStorage>(config, config.partition);
+    config.tiered = m_tiered.get();
+  }
+  if (!config.unixsocket.empty())
+    return init_unix_socket();
   return 0;
 }
 
+// Local clients skip the TCP stack through a unix domain socket, served by
+// the same event loop
+int Server::init_unix_socket() {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (config.unixsocket.length() >= sizeof(addr.sun_path)) {
+    std::cerr << "Unix socket path too long: " << config.unixsocket
+              << std::endl;
+    return -1;
+  }
+  strcpy(addr.sun_path, config.unixsocket.c_str());
+
+  m_unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_unix_fd < 0) {
+    std::cerr << "Could not create unix socket\n";
+    return -1;
+  }
+  // A socket file left by a previous run would make bind fail
+  unlink(addr.sun_path);
+  if (bind(m_unix_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    std::cerr << "Could not bind unix socket " << config.unixsocket
+              << std::endl;
+    return -1;
+  }
+  if (listen(m_unix_fd, config.tcp_backlog) != 0) {
+    std::cerr << "Could not listen on the unix socket" << std::endl;
+    return -1;
+  }
+  set_nonblocking(m_unix_fd);
+  std::cout << "Server listening to unix socket " << config.unixsocket
+            << std::endl;
+  return 0;
+}
+
+void Server::close_server() {
+  close(m_server_fd);
+  if (m_unix_fd >= 0) {
+    close(m_unix_fd);
+    unlink(config.unixsocket.c_str());
+  }
+}
+
+// Accepts every pending connection of a listener, up to MAX_ACCEPTS_PER_CALL
+void Server::accept_clients(int listen_fd) {
+  for (int accepted = 0; accepted < MAX_ACCEPTS_PER_CALL; ++accepted) {
+    int client_fd =
+        accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        std::cerr << "Accept error: " << strerror(errno) << std::endl;
+      return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.fd = client_fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+      std::cerr << "Failed to add client to epoll" << std::endl;
+      close(client_fd);
+      continue;
+    }
+    Client &client = m_clients[client_fd];
+    client.fd = client_fd;
+    client.id = m_partitions ? m_partitions->next_client_id()
+                             : ++m_next_client_id;
+  }
+}
+
 void Server::listen_connections() {
-  int epoll_fd = epoll_create1(0);
-  if (epoll_fd == -1) {
+  m_epoll_fd = epoll_create1(0);
+  if (m_epoll_fd == -1) {
     std::cerr << "Failed to create epoll file descriptor" << std::endl;
     close_server();
     exit(1);
@@ -129,68 +384,527 @@ void Server::listen_connections() {
   event.events = EPOLLIN;
   event.data.fd = m_server_fd;
 
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, m_server_fd, &event)) {
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_server_fd, &event)) {
     std::cerr << "Failed to add fd to epoll" << std::endl;
-    close(epoll_fd);
+    close(m_epoll_fd);
     close_server();
     exit(1);
   }
+  event.data.fd = m_unix_fd;
+  if (m_unix_fd >= 0 &&
+      epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_unix_fd, &event)) {
+    std::cerr << "Failed to add unix socket to epoll" << std::endl;
+    close(m_epoll_fd);
+    close_server();
+    exit(1);
+  }
+
+  config.cluster.set_event_loop(m_epoll_fd);
+  if (m_partitions) {
+    event.data.fd = m_partitions->wake_fd(m_index);
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event)) {
+      std::cerr << "Failed to add the wake up fd to epoll" << std::endl;
+      exit(1);
+    }
+  }
+  if (m_tiered) {
+    event.data.fd = m_tiered->event_fd();
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event)) {
+      std::cerr << "Failed to add the tiered storage fd to epoll" << std::endl;
+      exit(1);
+    }
+  }
+  for (auto &worker : m_workers)
+    m_threads.emplace_back(&Server::listen_connections, worker.get());
 
   struct epoll_event events[MAX_EVENTS];
+  Clock::update();
+  uint64_t last_cron = Clock::now_ms();
   while (true) {
-    int event_count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    // Sleep until the next cron tick or blocked client timeout
+    uint64_t elapsed = Clock::now_ms() - last_cron;
+    uint64_t until_cron =
+        elapsed >= CRON_INTERVAL_MS ? 0 : CRON_INTERVAL_MS - elapsed;
+    int timeout = config.blocking.next_timeout(Clock::now_ms(), until_cron);
+    if (m_partitions && !m_partitions->sleep(m_index))
+      timeout = 0;
+    int event_count = epoll_wait(m_epoll_fd, events, MAX_EVENTS, timeout);
+    if (m_partitions) {
+      m_partitions->awake(m_index);
+      // Another partition may be running a command on every partition
+      m_partitions->park();
+    }
+    // One clock read per loop iteration, shared by every command of the tick
+    Clock::update();
+    if (Clock::now_ms() - last_cron >= CRON_INTERVAL_MS) {
+      cron();
+      last_cron = Clock::now_ms();
+    }
+    bool loads_done = false;
     for (int i = 0; i < event_count; ++i) {
-      if (events[i].data.fd == m_server_fd) {
-        // New connection
-        int client_fd = accept(m_server_fd, NULL, NULL);
-        if (client_fd < 0) {
-          if (errno != EAGAIN && errno != EWOULDBLOCK)
-            std::cerr << "Accept error\n";
-          continue;
-        }
-        set_nonblocking(client_fd);
-        event.events = EPOLLIN | EPOLLET;
-        event.data.fd = client_fd;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
-          std::cerr << "Failed to add client to epoll" << std::endl;
-          close(client_fd);
-        }
+      if (events[i].data.fd == m_server_fd ||
+          events[i].data.fd == m_unix_fd) {
+        // New connections
+        accept_clients(events[i].data.fd);
+      } else if (m_partitions &&
+                 events[i].data.fd == m_partitions->wake_fd(m_index)) {
+        // Messages from other partitions, received below
+        m_partitions->clear_wake(m_index);
+      } else if (m_tiered && events[i].data.fd == m_tiered->event_fd()) {
+        // Spilled values read back, put in the keyspace below
+        loads_done = true;
+      } else if (config.cluster.handle_event(events[i].data.fd,
+                                             events[i].events)) {
+        // Link to another cluster node
       } else {
         // Active client
-        if (!handle_client(events[i].data.fd)) {
-          epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-          close(events[i].data.fd);
-        }
+        Client &client = m_clients[events[i].data.fd];
+        bool alive = true;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          alive = handle_client(client);
+        if (alive && (events[i].events & EPOLLOUT))
+          alive = flush_client(client);
+        if (!alive)
+          close_client(client);
       }
     }
+    if (m_partitions)
+      receive_messages();
+    if (loads_done)
+      finish_loads();
+    handle_blocked_clients();
+    handle_pending_writes();
+    if (m_partitions) {
+      handoff_clients();
+      m_partitions->flush(m_index);
+    }
   }
-  close(epoll_fd);
+  close(m_epoll_fd);
 }
 
-bool Server::handle_client(int client_fd) {
-  Request req;
-  char buffer[1024] = {0};
+void Server::close_client(Client &client) {
+  config.pubsub.unsubscribe_all(&client);
+  bool elsewhere = false;
+  for (const auto &watched : client.watched)
+    elsewhere |= config.partition_of(watched.first) != m_index;
+  if (elsewhere) {
+    WorldStop stop(*m_partitions, m_index);
+    HandleResponse::unwatch_all(client, config);
+  } else {
+    HandleResponse::unwatch_all(client, config);
+  }
+  config.blocking.unblock(&client);
+  config.cluster.forget_client(&client);
+  if (client.tracking)
+    config.tracking.disable(&client);
+  if (client.pending_write)
+    std::erase(config.pending_writes, &client);
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, client.fd, NULL);
+  close(client.fd);
+  m_clients.erase(client.fd);
+}
+
+// Flushes the clients other clients' commands wrote to, closing the ones over
+// their output limit
+void Server::handle_pending_writes() {
+  config.tracking.flush_broadcasts(config.pending_writes);
+  std::vector<Client *> pending;
+  pending.swap(config.pending_writes);
+  for (Client *client : pending) {
+    client->pending_write = false;
+    if (client->close_asap || !flush_client(*client))
+      close_client(*client);
+  }
+}
+
+// Periodic background work, run every CRON_INTERVAL_MS from the event loop
+void Server::cron() {
+  if (config.cluster.enabled())
+    config.cluster.cron(Clock::now_ms());
+  if (m_tiered)
+    m_tiered->cron(config.db, TIERED_CYCLE_US);
+  if (!config.active_defrag)
+    return;
 
-  ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-  if (bytes_read <= 0) {
-    if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+  SlabAllocator::Stats stats = config.db.allocator().stats();
+  if (!config.defrag_running) {
+    if (stats.resident - stats.allocated < DEFRAG_IGNORE_BYTES ||
+        stats.resident < stats.allocated * DEFRAG_THRESHOLD)
+      return;
+    config.defrag_running = true;
+  }
+  // A full pass ends the cycle, the next tick re-checks the thresholds
+  if (config.db.defrag(DEFRAG_CYCLE_US))
+    config.defrag_running = false;
+}
+
+bool Server::handle_client(Client &client) {
+  char buffer[16 * 1024];
+
+  // Edge triggered: drain the socket
+  while (true) {
+    ssize_t bytes_read = recv(client.fd, buffer, sizeof(buffer), 0);
+    if (bytes_read == 0)
+      return false;
+    if (bytes_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR)
+        continue;
       return false;
     }
-  } else {
-    buffer[bytes_read] = '\0'; // Null-terminate the received data
-    std::cout << "\nRequest:\n" << buffer;
+    client.query.append(buffer, bytes_read);
+  }
+  if (DEBUG_SERVER != 0)
+    std::cout << "\nRequest:\n" << client.query;
 
-    RespParser parser;
+  if (!process_query(client))
+    return false;
+  return !client.close_asap && flush_client(client);
+}
+
+// Runs the complete commands received, a partial one stays in the buffer.
+// A blocked client's commands wait, and the ones after a command that blocks
+// are left to run once it is served.
+//
+// With --threads a run of commands whose keys are in another partition is
+// sent there as one message, and the commands after the run wait until its
+// replies are back. A run goes to a single partition, so that the
+// connection's commands still run in order.
+//
+// A command on spilled values waits, with the ones after it, until they are
+// read back.
+//
+// The commands that wait stay parsed in the client (see Client::pending), so
+// that resuming a long pipeline only parses the bytes received since.
+bool Server::process_query(Client &client) {
+  if (client.blocked || client.run_waiting > 0 || client.handoff >= 0 ||
+      client.loading > 0)
+    return true;
+
+  RespParser parser;
+  std::vector<RespData> &pending = client.pending;
+  std::vector<size_t> &ends = client.pending_ends;
+  size_t pos = ends.empty() ? 0 : ends.back();
+  try {
+    while (pos < client.query.length()) {
+      size_t start = pos;
+      try {
+        pending.push_back(parser.parse(client.query, pos));
+        ends.push_back(pos);
+      } catch (const RespIncomplete &) {
+        pos = start;
+        break;
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Protocol error: " << e.what() << std::endl;
+    return false;
+  }
+
+  // Prefetches, once, the commands up to the first one to run elsewhere
+  size_t first = std::max(client.pending_head, client.prefetched);
+  size_t last = first;
+  for (; last < pending.size(); ++last) {
+    size_t partition;
+    HandleResponse::Route route =
+        HandleResponse::route(pending[last], client, config, partition);
+    if (route == HandleResponse::Route::Handoff ||
+        (route == HandleResponse::Route::Partition && partition != m_index))
+      break;
+  }
+  HandleResponse::prefetch(
+      std::span<const RespData>(pending).subspan(first, last - first), config);
+  client.prefetched = last;
 
+  PartitionMessage *run = nullptr;
+  size_t n = client.pending_head;
+  for (; n < pending.size(); ++n) {
+    if (DEBUG_SERVER != 0)
+      parser.printRespData(pending[n]);
+    size_t partition;
+    HandleResponse::Route route =
+        HandleResponse::route(pending[n], client, config, partition);
+    bool here = route == HandleResponse::Route::Partition
+                    ? partition == m_index
+                    : route != HandleResponse::Route::Handoff;
+    if (m_tiered && here && !client.in_multi &&
+        (client.loading = HandleResponse::load_spilled(
+             pending[n], client.fd, client.id, config)) > 0) {
+      // The values of the commands pipelined after it are read meanwhile,
+      // rather than one command at a time
+      for (size_t next = n + 1; next < pending.size(); ++next)
+        client.loading += HandleResponse::load_spilled(
+            pending[next], client.fd, client.id, config);
+      break;
+    }
+    if (route == HandleResponse::Route::Partition && partition != m_index &&
+        (run == nullptr || run->to == partition)) {
+      add_to_run(client, pending[n], partition, run);
+      continue;
+    }
+    if (!client.run_replies.empty())
+      break;
+    if (route == HandleResponse::Route::Handoff) {
+      client.handoff = partition;
+      m_handoffs.emplace_back(client.fd, client.id);
+      break;
+    }
     try {
-      RespData result = parser.parse(std::string(buffer));
-      parser.printRespData(result);
-      HandleResponse respond(result, client_fd, config);
+      if (route == HandleResponse::Route::World) {
+        WorldStop stop(*m_partitions, m_index);
+        HandleResponse respond(pending[n], client, config);
+      } else {
+        HandleResponse respond(pending[n], client, config);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+    }
+    if (client.blocked) {
+      ++n;
+      break;
+    }
+  }
+  client.pending_head = n;
+  client.prefetched = std::max(client.prefetched, n);
+
+  // The commands that ran are dropped with their bytes once they are the
+  // larger part, moving what is left only every so often
+  if (n == pending.size() || n > pending.size() / 2) {
+    size_t bytes = n == 0 ? 0 : ends[n - 1];
+    client.query.erase(0, bytes);
+    pending.erase(pending.begin(), pending.begin() + n);
+    ends.erase(ends.begin(), ends.begin() + n);
+    for (size_t &end : ends)
+      end -= bytes;
+    client.prefetched -= n;
+    client.pending_head = 0;
+  }
+
+  if (run != nullptr) {
+    m_partitions->send(m_index, run->to, run);
+    ++client.run_waiting;
+  }
+  return true;
+}
+
+// Adds command, whose keys are in partition, to the message of the client's
+// run. Its reply takes its place in run_replies once the message is back.
+void Server::add_to_run(Client &client, RespData &command, size_t partition,
+                        PartitionMessage *&run) {
+  size_t position = client.run_replies.size();
+  client.run_replies.emplace_back();
+  if (run == nullptr) {
+    run = new PartitionMessage;
+    run->from = m_index;
+    run->to = partition;
+    run->fd = client.fd;
+    run->client_id = client.id;
+    run->protocol = client.protocol;
+  }
+  run->commands.push_back(std::move(command));
+  run->positions.push_back(position);
+}
+
+void Server::receive_messages() {
+  for (int received = 0; received < MAX_MESSAGES_PER_CALL; ++received) {
+    PartitionMessage *message = m_partitions->receive(m_index);
+    if (message == nullptr)
+      return;
+    switch (message->kind) {
+    case PartitionMessage::Request:
+      run_request(message);
+      break;
+    case PartitionMessage::Reply:
+      finish_run(message);
+      break;
+    case PartitionMessage::Handoff:
+      adopt_client(message);
+      break;
+    }
+  }
+}
 
+// Runs the commands another partition sent for one of its clients and sends
+// the replies back, once the spilled values they use are read back
+void Server::run_request(PartitionMessage *message) {
+  if (m_tiered) {
+    uint64_t id = ++m_next_request_id;
+    for (const RespData &command : message->commands)
+      message->loading +=
+          HandleResponse::load_spilled(command, -1, id, config);
+    if (message->loading > 0) {
+      m_loading_requests[id] = message;
+      return;
+    }
+  }
+  m_proxy.capture_replies = true;
+  m_proxy.id = message->client_id;
+  m_proxy.protocol = message->protocol;
+  HandleResponse::prefetch(message->commands, config);
+  for (RespData &command : message->commands) {
+    try {
+      HandleResponse respond(command, m_proxy, config);
     } catch (const std::exception &e) {
       std::cerr << "Error: " << e.what() << std::endl;
     }
+    message->replies.push_back(std::move(m_proxy.reply));
+    m_proxy.reply.clear();
+  }
+  message->commands.clear();
+  message->kind = PartitionMessage::Reply;
+  m_partitions->send(m_index, message->from, message);
+}
+
+// Puts the replies of a partition in the client's run. Once the run is
+// complete they are queued in order and the commands that waited run.
+void Server::finish_run(PartitionMessage *message) {
+  auto it = m_clients.find(message->fd);
+  // The client may be gone, and its fd reused
+  if (it != m_clients.end() && it->second.id == message->client_id) {
+    Client &client = it->second;
+    for (size_t k = 0; k < message->positions.size(); ++k)
+      client.run_replies[message->positions[k]] =
+          std::move(message->replies[k]);
+    if (--client.run_waiting == 0) {
+      for (const std::string &reply : client.run_replies)
+        client.reply += reply;
+      client.run_replies.clear();
+      if (!process_query(client) || client.close_asap ||
+          !flush_client(client))
+        close_client(client);
+    }
+  }
+  delete message;
+}
+
+// Takes over a client another partition handed off, and runs the command it
+// was handed off for
+void Server::adopt_client(PartitionMessage *message) {
+  int fd = message->fd;
+  Client &client = m_clients[fd];
+  client = std::move(message->client);
+  client.handoff = -1;
+  delete message;
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  event.data.fd = fd;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    std::cerr << "Failed to add client to epoll" << std::endl;
+    close_client(client);
+    return;
+  }
+  if (!process_query(client) || client.close_asap || !flush_client(client))
+    close_client(client);
+}
+
+// Puts the spilled values read back in the keyspace and runs the commands
+// that waited for them, of clients and of other partitions
+void Server::finish_loads() {
+  std::vector<std::pair<int, uint64_t>> ready;
+  m_tiered->complete(config.db, ready);
+  for (const auto &[fd, id] : ready) {
+    if (fd == -1) {
+      auto request = m_loading_requests.find(id);
+      if (--request->second->loading == 0) {
+        PartitionMessage *message = request->second;
+        m_loading_requests.erase(request);
+        run_request(message);
+      }
+      continue;
+    }
+    auto it = m_clients.find(fd);
+    // The client may be gone, and its fd reused
+    if (it == m_clients.end() || it->second.id != id)
+      continue;
+    Client &client = it->second;
+    if (--client.loading == 0 &&
+        (!process_query(client) || client.close_asap || !flush_client(client)))
+      close_client(client);
+  }
+}
+
+// Moves the clients whose next command has to run on another partition
+void Server::handoff_clients() {
+  for (const auto &[fd, id] : m_handoffs) {
+    auto it = m_clients.find(fd);
+    if (it == m_clients.end() || it->second.id != id)
+      continue;
+    Client &client = it->second;
+    if (client.pending_write) {
+      std::erase(config.pending_writes, &client);
+      client.pending_write = false;
+    }
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    auto *message = new PartitionMessage;
+    message->kind = PartitionMessage::Handoff;
+    message->fd = fd;
+    size_t to = client.handoff;
+    message->client = std::move(client);
+    m_clients.erase(it);
+    m_partitions->send(m_index, to, message);
+  }
+  m_handoffs.clear();
+}
+
+// Answers the blocked clients whose keys got elements or whose timeout
+// passed, then runs the commands they pipelined after the blocking one
+void Server::handle_blocked_clients() {
+  std::vector<Client *> unblocked;
+  do {
+    unblocked.clear();
+    HandleResponse::handle_blocked_clients(config, Clock::now_ms(), unblocked);
+    // They are all in pending_writes, closed from there on a protocol error
+    for (Client *client : unblocked)
+      if (!process_query(*client))
+        client->close_asap = true;
+  } while (!unblocked.empty());
+}
+
+// Writes the queued output with one gathered write per MAX_IOV chunks, the
+// rest is sent once the socket is writable
+bool Server::flush_client(Client &client) {
+  client.commit_reply();
+  while (!client.output.empty()) {
+    struct iovec iov[MAX_IOV];
+    size_t count = 0;
+    size_t offset = client.output_pos;
+    for (auto it = client.output.begin();
+         it != client.output.end() && count < MAX_IOV; ++it, ++count) {
+      iov[count].iov_base = const_cast<char *>(it->data.data()) + offset;
+      iov[count].iov_len = it->data.length() - offset;
+      offset = 0;
+    }
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t written = sendmsg(client.fd, &msg, MSG_NOSIGNAL);
+    if (written < 0) {
+      // A client that does not read its replies is closed once they go over
+      // the output limit of its class
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (!client.over_limit(config.output_limit(client), Clock::now_ms()))
+          return true;
+        std::cerr << "Closing client " << client.id
+                  << " over its output buffer limit" << std::endl;
+        return false;
+      }
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    // Drop the chunks written, shared ones are freed with their last client
+    client.output_pos += written;
+    while (!client.output.empty() &&
+           client.output_pos >= client.output.front().data.length()) {
+      size_t length = client.output.front().data.length();
+      client.output_pos -= length;
+      client.output_bytes -= length;
+      client.output.pop_front();
+    }
   }
+  client.soft_limit_since = 0;
   return true;
 }
 
@@ -5,25 +5,72 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
+#include <memory>
 #include <netinet/in.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "Client.hpp"
 #include "DB.hpp"
+#include "LazyFree.hpp"
 #include "Parser.hpp"
+#include "Partitions.hpp"
 #include "RDB_Decoder.hpp"
+#include "TieredStorage.hpp"
 
 class Server {
 private:
   int m_server_fd;
-  int m_connection_backlog;
+  int m_unix_fd = -1;
+  int m_epoll_fd;
+  uint64_t m_next_client_id = 0;
   DB_Config config;
+  std::unordered_map<int, Client> m_clients;
+  // Frees big values in the background, for every partition
+  std::unique_ptr<LazyFree> m_lazy_free;
+  // --tiered-enabled: this partition's log of spilled values
+  std::unique_ptr<TieredStorage> m_tiered;
 
-  bool handle_client(int client_fd);
+  // --threads: the partition of this server's thread. The first server
+  // owns the others and starts their threads.
+  std::shared_ptr<Partitions> m_partitions;
+  size_t m_index = 0;
+  std::vector<std::unique_ptr<Server>> m_workers;
+  std::vector<std::thread> m_threads;
+  // Runs the commands other partitions send, on behalf of their clients
+  Client m_proxy;
+  // Requests from other partitions waiting for spilled values, by the id
+  // they wait under (with fd -1)
+  std::unordered_map<uint64_t, PartitionMessage *> m_loading_requests;
+  uint64_t m_next_request_id = 0;
+  // Clients moving to another partition at the end of the loop iteration
+  std::vector<std::pair<int, uint64_t>> m_handoffs;
+
+  Server(Server &primary, size_t index);
+  void start_partitions();
+  void receive_messages();
+  void add_to_run(Client &client, RespData &command, size_t partition,
+                  PartitionMessage *&run);
+  void run_request(PartitionMessage *message);
+  void finish_run(PartitionMessage *message);
+  void adopt_client(PartitionMessage *message);
+  void handoff_clients();
+  void finish_loads();
+
+  int init_unix_socket();
+  void accept_clients(int listen_fd);
+  bool handle_client(Client &client);
+  bool process_query(Client &client);
+  void handle_blocked_clients();
+  bool flush_client(Client &client);
+  void close_client(Client &client);
+  void handle_pending_writes();
+  void cron();
   void set_nonblocking(int sock);
   int parse_request(Request &req, const std::string &buffer);
   int set_db(int argc, char **argv);
@@ -35,7 +82,7 @@ public:
   void listen_connections();
 
   int fd() { return m_server_fd; };
-  void close_server() { close(m_server_fd); }
+  void close_server();
 
   std::string parse_value(const std::string &needle,
                           const std::string &haystack,
@@ -0,0 +1,222 @@
+#include "Slab.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <sys/mman.h>
+#include <unistd.h>
+
+SlabAllocator::SlabAllocator() {
+  // 16 byte steps up to 128, then four classes per power of two
+  for (uint32_t size = 16; size <= 128; size += 16)
+    m_classes.push_back(SizeClass{size});
+  for (uint32_t base = 128; base < MAX_CLASS_SIZE; base *= 2)
+    for (uint32_t step = 1; step <= 4; ++step)
+      m_classes.push_back(SizeClass{base + step * base / 4});
+
+  size_t cls = 0;
+  for (size_t i = 0; i < m_class_of.size(); ++i) {
+    while (m_classes[cls].size < i * 16)
+      ++cls;
+    m_class_of[i] = cls;
+  }
+}
+
+SlabAllocator::~SlabAllocator() {
+  for (auto &size_class : m_classes) {
+    while (size_class.partial != nullptr) {
+      Slab *slab = size_class.partial;
+      size_class.partial = slab->next;
+      munmap(slab, SLAB_SIZE);
+    }
+  }
+  // Full slabs are not linked anywhere, the owner of the allocator is
+  // expected to release every object before destroying it.
+}
+
+void SlabAllocator::swap(SlabAllocator &other) {
+  // The size classes are the same for every allocator
+  std::swap(m_classes, other.m_classes);
+  std::swap(m_used, other.m_used);
+  std::swap(m_allocated, other.m_allocated);
+  std::swap(m_large, other.m_large);
+  std::swap(m_slabs, other.m_slabs);
+}
+
+SlabAllocator::Slab *SlabAllocator::new_slab(uint8_t cls) {
+  // Over-map and trim so that the slab is SLAB_SIZE aligned
+  size_t len = SLAB_SIZE * 2;
+  void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    throw std::bad_alloc();
+  uintptr_t start = reinterpret_cast<uintptr_t>(mem);
+  uintptr_t aligned = (start + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1);
+  if (aligned != start)
+    munmap(mem, aligned - start);
+  if (start + len != aligned + SLAB_SIZE)
+    munmap(reinterpret_cast<void *>(aligned + SLAB_SIZE),
+           start + len - aligned - SLAB_SIZE);
+
+  auto *slab = reinterpret_cast<Slab *>(aligned);
+  slab->prev = nullptr;
+  slab->next = nullptr;
+  slab->free_list = nullptr;
+  slab->bump = reinterpret_cast<char *>(aligned) + HEADER_SIZE;
+  slab->used = 0;
+  slab->capacity = (SLAB_SIZE - HEADER_SIZE) / m_classes[cls].size;
+  slab->cls = cls;
+  ++m_classes[cls].slabs;
+  ++m_slabs;
+  return slab;
+}
+
+void SlabAllocator::release_slab(Slab *slab) {
+  --m_classes[slab->cls].slabs;
+  --m_slabs;
+  munmap(slab, SLAB_SIZE);
+}
+
+void SlabAllocator::unlink_partial(Slab *slab) {
+  SizeClass &size_class = m_classes[slab->cls];
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    size_class.partial = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = nullptr;
+}
+
+void SlabAllocator::push_partial(Slab *slab) {
+  SizeClass &size_class = m_classes[slab->cls];
+  slab->prev = nullptr;
+  slab->next = size_class.partial;
+  if (size_class.partial)
+    size_class.partial->prev = slab;
+  size_class.partial = slab;
+}
+
+void *SlabAllocator::allocate(size_t size) {
+  if (size > MAX_CLASS_SIZE) {
+    void *ptr = malloc(size);
+    if (ptr == nullptr)
+      throw std::bad_alloc();
+    m_used += size;
+    m_allocated += size;
+    m_large += size;
+    return ptr;
+  }
+
+  uint8_t cls = m_class_of[(size + 15) / 16];
+  SizeClass &size_class = m_classes[cls];
+  Slab *slab = size_class.partial;
+  if (slab == nullptr) {
+    slab = new_slab(cls);
+    push_partial(slab);
+  }
+
+  void *ptr;
+  if (slab->free_list != nullptr) {
+    ptr = slab->free_list;
+    slab->free_list = *static_cast<void **>(ptr);
+  } else {
+    ptr = slab->bump;
+    slab->bump += size_class.size;
+  }
+  if (++slab->used == slab->capacity)
+    unlink_partial(slab);
+
+  ++size_class.objects;
+  m_used += size;
+  m_allocated += size_class.size;
+  return ptr;
+}
+
+void SlabAllocator::deallocate(void *ptr, size_t size) {
+  if (ptr == nullptr)
+    return;
+  if (size > MAX_CLASS_SIZE) {
+    free(ptr);
+    m_used -= size;
+    m_allocated -= size;
+    m_large -= size;
+    return;
+  }
+
+  Slab *slab = slab_of(ptr);
+  SizeClass &size_class = m_classes[slab->cls];
+  bool was_full = slab->used == slab->capacity;
+  *static_cast<void **>(ptr) = slab->free_list;
+  slab->free_list = ptr;
+  --slab->used;
+  --size_class.objects;
+  m_used -= size;
+  m_allocated -= size_class.size;
+
+  if (slab->used == 0) {
+    if (!was_full)
+      unlink_partial(slab);
+    release_slab(slab);
+  } else if (was_full) {
+    push_partial(slab);
+  }
+}
+
+void *SlabAllocator::reallocate(void *ptr, size_t old_size, size_t new_size) {
+  if (old_size > MAX_CLASS_SIZE && new_size > MAX_CLASS_SIZE) {
+    void *resized = realloc(ptr, new_size);
+    if (resized == nullptr)
+      throw std::bad_alloc();
+    m_used += new_size - old_size;
+    m_allocated += new_size - old_size;
+    m_large += new_size - old_size;
+    return resized;
+  }
+  void *resized = allocate(new_size);
+  memcpy(resized, ptr, old_size < new_size ? old_size : new_size);
+  deallocate(ptr, old_size);
+  return resized;
+}
+
+bool SlabAllocator::should_move(const void *ptr, size_t size) const {
+  if (size > MAX_CLASS_SIZE)
+    return false;
+  const Slab *slab = slab_of(ptr);
+  const SizeClass &size_class = m_classes[slab->cls];
+  // The slab new objects are carved from would just receive it back
+  if (slab == size_class.partial || slab->used == slab->capacity)
+    return false;
+  // used / capacity < objects / (slabs * capacity)
+  return slab->used * size_class.slabs < size_class.objects;
+}
+
+SlabAllocator::Stats SlabAllocator::stats() const {
+  return Stats{m_used, m_allocated, m_slabs * SLAB_SIZE + m_large, m_slabs,
+               m_large};
+}
+
+std::vector<SlabAllocator::ClassStats> SlabAllocator::class_stats() const {
+  std::vector<ClassStats> stats;
+  for (const auto &size_class : m_classes) {
+    if (size_class.slabs == 0)
+      continue;
+    size_t per_slab = (SLAB_SIZE - HEADER_SIZE) / size_class.size;
+    stats.push_back(ClassStats{size_class.size, size_class.slabs,
+                               size_class.objects,
+                               size_class.slabs * per_slab});
+  }
+  return stats;
+}
+
+size_t process_rss() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr)
+    return 0;
+  unsigned long pages = 0;
+  if (fscanf(statm, "%*s %lu", &pages) != 1)
+    pages = 0;
+  fclose(statm);
+  return pages * sysconf(_SC_PAGESIZE);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+Size-class slab allocator for keyspace storage (entries and string buffers).
+
+Memory is taken from the OS in SLAB_SIZE aligned slabs, each dedicated to one
+size class. A slab keeps its own free list, and every class keeps the list of
+its slabs that still have free slots, so allocation and release are O(1) and
+the owning slab of any pointer is found by masking the address. Empty slabs
+are returned to the OS right away.
+
+Requests above MAX_CLASS_SIZE go to malloc and are only accounted for.
+*/
+class SlabAllocator {
+public:
+  static constexpr size_t SLAB_SIZE = 64 * 1024;
+  static constexpr size_t MAX_CLASS_SIZE = 4096;
+
+  struct ClassStats {
+    size_t size;     // slot size of the class
+    size_t slabs;    // slabs owned by the class
+    size_t objects;  // live objects
+    size_t capacity; // slots across all slabs
+  };
+
+  struct Stats {
+    size_t used;      // bytes requested by callers
+    size_t allocated; // bytes handed out, rounded to the size class
+    size_t resident;  // slab memory plus large allocations
+    size_t slabs;
+    size_t large;     // bytes in allocations above MAX_CLASS_SIZE
+  };
+
+  SlabAllocator();
+  ~SlabAllocator();
+  SlabAllocator(const SlabAllocator &) = delete;
+  SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+  void *allocate(size_t size);
+  // size must be the one passed to allocate()
+  void deallocate(void *ptr, size_t size);
+  // Large blocks are resized in place by realloc, slab objects are copied
+  void *reallocate(void *ptr, size_t old_size, size_t new_size);
+
+  // Defrag hint: true when ptr lives in a slab that is emptier than the
+  // average of its class, so moving it helps releasing that slab.
+  bool should_move(const void *ptr, size_t size) const;
+
+  Stats stats() const;
+  std::vector<ClassStats> class_stats() const;
+
+  // Exchanges the memory, and the objects in it, of the two allocators
+  void swap(SlabAllocator &other);
+
+private:
+  struct Slab {
+    Slab *prev;
+    Slab *next;
+    void *free_list;
+    char *bump; // start of never used slots
+    uint32_t used;
+    uint32_t capacity;
+    uint8_t cls;
+  };
+
+  struct SizeClass {
+    uint32_t size = 0;
+    Slab *partial = nullptr; // slabs with at least one free slot
+    size_t slabs = 0;
+    size_t objects = 0;
+  };
+
+  static constexpr size_t HEADER_SIZE = (sizeof(Slab) + 15) & ~size_t(15);
+
+  std::vector<SizeClass> m_classes;
+  std::array<uint8_t, MAX_CLASS_SIZE / 16 + 1> m_class_of;
+  size_t m_used = 0;
+  size_t m_allocated = 0;
+  size_t m_large = 0;
+  size_t m_slabs = 0;
+
+  static Slab *slab_of(const void *ptr) {
+    return reinterpret_cast<Slab *>(reinterpret_cast<uintptr_t>(ptr) &
+                                    ~(SLAB_SIZE - 1));
+  }
+  Slab *new_slab(uint8_t cls);
+  void release_slab(Slab *slab);
+  void unlink_partial(Slab *slab);
+  void push_partial(Slab *slab);
+};
+
+// Process resident set size, in bytes
+size_t process_rss();
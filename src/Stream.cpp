@@ -0,0 +1,405 @@
+#include "Stream.hpp"
+#include "Listpack.hpp"
+#include <charconv>
+
+#define STREAM_ITEM_FLAG_DELETED 1
+#define STREAM_ITEM_FLAG_SAMEFIELDS 2
+
+std::string StreamID::to_string() const {
+  return std::to_string(ms) + "-" + std::to_string(seq);
+}
+
+RadixTree::Key StreamID::key() const {
+  RadixTree::Key key;
+  for (int b = 0; b < 8; ++b) {
+    key[b] = ms >> (56 - 8 * b);
+    key[8 + b] = seq >> (56 - 8 * b);
+  }
+  return key;
+}
+
+StreamID StreamID::from_key(const RadixTree::Key &key) {
+  StreamID id;
+  for (int b = 0; b < 8; ++b) {
+    id.ms = id.ms << 8 | key[b];
+    id.seq = id.seq << 8 | key[8 + b];
+  }
+  return id;
+}
+
+static bool parse_u64(std::string_view str, uint64_t &out) {
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.length(), out);
+  return !str.empty() && ec == std::errc() && ptr == str.data() + str.length();
+}
+
+bool parse_stream_id(std::string_view str, StreamID &id, uint64_t missing_seq,
+                     bool *seq_given) {
+  size_t dash = str.find('-');
+  if (seq_given != nullptr)
+    *seq_given = dash != std::string_view::npos;
+  if (dash == std::string_view::npos) {
+    id.seq = missing_seq;
+    return parse_u64(str, id.ms);
+  }
+  return parse_u64(str.substr(0, dash), id.ms) &&
+         parse_u64(str.substr(dash + 1), id.seq);
+}
+
+// Integer elements written by us or checked by adopt_block()
+static int64_t lp_int(const uint8_t *p) {
+  int64_t value = 0;
+  Listpack::get_int(p, value);
+  return value;
+}
+
+// Formats integers to append to a listpack
+struct IntTexts {
+  std::array<std::array<char, 21>, 6> buffers;
+  size_t used = 0;
+
+  std::string_view operator()(int64_t value) {
+    char *buf = buffers[used++].data();
+    auto [ptr, ec] = std::to_chars(buf, buf + 21, value);
+    return {buf, static_cast<size_t>(ptr - buf)};
+  }
+};
+
+// Master entry elements: count, deleted, number of fields and the fields,
+// then the zero terminator. Returns the first field.
+static uint8_t *master_fields(uint8_t *lp, int64_t &count) {
+  uint8_t *p = Listpack::first(lp);
+  p = Listpack::next(lp, Listpack::next(lp, p));
+  count = lp_int(p);
+  return Listpack::next(lp, p);
+}
+
+Stream::~Stream() {
+  m_blocks.for_each([](const RadixTree::Key &, void *lp) {
+    Listpack::free(static_cast<uint8_t *>(lp));
+  });
+}
+
+uint8_t *Stream::new_block(const std::vector<std::string_view> &fields) {
+  size_t pairs = fields.size() / 2;
+  IntTexts ints;
+  std::vector<std::string_view> elements = {ints(1), ints(0), ints(pairs)};
+  for (size_t n = 0; n < pairs; ++n)
+    elements.push_back(fields[2 * n]);
+  elements.push_back(ints(0));
+  elements.push_back(ints(STREAM_ITEM_FLAG_SAMEFIELDS));
+  elements.push_back(elements[1]); // no difference to the master ID
+  elements.push_back(elements[1]);
+  for (size_t n = 0; n < pairs; ++n)
+    elements.push_back(fields[2 * n + 1]);
+  elements.push_back(ints(pairs + 3));
+  return Listpack::append(Listpack::create(), elements.data(),
+                          elements.size());
+}
+
+void Stream::append(StreamID id, const std::vector<std::string_view> &fields,
+                    size_t max_bytes, size_t max_entries) {
+  size_t pairs = fields.size() / 2;
+  uint8_t *lp = m_tail ? static_cast<uint8_t *>(*m_tail) : nullptr;
+  if (lp != nullptr) {
+    size_t added = 0;
+    for (std::string_view field : fields)
+      added += field.length();
+    uint8_t *first = Listpack::first(lp);
+    int64_t entries = lp_int(first) + lp_int(Listpack::next(lp, first));
+    if ((max_bytes != 0 && Listpack::bytes(lp) + added >= max_bytes) ||
+        (max_entries != 0 && entries >= int64_t(max_entries)))
+      lp = nullptr;
+  }
+  if (lp == nullptr) {
+    RadixTree::Key key = id.key();
+    m_blocks.insert(key, new_block(fields));
+    m_tail = m_blocks.find(key);
+    m_tail_id = id;
+    ++m_length;
+    m_last_id = id;
+    return;
+  }
+
+  IntTexts ints;
+  uint8_t *first = Listpack::first(lp);
+  lp = Listpack::insert(lp, ints(lp_int(first) + 1), first,
+                        Listpack::Where::Replace);
+  int64_t master_count;
+  uint8_t *p = master_fields(lp, master_count);
+  bool same = master_count == int64_t(pairs);
+  char scratch[21];
+  for (size_t n = 0; same && n < pairs; ++n, p = Listpack::next(lp, p))
+    same = Listpack::get(p, scratch) == fields[2 * n];
+
+  std::vector<std::string_view> elements = {
+      ints(same ? STREAM_ITEM_FLAG_SAMEFIELDS : 0),
+      ints(int64_t(id.ms - m_tail_id.ms)),
+      ints(int64_t(id.seq - m_tail_id.seq))};
+  if (same) {
+    for (size_t n = 0; n < pairs; ++n)
+      elements.push_back(fields[2 * n + 1]);
+    elements.push_back(ints(pairs + 3));
+  } else {
+    elements.push_back(ints(pairs));
+    elements.insert(elements.end(), fields.begin(), fields.end());
+    elements.push_back(ints(2 * pairs + 4));
+  }
+  *m_tail = Listpack::append(lp, elements.data(), elements.size());
+  ++m_length;
+  m_last_id = id;
+}
+
+// Returns the element after the entry at p, nullptr at the end of the block
+static uint8_t *skip_entry(uint8_t *lp, uint8_t *p, int64_t master_count,
+                           int64_t &flags) {
+  flags = lp_int(p);
+  p = Listpack::next(lp, Listpack::next(lp, Listpack::next(lp, p)));
+  int64_t elements = master_count;
+  if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS)) {
+    elements = 2 * lp_int(p);
+    p = Listpack::next(lp, p);
+  }
+  for (int64_t n = 0; n < elements; ++n)
+    p = Listpack::next(lp, p);
+  return Listpack::next(lp, p); // lp count
+}
+
+uint64_t Stream::trim(uint64_t maxlen, bool approximate) {
+  uint64_t removed = 0;
+  RadixTree::Key zero{};
+  while (m_length > maxlen) {
+    RadixTree::Key key;
+    void *value;
+    m_blocks.seek_ge(zero, key, value);
+    auto *lp = static_cast<uint8_t *>(value);
+    uint8_t *first = Listpack::first(lp);
+    uint64_t count = lp_int(first);
+    if (m_length - count >= maxlen) {
+      if (m_tail != nullptr && *m_tail == value)
+        m_tail = nullptr;
+      m_blocks.erase(key);
+      Listpack::free(lp);
+      m_length -= count;
+      removed += count;
+      continue;
+    }
+    if (approximate)
+      break;
+
+    // Remove the oldest entries of the block, with the deleted ones among them
+    uint64_t drop = m_length - maxlen;
+    int64_t master_count;
+    uint8_t *p = master_fields(lp, master_count);
+    for (int64_t n = 0; n <= master_count; ++n)
+      p = Listpack::next(lp, p);
+    uint8_t *start = p;
+    uint64_t valid = 0, deleted = 0;
+    uint32_t elements = 0;
+    while (valid < drop) {
+      int64_t flags;
+      uint8_t *next = skip_entry(lp, p, master_count, flags);
+      for (uint8_t *q = p; q != next; q = Listpack::next(lp, q))
+        ++elements;
+      (flags & STREAM_ITEM_FLAG_DELETED ? deleted : valid) += 1;
+      p = next;
+    }
+    lp = Listpack::remove(lp, start, elements);
+    IntTexts ints;
+    first = Listpack::first(lp);
+    lp = Listpack::insert(lp, ints(count - drop), first,
+                          Listpack::Where::Replace);
+    first = Listpack::first(lp);
+    uint8_t *second = Listpack::next(lp, first);
+    lp = Listpack::insert(lp, ints(lp_int(second) - deleted), second,
+                          Listpack::Where::Replace);
+    *m_blocks.find(key) = lp;
+    m_length -= drop;
+    removed += drop;
+  }
+  return removed;
+}
+
+Stream::Iterator::Iterator(const Stream &stream, StreamID start, StreamID end,
+                           bool reverse)
+    : m_stream(stream), m_start(start), m_end(end), m_reverse(reverse) {
+  RadixTree::Key key;
+  void *lp;
+  const RadixTree &blocks = stream.m_blocks;
+  // Going forward the block holding start may begin before it
+  if (reverse ? blocks.seek_le(end.key(), key, lp)
+              : blocks.seek_le(start.key(), key, lp) ||
+                    blocks.seek_ge(start.key(), key, lp))
+    load(key, static_cast<uint8_t *>(lp));
+  else
+    m_done = true;
+}
+
+bool Stream::Iterator::load(const RadixTree::Key &key, uint8_t *lp) {
+  m_key = key;
+  m_lp = lp;
+  m_master = StreamID::from_key(key);
+  int64_t count;
+  uint8_t *p = master_fields(lp, count);
+  m_master_fields.resize(count);
+  m_master_scratch.resize(count);
+  for (int64_t n = 0; n < count; ++n, p = Listpack::next(lp, p))
+    m_master_fields[n] = Listpack::get(p, m_master_scratch[n].buf);
+  m_first = Listpack::next(lp, p);
+  m_p = m_first;
+  if (m_reverse && m_first != nullptr) {
+    // From the lp count of the last entry back to its flags
+    p = Listpack::last(lp);
+    for (int64_t n = lp_int(p); n > 0; --n)
+      p = Listpack::prev(lp, p);
+    m_p = p;
+  }
+  return true;
+}
+
+bool Stream::Iterator::next_block() {
+  RadixTree::Key key = m_key;
+  // The key right after (before) the current one, if any
+  int b = RadixTree::KEY_SIZE - 1;
+  uint8_t wrap = m_reverse ? 0x00 : 0xff;
+  while (b >= 0 && key[b] == wrap)
+    key[b--] = ~wrap;
+  if (b < 0)
+    return false;
+  key[b] += m_reverse ? -1 : 1;
+  RadixTree::Key found;
+  void *lp;
+  const RadixTree &blocks = m_stream.m_blocks;
+  if (!(m_reverse ? blocks.seek_le(key, found, lp)
+                  : blocks.seek_ge(key, found, lp)))
+    return false;
+  return load(found, static_cast<uint8_t *>(lp));
+}
+
+bool Stream::Iterator::next(StreamID &id,
+                            std::vector<std::string_view> &fields) {
+  while (!m_done) {
+    if (m_p == nullptr) {
+      if (!next_block())
+        m_done = true;
+      continue;
+    }
+    uint8_t *p = m_p;
+    int64_t flags = lp_int(p);
+    p = Listpack::next(m_lp, p);
+    StreamID entry{m_master.ms + uint64_t(lp_int(p)), 0};
+    p = Listpack::next(m_lp, p);
+    entry.seq = m_master.seq + uint64_t(lp_int(p));
+    p = Listpack::next(m_lp, p);
+
+    fields.clear();
+    if (flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+      m_scratch.resize(m_master_fields.size());
+      for (size_t n = 0; n < m_master_fields.size(); ++n) {
+        fields.push_back(m_master_fields[n]);
+        fields.push_back(Listpack::get(p, m_scratch[n].buf));
+        p = Listpack::next(m_lp, p);
+      }
+    } else {
+      size_t count = 2 * lp_int(p);
+      p = Listpack::next(m_lp, p);
+      m_scratch.resize(count);
+      for (size_t n = 0; n < count; ++n) {
+        fields.push_back(Listpack::get(p, m_scratch[n].buf));
+        p = Listpack::next(m_lp, p);
+      }
+    }
+
+    if (!m_reverse) {
+      m_p = Listpack::next(m_lp, p);
+    } else if (m_p == m_first) {
+      m_p = nullptr;
+    } else {
+      // Back over the lp count of the previous entry and its elements
+      p = Listpack::prev(m_lp, m_p);
+      for (int64_t n = lp_int(p); n > 0; --n)
+        p = Listpack::prev(m_lp, p);
+      m_p = p;
+    }
+
+    if (flags & STREAM_ITEM_FLAG_DELETED)
+      continue;
+    if (m_reverse ? entry > m_end : entry < m_start)
+      continue;
+    if (m_reverse ? entry < m_start : entry > m_end) {
+      m_done = true;
+      break;
+    }
+    id = entry;
+    return true;
+  }
+  return false;
+}
+
+// Checks the layout described in Stream.hpp element by element, so that the
+// iterators can trust it
+bool Stream::adopt_block(const RadixTree::Key &key, uint8_t *lp) {
+  StreamID master = StreamID::from_key(key);
+  if (m_blocks.size() > 0 && master <= m_loaded_last)
+    return false;
+  int64_t values[3];
+  uint8_t *p = Listpack::first(lp);
+  for (int64_t &value : values) {
+    if (p == nullptr || !Listpack::get_int(p, value) || value < 0)
+      return false;
+    p = Listpack::next(lp, p);
+  }
+  int64_t count = values[0], deleted = values[1], master_count = values[2];
+  for (int64_t n = 0; n < master_count && p != nullptr; ++n)
+    p = Listpack::next(lp, p);
+  int64_t terminator;
+  if (p == nullptr || !Listpack::get_int(p, terminator) || terminator != 0)
+    return false;
+  p = Listpack::next(lp, p);
+
+  StreamID last = master;
+  bool first = true;
+  int64_t valid = 0, flagged = 0;
+  while (p != nullptr) {
+    int64_t flags, ms_diff, seq_diff;
+    uint8_t *q = p;
+    if (!Listpack::get_int(q, flags) || !(q = Listpack::next(lp, q)) ||
+        !Listpack::get_int(q, ms_diff) || !(q = Listpack::next(lp, q)) ||
+        !Listpack::get_int(q, seq_diff) || !(q = Listpack::next(lp, q)))
+      return false;
+    StreamID id{master.ms + uint64_t(ms_diff), master.seq + uint64_t(seq_diff)};
+    if (id < master || (!first && id <= last))
+      return false;
+    int64_t elements = master_count, expected = master_count + 3;
+    if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS)) {
+      int64_t pairs;
+      if (!Listpack::get_int(q, pairs) || pairs < 0 ||
+          !(q = Listpack::next(lp, q)))
+        return false;
+      elements = 2 * pairs;
+      expected = elements + 4;
+    }
+    for (int64_t n = 0; n < elements && q != nullptr; ++n)
+      q = Listpack::next(lp, q);
+    int64_t lp_count;
+    if (q == nullptr || !Listpack::get_int(q, lp_count) || lp_count != expected)
+      return false;
+    (flags & STREAM_ITEM_FLAG_DELETED ? flagged : valid) += 1;
+    last = id;
+    first = false;
+    p = Listpack::next(lp, q);
+  }
+  if (valid != count || flagged != deleted || !m_blocks.insert(key, lp))
+    return false;
+  m_length += count;
+  m_loaded_last = last;
+  m_tail = m_blocks.find(key);
+  m_tail_id = master;
+  return true;
+}
+
+bool Stream::finish_load(uint64_t length, StreamID last_id) {
+  if (length != m_length || (m_blocks.size() > 0 && last_id < m_loaded_last))
+    return false;
+  m_last_id = last_id;
+  return true;
+}
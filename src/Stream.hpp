@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ObjectAlloc.hpp"
+#include "RadixTree.hpp"
+
+/*
+Stream values (XADD, XRANGE, XREAD): entries of field/value pairs under
+increasing <ms>-<seq> IDs, kept like Redis keeps them so that RDB stream nodes
+are adopted as they are.
+
+Entries are packed into blocks, each a listpack of up to
+stream_node_max_entries entries and about stream_node_max_bytes bytes, indexed
+by a RadixTree on the big endian ID of their first entry, the master ID. A
+block starts with a master entry, and every entry is stored relative to it:
+
+  master  <count> <deleted> <num fields> <field> ... <field> 0
+  entry   <flags> <ms diff> <seq diff> <value> ... <value> <lp count>
+  or      <flags> <ms diff> <seq diff> <num fields> <field> <value> ...
+          <lp count>
+
+The first form, flagged SAMEFIELDS, is used when the entry has the master's
+fields in the same order, which is the common case of an event log: such an
+entry only costs its values and a few bytes. lp count, the number of listpack
+elements of the entry, allows walking a block backwards.
+
+New entries go to the last block, or start a new one when it is full. Trimming
+with MAXLEN ~ drops whole blocks from the head, which only unlinks them from
+the tree; an exact MAXLEN then removes the entries left over from the head
+block.
+*/
+
+struct StreamID {
+  uint64_t ms = 0;
+  uint64_t seq = 0;
+
+  auto operator<=>(const StreamID &) const = default;
+  std::string to_string() const;
+  // Big endian, so that keys sort like IDs
+  RadixTree::Key key() const;
+  static StreamID from_key(const RadixTree::Key &key);
+};
+
+// Parses "<ms>-<seq>" or "<ms>", the sequence then being missing_seq (and
+// seq_given false)
+bool parse_stream_id(std::string_view str, StreamID &id, uint64_t missing_seq,
+                     bool *seq_given = nullptr);
+
+class Stream : public TrackedObject {
+public:
+  Stream() = default;
+  ~Stream();
+  Stream(const Stream &) = delete;
+  Stream &operator=(const Stream &) = delete;
+
+  uint64_t length() const { return m_length; }
+  StreamID last_id() const { return m_last_id; }
+  size_t blocks() const { return m_blocks.size(); }
+
+  // Appends an entry, fields alternating names and values. id must be
+  // greater than last_id().
+  void append(StreamID id, const std::vector<std::string_view> &fields,
+              size_t max_bytes, size_t max_entries);
+  // Removes the oldest entries to leave maxlen. Approximate trimming only
+  // drops whole blocks and may leave more. Returns the entries removed.
+  uint64_t trim(uint64_t maxlen, bool approximate);
+
+  // The entries with IDs in [start, end], from the last one when reverse
+  class Iterator {
+  public:
+    Iterator(const Stream &stream, StreamID start, StreamID end, bool reverse);
+    // Next entry, false once done. fields alternates names and values and is
+    // valid until the next call.
+    bool next(StreamID &id, std::vector<std::string_view> &fields);
+
+  private:
+    const Stream &m_stream;
+    StreamID m_start, m_end;
+    bool m_reverse;
+    bool m_done = false;
+    RadixTree::Key m_key; // of the current block
+    uint8_t *m_lp = nullptr;
+    StreamID m_master;
+    // Integers read from the block are formatted into these
+    struct Scratch {
+      char buf[21];
+    };
+    std::vector<std::string_view> m_master_fields;
+    std::vector<Scratch> m_master_scratch;
+    std::vector<Scratch> m_scratch;
+    uint8_t *m_first = nullptr; // first entry of the block
+    uint8_t *m_p = nullptr;     // entry to read next, nullptr past the block
+
+    bool load(const RadixTree::Key &key, uint8_t *lp);
+    bool next_block();
+  };
+
+  // For RDB: calls fn(master key, listpack) for every block in order
+  template <typename F> void for_each_block(F &&fn) const {
+    m_blocks.for_each([&](const RadixTree::Key &key, void *lp) {
+      fn(key, static_cast<const uint8_t *>(lp));
+    });
+  }
+  // Takes a block read from RDB, false (leaving lp to the caller) unless it
+  // is well formed and goes after the blocks already there
+  bool adopt_block(const RadixTree::Key &key, uint8_t *lp);
+  // Sets what RDB says the length and last ID are, false if they do not
+  // match the blocks adopted
+  bool finish_load(uint64_t length, StreamID last_id);
+
+private:
+  RadixTree m_blocks; // master ID -> listpack
+  uint64_t m_length = 0;
+  StreamID m_last_id;
+  // The last block, where entries are appended
+  void **m_tail = nullptr;
+  StreamID m_tail_id;
+  StreamID m_loaded_last; // last entry ID of the blocks adopted
+
+  static uint8_t *new_block(const std::vector<std::string_view> &fields);
+};
@@ -0,0 +1,421 @@
+#include "Clock.hpp"
+#include "HandleResponse.hpp"
+#include "Stream.hpp"
+#include <limits>
+#include <string>
+
+#define STREAM_ID_MAX                                                          \
+  StreamID {                                                                   \
+    std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max() \
+  }
+
+static Stream *stream_of(DB_Entry *entry) {
+  return static_cast<Stream *>(entry->value.object);
+}
+
+// The ID right after id, false if there is none
+static bool next_id(StreamID &id) {
+  if (id == STREAM_ID_MAX)
+    return false;
+  if (++id.seq == 0)
+    ++id.ms;
+  return true;
+}
+
+static bool prev_id(StreamID &id) {
+  if (id == StreamID{})
+    return false;
+  if (id.seq-- == 0)
+    --id.ms;
+  return true;
+}
+
+// Appends the entries of stream in [start, end] as an array of [id, fields]
+// pairs, at most count of them unless count is 0
+static void append_entries(std::string &response, const Stream &stream,
+                           StreamID start, StreamID end, bool reverse,
+                           uint64_t count) {
+  std::string entries;
+  uint64_t found = 0;
+  Stream::Iterator it(stream, start, end, reverse);
+  StreamID id;
+  std::vector<std::string_view> fields;
+  while ((count == 0 || found < count) && it.next(id, fields)) {
+    append_array_len(entries, 2);
+    append_bulk(entries, id.to_string());
+    append_array_len(entries, fields.size());
+    for (std::string_view field : fields)
+      append_bulk(entries, field);
+    ++found;
+  }
+  append_array_len(response, found);
+  response += entries;
+}
+
+// XADD key [NOMKSTREAM] [MAXLEN [=|~] threshold] *|ms-*|ms[-seq] field value
+// [field value ...]
+void HandleResponse::xadd(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("XADD");
+    return;
+  }
+  bool nomkstream = false, trim = false, approximate = false;
+  int64_t maxlen = 0;
+  const std::string *id_arg = nullptr;
+  for (; i < command_array.size(); ++i) {
+    const std::string *arg = arg_at(command_array, i);
+    std::string option = arg ? upper(*arg) : "";
+    if (option == "NOMKSTREAM") {
+      nomkstream = true;
+    } else if (option == "MAXLEN" && i + 1 < command_array.size()) {
+      const std::string *value = arg_at(command_array, ++i);
+      if (value != nullptr && (*value == "~" || *value == "=")) {
+        approximate = *value == "~";
+        value = arg_at(command_array, ++i);
+      }
+      if (value == nullptr || !string_to_int64(*value, maxlen)) {
+        error("value is not an integer or out of range");
+        return;
+      }
+      if (maxlen < 0) {
+        error("The MAXLEN argument must be >= 0.");
+        return;
+      }
+      trim = true;
+    } else {
+      id_arg = arg;
+      ++i;
+      break;
+    }
+  }
+  size_t first_field = i;
+  i = command_array.size();
+  size_t pairs = command_array.size() - first_field;
+  if (id_arg == nullptr || pairs == 0 || pairs % 2 != 0) {
+    wrong_args("XADD");
+    return;
+  }
+  std::vector<std::string_view> fields;
+  for (size_t arg = first_field; arg < command_array.size(); ++arg) {
+    const std::string *field = arg_at(command_array, arg);
+    if (field == nullptr) {
+      wrong_args("XADD");
+      return;
+    }
+    fields.push_back(*field);
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::Stream))
+    return;
+  if (entry == nullptr && nomkstream) {
+    null();
+    return;
+  }
+  StreamID last = entry ? stream_of(entry)->last_id() : StreamID{};
+
+  // "*" takes the time, or the last ID's when the clock is behind it, and
+  // "<ms>-*" the next sequence of ms
+  StreamID id;
+  std::string_view text = *id_arg;
+  if (text == "*") {
+    id = {Clock::now_ms(), 0};
+    if (id.ms <= last.ms) {
+      id = last;
+      if (!next_id(id)) {
+        error("The stream has exhausted the last possible ID, unable to add "
+              "more items");
+        return;
+      }
+    }
+  } else {
+    bool auto_seq = text.size() > 2 && text.ends_with("-*");
+    if (auto_seq)
+      text.remove_suffix(2);
+    if (!parse_stream_id(text, id, 0)) {
+      error("Invalid stream ID specified as stream command argument");
+      return;
+    }
+    if (auto_seq && id.ms == last.ms)
+      id.seq = last.seq + (last.seq < std::numeric_limits<uint64_t>::max());
+    if (id == StreamID{}) {
+      error("The ID specified in XADD must be greater than 0-0");
+      return;
+    }
+    if (id <= last) {
+      error("The ID specified in XADD is equal or smaller than the target "
+            "stream top item");
+      return;
+    }
+  }
+
+  if (entry == nullptr) {
+    entry = DB_Entry::create_object(config.db.allocator(), *key,
+                                    ValueType::Stream, Encoding::Stream,
+                                    new Stream);
+    config.db.insert(entry);
+  }
+  Stream *stream = stream_of(entry);
+  stream->append(id, fields, config.stream_node_max_bytes,
+                 config.stream_node_max_entries);
+  if (trim)
+    stream->trim(maxlen, approximate);
+  bulk(id.to_string());
+  config.blocking.signal_ready(*key);
+}
+
+void HandleResponse::xlen(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("XLEN");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::Stream))
+    return;
+  integer(stream_of(entry)->length());
+}
+
+// Parses an XRANGE bound: "-", "+", or an ID, "(" making it exclusive. A
+// missing sequence is the lowest one for start and the highest for end.
+static bool parse_range_bound(std::string_view text, bool is_start,
+                              StreamID &id, bool &exclusive) {
+  exclusive = text.starts_with('(');
+  if (exclusive)
+    text.remove_prefix(1);
+  if (text == "-" && !exclusive)
+    id = StreamID{};
+  else if (text == "+" && !exclusive)
+    id = STREAM_ID_MAX;
+  else
+    return parse_stream_id(text, id,
+                           is_start ? 0 : std::numeric_limits<uint64_t>::max());
+  return true;
+}
+
+void HandleResponse::xrange_generic(size_t &i,
+                                    const std::vector<RespData> &command_array,
+                                    DB_Config &config, bool reverse,
+                                    const std::string &name) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *first_arg = arg_at(command_array, i++);
+  const std::string *second_arg = arg_at(command_array, i++);
+  if (key == nullptr || first_arg == nullptr || second_arg == nullptr) {
+    wrong_args(name);
+    return;
+  }
+  int64_t count = 0;
+  bool has_count = false;
+  for (; i < command_array.size(); ++i) {
+    const std::string *arg = arg_at(command_array, i);
+    std::string option = arg ? upper(*arg) : "";
+    if (option == "COUNT" && i + 1 < command_array.size()) {
+      const std::string *count_arg = arg_at(command_array, ++i);
+      if (count_arg == nullptr || !string_to_int64(*count_arg, count)) {
+        error("value is not an integer or out of range");
+        return;
+      }
+      has_count = true;
+    } else {
+      error("syntax error");
+      return;
+    }
+  }
+
+  // XREVRANGE takes the end first
+  StreamID start, end;
+  bool start_ex, end_ex;
+  if (!parse_range_bound(reverse ? *second_arg : *first_arg, true, start,
+                         start_ex) ||
+      !parse_range_bound(reverse ? *first_arg : *second_arg, false, end,
+                         end_ex)) {
+    error("Invalid stream ID specified as stream command argument");
+    return;
+  }
+  if ((start_ex && !next_id(start)) || (end_ex && !prev_id(end))) {
+    error("invalid start or end ID for the interval");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::Stream))
+    return;
+  if (entry == nullptr || start > end || (has_count && count <= 0)) {
+    empty();
+    return;
+  }
+  std::string response;
+  append_entries(response, *stream_of(entry), start, end, reverse, count);
+  reply(response);
+}
+
+void HandleResponse::xrange(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  xrange_generic(i, command_array, config, false, "XRANGE");
+}
+
+void HandleResponse::xrevrange(size_t &i,
+                               const std::vector<RespData> &command_array,
+                               DB_Config &config) {
+  xrange_generic(i, command_array, config, true, "XREVRANGE");
+}
+
+// XREAD [COUNT count] [BLOCK ms] STREAMS key [key ...] id [id ...]: the
+// entries after each id, or parks the client until one of the streams gets
+// some
+void HandleResponse::xread(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  int64_t count = 0, timeout = -1;
+  for (; i < command_array.size(); ++i) {
+    const std::string *arg = arg_at(command_array, i);
+    std::string option = arg ? upper(*arg) : "";
+    if (option == "STREAMS") {
+      ++i;
+      break;
+    }
+    const std::string *value = arg_at(command_array, i + 1);
+    if ((option != "COUNT" && option != "BLOCK") || value == nullptr) {
+      error("syntax error");
+      return;
+    }
+    int64_t number;
+    if (!string_to_int64(*value, number)) {
+      error(option == "COUNT" ? "value is not an integer or out of range"
+                              : "timeout is not an integer or out of range");
+      return;
+    }
+    if (option == "BLOCK" && number < 0) {
+      error("timeout is negative");
+      return;
+    }
+    (option == "COUNT" ? count : timeout) = number;
+    ++i;
+  }
+  size_t first = i;
+  i = command_array.size();
+  size_t streams = (command_array.size() - first) / 2;
+  if (first > command_array.size() || streams == 0 ||
+      (command_array.size() - first) % 2 != 0) {
+    error("Unbalanced 'xread' list of streams: for each stream key an ID or "
+          "'$' must be specified.");
+    return;
+  }
+  count = std::max<int64_t>(0, count);
+
+  std::vector<std::string> keys;
+  std::vector<StreamID> ids;
+  for (size_t s = 0; s < streams; ++s) {
+    const std::string *key = arg_at(command_array, first + s);
+    const std::string *id_arg = arg_at(command_array, first + streams + s);
+    if (key == nullptr || id_arg == nullptr) {
+      wrong_args("XREAD");
+      return;
+    }
+    DB_Entry *entry = lookup_key(config.partition_for(*key), *key);
+    if (entry != nullptr && !check_type(entry, ValueType::Stream))
+      return;
+    // "$" only wants what is added from now on
+    StreamID id;
+    if (*id_arg == "$")
+      id = entry ? stream_of(entry)->last_id() : StreamID{};
+    else if (!parse_stream_id(*id_arg, id, 0)) {
+      error("Invalid stream ID specified as stream command argument");
+      return;
+    }
+    keys.push_back(*key);
+    ids.push_back(id);
+  }
+
+  // With --threads a client only waits on the keys of its own partition, as
+  // in BLPOP
+  if (timeout >= 0 && !m_exec)
+    for (const std::string &key : keys)
+      if (config.partition_of(key) != config.partition) {
+        if (m_client.subscriptions() > 0)
+          error("blocking on keys of another thread is not allowed while "
+                "subscribed");
+        else
+          reply("-CROSSSLOT Keys in request don't hash to the same "
+                "partition\r\n");
+        return;
+      }
+
+  std::string entries;
+  size_t found = 0;
+  for (size_t s = 0; s < streams; ++s) {
+    DB_Entry *entry = lookup_key(config.partition_for(keys[s]), keys[s]);
+    StreamID start = ids[s];
+    if (entry == nullptr || !next_id(start) ||
+        stream_of(entry)->last_id() < start)
+      continue;
+    if (m_client.protocol < 3)
+      append_array_len(entries, 2);
+    append_bulk(entries, keys[s]);
+    append_entries(entries, *stream_of(entry), start, STREAM_ID_MAX, false,
+                   count);
+    ++found;
+  }
+  if (found > 0) {
+    std::string response;
+    if (m_client.protocol < 3)
+      append_array_len(response, found);
+    else
+      append_map_len(response, found, m_client.protocol);
+    reply(response + entries);
+    return;
+  }
+  // A transaction can not wait
+  if (timeout < 0 || m_exec) {
+    null_array();
+    return;
+  }
+  uint64_t deadline = 0;
+  if (timeout > 0)
+    deadline = Clock::now_ms() + timeout;
+  config.blocking.block(&m_client, keys, true, deadline, Clock::now_ms());
+  m_client.blocked_ids = std::move(ids);
+  m_client.blocked_count = count;
+}
+
+void HandleResponse::serve_stream_waiters(DB_Config &config, DB_Entry *entry,
+                                          const std::string &key,
+                                          std::vector<Client *> &unblocked) {
+  const Stream &stream = *stream_of(entry);
+  // Serving a client takes it off the list
+  std::vector<Client *> waiters;
+  if (const std::list<Client *> *list = config.blocking.waiters(key))
+    waiters.assign(list->begin(), list->end());
+  for (Client *client : waiters) {
+    if (client->blocked_ids.empty())
+      continue; // BLPOP/BRPOP
+    size_t s = 0;
+    while (client->blocked_on[s].first != key)
+      ++s;
+    StreamID start = client->blocked_ids[s];
+    if (!next_id(start) || stream.last_id() < start)
+      continue;
+    std::string response;
+    if (client->protocol < 3)
+      append_array_len(response, 1);
+    else
+      append_map_len(response, 1, client->protocol);
+    if (client->protocol < 3)
+      append_array_len(response, 2);
+    append_bulk(response, key);
+    append_entries(response, stream, start, STREAM_ID_MAX, false,
+                   client->blocked_count);
+    config.blocking.unblock(client);
+    client->push(std::make_shared<const std::string>(std::move(response)),
+                 config.pending_writes);
+    unblocked.push_back(client);
+  }
+}
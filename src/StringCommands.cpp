@@ -0,0 +1,319 @@
+#include "HandleResponse.hpp"
+#include <climits>
+#include <string>
+
+// A Raw value grows its buffer in place, other encodings are converted into a
+// new entry that takes the place of the old one in the keyspace.
+DB_Entry *make_room(Dict &db, DB_Entry *entry, size_t len) {
+  if (entry->encoding == Encoding::Raw) {
+    entry->value.raw =
+        RawString::reserve(db.allocator(), entry->value.raw, len);
+    return entry;
+  }
+  DB_Entry *raw = DB_Entry::to_raw(db.allocator(), entry, len);
+  db.relink(entry, raw);
+  DB_Entry::destroy(db.allocator(), entry);
+  return raw;
+}
+
+void HandleResponse::incr_by(DB_Config &config, const std::string &key,
+                             int64_t by) {
+  DB_Entry *entry = lookup_key(config, key);
+  if (entry == nullptr) {
+    config.db.insert(DB_Entry::create_int(config.db.allocator(), key, by));
+    integer(by);
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+
+  int64_t value;
+  if (entry->encoding == Encoding::Int) {
+    value = entry->value.integer;
+  } else {
+    DB_Entry::Scratch scratch;
+    if (!string_to_int64(entry->str(scratch), value)) {
+      error("value is not an integer or out of range");
+      return;
+    }
+  }
+
+  int64_t result;
+  if (__builtin_add_overflow(value, by, &result)) {
+    error("increment or decrement would overflow");
+    return;
+  }
+  // Counters stay Int encoded and are updated in place
+  if (entry->encoding == Encoding::Int)
+    entry->value.integer = result;
+  else
+    config.db.insert(DB_Entry::create_int(config.db.allocator(), key, result,
+                                          entry->expiry()));
+  integer(result);
+}
+
+void HandleResponse::incr(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("INCR");
+    return;
+  }
+  incr_by(config, *key, 1);
+}
+
+void HandleResponse::decr(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("DECR");
+    return;
+  }
+  incr_by(config, *key, -1);
+}
+
+void HandleResponse::incrby(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *by = arg_at(command_array, i++);
+  if (key == nullptr || by == nullptr) {
+    wrong_args("INCRBY");
+    return;
+  }
+  int64_t increment;
+  if (!string_to_int64(*by, increment)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+  incr_by(config, *key, increment);
+}
+
+void HandleResponse::decrby(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *by = arg_at(command_array, i++);
+  if (key == nullptr || by == nullptr) {
+    wrong_args("DECRBY");
+    return;
+  }
+  int64_t decrement;
+  if (!string_to_int64(*by, decrement)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+  if (decrement == LLONG_MIN) {
+    error("decrement would overflow");
+    return;
+  }
+  incr_by(config, *key, -decrement);
+}
+
+void HandleResponse::append(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *suffix = arg_at(command_array, i++);
+  if (key == nullptr || suffix == nullptr) {
+    wrong_args("APPEND");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    config.db.insert(DB_Entry::create(config.db.allocator(), *key, *suffix));
+    integer(suffix->length());
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+
+  size_t len = entry->value_len() + suffix->length();
+  if (len > MAX_STRING_SIZE) {
+    error("string exceeds maximum allowed size (proto-max-bulk-len)");
+    return;
+  }
+  entry = make_room(config.db, entry, len);
+  RawString *raw = entry->value.raw;
+  memcpy(raw->buf + raw->len, suffix->data(), suffix->length());
+  raw->len = len;
+  integer(len);
+}
+
+void HandleResponse::getrange(size_t &i,
+                              const std::vector<RespData> &command_array,
+                              DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *start_arg = arg_at(command_array, i++);
+  const std::string *end_arg = arg_at(command_array, i++);
+  if (key == nullptr || start_arg == nullptr || end_arg == nullptr) {
+    wrong_args("GETRANGE");
+    return;
+  }
+  int64_t start, end;
+  if (!string_to_int64(*start_arg, start) ||
+      !string_to_int64(*end_arg, end)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    empty();
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+  DB_Entry::Scratch scratch;
+  std::string_view value = entry->str(scratch);
+  int64_t len = value.length();
+
+  // Negative offsets count from the end, like Redis
+  if (start < 0 && end < 0 && start > end) {
+    empty();
+    return;
+  }
+  if (start < 0)
+    start = std::max<int64_t>(len + start, 0);
+  if (end < 0)
+    end = std::max<int64_t>(len + end, 0);
+  if (end >= len)
+    end = len - 1;
+  if (len == 0 || start > end) {
+    empty();
+    return;
+  }
+  bulk_value(entry, value.substr(start, end - start + 1));
+}
+
+void HandleResponse::setrange(size_t &i,
+                              const std::vector<RespData> &command_array,
+                              DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *offset_arg = arg_at(command_array, i++);
+  const std::string *value = arg_at(command_array, i++);
+  if (key == nullptr || offset_arg == nullptr || value == nullptr) {
+    wrong_args("SETRANGE");
+    return;
+  }
+  int64_t offset;
+  if (!string_to_int64(*offset_arg, offset)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+  if (offset < 0) {
+    error("offset is out of range");
+    return;
+  }
+  if (offset + value->length() > MAX_STRING_SIZE) {
+    error("string exceeds maximum allowed size (proto-max-bulk-len)");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    if (value->empty()) {
+      m_signal_keys = false;
+      integer(0);
+      return;
+    }
+    std::string padded(offset, '\0');
+    padded += *value;
+    config.db.insert(DB_Entry::create(config.db.allocator(), *key, padded));
+    integer(padded.length());
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+
+  size_t old_len = entry->value_len();
+  if (value->empty()) {
+    m_signal_keys = false;
+    integer(old_len);
+    return;
+  }
+  size_t len = std::max<size_t>(old_len, offset + value->length());
+  entry = make_room(config.db, entry, len);
+  RawString *raw = entry->value.raw;
+  if (static_cast<size_t>(offset) > old_len)
+    memset(raw->buf + old_len, 0, offset - old_len);
+  memcpy(raw->buf + offset, value->data(), value->length());
+  raw->len = len;
+  integer(len);
+}
+
+void HandleResponse::strlen_cmd(size_t &i,
+                                const std::vector<RespData> &command_array,
+                                DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("STRLEN");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::String))
+    return;
+  integer(entry->value_len());
+}
+
+void HandleResponse::mget(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  if (i >= command_array.size()) {
+    wrong_args("MGET");
+    return;
+  }
+
+  std::string response = "*";
+  response += std::to_string(command_array.size() - i);
+  response += "\r\n";
+  for (; i < command_array.size(); ++i) {
+    const std::string *key = arg_at(command_array, i);
+    DB_Entry *entry =
+        key ? lookup_key(config.partition_for(*key), *key) : nullptr;
+    // Like Redis, keys holding other types read as nil
+    if (entry == nullptr || entry->type != ValueType::String) {
+      append_null(response, m_client.protocol);
+      continue;
+    }
+    DB_Entry::Scratch scratch;
+    std::string_view value = entry->str(scratch);
+    if (value.length() < ZERO_COPY_MIN) {
+      append_bulk(response, value);
+      continue;
+    }
+    reply(response);
+    response.clear();
+    bulk_value(entry, value);
+  }
+  reply(response);
+}
+
+void HandleResponse::mset(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  size_t args = command_array.size() - i;
+  if (args == 0 || args % 2 != 0) {
+    wrong_args("MSET");
+    return;
+  }
+  for (size_t arg = i; arg < command_array.size(); ++arg)
+    if (arg_at(command_array, arg) == nullptr) {
+      wrong_args("MSET");
+      return;
+    }
+
+  for (; i < command_array.size(); i += 2) {
+    const std::string &key = std::get<std::string>(command_array[i].value);
+    const std::string &value =
+        std::get<std::string>(command_array[i + 1].value);
+    DB_Config &partition = config.partition_for(key);
+    partition.db.insert(
+        DB_Entry::create(partition.db.allocator(), key, value, 0,
+                         partition.string_compress_min_size));
+  }
+  ok();
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+Deterministic test data, shared by DEBUG POPULATE and tools/rdbgen so that a
+dataset built in memory and one loaded from a generated RDB file are the same
+for the same seed.
+
+Every key draws from its own generator, seeded with the seed and the index of
+the key, so a value does not depend on how many keys come before it or on
+which partition builds it. Values are words and numbers separated by spaces,
+text that compresses about as well as JSON or HTML does.
+*/
+
+// SplitMix64: one add and three multiply-xorshift rounds per 64 bits
+class SyntheticRng {
+public:
+  SyntheticRng(uint64_t seed, uint64_t stream = 0)
+      : m_state(seed ^ (stream * 0xd1b54a32d192ed03ULL)) {}
+
+  uint64_t next() {
+    uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+  // Uniform in [0, n), n > 0
+  uint64_t below(uint64_t n) { return next() % n; }
+  // Uniform in [0, 1)
+  double unit() { return (next() >> 11) * 0x1.0p-53; }
+
+private:
+  uint64_t m_state;
+};
+
+// Appends len bytes of words drawn from rng to out
+inline void synthetic_text(SyntheticRng &rng, size_t len, std::string &out) {
+  static const char *const words[] = {
+      "id",      "name",   "user",     "order",   "status", "price",
+      "item",    "value",  "count",    "created", "active", "true",
+      "false",   "null",   "the",      "and",     "of",     "to",
+      "product", "review", "shipping", "address", "city",   "email",
+      "div",     "class",  "span",     "href",    "title",  "content",
+      "data",    "type"};
+  constexpr size_t WORDS = sizeof(words) / sizeof(words[0]);
+  size_t end = out.length() + len;
+  while (out.length() < end) {
+    // A quarter of the words are numbers
+    std::string word = rng.below(4) == 0 ? std::to_string(rng.below(100000))
+                                         : words[rng.below(WORDS)];
+    word += rng.below(8) == 0 ? ':' : ' ';
+    out.append(word, 0, end - out.length());
+  }
+}
@@ -0,0 +1,517 @@
+#include "TieredStorage.hpp"
+#include "Clock.hpp"
+#include "DB.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Segments are at least this big so that a tiny setting does not make a file
+// per value, and at most this big for record offsets to fit in 32 bits with
+// the last batch and value going over
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+#define SEGMENT_MAX_SIZE (1024 * 1024 * 1024)
+
+static bool pread_all(int fd, char *buf, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static bool pwrite_all(int fd, const char *buf, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Records are written in native byte order, the log never outlives the
+// process
+static void append_record(std::string &out, std::string_view key,
+                          std::string_view value) {
+  uint32_t lengths[2] = {static_cast<uint32_t>(key.length()),
+                         static_cast<uint32_t>(value.length())};
+  out.append(reinterpret_cast<const char *>(lengths), sizeof(lengths));
+  out += key;
+  out += value;
+}
+
+TieredStorage::TieredStorage(const DB_Options &options, size_t partition)
+    : m_prefix(options.dir + "/tiered-" + std::to_string(getpid()) + "-" +
+               std::to_string(partition) + "-"),
+      m_min_value(std::max(options.tiered_min_value, DB_Entry::EMBED_MAX + 1)),
+      m_segment_size(std::clamp<uint64_t>(options.tiered_segment_size,
+                                          SEGMENT_MIN_SIZE, SEGMENT_MAX_SIZE)) {
+  m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  for (size_t n = 0; n < std::max<size_t>(options.tiered_io_threads, 1); ++n)
+    m_threads.emplace_back(&TieredStorage::run, this);
+}
+
+TieredStorage::~TieredStorage() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (std::thread &thread : m_threads)
+    thread.join();
+  for (auto &[id, segment] : m_segments)
+    close(segment->fd);
+  close(m_event_fd);
+}
+
+LogSegment *TieredStorage::new_segment() {
+  std::string path = m_prefix + std::to_string(m_next_id) + ".log";
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    std::cerr << "Could not create " << path << ": " << strerror(errno)
+              << std::endl;
+    return nullptr;
+  }
+  // Only the descriptor is kept, the file goes away with it
+  unlink(path.c_str());
+  auto segment = std::make_unique<LogSegment>();
+  segment->id = m_next_id++;
+  segment->fd = fd;
+  LogSegment *created = segment.get();
+  m_segments[created->id] = std::move(segment);
+  return created;
+}
+
+void TieredStorage::cron(Dict &db, uint64_t budget_us) {
+  Deadline deadline =
+      std::chrono::steady_clock::now() + std::chrono::microseconds(budget_us);
+  reap();
+  compact();
+  check_compaction(db, deadline);
+  spill(db, deadline);
+}
+
+// Scans the keyspace from the cursor for cold values, handed to the I/O
+// threads in batches of SPILL_BATCH bytes
+void TieredStorage::spill(Dict &db, Deadline deadline) {
+  uint8_t now = Clock::lru();
+  auto batch = std::make_unique<Job>();
+  batch->kind = Job::Spill;
+  do {
+    m_cursor = db.scan(m_cursor, SCAN_STEP, [&](DB_Entry *entry) {
+      if (entry->encoding != Encoding::Raw ||
+          entry->value.raw->len < m_min_value ||
+          static_cast<uint8_t>(now - entry->lru) < COLD_TICKS)
+        return;
+      auto [it, inserted] = m_spilling.emplace(entry->key());
+      if (!inserted)
+        return;
+      uint32_t length = entry->value.raw->len;
+      batch->moves.push_back({*it, static_cast<uint32_t>(batch->data.size()),
+                              0, length});
+      append_record(batch->data, entry->key(),
+                    {entry->value.raw->buf, length});
+    });
+    if (batch->data.size() >= SPILL_BATCH) {
+      write_spills(std::move(batch));
+      batch = std::make_unique<Job>();
+      batch->kind = Job::Spill;
+    }
+  } while (m_cursor != 0 && std::chrono::steady_clock::now() < deadline);
+  if (!batch->moves.empty())
+    write_spills(std::move(batch));
+}
+
+// Reserves room for the records of batch at the end of the active segment
+// and has the I/O threads write them there
+void TieredStorage::write_spills(std::unique_ptr<Job> batch) {
+  bool full = m_active != nullptr && m_active->size > 0 &&
+              m_active->size + batch->data.length() > m_segment_size;
+  if (m_active == nullptr || full) {
+    if (m_active != nullptr)
+      m_active->sealed = true;
+    if ((m_active = new_segment()) == nullptr) {
+      for (const Move &move : batch->moves)
+        m_spilling.erase(move.key);
+      return;
+    }
+  }
+  batch->segment = m_active;
+  batch->offset = m_active->size;
+  for (Move &move : batch->moves)
+    move.to = batch->offset + move.from;
+  m_active->size += batch->data.length();
+  ++m_active->writes;
+  submit(std::move(batch));
+}
+
+// Makes Spilled the entries of the records written, unless their value
+// changed or was accessed meanwhile
+void TieredStorage::finish_spill(Dict &db, std::unique_ptr<Job> job) {
+  LogSegment *segment = job->segment;
+  --segment->writes;
+  for (const Move &move : job->moves)
+    m_spilling.erase(move.key);
+  if (!job->ok) {
+    std::cerr << "Could not write to the tiered storage log: "
+              << strerror(errno) << std::endl;
+    // What the segment holds past the failed write is unknown
+    segment->failed = true;
+    segment->sealed = true;
+    if (m_active == segment)
+      m_active = nullptr;
+    return;
+  }
+  uint8_t now = Clock::lru();
+  for (const Move &move : job->moves) {
+    DB_Entry *entry = db.find(move.key);
+    std::string_view value = std::string_view(job->data).substr(
+        move.from + 2 * sizeof(uint32_t) + move.key.length(), move.length);
+    if (entry == nullptr || entry->encoding != Encoding::Raw ||
+        static_cast<uint8_t>(now - entry->lru) < COLD_TICKS ||
+        std::string_view(entry->value.raw->buf, entry->value.raw->len) !=
+            value)
+      continue;
+    DB_Entry *spilled = DB_Entry::create_spilled(
+        db.allocator(), entry, segment, {move.to, move.length});
+    db.relink(entry, spilled);
+    DB_Entry::destroy(db.allocator(), entry);
+    segment->add(LogSegment::record_size(move.key.length(), move.length));
+    ++m_stats.spills;
+  }
+}
+
+// Starts compacting the first sealed segment less than half live, one at a
+// time
+void TieredStorage::compact() {
+  if (m_compacting)
+    return;
+  for (auto &[id, segment] : m_segments) {
+    uint64_t live = segment->live_bytes.load(std::memory_order_relaxed);
+    if (!segment->sealed || segment->failed || segment->writes > 0 ||
+        live == 0 || live * 2 >= segment->size)
+      continue;
+    auto job = std::make_unique<Job>();
+    job->kind = Job::Scan;
+    job->segment = segment.get();
+    job->length = segment->size;
+    segment->compacting = true;
+    ++segment->reads;
+    m_compacting = true;
+    submit(std::move(job));
+    return;
+  }
+}
+
+// Keeps the segment read for its records to be checked by check_compaction
+void TieredStorage::finish_scan(std::unique_ptr<Job> job) {
+  LogSegment *from = job->segment;
+  --from->reads;
+  if (!job->ok) {
+    std::cerr << "Could not compact the tiered storage log: "
+              << strerror(errno) << std::endl;
+    from->failed = true;
+    from->compacting = false;
+    m_compacting = false;
+    return;
+  }
+  job->kind = Job::Write;
+  job->from = from;
+  job->segment = nullptr;
+  m_compaction = std::move(job);
+  m_next_record = 0;
+}
+
+// Keeps the records of the segment read that entries still point at, until
+// deadline. Once they are all checked the I/O threads write them to a new
+// segment.
+void TieredStorage::check_compaction(Dict &db, Deadline deadline) {
+  Job *job = m_compaction.get();
+  if (job == nullptr)
+    return;
+  LogSegment *from = job->from;
+  do {
+    size_t end = std::min(m_next_record + SCAN_STEP, job->records.size());
+    for (; m_next_record < end; ++m_next_record) {
+      const Record &record = job->records[m_next_record];
+      std::string_view key(job->data.data() + record.offset +
+                               2 * sizeof(uint32_t),
+                           record.key_len);
+      DB_Entry *entry = db.find(key);
+      if (entry == nullptr || entry->encoding != Encoding::Spilled ||
+          entry->segment() != from ||
+          entry->spill_ref().offset != record.offset)
+        continue;
+      job->moves.push_back(
+          {std::string(key), record.offset, 0, record.value_len});
+    }
+  } while (m_next_record < job->records.size() &&
+           std::chrono::steady_clock::now() < deadline);
+  if (m_next_record < job->records.size())
+    return;
+
+  std::unique_ptr<Job> write = std::move(m_compaction);
+  write->records.clear();
+  // What is left live belongs to keys freed meanwhile (see LazyFree)
+  if (write->moves.empty() || (write->segment = new_segment()) == nullptr) {
+    from->compacting = false;
+    m_compacting = false;
+    return;
+  }
+  write->segment->sealed = true;
+  ++write->segment->reads;
+  ++from->reads;
+  submit(std::move(write));
+}
+
+// Moves the entries whose record was copied, unless they changed meanwhile
+void TieredStorage::finish_write(Dict &db, std::unique_ptr<Job> job) {
+  LogSegment *to = job->segment;
+  LogSegment *from = job->from;
+  --to->reads;
+  --from->reads;
+  from->compacting = false;
+  m_compacting = false;
+  if (!job->ok) {
+    std::cerr << "Could not compact the tiered storage log: "
+              << strerror(errno) << std::endl;
+    return;
+  }
+  to->size = job->data.length();
+  for (const Move &move : job->moves) {
+    DB_Entry *entry = db.find(move.key);
+    if (entry == nullptr || entry->encoding != Encoding::Spilled ||
+        entry->segment() != from || entry->spill_ref().offset != move.from)
+      continue;
+    from->release(entry);
+    entry->move_spilled(to, {move.to, move.length});
+    to->add(LogSegment::record_size(entry->key_len, move.length));
+  }
+  ++m_stats.compactions;
+}
+
+// Closes the sealed segments nothing points at
+void TieredStorage::reap() {
+  for (auto it = m_segments.begin(); it != m_segments.end();) {
+    LogSegment *segment = it->second.get();
+    if (segment->sealed && !segment->compacting && segment->reads == 0 &&
+        segment->writes == 0 &&
+        segment->live_keys.load(std::memory_order_acquire) == 0) {
+      close(segment->fd);
+      it = m_segments.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+bool TieredStorage::load_async(const DB_Entry *entry, int fd,
+                               uint64_t client_id) {
+  if (!m_unreadable.empty() && m_unreadable.count(std::string(entry->key())))
+    return false;
+  auto [it, inserted] = m_loading.try_emplace(std::string(entry->key()));
+  it->second.emplace_back(fd, client_id);
+  if (!inserted)
+    return true;
+  auto job = std::make_unique<Job>();
+  job->kind = Job::Read;
+  job->segment = entry->segment();
+  job->offset = entry->spill_ref().offset;
+  job->length = entry->spill_ref().length;
+  job->key = it->first;
+  ++job->segment->reads;
+  ++m_stats.loads_in_flight;
+  submit(std::move(job));
+  return true;
+}
+
+void TieredStorage::finish_read(Dict &db, std::unique_ptr<Job> job,
+                                std::vector<std::pair<int, uint64_t>> &ready) {
+  --job->segment->reads;
+  --m_stats.loads_in_flight;
+  auto waiters = m_loading.extract(job->key);
+  if (!waiters.empty())
+    ready.insert(ready.end(), waiters.mapped().begin(),
+                 waiters.mapped().end());
+  // The key may have been deleted, written or read back meanwhile
+  DB_Entry *entry = db.find(job->key);
+  if (entry == nullptr || entry->encoding != Encoding::Spilled ||
+      entry->segment() != job->segment ||
+      entry->spill_ref().offset != job->offset)
+    return;
+  // What could not be read stays spilled, the command reading it tries again
+  // and fails
+  if (!job->ok) {
+    ++m_stats.load_errors;
+    m_unreadable.insert(std::move(job->key));
+    return;
+  }
+  restore(db, entry, record_value(job->data, job->key.length()));
+  ++m_stats.loads;
+}
+
+void TieredStorage::complete(Dict &db,
+                             std::vector<std::pair<int, uint64_t>> &ready) {
+  // Cleared first: jobs completing from here on signal it again
+  uint64_t count;
+  ssize_t bytes = read(m_event_fd, &count, sizeof(count));
+  (void)bytes; // EAGAIN if it was already cleared
+  std::vector<std::unique_ptr<Job>> done;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    done.swap(m_done);
+  }
+  for (auto &job : done) {
+    switch (job->kind) {
+    case Job::Read:
+      finish_read(db, std::move(job), ready);
+      break;
+    case Job::Spill:
+      finish_spill(db, std::move(job));
+      break;
+    case Job::Scan:
+      finish_scan(std::move(job));
+      break;
+    case Job::Write:
+      finish_write(db, std::move(job));
+      break;
+    }
+  }
+}
+
+DB_Entry *TieredStorage::load(Dict &db, DB_Entry *entry) {
+  if (!m_unreadable.empty())
+    m_unreadable.erase(std::string(entry->key()));
+  DB_Entry::SpillRef ref = entry->spill_ref();
+  std::string record;
+  if (!read_record(entry->segment()->fd, ref.offset, entry->key(), ref.length,
+                   record)) {
+    std::cerr << "Could not read the spilled value of " << entry->key()
+              << std::endl;
+    ++m_stats.load_errors;
+    return nullptr;
+  }
+  ++m_stats.sync_loads;
+  return restore(db, entry, record_value(record, entry->key_len));
+}
+
+// Replaces the Spilled entry by one holding value
+DB_Entry *TieredStorage::restore(Dict &db, DB_Entry *entry,
+                                 std::string_view value) {
+  DB_Entry *loaded =
+      DB_Entry::create(db.allocator(), entry->key(), value, entry->expiry());
+  db.relink(entry, loaded);
+  DB_Entry::destroy(db.allocator(), entry);
+  return loaded;
+}
+
+TieredStorage::Stats TieredStorage::stats() const {
+  Stats stats = m_stats;
+  for (const auto &[id, segment] : m_segments) {
+    ++stats.segments;
+    stats.log_bytes += segment->size;
+    stats.spilled_keys += segment->live_keys.load(std::memory_order_relaxed);
+    stats.spilled_bytes += segment->live_bytes.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+void TieredStorage::submit(std::unique_ptr<Job> job) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(std::move(job));
+  }
+  m_wake.notify_one();
+}
+
+void TieredStorage::run() {
+  while (true) {
+    std::unique_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+      if (m_stop)
+        return;
+      job = std::move(m_jobs.front());
+      m_jobs.pop_front();
+    }
+    run_job(*job);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_done.push_back(std::move(job));
+    }
+    uint64_t one = 1;
+    ssize_t written = write(m_event_fd, &one, sizeof(one));
+    (void)written; // a full counter is still readable
+  }
+}
+
+// On an I/O thread: only the job and the segment's fd are touched
+void TieredStorage::run_job(Job &job) {
+  switch (job.kind) {
+  case Job::Read:
+    job.ok = read_record(job.segment->fd, job.offset, job.key, job.length,
+                         job.data);
+    break;
+  case Job::Scan: {
+    job.data.resize(job.length);
+    job.ok = pread_all(job.segment->fd, job.data.data(), job.length, 0);
+    size_t pos = 0;
+    while (job.ok && pos + 2 * sizeof(uint32_t) <= job.data.length()) {
+      uint32_t lengths[2];
+      memcpy(lengths, job.data.data() + pos, sizeof(lengths));
+      size_t size = LogSegment::record_size(lengths[0], lengths[1]);
+      if (size > job.data.length() - pos)
+        break;
+      job.records.push_back({static_cast<uint32_t>(pos), lengths[0],
+                             lengths[1]});
+      pos += size;
+    }
+    job.ok = job.ok && pos == job.data.length();
+    break;
+  }
+  case Job::Spill:
+    job.ok = pwrite_all(job.segment->fd, job.data.data(), job.data.length(),
+                        job.offset);
+    break;
+  case Job::Write: {
+    // The records kept, out of the segment the Scan read
+    std::string records;
+    for (Move &move : job.moves) {
+      move.to = records.length();
+      records.append(job.data, move.from,
+                     LogSegment::record_size(move.key.length(), move.length));
+    }
+    job.data = std::move(records);
+    job.ok = pwrite_all(job.segment->fd, job.data.data(), job.data.length(),
+                        0);
+    break;
+  }
+  }
+}
+
+bool TieredStorage::read_record(int fd, uint32_t offset, std::string_view key,
+                                uint32_t length, std::string &record) {
+  record.resize(LogSegment::record_size(key.length(), length));
+  if (!pread_all(fd, record.data(), record.length(), offset))
+    return false;
+  uint32_t lengths[2];
+  memcpy(lengths, record.data(), sizeof(lengths));
+  return lengths[0] == key.length() && lengths[1] == length &&
+         record.compare(sizeof(lengths), key.length(), key) == 0;
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "DB_Entry.hpp"
+#include "Dict.hpp"
+
+struct DB_Options;
+
+/*
+Tiered storage (--tiered-enabled): cold String values move to an append-only
+log on local disk while their keys stay in memory.
+
+Every cron tick the keyspace is scanned for a while from where the previous
+scan stopped. Values of at least tiered_min_value bytes whose key was not
+accessed for tiered_cold_seconds (by the LRU clock of the entry, see
+Clock::lru) are appended to the active segment of the log, a file of at most
+tiered_segment_size bytes, as records
+
+  <key length: u32> <value length: u32> <key> <value>
+
+The I/O threads write them, and once written their entries are replaced by
+Spilled ones, which keep the key, the expiry and where the value is, unless
+the value changed or was accessed meanwhile.
+
+A command about to run on a spilled key does not block the event loop: the
+value is read by a pool of I/O threads while the client waits, its commands
+left in the query buffer like those of a blocked client, and put back in the
+keyspace before the command runs. What reaches a spilled key without waiting
+(a command run for another partition, EXEC, MIGRATE) reads it synchronously.
+A value that cannot be read back stays spilled, and the command reading it
+fails with -IOERR.
+
+A value read back, overwritten or deleted leaves a dead record behind. Entries
+count the bytes they keep alive in their segment, from whatever thread frees
+them (see LazyFree). Once less than half of a sealed segment is live it is
+compacted: the I/O threads read it, its records are checked against the
+keyspace a slice per cron tick, the ones still pointed at are written to a new
+segment by the I/O threads, and their entries moved there. A segment nothing
+points at any more is closed. Segment files are unlinked as soon as they are
+created, so the log never outlives the process.
+*/
+
+// Thrown by HandleResponse::lookup_key when a spilled value cannot be read
+// back: the command fails and the key stays spilled
+class SpillReadError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// A file of the log
+struct LogSegment {
+  uint32_t id;
+  int fd;
+  uint64_t size = 0; // bytes written
+  // Records the keyspace points at, and their bytes
+  std::atomic<uint64_t> live_keys{0};
+  std::atomic<uint64_t> live_bytes{0};
+  uint32_t reads = 0;  // I/O jobs in flight on the segment
+  uint32_t writes = 0; // spills being appended to it
+  bool sealed = false;
+  bool compacting = false;
+  // A spill to it or its compaction failed: it is never compacted, only
+  // closed once nothing points at it
+  bool failed = false;
+
+  static size_t record_size(size_t key_len, size_t value_len) {
+    return 2 * sizeof(uint32_t) + key_len + value_len;
+  }
+  void add(size_t bytes) {
+    live_keys.fetch_add(1, std::memory_order_relaxed);
+    live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  // Called by the Spilled entry pointing at it when it is destroyed. Once
+  // live_keys is 0 the event loop may free the segment.
+  void release(const DB_Entry *entry) {
+    live_bytes.fetch_sub(record_size(entry->key_len, entry->spill_ref().length),
+                         std::memory_order_relaxed);
+    live_keys.fetch_sub(1, std::memory_order_acq_rel);
+  }
+};
+
+class TieredStorage {
+public:
+  // Ticks of Clock::lru a value has to stay idle to be spilled, the tick
+  // being tiered_cold_seconds / COLD_TICKS
+  static constexpr uint8_t COLD_TICKS = 16;
+
+  struct Stats {
+    uint64_t spilled_keys = 0;
+    uint64_t spilled_bytes = 0; // live records
+    uint64_t log_bytes = 0;     // of every segment
+    uint64_t segments = 0;
+    uint64_t spills = 0;
+    uint64_t loads = 0;      // read by the I/O threads
+    uint64_t sync_loads = 0; // read by the event loop
+    uint64_t loads_in_flight = 0;
+    uint64_t compactions = 0;
+    uint64_t load_errors = 0;
+  };
+
+  // The log of partition, in options.dir
+  TieredStorage(const DB_Options &options, size_t partition);
+  ~TieredStorage();
+  TieredStorage(const TieredStorage &) = delete;
+  TieredStorage &operator=(const TieredStorage &) = delete;
+
+  // Spills cold values of db and compacts the log, for about budget_us
+  // microseconds
+  void cron(Dict &db, uint64_t budget_us);
+
+  // Starts reading back the value of entry, Spilled, for the client fd/id.
+  // False if its last read failed: the command reads it right away instead,
+  // and fails if it still cannot.
+  bool load_async(const DB_Entry *entry, int fd, uint64_t client_id);
+  // Signaled when I/O jobs completed
+  int event_fd() const { return m_event_fd; }
+  // Puts the values read back in db and applies the compactions done.
+  // Appends the clients whose loads completed to ready. A value that could
+  // not be read stays spilled, the command reading it fails.
+  void complete(Dict &db, std::vector<std::pair<int, uint64_t>> &ready);
+  // Reads the value of entry, Spilled, back right away. Returns the entry
+  // now holding it, nullptr (entry left as it is) if it could not be read.
+  DB_Entry *load(Dict &db, DB_Entry *entry);
+
+  Stats stats() const;
+
+private:
+  // Bytes written to the log by a single write
+  static constexpr size_t SPILL_BATCH = 1024 * 1024;
+  // Buckets scanned between time checks
+  static constexpr size_t SCAN_STEP = 64;
+
+  struct Record {
+    uint32_t offset;
+    uint32_t key_len;
+    uint32_t value_len;
+  };
+  // A record copied from offset from of the job's data to offset to of its
+  // segment (set by the I/O thread for a Write)
+  struct Move {
+    std::string key;
+    uint32_t from;
+    uint32_t to;
+    uint32_t length;
+  };
+  // Work for the I/O threads: reading a value back, appending spilled values
+  // to the active segment at offset, reading a segment to compact (parsed
+  // into records), writing the records kept to a new one
+  struct Job {
+    enum Kind { Read, Spill, Scan, Write } kind;
+    LogSegment *segment;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    std::string key;
+    std::string data;
+    std::vector<Record> records;
+    LogSegment *from = nullptr; // Write: the segment compacted
+    std::vector<Move> moves;
+    bool ok = false;
+  };
+  typedef std::chrono::steady_clock::time_point Deadline;
+
+  std::string m_prefix; // of the segment files
+  size_t m_min_value;
+  uint64_t m_segment_size;
+
+  std::map<uint32_t, std::unique_ptr<LogSegment>> m_segments;
+  LogSegment *m_active = nullptr;
+  uint32_t m_next_id = 0;
+  size_t m_cursor = 0; // of the keyspace scan
+  // Keys whose spill is being written
+  std::unordered_set<std::string> m_spilling;
+  bool m_compacting = false;
+  // The segment read for compaction while its records are checked, the
+  // next one to check and the Write filled meanwhile
+  std::unique_ptr<Job> m_compaction;
+  size_t m_next_record = 0;
+  // Keys being read back, with the clients waiting for them
+  std::unordered_map<std::string, std::vector<std::pair<int, uint64_t>>>
+      m_loading;
+  // Keys whose last read by the I/O threads failed
+  std::unordered_set<std::string> m_unreadable;
+  Stats m_stats;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::deque<std::unique_ptr<Job>> m_jobs;
+  std::vector<std::unique_ptr<Job>> m_done;
+  bool m_stop = false;
+  int m_event_fd;
+  std::vector<std::thread> m_threads;
+
+  LogSegment *new_segment();
+  void spill(Dict &db, Deadline deadline);
+  void write_spills(std::unique_ptr<Job> job);
+  void compact();
+  void check_compaction(Dict &db, Deadline deadline);
+  void finish_spill(Dict &db, std::unique_ptr<Job> job);
+  void finish_scan(std::unique_ptr<Job> job);
+  void finish_write(Dict &db, std::unique_ptr<Job> job);
+  void finish_read(Dict &db, std::unique_ptr<Job> job,
+                   std::vector<std::pair<int, uint64_t>> &ready);
+  void reap();
+  DB_Entry *restore(Dict &db, DB_Entry *entry, std::string_view value);
+  void submit(std::unique_ptr<Job> job);
+  void run();
+  static void run_job(Job &job);
+  // Reads the record of key at offset into record, false unless it is there
+  static bool read_record(int fd, uint32_t offset, std::string_view key,
+                          uint32_t length, std::string &record);
+  static std::string_view record_value(const std::string &record,
+                                       size_t key_len) {
+    return std::string_view(record).substr(2 * sizeof(uint32_t) + key_len);
+  }
+};
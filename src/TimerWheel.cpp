@@ -0,0 +1,132 @@
+#include "TimerWheel.hpp"
+
+TimerWheel::TimerWheel() {
+  for (auto &level : m_slots)
+    for (Timer &head : level)
+      head.prev = head.next = &head;
+}
+
+void TimerWheel::schedule(Timer *timer, uint64_t expires_ms,
+                          uint64_t now_ms) {
+  if (timer->scheduled())
+    cancel(timer);
+  // An empty wheel has nothing to catch up with
+  if (m_count == 0 && m_current < now_ms)
+    m_current = now_ms;
+  timer->expires = expires_ms;
+  place(timer);
+  ++m_count;
+}
+
+void TimerWheel::cancel(Timer *timer) {
+  if (!timer->scheduled())
+    return;
+  unlink(timer);
+  --m_count;
+}
+
+void TimerWheel::unlink(Timer *timer) {
+  Timer *next = timer->next;
+  timer->prev->next = next;
+  next->prev = timer->prev;
+  // A slot left with only its head is empty
+  if (next == timer->prev) {
+    Timer *head = next;
+    for (int level = 0; level < LEVELS; ++level)
+      if (head >= m_slots[level] && head < m_slots[level] + SLOTS)
+        m_occupied[level] &= ~(1ull << (head - m_slots[level]));
+  }
+  timer->prev = timer->next = nullptr;
+}
+
+void TimerWheel::place(Timer *timer) {
+  uint64_t expires = timer->expires < m_current ? m_current : timer->expires;
+  uint64_t delta = expires - m_current;
+  int level = 0;
+  while (level < LEVELS - 1 && delta >= 1ull << (LEVEL_BITS * (level + 1)))
+    ++level;
+  // Beyond the last wheel: wait in its furthest slot
+  if (delta >= 1ull << (LEVEL_BITS * LEVELS))
+    expires = m_current + (1ull << (LEVEL_BITS * LEVELS)) - 1;
+
+  size_t slot = (expires >> (LEVEL_BITS * level)) & MASK;
+  Timer *head = &m_slots[level][slot];
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+  m_occupied[level] |= 1ull << slot;
+}
+
+// Spreads the current slot of level over the levels below it
+void TimerWheel::cascade(int level) {
+  size_t slot = (m_current >> (LEVEL_BITS * level)) & MASK;
+  if (slot == 0 && level + 1 < LEVELS)
+    cascade(level + 1);
+  Timer *head = &m_slots[level][slot];
+  if (head->next == head)
+    return;
+  // Detach the whole list first, timers may land back in this level
+  Timer *first = head->next;
+  head->prev->next = nullptr;
+  head->prev = head->next = head;
+  m_occupied[level] &= ~(1ull << slot);
+  for (Timer *timer = first; timer != nullptr;) {
+    Timer *next = timer->next;
+    place(timer);
+    timer = next;
+  }
+}
+
+void TimerWheel::advance(uint64_t now_ms, std::vector<Timer *> &expired) {
+  while (m_current <= now_ms) {
+    if (m_count == 0) {
+      m_current = now_ms + 1;
+      return;
+    }
+    size_t slot = m_current & MASK;
+    if (slot == 0)
+      cascade(1);
+    // Nothing due in level 0 before it wraps: jump to the wrap
+    if ((m_occupied[0] >> slot) == 0) {
+      uint64_t wrap = (m_current | MASK) + 1;
+      m_current = wrap <= now_ms + 1 ? wrap : now_ms + 1;
+      continue;
+    }
+    Timer *head = &m_slots[0][slot];
+    while (head->next != head) {
+      Timer *timer = head->next;
+      unlink(timer);
+      if (timer->expires > m_current) {
+        // Parked beyond the wheels' reach
+        place(timer);
+        continue;
+      }
+      --m_count;
+      expired.push_back(timer);
+    }
+    ++m_current;
+  }
+}
+
+uint64_t TimerWheel::next_timeout(uint64_t now_ms, uint64_t max_ms) const {
+  if (m_count == 0)
+    return max_ms;
+  if (m_current > now_ms + max_ms)
+    return max_ms;
+  uint64_t base = m_current > now_ms ? m_current - now_ms : 0;
+  size_t slot = m_current & MASK;
+  uint64_t ticks = max_ms;
+  // Timers in the higher levels, or in level 0 slots behind the current one,
+  // are not due before level 0 wraps, which may be the tick about to run
+  uint64_t behind = slot == 0 ? 0 : m_occupied[0] << (SLOTS - slot);
+  bool higher = false;
+  for (int level = 1; level < LEVELS; ++level)
+    higher |= m_occupied[level] != 0;
+  if (higher || behind != 0)
+    ticks = slot == 0 ? 0 : SLOTS - slot;
+  uint64_t ahead = m_occupied[0] >> slot;
+  if (ahead != 0 && (uint64_t)__builtin_ctzll(ahead) < ticks)
+    ticks = __builtin_ctzll(ahead);
+  return base + ticks < max_ms ? base + ticks : max_ms;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+Hierarchical timer wheel with millisecond ticks, the kernel's classic design.
+
+LEVELS wheels of 64 slots each: level 0 holds the timers of the next 64 ms,
+one slot per ms, level 1 the next 64 * 64 ms in slots of 64 ms, and so on.
+A timer goes to the lowest level whose range covers it, and whenever level 0
+wraps the next slot of level 1 is spread over level 0 (cascading further up
+when level 1 wraps too). Scheduling and cancelling are O(1), advancing costs
+one step per elapsed tick plus the cascades, and idle stretches of level 0
+are skipped, so the cost does not grow with the number of timers waiting.
+Timers further away than the wheels reach are parked in the last slot and
+rescheduled when it comes up.
+
+Timers are intrusive: the owner embeds a Timer and gets it back on expiry.
+*/
+class TimerWheel {
+public:
+  struct Timer {
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+    uint64_t expires = 0; // ms
+    void *owner = nullptr;
+
+    bool scheduled() const { return prev != nullptr; }
+  };
+
+  TimerWheel();
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // A timer already due expires on the next advance
+  void schedule(Timer *timer, uint64_t expires_ms, uint64_t now_ms);
+  void cancel(Timer *timer);
+  // Moves the wheel up to now_ms, appending the expired timers to expired
+  void advance(uint64_t now_ms, std::vector<Timer *> &expired);
+  // Milliseconds until the wheel has work to do, at most max_ms
+  uint64_t next_timeout(uint64_t now_ms, uint64_t max_ms) const;
+  size_t size() const { return m_count; }
+
+private:
+  static constexpr int LEVELS = 5;
+  static constexpr int LEVEL_BITS = 6;
+  static constexpr uint64_t SLOTS = 1 << LEVEL_BITS;
+  static constexpr uint64_t MASK = SLOTS - 1;
+
+  // Slot lists are circular with a sentinel head
+  Timer m_slots[LEVELS][SLOTS];
+  uint64_t m_occupied[LEVELS] = {}; // bit per non-empty slot
+  uint64_t m_current = 0;           // next tick to run
+  size_t m_count = 0;
+
+  void place(Timer *timer);
+  void cascade(int level);
+  void unlink(Timer *timer);
+};
@@ -0,0 +1,137 @@
+#include "Tracking.hpp"
+#include "HandleResponse.hpp"
+#include <algorithm>
+
+std::shared_ptr<const std::string>
+Tracking::invalidation(const std::vector<std::string_view> &keys) {
+  std::string frame;
+  append_push_len(frame, 2, 3);
+  append_bulk(frame, "invalidate");
+  append_array_len(frame, keys.size());
+  for (std::string_view key : keys)
+    append_bulk(frame, key);
+  return std::make_shared<const std::string>(std::move(frame));
+}
+
+void Tracking::enable(Client *client) {
+  m_clients[client->id] = client;
+  if (!client->tracking_bcast)
+    return;
+  for (const std::string &name : client->tracking_prefixes) {
+    Prefix &prefix = m_prefixes[name];
+    if (prefix.clients.empty())
+      ++m_prefix_lengths[name.length()];
+    prefix.clients.insert(client->id);
+  }
+}
+
+void Tracking::disable(Client *client) {
+  m_clients.erase(client->id);
+  if (client->tracking_bcast) {
+    for (const std::string &name : client->tracking_prefixes) {
+      auto it = m_prefixes.find(name);
+      if (it == m_prefixes.end())
+        continue;
+      it->second.clients.erase(client->id);
+      if (!it->second.clients.empty())
+        continue;
+      if (!it->second.keys.empty())
+        std::erase(m_dirty, &it->second);
+      if (--m_prefix_lengths[name.length()] == 0)
+        m_prefix_lengths.erase(name.length());
+      m_prefixes.erase(it);
+    }
+  }
+  // Keys remembered for clients that are gone are never sent
+  if (m_clients.empty())
+    m_keys.clear();
+}
+
+void Tracking::remember(const Client *client, std::string_view key) {
+  m_keys[std::string(key)].insert(client->id);
+}
+
+void Tracking::invalidate(std::string_view key, const Client *writer,
+                          std::vector<Client *> &pending_writes) {
+  if (m_clients.empty())
+    return;
+
+  auto readers =
+      m_keys.empty() ? m_keys.end() : m_keys.find(std::string(key));
+  if (readers != m_keys.end()) {
+    std::shared_ptr<const std::string> frame;
+    for (uint64_t id : readers->second) {
+      auto it = m_clients.find(id);
+      if (it == m_clients.end())
+        continue;
+      Client *client = it->second;
+      if (client->tracking_bcast ||
+          (client == writer && client->tracking_noloop))
+        continue;
+      if (!frame)
+        frame = invalidation({key});
+      client->push(frame, pending_writes);
+    }
+    m_keys.erase(readers);
+  }
+
+  uint64_t writer_id = writer ? writer->id : 0;
+  for (const auto &[length, count] : m_prefix_lengths) {
+    if (length > key.length())
+      break;
+    auto it = m_prefixes.find(std::string(key.substr(0, length)));
+    if (it == m_prefixes.end())
+      continue;
+    Prefix &prefix = it->second;
+    if (prefix.keys.empty())
+      m_dirty.push_back(&prefix);
+    auto [written, inserted] =
+        prefix.keys.try_emplace(std::string(key), writer_id);
+    if (!inserted && written->second != writer_id)
+      written->second = 0;
+  }
+}
+
+void Tracking::invalidate_all(std::vector<Client *> &pending_writes) {
+  if (m_clients.empty())
+    return;
+  std::string frame;
+  append_push_len(frame, 2, 3);
+  append_bulk(frame, "invalidate");
+  append_null(frame, 3);
+  auto shared = std::make_shared<const std::string>(std::move(frame));
+  for (const auto &[id, client] : m_clients)
+    client->push(shared, pending_writes);
+  m_keys.clear();
+  // Keys collected for the prefixes are covered too
+  for (Prefix *prefix : m_dirty)
+    prefix->keys.clear();
+  m_dirty.clear();
+}
+
+void Tracking::flush_broadcasts(std::vector<Client *> &pending_writes) {
+  for (Prefix *prefix : m_dirty) {
+    std::shared_ptr<const std::string> frame;
+    for (uint64_t id : prefix->clients) {
+      Client *client = m_clients.at(id);
+      std::vector<std::string_view> keys;
+      if (client->tracking_noloop) {
+        // Its own writes are left out, so it gets a frame of its own
+        for (const auto &[key, writer] : prefix->keys)
+          if (writer != client->id)
+            keys.push_back(key);
+        if (!keys.empty())
+          client->push(invalidation(keys), pending_writes);
+        continue;
+      }
+      if (!frame) {
+        for (const auto &[key, writer] : prefix->keys)
+          keys.push_back(key);
+        frame = invalidation(keys);
+      }
+      client->push(frame, pending_writes);
+    }
+    prefix->keys.clear();
+  }
+  m_dirty.clear();
+}
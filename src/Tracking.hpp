@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Client.hpp"
+
+/*
+Server assisted client side caching, CLIENT TRACKING.
+
+In the default mode the server remembers, per key, the ids of the tracking
+clients that read it and sends them an invalidation the first time the key is
+written afterwards. The key is then forgotten until it is read again. Clients
+are referenced by id, so the ones that closed or stopped tracking are skipped.
+
+In broadcast mode clients register key prefixes and nothing is remembered on
+reads. The keys written under a prefix are collected and sent together once
+the running batch is done, as a single frame shared by the prefix' clients.
+Prefixes are found by looking the key up once per distinct prefix length, not
+by testing every prefix.
+
+Invalidations are RESP3 pushes: ["invalidate", [key, ...]].
+*/
+class Tracking {
+public:
+  // Starts tracking with the mode and prefixes set in client
+  void enable(Client *client);
+  void disable(Client *client);
+  // Remembers that a default mode client read key
+  void remember(const Client *client, std::string_view key);
+  // key was written by writer, nullptr when it expired. Clients given
+  // output are added to pending_writes.
+  void invalidate(std::string_view key, const Client *writer,
+                  std::vector<Client *> &pending_writes);
+  // Every key was removed: tells every tracking client with a null
+  // invalidation and forgets the keys read so far
+  void invalidate_all(std::vector<Client *> &pending_writes);
+  // Sends the keys collected for the broadcast prefixes
+  void flush_broadcasts(std::vector<Client *> &pending_writes);
+
+  size_t keys() const { return m_keys.size(); }
+
+private:
+  struct Prefix {
+    std::unordered_set<uint64_t> clients;
+    // Keys written since the last flush, with the id of their writer (0 when
+    // several clients or an expiry wrote them)
+    std::unordered_map<std::string, uint64_t> keys;
+  };
+
+  std::unordered_map<uint64_t, Client *> m_clients;
+  std::unordered_map<std::string, std::unordered_set<uint64_t>> m_keys;
+  std::unordered_map<std::string, Prefix> m_prefixes;
+  // Distinct prefix lengths, with the number of prefixes of each
+  std::map<size_t, size_t> m_prefix_lengths;
+  // Prefixes with keys to send
+  std::vector<Prefix *> m_dirty;
+
+  static std::shared_ptr<const std::string>
+  invalidation(const std::vector<std::string_view> &keys);
+};
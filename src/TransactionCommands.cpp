@@ -0,0 +1,113 @@
+#include "HandleResponse.hpp"
+#include <string>
+#include <vector>
+
+void HandleResponse::unwatch_all(Client &client, DB_Config &config) {
+  for (const auto &[key, version] : client.watched)
+    config.partition_for(key).key_versions.unwatch(key);
+  client.watched.clear();
+}
+
+void HandleResponse::multi(size_t &, const std::vector<RespData> &,
+                           DB_Config &) {
+  if (m_client.in_multi) {
+    error("MULTI calls can not be nested");
+    return;
+  }
+  m_client.in_multi = true;
+  m_client.multi_failed = false;
+  m_client.multi_slot = -1;
+  ok();
+}
+
+// Runs the queued commands back to back, unless one was rejected while
+// queueing or a watched key was written since WATCH
+void HandleResponse::exec(size_t &, const std::vector<RespData> &,
+                          DB_Config &config) {
+  if (!m_client.in_multi) {
+    error("EXEC without MULTI");
+    return;
+  }
+  std::vector<RespData> queue = std::move(m_client.multi_queue);
+  bool failed = m_client.multi_failed;
+  m_client.multi_queue.clear();
+  m_client.in_multi = false;
+  m_client.multi_failed = false;
+
+  // A watched key that expired since WATCH counts as written, expiring it
+  // now bumps its version even if nothing looked it up in between
+  bool touched = false;
+  for (const auto &[key, version] : m_client.watched) {
+    DB_Config &partition = config.partition_for(key);
+    if (DB_Entry *entry = partition.db.find(key))
+      check_expire_ms(entry, partition);
+    if (partition.key_versions.version(key) != version) {
+      touched = true;
+      break;
+    }
+  }
+  unwatch_all(m_client, config);
+
+  if (failed) {
+    reply("-EXECABORT Transaction discarded because of previous errors.\r\n");
+    return;
+  }
+  if (touched) {
+    null_array();
+    return;
+  }
+  std::string response;
+  append_array_len(response, queue.size());
+  reply(response);
+  m_exec = true;
+  for (const RespData &command : queue)
+    call(*lookup_command(command),
+         std::get<std::vector<RespData>>(command.value), config);
+}
+
+void HandleResponse::discard(size_t &, const std::vector<RespData> &,
+                             DB_Config &config) {
+  if (!m_client.in_multi) {
+    error("DISCARD without MULTI");
+    return;
+  }
+  m_client.multi_queue.clear();
+  m_client.in_multi = false;
+  m_client.multi_failed = false;
+  unwatch_all(m_client, config);
+  ok();
+}
+
+void HandleResponse::watch(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  if (m_client.in_multi) {
+    error("WATCH inside MULTI is not allowed");
+    return;
+  }
+  if (i >= command_array.size()) {
+    wrong_args("WATCH");
+    return;
+  }
+  for (; i < command_array.size(); ++i) {
+    const std::string *key = arg_at(command_array, i);
+    if (key == nullptr)
+      continue;
+    bool watching = false;
+    for (const auto &watched : m_client.watched)
+      watching |= watched.first == *key;
+    if (watching)
+      continue;
+    // Expire the key now so that its expiry does not count as a write
+    DB_Config &partition = config.partition_for(*key);
+    find_key(partition, *key);
+    m_client.watched.emplace_back(*key, partition.key_versions.watch(*key));
+  }
+  ok();
+}
+
+void HandleResponse::unwatch(size_t &, const std::vector<RespData> &,
+                             DB_Config &config) {
+  unwatch_all(m_client, config);
+  ok();
+}
@@ -0,0 +1,456 @@
+#include "ZSet.hpp"
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <strings.h>
+
+// Probability for a node to reach the next level, 1/4 like Redis
+#define SKIPLIST_P 0.25
+
+// True if node sorts before (score, member)
+static bool node_less(const SortedSet::Node *node, double score,
+                      std::string_view member) {
+  return node->score < score ||
+         (node->score == score && node->member() < member);
+}
+
+SortedSet::SortedSet() {
+  m_head = new_node(MAX_LEVEL, 0, {});
+  for (int i = 0; i < MAX_LEVEL; ++i)
+    m_head->level[i] = {nullptr, 0};
+}
+
+SortedSet::~SortedSet() {
+  Node *node = m_head->level[0].forward;
+  while (node != nullptr) {
+    Node *next = node->level[0].forward;
+    free_node(node);
+    node = next;
+  }
+  free_node(m_head);
+}
+
+SortedSet::Node *SortedSet::new_node(int height, double score,
+                                     std::string_view member) {
+  size_t size = sizeof(Node) + height * sizeof(Node::Level) + member.length();
+  auto *node = static_cast<Node *>(object_alloc(size));
+  node->score = score;
+  node->backward = nullptr;
+  node->member_len = member.length();
+  node->height = height;
+  // The header has no member, and memcpy from its null data is undefined
+  if (!member.empty())
+    memcpy(node->level + height, member.data(), member.length());
+  return node;
+}
+
+void SortedSet::free_node(Node *node) {
+  object_free(node, sizeof(Node) + node->height * sizeof(Node::Level) +
+                        node->member_len);
+}
+
+int SortedSet::random_level() {
+  thread_local std::minstd_rand generator(std::random_device{}());
+  int level = 1;
+  while (level < MAX_LEVEL &&
+         (generator() & 0xFFFF) < SKIPLIST_P * 0xFFFF)
+    ++level;
+  return level;
+}
+
+SortedSet::Node *SortedSet::find(std::string_view member) const {
+  auto it = m_members.find(member);
+  return it == m_members.end() ? nullptr : it->second;
+}
+
+void SortedSet::find_update(double score, std::string_view member,
+                            Node **update, uint64_t *rank) const {
+  Node *x = m_head;
+  for (int i = m_level - 1; i >= 0; --i) {
+    // Rank of x, summed over the spans walked on the way down
+    rank[i] = i == m_level - 1 ? 0 : rank[i + 1];
+    while (x->level[i].forward != nullptr &&
+           node_less(x->level[i].forward, score, member)) {
+      rank[i] += x->level[i].span;
+      x = x->level[i].forward;
+    }
+    update[i] = x;
+  }
+}
+
+void SortedSet::link(Node *node) {
+  Node *update[MAX_LEVEL];
+  uint64_t rank[MAX_LEVEL];
+  find_update(node->score, node->member(), update, rank);
+
+  int height = node->height;
+  if (height > m_level) {
+    for (int i = m_level; i < height; ++i) {
+      rank[i] = 0;
+      update[i] = m_head;
+      update[i]->level[i].span = m_length;
+    }
+    m_level = height;
+  }
+  for (int i = 0; i < height; ++i) {
+    node->level[i].forward = update[i]->level[i].forward;
+    update[i]->level[i].forward = node;
+    // update[i] now skips up to node, node the rest of the old span
+    node->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+    update[i]->level[i].span = rank[0] - rank[i] + 1;
+  }
+  // Links above the node skip one more element
+  for (int i = height; i < m_level; ++i)
+    ++update[i]->level[i].span;
+
+  node->backward = update[0] == m_head ? nullptr : update[0];
+  if (node->level[0].forward != nullptr)
+    node->level[0].forward->backward = node;
+  else
+    m_tail = node;
+  ++m_length;
+}
+
+void SortedSet::unlink(Node *node, Node **update) {
+  for (int i = 0; i < m_level; ++i) {
+    if (update[i]->level[i].forward == node) {
+      update[i]->level[i].span += node->level[i].span - 1;
+      update[i]->level[i].forward = node->level[i].forward;
+    } else {
+      --update[i]->level[i].span;
+    }
+  }
+  if (node->level[0].forward != nullptr)
+    node->level[0].forward->backward = node->backward;
+  else
+    m_tail = node->backward;
+  while (m_level > 1 && m_head->level[m_level - 1].forward == nullptr)
+    --m_level;
+  --m_length;
+}
+
+SortedSet::Node *SortedSet::insert(double score, std::string_view member) {
+  Node *node = new_node(random_level(), score, member);
+  try {
+    m_members.emplace(node->member(), node);
+  } catch (...) {
+    free_node(node);
+    throw;
+  }
+  link(node);
+  return node;
+}
+
+void SortedSet::update_score(Node *node, double score) {
+  std::string_view member = node->member();
+  // Still between its neighbours: update in place
+  Node *next = node->level[0].forward;
+  if ((node->backward == nullptr || node_less(node->backward, score, member)) &&
+      (next == nullptr || !node_less(next, score, member))) {
+    node->score = score;
+    return;
+  }
+
+  Node *update[MAX_LEVEL];
+  uint64_t rank[MAX_LEVEL];
+  find_update(node->score, member, update, rank);
+  unlink(node, update);
+  node->score = score;
+  link(node);
+}
+
+bool SortedSet::erase(std::string_view member) {
+  auto it = m_members.find(member);
+  if (it == m_members.end())
+    return false;
+  Node *node = it->second;
+  m_members.erase(it);
+
+  Node *update[MAX_LEVEL];
+  uint64_t rank[MAX_LEVEL];
+  find_update(node->score, node->member(), update, rank);
+  unlink(node, update);
+  free_node(node);
+  return true;
+}
+
+uint64_t SortedSet::rank(const Node *node) const {
+  Node *update[MAX_LEVEL];
+  uint64_t rank[MAX_LEVEL];
+  find_update(node->score, node->member(), update, rank);
+  // update[0] is the node right before it
+  return rank[0] + 1;
+}
+
+SortedSet::Node *SortedSet::by_rank(uint64_t rank) const {
+  if (rank == 0 || rank > m_length)
+    return nullptr;
+  Node *x = m_head;
+  uint64_t traversed = 0;
+  for (int i = m_level - 1; i >= 0; --i) {
+    while (x->level[i].forward != nullptr &&
+           traversed + x->level[i].span <= rank) {
+      traversed += x->level[i].span;
+      x = x->level[i].forward;
+    }
+    if (traversed == rank)
+      return x;
+  }
+  return nullptr;
+}
+
+SortedSet::Node *SortedSet::first_in_range(const ScoreRange &range) const {
+  if (range.empty() || m_tail == nullptr || !range.above_min(m_tail->score))
+    return nullptr;
+  Node *x = m_head;
+  for (int i = m_level - 1; i >= 0; --i)
+    while (x->level[i].forward != nullptr &&
+           !range.above_min(x->level[i].forward->score))
+      x = x->level[i].forward;
+  x = x->level[0].forward;
+  return x != nullptr && range.below_max(x->score) ? x : nullptr;
+}
+
+SortedSet::Node *SortedSet::last_in_range(const ScoreRange &range) const {
+  Node *first = m_head->level[0].forward;
+  if (range.empty() || first == nullptr || !range.below_max(first->score))
+    return nullptr;
+  Node *x = m_head;
+  for (int i = m_level - 1; i >= 0; --i)
+    while (x->level[i].forward != nullptr &&
+           range.below_max(x->level[i].forward->score))
+      x = x->level[i].forward;
+  return x != m_head && range.above_min(x->score) ? x : nullptr;
+}
+
+std::string format_score(double score) {
+  if (std::isinf(score))
+    return score > 0 ? "inf" : "-inf";
+  char buf[32];
+  auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), score);
+  return std::string(buf, ptr - buf);
+}
+
+bool parse_score(std::string_view str, double &out) {
+  if (str.empty())
+    return false;
+  if (str.length() <= 4) {
+    std::string text(str);
+    if (strcasecmp(text.c_str(), "inf") == 0 ||
+        strcasecmp(text.c_str(), "+inf") == 0) {
+      out = INFINITY;
+      return true;
+    }
+    if (strcasecmp(text.c_str(), "-inf") == 0) {
+      out = -INFINITY;
+      return true;
+    }
+  }
+  const char *begin = str.data();
+  const char *end = begin + str.length();
+  if (*begin == '+' && str.length() > 1 && begin[1] != '-')
+    ++begin;
+  auto [ptr, ec] = std::from_chars(begin, end, out);
+  return ec == std::errc() && ptr == end && !std::isnan(out);
+}
+
+static uint8_t *listpack_of(const DB_Entry *entry) {
+  return static_cast<uint8_t *>(entry->value.object);
+}
+
+static SortedSet *set_of(const DB_Entry *entry) {
+  return static_cast<SortedSet *>(entry->value.object);
+}
+
+// Returns the member element of a listpack encoded sorted set, or nullptr
+static uint8_t *find_member(uint8_t *lp, std::string_view member) {
+  for (uint8_t *p = Listpack::first(lp); p != nullptr;
+       p = ZSet::listpack_step(lp, p, false)) {
+    char scratch[21];
+    if (Listpack::get(p, scratch) == member)
+      return p;
+  }
+  return nullptr;
+}
+
+double ZSet::listpack_score(const uint8_t *p) {
+  int64_t integer;
+  if (Listpack::get_int(p, integer))
+    return integer;
+  char scratch[21];
+  double score = 0;
+  parse_score(Listpack::get(p, scratch), score);
+  return score;
+}
+
+uint8_t *ZSet::listpack_step(uint8_t *lp, uint8_t *member, bool reverse) {
+  if (!reverse)
+    return Listpack::next(lp, Listpack::next(lp, member));
+  uint8_t *p = Listpack::prev(lp, member);
+  return p == nullptr ? nullptr : Listpack::prev(lp, p);
+}
+
+DB_Entry *ZSet::create(SlabAllocator &alloc, std::string_view key,
+                       uint64_t expiry) {
+  uint8_t *lp = Listpack::create();
+  try {
+    return DB_Entry::create_object(alloc, key, ValueType::ZSet,
+                                   Encoding::Listpack, lp, expiry);
+  } catch (...) {
+    Listpack::free(lp);
+    throw;
+  }
+}
+
+DB_Entry *ZSet::from_listpack(SlabAllocator &alloc, std::string_view key,
+                              uint8_t *lp, const DB_Config &config,
+                              uint64_t expiry) {
+  DB_Entry *entry;
+  try {
+    entry = DB_Entry::create_object(alloc, key, ValueType::ZSet,
+                                    Encoding::Listpack, lp, expiry);
+  } catch (...) {
+    Listpack::free(lp);
+    throw;
+  }
+
+  bool too_big = length(entry) > config.zset_max_listpack_entries;
+  for (uint8_t *p = Listpack::first(lp); p != nullptr && !too_big;
+       p = listpack_step(lp, p, false)) {
+    char scratch[21];
+    too_big = Listpack::get(p, scratch).length() >
+              config.zset_max_listpack_value;
+  }
+  if (too_big)
+    convert(entry);
+  return entry;
+}
+
+size_t ZSet::length(const DB_Entry *entry) {
+  if (entry->encoding == Encoding::Skiplist)
+    return set_of(entry)->length();
+  return Listpack::length(listpack_of(entry)) / 2;
+}
+
+bool ZSet::score(DB_Entry *entry, std::string_view member, double &out) {
+  if (entry->encoding == Encoding::Skiplist) {
+    SortedSet::Node *node = set_of(entry)->find(member);
+    if (node == nullptr)
+      return false;
+    out = node->score;
+    return true;
+  }
+  uint8_t *lp = listpack_of(entry);
+  uint8_t *p = find_member(lp, member);
+  if (p == nullptr)
+    return false;
+  out = listpack_score(Listpack::next(lp, p));
+  return true;
+}
+
+bool ZSet::add(DB_Entry *entry, std::string_view member, double score,
+               const DB_Config &config) {
+  if (entry->encoding == Encoding::Listpack) {
+    uint8_t *lp = listpack_of(entry);
+    bool added = true;
+    if (uint8_t *p = find_member(lp, member)) {
+      if (listpack_score(Listpack::next(lp, p)) == score)
+        return false;
+      // Moved to its new place below
+      lp = Listpack::remove(lp, p, 2);
+      entry->value.object = lp;
+      added = false;
+    } else if (length(entry) + 1 > config.zset_max_listpack_entries ||
+               member.length() > config.zset_max_listpack_value) {
+      convert(entry);
+      return add(entry, member, score, config);
+    }
+
+    // Insert before the first pair that sorts after (score, member)
+    uint8_t *p = Listpack::first(lp);
+    for (; p != nullptr; p = listpack_step(lp, p, false)) {
+      double s = listpack_score(Listpack::next(lp, p));
+      char scratch[21];
+      if (s > score || (s == score && Listpack::get(p, scratch) > member))
+        break;
+    }
+    std::string text = format_score(score);
+    if (p == nullptr) {
+      lp = Listpack::append(lp, member);
+      lp = Listpack::append(lp, text);
+    } else {
+      uint8_t *newp;
+      lp = Listpack::insert(lp, member, p, Listpack::Where::Before, &newp);
+      lp = Listpack::insert(lp, text, newp, Listpack::Where::After);
+    }
+    entry->value.object = lp;
+    return added;
+  }
+
+  SortedSet *set = set_of(entry);
+  if (SortedSet::Node *node = set->find(member)) {
+    if (node->score != score)
+      set->update_score(node, score);
+    return false;
+  }
+  set->insert(score, member);
+  return true;
+}
+
+bool ZSet::remove(DB_Entry *entry, std::string_view member) {
+  if (entry->encoding == Encoding::Skiplist)
+    return set_of(entry)->erase(member);
+
+  uint8_t *lp = listpack_of(entry);
+  uint8_t *p = find_member(lp, member);
+  if (p == nullptr)
+    return false;
+  entry->value.object = Listpack::remove(lp, p, 2);
+  return true;
+}
+
+bool ZSet::rank(DB_Entry *entry, std::string_view member, bool reverse,
+                uint64_t &out) {
+  uint64_t len = length(entry);
+  if (entry->encoding == Encoding::Skiplist) {
+    SortedSet *set = set_of(entry);
+    SortedSet::Node *node = set->find(member);
+    if (node == nullptr)
+      return false;
+    uint64_t rank = set->rank(node);
+    out = reverse ? len - rank : rank - 1;
+    return true;
+  }
+
+  uint8_t *lp = listpack_of(entry);
+  uint64_t rank = 0;
+  for (uint8_t *p = Listpack::first(lp); p != nullptr;
+       p = listpack_step(lp, p, false), ++rank) {
+    char scratch[21];
+    if (Listpack::get(p, scratch) == member) {
+      out = reverse ? len - 1 - rank : rank;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ZSet::convert(DB_Entry *entry) {
+  auto *set = new SortedSet;
+  uint8_t *lp = listpack_of(entry);
+  try {
+    for (uint8_t *p = Listpack::first(lp); p != nullptr;
+         p = listpack_step(lp, p, false)) {
+      char scratch[21];
+      set->insert(listpack_score(Listpack::next(lp, p)),
+                  Listpack::get(p, scratch));
+    }
+  } catch (...) {
+    delete set;
+    throw;
+  }
+  Listpack::free(lp);
+  entry->encoding = Encoding::Skiplist;
+  entry->value.object = set;
+}
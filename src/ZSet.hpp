@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "DB.hpp"
+#include "Hash.hpp"
+#include "Listpack.hpp"
+#include "ObjectAlloc.hpp"
+
+/*
+Sorted set values have two encodings:
+  Listpack   members and scores alternate in a single listpack, ordered by
+             score then member, and every operation is a linear scan
+  Skiplist   a SortedSet, once the set has more than zset_max_listpack_entries
+             members or a member longer than zset_max_listpack_value bytes
+
+A SortedSet is Redis' zset: a skiplist ordered by (score, member) whose links
+carry spans - the number of elements they skip - so that ranks are summed on
+the way down in O(log n), plus a hash map from member to node for O(1) score
+lookups. The member bytes live in the node, the map only points into it.
+*/
+
+// Score interval, min and max are excluded when minex/maxex are set
+struct ScoreRange {
+  double min;
+  double max;
+  bool minex = false;
+  bool maxex = false;
+
+  bool above_min(double score) const {
+    return minex ? score > min : score >= min;
+  }
+  bool below_max(double score) const {
+    return maxex ? score < max : score <= max;
+  }
+  bool empty() const {
+    return min > max || (min == max && (minex || maxex));
+  }
+};
+
+class SortedSet : public TrackedObject {
+public:
+  static constexpr int MAX_LEVEL = 32;
+
+  struct Node {
+    double score;
+    Node *backward;
+    uint32_t member_len;
+    uint8_t height;
+    struct Level {
+      Node *forward;
+      uint64_t span;
+    } level[];
+    // The member follows the levels
+
+    std::string_view member() const {
+      return {reinterpret_cast<const char *>(level + height), member_len};
+    }
+  };
+
+  SortedSet();
+  ~SortedSet();
+  SortedSet(const SortedSet &) = delete;
+  SortedSet &operator=(const SortedSet &) = delete;
+
+  size_t length() const { return m_length; }
+  Node *find(std::string_view member) const;
+  // The member must not be in the set
+  Node *insert(double score, std::string_view member);
+  // Moves node to its place for the new score
+  void update_score(Node *node, double score);
+  bool erase(std::string_view member);
+
+  // 1 based rank of node
+  uint64_t rank(const Node *node) const;
+  // Node with the 1 based rank, or nullptr
+  Node *by_rank(uint64_t rank) const;
+  Node *first_in_range(const ScoreRange &range) const;
+  Node *last_in_range(const ScoreRange &range) const;
+  Node *first() const { return m_head->level[0].forward; }
+  Node *last() const { return m_tail; }
+
+private:
+  Node *m_head;
+  Node *m_tail = nullptr;
+  size_t m_length = 0;
+  int m_level = 1;
+  std::unordered_map<std::string_view, Node *, StringViewHash,
+                     std::equal_to<>,
+                     ObjectAllocator<std::pair<const std::string_view, Node *>>>
+      m_members;
+
+  static Node *new_node(int height, double score, std::string_view member);
+  static void free_node(Node *node);
+  static int random_level();
+  // Links node, which must not be in the list, at its place
+  void link(Node *node);
+  // Unlinks node, update holds its predecessor at every level
+  void unlink(Node *node, Node **update);
+  // Fills update with the predecessors of (score, member) at every level
+  void find_update(double score, std::string_view member, Node **update,
+                   uint64_t *rank) const;
+};
+
+struct ZSet {
+  // A new, empty, listpack encoded sorted set entry
+  static DB_Entry *create(SlabAllocator &alloc, std::string_view key,
+                          uint64_t expiry = 0);
+  // Adopts a listpack read from disk, converting it if it is over the limits
+  static DB_Entry *from_listpack(SlabAllocator &alloc, std::string_view key,
+                                 uint8_t *lp, const DB_Config &config,
+                                 uint64_t expiry = 0);
+
+  static size_t length(const DB_Entry *entry);
+  static bool score(DB_Entry *entry, std::string_view member, double &out);
+  // Adds member or updates its score, returns true if the member is new
+  static bool add(DB_Entry *entry, std::string_view member, double score,
+                  const DB_Config &config);
+  // Returns true if the member existed
+  static bool remove(DB_Entry *entry, std::string_view member);
+  // 0 based rank, from the highest score when reverse. False if not found.
+  static bool rank(DB_Entry *entry, std::string_view member, bool reverse,
+                   uint64_t &out);
+
+  // Calls fn(member, score) for ranks start to stop, which must be in range
+  template <typename F>
+  static void range_by_rank(DB_Entry *entry, uint64_t start, uint64_t stop,
+                            bool reverse, F &&fn);
+  // Calls fn(member, score) for the members in range, skipping offset of them
+  // and stopping after count (all of them if count < 0)
+  template <typename F>
+  static void range_by_score(DB_Entry *entry, const ScoreRange &range,
+                             bool reverse, int64_t offset, int64_t count,
+                             F &&fn);
+
+  // Score of a listpack element
+  static double listpack_score(const uint8_t *p);
+  // Member element of the pair after (or before, when reverse) the pair of
+  // member, or nullptr
+  static uint8_t *listpack_step(uint8_t *lp, uint8_t *member, bool reverse);
+
+private:
+  static void convert(DB_Entry *entry);
+};
+
+// Formats a score the way Redis replies with it: the shortest text that
+// parses back to the same double ("1.5", "3", "inf")
+std::string format_score(double score);
+// Parses a score, accepting "inf", "+inf" and "-inf" but not NaN
+bool parse_score(std::string_view str, double &out);
+
+template <typename F>
+void ZSet::range_by_rank(DB_Entry *entry, uint64_t start, uint64_t stop,
+                         bool reverse, F &&fn) {
+  uint64_t count = stop - start + 1;
+  if (entry->encoding == Encoding::Skiplist) {
+    auto *set = static_cast<SortedSet *>(entry->value.object);
+    SortedSet::Node *node =
+        set->by_rank(reverse ? set->length() - start : start + 1);
+    for (; count > 0 && node != nullptr; --count) {
+      fn(node->member(), node->score);
+      node = reverse ? node->backward : node->level[0].forward;
+    }
+    return;
+  }
+
+  auto *lp = static_cast<uint8_t *>(entry->value.object);
+  uint64_t len = length(entry);
+  uint8_t *p = Listpack::seek(lp, 2 * (reverse ? len - 1 - start : start));
+  for (; count > 0 && p != nullptr; --count) {
+    char scratch[21];
+    fn(Listpack::get(p, scratch), listpack_score(Listpack::next(lp, p)));
+    p = listpack_step(lp, p, reverse);
+  }
+}
+
+template <typename F>
+void ZSet::range_by_score(DB_Entry *entry, const ScoreRange &range,
+                          bool reverse, int64_t offset, int64_t count,
+                          F &&fn) {
+  if (range.empty())
+    return;
+
+  if (entry->encoding == Encoding::Skiplist) {
+    auto *set = static_cast<SortedSet *>(entry->value.object);
+    SortedSet::Node *node =
+        reverse ? set->last_in_range(range) : set->first_in_range(range);
+    for (; node != nullptr && count != 0;
+         node = reverse ? node->backward : node->level[0].forward) {
+      if (reverse ? !range.above_min(node->score)
+                  : !range.below_max(node->score))
+        break;
+      if (offset > 0) {
+        --offset;
+        continue;
+      }
+      fn(node->member(), node->score);
+      if (count > 0)
+        --count;
+    }
+    return;
+  }
+
+  auto *lp = static_cast<uint8_t *>(entry->value.object);
+  // Walk (member, score) pairs from the end that is closer to the range
+  uint8_t *p = reverse ? Listpack::seek(lp, -2) : Listpack::first(lp);
+  while (p != nullptr && count != 0) {
+    uint8_t *member = p;
+    double score = listpack_score(Listpack::next(lp, member));
+    p = listpack_step(lp, member, reverse);
+
+    if (reverse ? !range.below_max(score) : !range.above_min(score))
+      continue;
+    if (reverse ? !range.above_min(score) : !range.below_max(score))
+      break;
+    if (offset > 0) {
+      --offset;
+      continue;
+    }
+    char scratch[21];
+    fn(Listpack::get(member, scratch), score);
+    if (count > 0)
+      --count;
+  }
+}
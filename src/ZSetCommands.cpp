@@ -0,0 +1,391 @@
+#include "HandleResponse.hpp"
+#include "ZSet.hpp"
+#include <cmath>
+#include <string>
+
+// Parses a ZRANGEBYSCORE bound: a score, optionally prefixed by '(' to
+// exclude it
+static bool parse_bound(const std::string &arg, double &score,
+                        bool &exclusive) {
+  exclusive = !arg.empty() && arg[0] == '(';
+  return parse_score(std::string_view(arg).substr(exclusive ? 1 : 0), score);
+}
+
+void HandleResponse::zadd(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("ZADD");
+    return;
+  }
+  bool nx = false, xx = false, gt = false, lt = false, ch = false;
+  bool incr = false;
+  for (; const std::string *arg = arg_at(command_array, i); ++i) {
+    std::string option = upper(*arg);
+    if (option == "NX")
+      nx = true;
+    else if (option == "XX")
+      xx = true;
+    else if (option == "GT")
+      gt = true;
+    else if (option == "LT")
+      lt = true;
+    else if (option == "CH")
+      ch = true;
+    else if (option == "INCR")
+      incr = true;
+    else
+      break;
+  }
+
+  size_t args = command_array.size() - i;
+  if (args == 0 || args % 2 != 0) {
+    error("syntax error");
+    return;
+  }
+  if (nx && xx) {
+    error("XX and NX options at the same time are not compatible");
+    return;
+  }
+  if ((gt && lt) || (nx && (gt || lt))) {
+    error("GT, LT, and/or NX options at the same time are not compatible");
+    return;
+  }
+  if (incr && args != 2) {
+    error("INCR option supports a single increment-element pair");
+    return;
+  }
+  // Every score is checked before anything is added
+  std::vector<double> scores;
+  for (size_t arg = i; arg < command_array.size(); arg += 2) {
+    const std::string *score = arg_at(command_array, arg);
+    double value;
+    if (score == nullptr || arg_at(command_array, arg + 1) == nullptr ||
+        !parse_score(*score, value)) {
+      error("value is not a valid float");
+      return;
+    }
+    scores.push_back(value);
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::ZSet))
+    return;
+  if (entry == nullptr) {
+    if (xx) {
+      m_signal_keys = false;
+      if (incr)
+        null();
+      else
+        integer(0);
+      return;
+    }
+    entry = ZSet::create(config.db.allocator(), *key);
+    config.db.insert(entry);
+  }
+
+  int64_t added = 0, changed = 0;
+  double result = 0;
+  bool aborted = false;
+  for (size_t n = 0; n < scores.size(); ++n, i += 2) {
+    const std::string &member =
+        std::get<std::string>(command_array[i + 1].value);
+    double score = scores[n];
+    double current;
+    bool exists = ZSet::score(entry, member, current);
+    if ((nx && exists) || (xx && !exists)) {
+      aborted = true;
+      continue;
+    }
+    if (incr && exists) {
+      score += current;
+      if (std::isnan(score)) {
+        error("resulting score is not a number (NaN)");
+        return;
+      }
+    }
+    if (exists && ((gt && score <= current) || (lt && score >= current))) {
+      aborted = true;
+      continue;
+    }
+    result = score;
+    if (ZSet::add(entry, member, score, config))
+      ++added;
+    else if (score != current)
+      ++changed;
+  }
+  // NX on an existing member can leave a new key empty
+  if (ZSet::length(entry) == 0)
+    config.db.erase(*key);
+  m_signal_keys = added + changed > 0;
+
+  if (incr) {
+    if (aborted)
+      null();
+    else
+      double_value(result);
+    return;
+  }
+  integer(ch ? added + changed : added);
+}
+
+void HandleResponse::zincrby(size_t &i,
+                             const std::vector<RespData> &command_array,
+                             DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *by = arg_at(command_array, i++);
+  const std::string *member = arg_at(command_array, i++);
+  if (key == nullptr || by == nullptr || member == nullptr) {
+    wrong_args("ZINCRBY");
+    return;
+  }
+  double increment;
+  if (!parse_score(*by, increment)) {
+    error("value is not a valid float");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry != nullptr && !check_type(entry, ValueType::ZSet))
+    return;
+  double score = 0;
+  if (entry != nullptr)
+    ZSet::score(entry, *member, score);
+  score += increment;
+  if (std::isnan(score)) {
+    error("resulting score is not a number (NaN)");
+    return;
+  }
+
+  if (entry == nullptr) {
+    entry = ZSet::create(config.db.allocator(), *key);
+    config.db.insert(entry);
+  }
+  ZSet::add(entry, *member, score, config);
+  double_value(score);
+}
+
+void HandleResponse::zrem(size_t &i, const std::vector<RespData> &command_array,
+                          DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr || i >= command_array.size()) {
+    wrong_args("ZREM");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    m_signal_keys = false;
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::ZSet))
+    return;
+
+  int64_t removed = 0;
+  for (; i < command_array.size(); ++i)
+    if (const std::string *member = arg_at(command_array, i))
+      removed += ZSet::remove(entry, *member);
+  // Empty sorted sets do not exist
+  if (ZSet::length(entry) == 0)
+    config.db.erase(*key);
+  m_signal_keys = removed > 0;
+  integer(removed);
+}
+
+void HandleResponse::zscore(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *member = arg_at(command_array, i++);
+  if (key == nullptr || member == nullptr) {
+    wrong_args("ZSCORE");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    null();
+    return;
+  }
+  if (!check_type(entry, ValueType::ZSet))
+    return;
+  double score;
+  if (!ZSet::score(entry, *member, score)) {
+    null();
+    return;
+  }
+  double_value(score);
+}
+
+void HandleResponse::zcard(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  const std::string *key = arg_at(command_array, i++);
+  if (key == nullptr) {
+    wrong_args("ZCARD");
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    integer(0);
+    return;
+  }
+  if (!check_type(entry, ValueType::ZSet))
+    return;
+  integer(ZSet::length(entry));
+}
+
+void HandleResponse::zrank_generic(size_t &i,
+                                   const std::vector<RespData> &command_array,
+                                   DB_Config &config, bool reverse,
+                                   const std::string &name) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *member = arg_at(command_array, i++);
+  if (key == nullptr || member == nullptr) {
+    wrong_args(name);
+    return;
+  }
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    null();
+    return;
+  }
+  if (!check_type(entry, ValueType::ZSet))
+    return;
+  uint64_t rank;
+  if (!ZSet::rank(entry, *member, reverse, rank)) {
+    null();
+    return;
+  }
+  integer(rank);
+}
+
+void HandleResponse::zrank(size_t &i,
+                           const std::vector<RespData> &command_array,
+                           DB_Config &config) {
+  zrank_generic(i, command_array, config, false, "ZRANK");
+}
+
+void HandleResponse::zrevrank(size_t &i,
+                              const std::vector<RespData> &command_array,
+                              DB_Config &config) {
+  zrank_generic(i, command_array, config, true, "ZREVRANK");
+}
+
+// ZRANGE key start stop [BYSCORE] [REV] [LIMIT offset count] [WITHSCORES]
+// and ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+void HandleResponse::zrange_generic(size_t &i,
+                                    const std::vector<RespData> &command_array,
+                                    DB_Config &config, bool by_score,
+                                    const std::string &name) {
+  const std::string *key = arg_at(command_array, i++);
+  const std::string *start_arg = arg_at(command_array, i++);
+  const std::string *stop_arg = arg_at(command_array, i++);
+  if (key == nullptr || start_arg == nullptr || stop_arg == nullptr) {
+    wrong_args(name);
+    return;
+  }
+  bool reverse = false, withscores = false, limit = false;
+  int64_t offset = 0, count = -1;
+  for (; i < command_array.size(); ++i) {
+    const std::string *arg = arg_at(command_array, i);
+    std::string option = arg ? upper(*arg) : "";
+    if (option == "WITHSCORES") {
+      withscores = true;
+    } else if (option == "BYSCORE" && name == "ZRANGE") {
+      by_score = true;
+    } else if (option == "REV" && name == "ZRANGE") {
+      reverse = true;
+    } else if (option == "LIMIT" && i + 2 < command_array.size()) {
+      const std::string *offset_arg = arg_at(command_array, ++i);
+      const std::string *count_arg = arg_at(command_array, ++i);
+      if (offset_arg == nullptr || count_arg == nullptr ||
+          !string_to_int64(*offset_arg, offset) ||
+          !string_to_int64(*count_arg, count)) {
+        error("value is not an integer or out of range");
+        return;
+      }
+      limit = true;
+    } else {
+      error("syntax error");
+      return;
+    }
+  }
+  if (limit && !by_score) {
+    error("syntax error, LIMIT is only supported in combination with either "
+          "BYSCORE or BYLEX");
+    return;
+  }
+
+  ScoreRange range;
+  int64_t start = 0, stop = 0;
+  if (by_score) {
+    // With REV the first bound is the maximum
+    const std::string &min = reverse ? *stop_arg : *start_arg;
+    const std::string &max = reverse ? *start_arg : *stop_arg;
+    if (!parse_bound(min, range.min, range.minex) ||
+        !parse_bound(max, range.max, range.maxex)) {
+      error("min or max is not a float");
+      return;
+    }
+  } else if (!string_to_int64(*start_arg, start) ||
+             !string_to_int64(*stop_arg, stop)) {
+    error("value is not an integer or out of range");
+    return;
+  }
+
+  DB_Entry *entry = lookup_key(config, *key);
+  if (entry == nullptr) {
+    reply("*0\r\n");
+    return;
+  }
+  if (!check_type(entry, ValueType::ZSet))
+    return;
+
+  // RESP3 replies WITHSCORES as [member, score] pairs with double scores
+  int protocol = m_client.protocol;
+  std::string body;
+  int64_t elements = 0;
+  auto emit = [&body, &elements, withscores, protocol](std::string_view member,
+                                                       double score) {
+    if (withscores && protocol >= 3)
+      append_array_len(body, 2);
+    append_bulk(body, member);
+    if (withscores)
+      append_double(body, score, protocol);
+    ++elements;
+  };
+
+  if (by_score) {
+    if (offset >= 0)
+      ZSet::range_by_score(entry, range, reverse, offset, count, emit);
+  } else {
+    int64_t len = ZSet::length(entry);
+    // Negative indexes count from the end, out of range ones are clamped
+    if (start < 0)
+      start = std::max<int64_t>(len + start, 0);
+    if (stop < 0)
+      stop = len + stop;
+    if (stop >= len)
+      stop = len - 1;
+    if (start <= stop && start < len)
+      ZSet::range_by_rank(entry, start, stop, reverse, emit);
+  }
+
+  std::string response;
+  append_array_len(response,
+                   withscores && protocol < 3 ? elements * 2 : elements);
+  response += body;
+  reply(response);
+}
+
+void HandleResponse::zrange(size_t &i,
+                            const std::vector<RespData> &command_array,
+                            DB_Config &config) {
+  zrange_generic(i, command_array, config, false, "ZRANGE");
+}
+
+void HandleResponse::zrangebyscore(size_t &i,
+                                   const std::vector<RespData> &command_array,
+                                   DB_Config &config) {
+  zrange_generic(i, command_array, config, true, "ZRANGEBYSCORE");
+}
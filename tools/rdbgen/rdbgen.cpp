@@ -0,0 +1,315 @@
+#include "Crc64.hpp"
+#include "Lzf.hpp"
+#include "Synthetic.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+/*
+Writes an RDB file of synthetic String keys, for load time and memory
+benchmarks that have to be rerun on exactly the same data.
+
+Keys are prefix:0 to prefix:keys-1. Their values are drawn from the seed the
+same way DEBUG POPULATE draws them (see Synthetic.hpp): with a fixed
+--value-size and no integers, the file loads into the keyspace
+DEBUG POPULATE keys prefix size seed builds. The other choices (value sizes,
+integers, expiries, LZF) come from a second generator, so they do not change
+the text of the values either.
+
+Nothing depends on the clock: expiries count from --now, which is required
+with a --ttl-ratio above 0, so the same options always write the same bytes.
+
+  --int-ratio    values that are integers, written with the 8, 16 and 32 bit
+                 integer encodings when they fit and as text otherwise
+  --lzf-ratio    text values written LZF compressed (0xC3), when that saves
+                 at least 4 bytes of a value longer than 20, as Redis does
+  --ttl-ratio    keys with an expiry, 1 ms to --ttl-max seconds after --now
+*/
+
+#define RDB_VERSION "0011"
+#define RDB_OPCODE_AUX 0xFA
+#define RDB_OPCODE_RESIZEDB 0xFB
+#define RDB_OPCODE_EXPIRETIME_MS 0xFC
+#define RDB_OPCODE_SELECTDB 0xFE
+#define RDB_OPCODE_EOF 0xFF
+#define RDB_TYPE_STRING 0
+#define RDB_ENC_LZF 0xC3
+// Output buffered before each write
+#define WRITE_BATCH (1024 * 1024)
+
+struct Options {
+  std::string out = "dump.rdb";
+  uint64_t keys = 100000;
+  std::string prefix = "key";
+  uint64_t seed = 0;
+  uint64_t min_size = 100;
+  uint64_t max_size = 100;
+  bool log_sizes = false; // log-uniform instead of uniform sizes
+  double int_ratio = 0;
+  double lzf_ratio = 0;
+  double ttl_ratio = 0;
+  uint64_t ttl_max = 3600;
+  uint64_t now = 0;
+  bool has_now = false;
+};
+
+struct Counts {
+  uint64_t ints = 0;
+  uint64_t lzf = 0;
+  uint64_t expiring = 0;
+  uint64_t value_bytes = 0;
+};
+
+static void how_to_use() {
+  std::cout << "\nAccepted arguments:\n\t"
+            << "--out file.rdb\n\t"
+            << "--keys count\n\t"
+            << "--prefix prefix\n\t"
+            << "--seed seed\n\t"
+            << "--value-size bytes|min-max\n\t"
+            << "--size-dist uniform|log\n\t"
+            << "--int-ratio 0..1\n\t"
+            << "--lzf-ratio 0..1\n\t"
+            << "--ttl-ratio 0..1\n\t"
+            << "--ttl-max seconds\n\t"
+            << "--now unix_ms" << std::endl;
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string name = argv[i];
+    if (name == "--help" || i + 1 >= argc)
+      return false;
+    std::string value = argv[++i];
+    if (name == "--out") {
+      options.out = value;
+    } else if (name == "--keys") {
+      options.keys = std::stoull(value);
+    } else if (name == "--prefix") {
+      options.prefix = value;
+    } else if (name == "--seed") {
+      options.seed = std::stoull(value);
+    } else if (name == "--value-size") {
+      size_t dash = value.find('-');
+      options.min_size = std::stoull(value.substr(0, dash));
+      options.max_size = dash == std::string::npos
+                             ? options.min_size
+                             : std::stoull(value.substr(dash + 1));
+      if (options.max_size < options.min_size)
+        return false;
+    } else if (name == "--size-dist") {
+      if (value != "uniform" && value != "log")
+        return false;
+      options.log_sizes = value == "log";
+    } else if (name == "--int-ratio") {
+      options.int_ratio = std::stod(value);
+    } else if (name == "--lzf-ratio") {
+      options.lzf_ratio = std::stod(value);
+    } else if (name == "--ttl-ratio") {
+      options.ttl_ratio = std::stod(value);
+    } else if (name == "--ttl-max") {
+      options.ttl_max = std::max<uint64_t>(1, std::stoull(value));
+    } else if (name == "--now") {
+      options.now = std::stoull(value);
+      options.has_now = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// See the length encoding table in RDB_Decoder.cpp
+static void write_length(std::string &out, uint64_t len) {
+  if (len < (1 << 6)) {
+    out += static_cast<char>(len);
+  } else if (len < (1 << 14)) {
+    out += static_cast<char>(0x40 | (len >> 8));
+    out += static_cast<char>(len & 0xFF);
+  } else if (len <= UINT32_MAX) {
+    out += static_cast<char>(0x80);
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out += static_cast<char>((len >> shift) & 0xFF);
+  } else {
+    out += static_cast<char>(0x81);
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out += static_cast<char>((len >> shift) & 0xFF);
+  }
+}
+
+static void write_string(std::string &out, std::string_view str) {
+  write_length(out, str.length());
+  out += str;
+}
+
+// 0xC0, 0xC1 or 0xC2 and the value, little endian, if it fits 32 bits
+static bool write_int(std::string &out, int64_t value) {
+  int bytes;
+  if (value >= INT8_MIN && value <= INT8_MAX)
+    bytes = 1;
+  else if (value >= INT16_MIN && value <= INT16_MAX)
+    bytes = 2;
+  else if (value >= INT32_MIN && value <= INT32_MAX)
+    bytes = 4;
+  else
+    return false;
+  out += static_cast<char>(0xC0 | (bytes >> 1));
+  for (int n = 0; n < bytes; ++n)
+    out += static_cast<char>((value >> (8 * n)) & 0xFF);
+  return true;
+}
+
+static bool write_lzf(std::string &out, std::string_view str,
+                      std::string &scratch) {
+  if (str.length() <= 20)
+    return false;
+  scratch.resize(str.length() - 4);
+  size_t len =
+      lzf_compress(str.data(), str.length(), scratch.data(), scratch.length());
+  if (len == 0)
+    return false;
+  out += static_cast<char>(RDB_ENC_LZF);
+  write_length(out, len);
+  write_length(out, str.length());
+  out.append(scratch, 0, len);
+  return true;
+}
+
+// Integers of every width, so all three integer encodings and text show up
+static int64_t draw_int(SyntheticRng &rng) {
+  static const int64_t limits[] = {INT8_MAX, INT16_MAX, INT32_MAX, INT64_MAX};
+  int64_t limit = limits[rng.below(4)];
+  int64_t value = rng.below(static_cast<uint64_t>(limit) + 1);
+  return rng.below(2) ? -value : value;
+}
+
+static uint64_t draw_size(SyntheticRng &rng, const Options &options) {
+  if (options.min_size == options.max_size)
+    return options.min_size;
+  if (!options.log_sizes)
+    return options.min_size +
+           rng.below(options.max_size - options.min_size + 1);
+  double low = std::log(std::max<uint64_t>(1, options.min_size));
+  double high = std::log(options.max_size + 1.0);
+  return std::min<uint64_t>(
+      options.max_size,
+      std::max<uint64_t>(options.min_size,
+                         std::exp(low + rng.unit() * (high - low))));
+}
+
+// Appends the record of key n to out
+static void write_key(std::string &out, uint64_t n, const Options &options,
+                      Counts &counts, std::string &value,
+                      std::string &scratch) {
+  // Sizes, integers, expiries and LZF from their own generator, so the text
+  // drawn from (seed, n) stays the one DEBUG POPULATE draws
+  SyntheticRng choices(~options.seed, n);
+  bool is_int = choices.unit() < options.int_ratio;
+  uint64_t size = draw_size(choices, options);
+  bool expiring = choices.unit() < options.ttl_ratio;
+  uint64_t ttl_ms = 1 + choices.below(options.ttl_max * 1000);
+  bool lzf = choices.unit() < options.lzf_ratio;
+  int64_t integer = draw_int(choices);
+
+  if (expiring) {
+    uint64_t expiry = options.now + ttl_ms;
+    out += static_cast<char>(RDB_OPCODE_EXPIRETIME_MS);
+    for (int shift = 0; shift < 64; shift += 8)
+      out += static_cast<char>((expiry >> shift) & 0xFF);
+    ++counts.expiring;
+  }
+  out += static_cast<char>(RDB_TYPE_STRING);
+  write_string(out, options.prefix + ":" + std::to_string(n));
+
+  if (is_int) {
+    ++counts.ints;
+    value = std::to_string(integer);
+    counts.value_bytes += value.length();
+    if (!write_int(out, integer))
+      write_string(out, value);
+    return;
+  }
+  value.clear();
+  SyntheticRng text(options.seed, n);
+  synthetic_text(text, size, value);
+  counts.value_bytes += value.length();
+  if (lzf && write_lzf(out, value, scratch))
+    ++counts.lzf;
+  else
+    write_string(out, value);
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  try {
+    if (!parse_options(argc, argv, options)) {
+      how_to_use();
+      return 1;
+    }
+  } catch (const std::exception &) {
+    how_to_use();
+    return 1;
+  }
+  // Expiries from the clock would make every run different
+  if (options.ttl_ratio > 0 && !options.has_now) {
+    std::cerr << "--ttl-ratio needs --now, the time expiries count from"
+              << std::endl;
+    return 1;
+  }
+
+  std::ofstream file(options.out, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    std::cerr << "Could not open " << options.out << ": " << strerror(errno)
+              << std::endl;
+    return 1;
+  }
+
+  std::string out = "REDIS" RDB_VERSION;
+  out += static_cast<char>(RDB_OPCODE_AUX);
+  write_string(out, "redis-ver");
+  write_string(out, "7.2.0");
+  out += static_cast<char>(RDB_OPCODE_SELECTDB);
+  write_length(out, 0);
+  // The expires count is only a hint, sized for the expected ratio
+  out += static_cast<char>(RDB_OPCODE_RESIZEDB);
+  write_length(out, options.keys);
+  write_length(out, static_cast<uint64_t>(options.keys * options.ttl_ratio));
+
+  Counts counts;
+  uint64_t crc = 0;
+  size_t written = 0;
+  std::string value, scratch;
+  auto flush = [&]() {
+    crc = crc64(crc, out.data(), out.length());
+    file.write(out.data(), out.length());
+    written += out.length();
+    out.clear();
+  };
+  for (uint64_t n = 0; n < options.keys; ++n) {
+    write_key(out, n, options, counts, value, scratch);
+    if (out.length() >= WRITE_BATCH)
+      flush();
+  }
+  out += static_cast<char>(RDB_OPCODE_EOF);
+  flush();
+  char checksum[sizeof(crc)];
+  memcpy(checksum, &crc, sizeof(crc));
+  file.write(checksum, sizeof(checksum));
+  written += sizeof(checksum);
+  if (!file.flush()) {
+    std::cerr << "Could not write " << options.out << ": " << strerror(errno)
+              << std::endl;
+    return 1;
+  }
+
+  std::cout << options.out << ": " << options.keys << " keys, "
+            << counts.value_bytes << " value bytes, " << counts.ints
+            << " integers, " << counts.lzf << " LZF, " << counts.expiring
+            << " expiring, " << written << " bytes" << std::endl;
+  return 0;
+}